@@ -40,9 +40,13 @@
 #include <QDir>
 #include <QColor>
 #include <QTextDocument>
+#include <QImage>
 #include <QImageWriter>
+#include <QPainter>
 #include <QTextCodec>
 #include <QTemporaryDir>
+#include <QElapsedTimer>
+#include <QDataStream>
 
 #include <klfutil.h>
 #include <klfsysinfo.h>
@@ -51,6 +55,8 @@
 #include "klfblockprocess.h"
 #include "klffilterprocess.h"
 #include "klfuserscript.h"
+#include "klfrendercache.h"
+#include "klfgsserver_p.h"
 #include "klfbackend.h"
 #include "klfbackend_p.h"
 
@@ -289,7 +295,12 @@ void KLFPdfmarksWriteLatexMetaInfo::savePDFField(const QString& k, const QString
 // ---------------------------------
 
 
-static QMutex klf_mutex;
+// protects the gsInfo cache below. getLatexFormula() itself is reentrant; only access to
+// shared static state needs to be serialized.
+static QMutex klf_gsinfo_mutex;
+// user scripts may keep state between runs (and KLFUserScriptInfo's cache is shared), so
+// we still run them one at a time.
+static QMutex klf_userscript_mutex;
 
 struct GsInfo
 {
@@ -307,6 +318,34 @@ static QMap<QString,GsInfo> gsInfo = QMap<QString,GsInfo>();
 
 static void initGsInfo(const KLFBackend::klfSettings *settings, bool isMainThread);
 
+// identifies the versions of the tools we use, for KLFRenderCache
+static QString klf_tools_stamp(const KLFBackend::klfSettings& settings, const GsInfo& gsinfo)
+{
+  QStringList stamp;
+  stamp << QString::fromLatin1("klf=%1").arg(KLF_VERSION_STRING)
+        << QString::fromLatin1("gs=%1:%2").arg(settings.gsexec, gsinfo.version);
+  // we don't query latex/dvips versions, use the executables' modification times instead
+  QStringList execs = QStringList() << settings.latexexec << settings.dvipsexec;
+  foreach (const QString& ex, execs) {
+    QFileInfo fi(ex);
+    stamp << QString::fromLatin1("%1:%2").arg(ex, fi.lastModified().toString(Qt::ISODate));
+  }
+  return stamp.join(";");
+}
+
+static bool getGsInfo(const QString& gsexec, GsInfo *info)
+{
+  QMutexLocker lock(&klf_gsinfo_mutex);
+  QMap<QString,GsInfo>::const_iterator it = gsInfo.constFind(gsexec);
+  if (it == gsInfo.constEnd()) {
+    return false;
+  }
+  if (info != NULL) {
+    *info = *it;
+  }
+  return true;
+}
+
 
 
 
@@ -392,12 +431,25 @@ static bool calculate_gs_eps_bbox(const QByteArray& epsdata, const QString& epsF
 				  KLFBackend::klfOutput * resError, const KLFBackend::klfSettings& settings,
 				  bool isMainThread);
 static bool read_eps_bbox(const QByteArray& epsdata, klfbbox *bbox, KLFBackend::klfOutput * resError);
+static bool calculate_raster_eps_bbox(const QByteArray& rawepsdata, int dpi, klfbbox *bbox,
+                                      QImage *raster, klfbbox *rasterbbox,
+                                      const KLFBackend::klfSettings& settings, bool isMainThread,
+                                      const QString& tempdir);
 static void correct_eps_bbox(const QByteArray& epsdata,
                              const klfbbox& bbox_corrected, const klfbbox& bbox_orig,
 			     double vectorscale, QRgb bgcolor, QByteArray * epsdatacorrected);
 
 static void replace_svg_width_or_height(QByteArray *svgdata, const char * attr, double val);
 
+static QByteArray gs_server_device_job(const QString& device, const QString& outFile,
+                                       const QByteArray& deviceparams, const QStringList& inputFiles);
+static bool run_gs_server_job(const KLFBackend::klfSettings& settings, bool isMainThread,
+                              const QStringList& startupArgs, const QByteArray& psjob,
+                              const QString& outFile, QByteArray *outdata, QByteArray *printed = NULL);
+static bool write_temp_file(const QString& fn, const QByteArray& data);
+static bool ensure_temp_file(bool *written, const QString& fn, const QByteArray& data);
+static qint64 buffers_memory_size(const QList<const QByteArray*>& buffers, const QImage& image);
+
 
 static inline bool has_userscript_output(const QSet<QString>& fmts, const QString& format)
 {
@@ -417,10 +469,18 @@ KLF_EXPORT KLFStringSet klfbackend_fmts =
 /*   */   << "png" << "pdf" << "svg-gs" << "svg" ;
 
 
+static KLFStringSet klfbackend_dependencies_p(const QString& fmt, bool recursive, KLFStringSet& fn_lock);
+
 KLF_EXPORT KLFStringSet klfbackend_dependencies(const QString& fmt, bool recursive = false)
 {
-  static KLFStringSet fn_lock = KLFStringSet();
+  // the loop-detection set is local to this call, so that this function may be called
+  // from several rendering threads at once
+  KLFStringSet fn_lock;
+  return klfbackend_dependencies_p(fmt, recursive, fn_lock);
+}
 
+static KLFStringSet klfbackend_dependencies_p(const QString& fmt, bool recursive, KLFStringSet& fn_lock)
+{
   if (fn_lock.contains(fmt)) {
     klfWarning("Dependency loop detected for format "<<fmt) ;
     return KLFStringSet();
@@ -456,7 +516,7 @@ KLF_EXPORT KLFStringSet klfbackend_dependencies(const QString& fmt, bool recursi
   // explore dependencies recursively 
   KLFStringSet basedeps = s;
   foreach (QString str, basedeps) {
-    KLFStringSet subdeps = klfbackend_dependencies(str, true);
+    KLFStringSet subdeps = klfbackend_dependencies_p(str, true, fn_lock);
     foreach (QString subdep, subdeps) {
       s << subdep;
     }
@@ -487,14 +547,23 @@ static inline bool assert_have_formats_for(const KLFStringSet& outputs, const KL
     }									\
   }
 
+#define UPDATE_PEAK_MEMORY()						\
+  { res.peak_memory = qMax(res.peak_memory, buffers_memory_size(	\
+        QList<const QByteArray*>() << &res.dvidata << &rawepsdata << &bboxepsdata \
+        << &res.epsdata_raw << &res.epsdata_bbox << &res.epsdata << &res.pngdata_raw \
+        << &res.pngdata << &res.pdfdata << &gssvgdata << &res.svgdata,	\
+        res.result));							\
+  }
+
 
 
 
 KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const klfSettings& usersettings,
 						  bool isMainThread)
 {
-  // ALLOW ONLY ONE RUNNING getLatexFormula() AT A TIME 
-  QMutexLocker mutexlocker(&klf_mutex);
+  // Several getLatexFormula() calls may run concurrently: each run works in its own
+  // temporary directory and the only shared state (gsInfo, user scripts) is locked
+  // separately.
 
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
 
@@ -530,23 +599,36 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   res.epsdata = QByteArray();
   res.pdfdata = QByteArray();
   res.svgdata = QByteArray();
+  res.peak_memory = 0;
   res.input = in;
   res.settings = settings;
 
 
   // read GS version, will need later
   initGsInfo(&settings, isMainThread);
-  if (!gsInfo.contains(settings.gsexec)) {
+  GsInfo thisGsInfo;
+  if (!getGsInfo(settings.gsexec, &thisGsInfo)) {
     res.status = KLFERR_NOGSVERSION;
     res.errorstr = QObject::tr("Can't query version of ghostscript located at `%1'.", "KLFBackend")
       .arg(settings.gsexec);
     return res;
   }
 
-  const GsInfo thisGsInfo = gsInfo.value(settings.gsexec);
-
   klfDebugf(("%s: queried ghostscript version: %s", KLF_FUNC_NAME, qPrintable(thisGsInfo.version))) ;
 
+  QByteArray rendercachekey;
+  QString toolsstamp;
+  if (settings.renderCache != NULL) {
+    // results obtained with other tools (or other versions of them) are not reused
+    toolsstamp = klf_tools_stamp(settings, thisGsInfo);
+    // use the settings as given by the user, in particular without the full environment
+    rendercachekey = KLFRenderCache::cacheKey(input, usersettings, toolsstamp);
+    if (settings.renderCache->lookup(rendercachekey, &res)) {
+      klfDbg("result found in render cache.") ;
+      return res;
+    }
+  }
+
   // force some rules on settings
 
   // if calcEpsBoundingBox is being used, we need to add bg color at "correcting bbox time"
@@ -643,6 +725,12 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   // processes raw svg in memory, not generating final svg file)
   QString fnSvg = tempfname + ".svg";
 
+  // with klfSettings::BBoxRaster, the image from which we computed the bounding box, which
+  // may be reused as PNG output
+  QImage bboxraster;
+  klfbbox bboxrasterarea;
+  bool pngfromraster = false;
+
   // we need non-outlinedfont EPS data anyway.
   QByteArray rawepsdata;
   QByteArray bboxepsdata;
@@ -665,6 +753,7 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   }
 
   // prepare LaTeX file
+  QString texsource;
   {
     QFile file(fnTex);
     bool r = file.open(QIODevice::WriteOnly);
@@ -684,12 +773,20 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
       } else {
 	t = &deft;
       }
-      stream << t->generateTemplate(in, settings);
+      texsource = t->generateTemplate(in, settings);
     } else {
-      stream << in.latex;
+      texsource = in.latex;
     }
+    stream << texsource;
   }
 
+  // Intermediate results are memoized in the render cache, keyed by everything each step
+  // depends on, so that e.g. a DPI change only re-runs the PNG (and PDF) steps. Note that the
+  // colors are part of the LaTeX source. User scripts may replace any step, so don't do this
+  // for them.
+  bool usestagecache = (settings.renderCache != NULL && in.userScript.isEmpty());
+  QByteArray stageenv = (toolsstamp + "\n" + settings.execenv.join("\n")).toUtf8();
+
   KLFStringSet us_outputs;
   KLFStringSet us_skipfmts;
   KLFStringSet our_skipfmts;
@@ -752,6 +849,8 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
       ;
 
     { // now run the script
+      QMutexLocker userscriptlocker(&klf_userscript_mutex);
+
       KLFUserScriptFilterProcess p(scriptinfo.userScriptPath(), &settings);
 
       p.addExecEnviron(addenv);
@@ -905,7 +1004,18 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   klfDbg("our_skipfmts = " << our_skipfmts) ;
 
 
-  if (!has_userscript_output(us_outputs, "dvi") && !our_skipfmts.contains("dvi")) {
+  QByteArray dvistagekey;
+  bool dvifromcache = false;
+  if (usestagecache) {
+    dvistagekey = KLFRenderCache::stageKey("dvi", QList<QByteArray>() << texsource.toUtf8()
+                                           << settings.latexexec.toUtf8() << stageenv);
+    dvifromcache = settings.renderCache->lookupStage(dvistagekey, &res.dvidata)
+      && write_temp_file(fnDvi, res.dvidata);
+  }
+
+  if (dvifromcache) {
+    klfDbg("reusing DVI from stage cache.") ;
+  } else if (!has_userscript_output(us_outputs, "dvi") && !our_skipfmts.contains("dvi")) {
     // execute latex
     klfDbg("preparing to launch latex.") ;
 
@@ -931,9 +1041,23 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
       p.errorToOutput(&res);
       return res;
     }
+    if (usestagecache) {
+      settings.renderCache->insertStage(dvistagekey, res.dvidata);
+    }
+  }
+
+  QByteArray rawepsstagekey;
+  bool rawepsfromcache = false;
+  if (usestagecache) {
+    rawepsstagekey = KLFRenderCache::stageKey("eps-raw", QList<QByteArray>() << res.dvidata
+                                              << settings.dvipsexec.toUtf8() << stageenv);
+    rawepsfromcache = settings.renderCache->lookupStage(rawepsstagekey, &rawepsdata)
+      && write_temp_file(fnRawEps, rawepsdata);
   }
 
-  if (!has_userscript_output(us_outputs, "eps-raw") && !our_skipfmts.contains("eps-raw")) {
+  if (rawepsfromcache) {
+    klfDbg("reusing raw EPS from stage cache.") ;
+  } else if (!has_userscript_output(us_outputs, "eps-raw") && !our_skipfmts.contains("eps-raw")) {
 
     ASSERT_HAVE_FORMATS_FOR("eps-raw") ;
 
@@ -971,6 +1095,9 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
       return res;
     }
     klfDbg("read raw EPS; rawepsdata/length="<<rawepsdata.size()) ;
+    if (usestagecache) {
+      settings.renderCache->insertStage(rawepsstagekey, rawepsdata);
+    }
   } // end of 'dvips' block
 
   // the settings requires, save the intermediary data in to result output
@@ -981,7 +1108,28 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   //  // width and height of the (final) EPS bbox in postscript points
   //  double width_pt = 0, height_pt = 0;
 
-  if (!has_userscript_output(us_outputs, "eps-bbox") && !our_skipfmts.contains("eps-bbox")) {
+  QByteArray bboxstagekey;
+  bool bboxfromcache = false;
+  // with the raster method, this step also produces the PNG output, which depends on the DPI
+  if (usestagecache && !(settings.calcEpsBoundingBox && settings.bboxMethod == klfSettings::BBoxRaster)) {
+    QByteArray params;
+    { QDataStream stream(&params, QIODevice::WriteOnly);
+      stream << settings.calcEpsBoundingBox << settings.lborderoffset << settings.tborderoffset
+             << settings.rborderoffset << settings.bborderoffset << in.vectorscale
+             << (quint32)bgcolor_when_correcting_bbox << settings.gsexec; }
+    bboxstagekey = KLFRenderCache::stageKey("eps-bbox", QList<QByteArray>() << rawepsdata << params
+                                            << stageenv);
+    QByteArray cached;
+    if (settings.renderCache->lookupStage(bboxstagekey, &cached)) {
+      QDataStream stream(cached);
+      stream >> bboxepsdata >> res.width_pt >> res.height_pt;
+      bboxfromcache = (stream.status() == QDataStream::Ok);
+    }
+  }
+
+  if (bboxfromcache) {
+    klfDbg("reusing bbox-corrected EPS from stage cache.") ;
+  } else if (!has_userscript_output(us_outputs, "eps-bbox") && !our_skipfmts.contains("eps-bbox")) {
     // find correct bounding box of EPS file, and modify EPS data manually to add boffset and
     // translate to (0,0,width,height)
 
@@ -990,9 +1138,18 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
     klfbbox bbox, bbox_corrected;
 
     if (settings.calcEpsBoundingBox) {
-      bool ok = calculate_gs_eps_bbox(QByteArray(), fnRawEps, &bbox, &res, settings, isMainThread);
-      if (!ok)
-	return res; // res was set by the function
+      bool gotbbox = false;
+      // with an opaque background, the page is filled with \pagecolor and the ink always
+      // reaches the edge of the raster: don't even try
+      if (settings.bboxMethod == klfSettings::BBoxRaster && qAlpha(in.bg_color) == 0) {
+        gotbbox = calculate_raster_eps_bbox(rawepsdata, in.dpi, &bbox, &bboxraster, &bboxrasterarea,
+                                            settings, isMainThread, tempdir.path());
+      }
+      if (!gotbbox) {
+        bool ok = calculate_gs_eps_bbox(QByteArray(), fnRawEps, &bbox, &res, settings, isMainThread);
+        if (!ok)
+          return res; // res was set by the function
+      }
     } else {
       bool ok = read_eps_bbox(rawepsdata, &bbox, &res);
       if (!ok)
@@ -1020,6 +1177,40 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
 		     bgcolor_when_correcting_bbox,  &bboxepsdata);
 
     klfDbg("corrected bbox to "<<bbox.x1<<","<<bbox.y1<<","<<bbox.x2<<","<<bbox.y2);
+
+    if (!bboxraster.isNull() && in.vectorscale == 1.0 &&
+        !has_userscript_output(us_outputs, "png") && !our_skipfmts.contains("png")) {
+      // The raster we computed the bounding box from already contains the PNG output at the
+      // right resolution: crop it instead of running gs once more. Use the same page size
+      // (rounded up to whole points) as correct_eps_bbox() gives to gs.
+      double sx = (bboxrasterarea.x2 - bboxrasterarea.x1) / bboxraster.width();
+      double sy = (bboxrasterarea.y2 - bboxrasterarea.y1) / bboxraster.height();
+      int wi = (int)(res.width_pt + 0.99999);
+      int hi = (int)(res.height_pt + 0.99999);
+      QRect croprect((int)floor((bbox.x1 - bboxrasterarea.x1) / sx + 0.5),
+                     (int)floor((bboxrasterarea.y2 - (bbox.y1 + hi)) / sy + 0.5),
+                     (int)floor(wi / sx + 0.5), (int)floor(hi / sy + 0.5));
+      QImage cropped = bboxraster.copy(croprect); // transparent where outside the raster
+      // render the background color like gs would (png16m device, or background drawn in EPS)
+      QRgb bg = (qAlpha(in.bg_color) > 0) ? in.bg_color : bgcolor_when_correcting_bbox;
+      if (qAlpha(bg) > 0) {
+        QImage withbg(cropped.size(), QImage::Format_RGB32);
+        withbg.fill(qRgb(qRed(bg), qGreen(bg), qBlue(bg)));
+        QPainter painter(&withbg);
+        painter.drawImage(0, 0, cropped);
+        painter.end();
+        cropped = withbg;
+      }
+      res.result = cropped;
+      pngfromraster = true;
+    }
+
+    if (!bboxstagekey.isEmpty()) {
+      QByteArray cached;
+      { QDataStream stream(&cached, QIODevice::WriteOnly);
+        stream << bboxepsdata << res.width_pt << res.height_pt; }
+      settings.renderCache->insertStage(bboxstagekey, cached);
+    }
   } else if (!our_skipfmts.contains("eps-bbox")) {
     // userscript generated bbox-corrected EPS for us, but we still
     // need to set width_pt and height_pt appropriately.
@@ -1054,8 +1245,28 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   // the settings requires, save the intermediary data in to result output
   if (settings.wantRaw)
     res.epsdata_bbox = bboxepsdata;
+
+  UPDATE_PEAK_MEMORY() ;
+
+  // The following gs stages all read the bbox-corrected EPS. Rather than piping our copy of it
+  // into each gs process, write it out once and let gs read the file directly.
+  bool bboxepsfileok = has_userscript_output(us_outputs, "eps-bbox") && QFile::exists(fnBBoxEps);
+  // the file which holds the contents of res.epsdata, if any
+  QString epsdatafile;
   
-  if (!has_userscript_output(us_outputs, "eps-processed") && !our_skipfmts.contains("eps-processed")) {
+  QByteArray processedstagekey;
+  bool processedfromcache = false;
+  if (usestagecache) {
+    processedstagekey = KLFRenderCache::stageKey("eps-processed", QList<QByteArray>() << bboxepsdata
+                                                 << QByteArray(settings.outlineFonts ? "1" : "0")
+                                                 << settings.gsexec.toUtf8() << stageenv
+                                                 << QByteArray(getenv("KLFBACKEND_GS_PS_DEVICE")));
+    processedfromcache = settings.renderCache->lookupStage(processedstagekey, &res.epsdata);
+  }
+
+  if (processedfromcache) {
+    klfDbg("reusing processed EPS from stage cache.") ;
+  } else if (!has_userscript_output(us_outputs, "eps-processed") && !our_skipfmts.contains("eps-processed")) {
     // need to process EPS, i.e. outline fonts
 
     ASSERT_HAVE_FORMATS_FOR("eps-processed") ;
@@ -1108,23 +1319,68 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
       p.addArgv(QStringList() << gsoptions
 		<< "-dNOPAUSE" << "-dSAFER" << "-dEPSCrop" << QString::fromLatin1("-sDEVICE=%1").arg(psdevice)
 		<< "-sOutputFile="+QDir::toNativeSeparators(fnProcessedEps)
-		<< "-q" << "-dBATCH" << "-");
-      
-      ok = p.run(bboxepsdata, fnProcessedEps, &res.epsdata);
-      if (!ok) {
-	p.errorToOutput(&res);
-	return res;
+		<< "-q" << "-dBATCH");
+      bool bboxepsinfile = ensure_temp_file(&bboxepsfileok, fnBBoxEps, bboxepsdata);
+      p.addArgv(bboxepsinfile ? QDir::toNativeSeparators(fnBBoxEps) : QString::fromLatin1("-"));
+
+      QElapsedTimer gstimer;
+      gstimer.start();
+      bool gsserverok = false;
+      if (settings.useGsServer && env_gs_device == NULL && bboxepsinfile) {
+        QStringList startupargs = QStringList() << "-dEPSCrop";
+        QByteArray devparams;
+        if (psdevice == QLatin1String("pswrite")) {
+          startupargs << "-dNOCACHE";
+        } else {
+          devparams = "/NoOutputFonts true";
+        }
+        gsserverok = run_gs_server_job(settings, isMainThread, startupargs,
+                                       gs_server_device_job(psdevice, fnProcessedEps, devparams,
+                                                            QStringList() << fnBBoxEps),
+                                       fnProcessedEps, &res.epsdata);
       }
+      if (!gsserverok) {
+        if (bboxepsinfile)
+          ok = p.run(fnProcessedEps, &res.epsdata);
+        else
+          ok = p.run(bboxepsdata, fnProcessedEps, &res.epsdata);
+        if (!ok) {
+          p.errorToOutput(&res);
+          return res;
+        }
+      }
+      klfDbg("gs stage eps-processed took "<<gstimer.elapsed()<<"ms using "
+             <<(gsserverok ? "gs server" : "new gs process")) ;
 
       klfDebugf(("%s: res.epsdata has length=%d", KLF_FUNC_NAME, res.epsdata.size())) ;
+      epsdatafile = fnProcessedEps;
 
     } else {
       // no post-processed EPS, copy raw (bbox-corrected) EPS data:
       res.epsdata = bboxepsdata;
+      if (bboxepsfileok)
+        epsdatafile = fnBBoxEps;
+    }
+    if (usestagecache) {
+      settings.renderCache->insertStage(processedstagekey, res.epsdata);
     }
   }
 
-  if (!has_userscript_output(us_outputs, "png") && !our_skipfmts.contains("png")) {
+  if (epsdatafile.isEmpty() && has_userscript_output(us_outputs, "eps-processed") && QFile::exists(fnProcessedEps)) {
+    epsdatafile = fnProcessedEps;
+  }
+
+  UPDATE_PEAK_MEMORY() ;
+
+  if (pngfromraster) {
+    // res.result was cropped from the bounding box raster, see above
+    if (settings.wantRaw) {
+      QBuffer buf(&res.pngdata_raw);
+      buf.open(QIODevice::WriteOnly);
+      res.result.save(&buf, "PNG");
+    }
+    klfDbg("PNG output was obtained from the bounding box raster.") ;
+  } else if (!has_userscript_output(us_outputs, "png") && !our_skipfmts.contains("png")) {
 
     ASSERT_HAVE_FORMATS_FOR("png") ;
 
@@ -1156,15 +1412,43 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
     } else {
       p.addArgv("-sDEVICE=pngalpha");
     }
-    p.addArgv(QStringList() << "-sOutputFile="+QDir::toNativeSeparators(fnRawPng) << "-q" << "-dBATCH" << "-");
-
-    ok = p.run(bboxepsdata, fnRawPng, &res.pngdata_raw);
-    if (!ok) {
-      p.errorToOutput(&res);
-      return res;
+    p.addArgv(QStringList() << "-sOutputFile="+QDir::toNativeSeparators(fnRawPng) << "-q" << "-dBATCH");
+    bool bboxepsinfile = ensure_temp_file(&bboxepsfileok, fnBBoxEps, bboxepsdata);
+    p.addArgv(bboxepsinfile ? QDir::toNativeSeparators(fnBBoxEps) : QString::fromLatin1("-"));
+
+    // unless the raw PNG data is wanted, leave it on disk and decode the image directly from there
+    QByteArray *pngdataout = settings.wantRaw ? &res.pngdata_raw : NULL;
+
+    QElapsedTimer gstimer;
+    gstimer.start();
+    bool gsserverok = false;
+    if (settings.useGsServer && bboxepsinfile) {
+      QByteArray dpi = QByteArray::number(in.dpi);
+      QByteArray devparams = "/HWResolution [" + dpi + " " + dpi + "] /TextAlphaBits 4 /GraphicsAlphaBits 4"
+        " /MaxBitmap 2147483647";
+      QString pngdevice = (qAlpha(in.bg_color) > 0) ? QLatin1String("png16m") : QLatin1String("pngalpha");
+      gsserverok = run_gs_server_job(settings, isMainThread, QStringList() << "-dEPSCrop",
+                                     gs_server_device_job(pngdevice, fnRawPng, devparams,
+                                                          QStringList() << fnBBoxEps),
+                                     fnRawPng, pngdataout);
     }
+    if (!gsserverok) {
+      if (bboxepsinfile)
+        ok = p.run(fnRawPng, pngdataout);
+      else
+        ok = p.run(bboxepsdata, fnRawPng, pngdataout);
+      if (!ok) {
+        p.errorToOutput(&res);
+        return res;
+      }
+    }
+    klfDbg("gs stage png took "<<gstimer.elapsed()<<"ms using "
+           <<(gsserverok ? "gs server" : "new gs process")) ;
 
-    res.result.loadFromData(res.pngdata_raw, "PNG");
+    if (pngdataout != NULL)
+      res.result.loadFromData(res.pngdata_raw, "PNG");
+    else
+      res.result.load(fnRawPng, "PNG");
   } // raw PNG
   else {
     if (us_skipfmts.contains("png")) {
@@ -1196,12 +1480,19 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
       if (!r) {
 	klfWarning("Can't save \"final\" PNG data.") ;
 	res.pngdata = res.pngdata_raw;
+	if (res.pngdata.isEmpty()) {
+	  QFile frawpng(fnRawPng);
+	  if (frawpng.open(QIODevice::ReadOnly))
+	    res.pngdata = frawpng.readAll();
+	}
       }
     }
 
     klfDbg("prepared final PNG data.") ;
   }
 
+  UPDATE_PEAK_MEMORY() ;
+
   if ( settings.wantPDF && !has_userscript_output(us_outputs, "pdf") && !our_skipfmts.contains("pdf") ) {
 
     ASSERT_HAVE_FORMATS_FOR("pdf") ;
@@ -1242,19 +1533,61 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
     p.setArgv(QStringList() << settings.gsexec
 	      << "-dNOPAUSE" << "-dSAFER" << "-sDEVICE=pdfwrite"
 	      << "-sOutputFile="+QDir::toNativeSeparators(fnPdf)
-	      << "-q" << "-dBATCH" << "-" << fnPdfMarks);
-
-    // input: res.epsdata is the processed EPS file, or the raw EPS + bbox/page correction if no post-processing
-    ok = p.run(res.epsdata, fnPdf, &res.pdfdata);
-    if (!ok) {
-      p.errorToOutput(&res);
-      return res;
+	      << "-q" << "-dBATCH");
+    // input: res.epsdata is the processed EPS file, or the raw EPS + bbox/page correction if no
+    // post-processing. Read it from the file it came from if possible.
+    QString fnPdfInput = epsdatafile;
+    if (fnPdfInput.isEmpty()) {
+      fnPdfInput = tempfname + "-pdfinput.eps";
+      if (!write_temp_file(fnPdfInput, res.epsdata))
+        fnPdfInput = QString();
+    }
+    p.addArgv(QStringList() << (fnPdfInput.isEmpty() ? QString::fromLatin1("-") : QDir::toNativeSeparators(fnPdfInput))
+              << fnPdfMarks);
+
+    QElapsedTimer gstimer;
+    gstimer.start();
+    bool gsserverok = false;
+    if (settings.useGsServer && !fnPdfInput.isEmpty()) {
+      gsserverok = run_gs_server_job(settings, isMainThread, QStringList(),
+                                     gs_server_device_job("pdfwrite", fnPdf, QByteArray(),
+                                                          QStringList() << fnPdfInput << fnPdfMarks),
+                                     fnPdf, &res.pdfdata);
+      // make sure the PDF was properly finalized when the job's device was closed
+      if (gsserverok && !res.pdfdata.right(32).contains("%%EOF")) {
+        klfDbg("PDF produced by gs server is incomplete.") ;
+        gsserverok = false;
+      }
+    }
+    if (!gsserverok) {
+      if (!fnPdfInput.isEmpty())
+        ok = p.run(fnPdf, &res.pdfdata);
+      else
+        ok = p.run(res.epsdata, fnPdf, &res.pdfdata);
+      if (!ok) {
+        p.errorToOutput(&res);
+        return res;
+      }
     }
+    klfDbg("gs stage pdf took "<<gstimer.elapsed()<<"ms using "
+           <<(gsserverok ? "gs server" : "new gs process")) ;
   }
 
+  UPDATE_PEAK_MEMORY() ;
+
   if (settings.wantSVG) {
 
-    if (!has_userscript_output(us_outputs, "svg-gs") &&
+    QByteArray svgstagekey;
+    bool svgfromcache = false;
+    if (usestagecache) {
+      svgstagekey = KLFRenderCache::stageKey("svg-gs", QList<QByteArray>() << bboxepsdata
+                                             << settings.gsexec.toUtf8() << stageenv);
+      svgfromcache = settings.renderCache->lookupStage(svgstagekey, &gssvgdata);
+    }
+
+    if (svgfromcache) {
+      klfDbg("reusing gs SVG output from stage cache.") ;
+    } else if (!has_userscript_output(us_outputs, "svg-gs") &&
 	!our_skipfmts.contains("svg-gs")) {
 
       ASSERT_HAVE_FORMATS_FOR("svg-gs") ;
@@ -1285,13 +1618,34 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
       // unconditionally outline fonts, otherwise output is horrible
       p.addArgv(QStringList() << "-dNOCACHE" << "-dNOPAUSE" << "-dSAFER" << "-dEPSCrop" << "-sDEVICE=svg"
 		<< "-sOutputFile="+QDir::toNativeSeparators(fnGsSvg)
-		<< "-q" << "-dBATCH" << "-");
-
-      // input: res.epsdata is the processed EPS file, or the raw EPS file if no post-processing
-      ok = p.run(bboxepsdata, fnGsSvg, &gssvgdata);
-      if (!ok) {
-	p.errorToOutput(&res);
-	return res;
+		<< "-q" << "-dBATCH");
+      bool bboxepsinfile = ensure_temp_file(&bboxepsfileok, fnBBoxEps, bboxepsdata);
+      p.addArgv(bboxepsinfile ? QDir::toNativeSeparators(fnBBoxEps) : QString::fromLatin1("-"));
+
+      QElapsedTimer gstimer;
+      gstimer.start();
+      bool gsserverok = false;
+      if (settings.useGsServer && bboxepsinfile) {
+        gsserverok = run_gs_server_job(settings, isMainThread, QStringList() << "-dEPSCrop" << "-dNOCACHE",
+                                       gs_server_device_job("svg", fnGsSvg, QByteArray(),
+                                                            QStringList() << fnBBoxEps),
+                                       fnGsSvg, &gssvgdata);
+      }
+      if (!gsserverok) {
+        // input: the bbox-corrected EPS file, with fonts outlined by gs itself
+        if (bboxepsinfile)
+          ok = p.run(fnGsSvg, &gssvgdata);
+        else
+          ok = p.run(bboxepsdata, fnGsSvg, &gssvgdata);
+        if (!ok) {
+          p.errorToOutput(&res);
+          return res;
+        }
+      }
+      klfDbg("gs stage svg-gs took "<<gstimer.elapsed()<<"ms using "
+             <<(gsserverok ? "gs server" : "new gs process")) ;
+      if (usestagecache) {
+        settings.renderCache->insertStage(svgstagekey, gssvgdata);
       }
     }
 
@@ -1314,7 +1668,13 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
     }
   } // end if(wantSVG)
 
-  klfDbg("end of function.") ;
+  UPDATE_PEAK_MEMORY() ;
+
+  if (settings.renderCache != NULL) {
+    settings.renderCache->insert(rendercachekey, res);
+  }
+
+  klfDbg("end of function; peak memory held in buffers was "<<res.peak_memory<<" bytes.") ;
 
   return res;
 }
@@ -1351,11 +1711,28 @@ static bool calculate_gs_eps_bbox(const QByteArray& epsData, const QString& epsF
   p.setArgv(QStringList() << settings.gsexec << "-dNOPAUSE" << "-dSAFER" << "-sDEVICE=bbox" << "-q" << "-dBATCH"
 	    << (epsFile.isEmpty() ? QString::fromLatin1("-") : epsFile));
 
-  bool ok = p.run(epsData /*stdin*/, QString() /*no output file*/, &bboxdata/*collect stdout*/);
-  if (!ok) {
-    p.errorToOutput(resError);
-    return false;
+  QElapsedTimer gstimer;
+  gstimer.start();
+  bool gsserverok = false;
+  if (settings.useGsServer && !epsFile.isEmpty()) {
+    // the bbox device prints the bounding box when the page is output
+    gsserverok = run_gs_server_job(settings, isMainThread, QStringList(),
+                                   gs_server_device_job("bbox", QString(), QByteArray(),
+                                                        QStringList() << epsFile),
+                                   QString(), NULL, &bboxdata);
+    if (gsserverok && !bboxdata.contains("%%HiResBoundingBox")) {
+      gsserverok = false;
+    }
+  }
+  if (!gsserverok) {
+    bool ok = p.run(epsData /*stdin*/, QString() /*no output file*/, &bboxdata/*collect stdout*/);
+    if (!ok) {
+      p.errorToOutput(resError);
+      return false;
+    }
   }
+  klfDbg("gs stage bbox took "<<gstimer.elapsed()<<"ms using "
+         <<(gsserverok ? "gs server" : "new gs process")) ;
   
   klfDbg("gs provided output:\n"<<bboxdata);
 
@@ -1376,6 +1753,261 @@ static bool calculate_gs_eps_bbox(const QByteArray& epsData, const QString& epsF
 }
 
 
+// The smallest rectangle containing all pixels of img with nonzero alpha. Returns a null
+// rectangle if the image is fully transparent.
+static QRect klf_inked_rect(const QImage& image)
+{
+  QImage img = image;
+  if (img.format() != QImage::Format_ARGB32 && img.format() != QImage::Format_ARGB32_Premultiplied) {
+    img = img.convertToFormat(QImage::Format_ARGB32);
+  }
+  const int w = img.width();
+  const int h = img.height();
+  int x, y;
+
+  // first and last rows with ink
+  int top = -1, bottom = -1;
+  for (y = 0; y < h && top < 0; ++y) {
+    const QRgb *line = (const QRgb*)img.constScanLine(y);
+    for (x = 0; x < w; ++x) {
+      if (qAlpha(line[x])) { top = y; break; }
+    }
+  }
+  if (top < 0) {
+    return QRect();
+  }
+  for (y = h-1; y >= top && bottom < 0; --y) {
+    const QRgb *line = (const QRgb*)img.constScanLine(y);
+    for (x = 0; x < w; ++x) {
+      if (qAlpha(line[x])) { bottom = y; break; }
+    }
+  }
+  // within those rows, only look at pixels left of the leftmost and right of the rightmost
+  // ink found so far
+  int left = w, right = -1;
+  for (y = top; y <= bottom; ++y) {
+    const QRgb *line = (const QRgb*)img.constScanLine(y);
+    for (x = 0; x < left; ++x) {
+      if (qAlpha(line[x])) { left = x; break; }
+    }
+    for (x = w-1; x > right; --x) {
+      if (qAlpha(line[x])) { right = x; break; }
+    }
+  }
+  return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+// Calculate the bounding box by rendering the raw EPS once at the output resolution, with a
+// generous margin around dvips' bounding box, and scanning the alpha channel for the inked
+// area. This is precise up to one output pixel. Returns FALSE if this didn't work out (e.g. the
+// ink reaches the edge of the rendered area), in which case the caller should use
+// calculate_gs_eps_bbox(). On success, *raster is the rendered image and *rasterbbox the area
+// it covers, in postscript points.
+static bool calculate_raster_eps_bbox(const QByteArray& rawepsdata, int dpi, klfbbox *bbox,
+                                      QImage *raster, klfbbox *rasterbbox,
+                                      const KLFBackend::klfSettings& settings, bool isMainThread,
+                                      const QString& tempdir)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  if (settings.gsexec.isEmpty() || dpi <= 0) {
+    return false;
+  }
+
+  klfbbox declared;
+  if (!read_eps_bbox(rawepsdata, &declared, NULL)) {
+    return false;
+  }
+
+  // glyphs may stick out of dvips' bounding box, but not by much
+  double margin = 10 + 0.25 * qMax(declared.x2 - declared.x1, declared.y2 - declared.y1);
+  klfbbox area;
+  area.x1 = floor(declared.x1 - margin);
+  area.y1 = floor(declared.y1 - margin);
+  area.x2 = ceil(declared.x2 + margin);
+  area.y2 = ceil(declared.y2 + margin);
+  klfbbox areacorrected;
+  areacorrected.x1 = 0;
+  areacorrected.y1 = 0;
+  areacorrected.x2 = area.x2 - area.x1;
+  areacorrected.y2 = area.y2 - area.y1;
+
+  QByteArray areaepsdata;
+  correct_eps_bbox(rawepsdata, areacorrected, area, 1.0, qRgba(0,0,0,0), &areaepsdata);
+
+  QString fnAreaEps = tempdir + "/klftemp-bboxraster.eps";
+  QString fnAreaPng = tempdir + "/klftemp-bboxraster.png";
+  QByteArray pngdata;
+
+  bool gsserverok = false;
+  if (settings.useGsServer && write_temp_file(fnAreaEps, areaepsdata)) {
+    QByteArray sdpi = QByteArray::number(dpi);
+    gsserverok = run_gs_server_job(settings, isMainThread, QStringList() << "-dEPSCrop",
+                                   gs_server_device_job("pngalpha", fnAreaPng,
+                                                        "/HWResolution [" + sdpi + " " + sdpi + "]"
+                                                        " /TextAlphaBits 4 /GraphicsAlphaBits 4"
+                                                        " /MaxBitmap 2147483647",
+                                                        QStringList() << fnAreaEps),
+                                   fnAreaPng, &pngdata);
+  }
+  if (!gsserverok) {
+    KLFBackendFilterProgram p(QLatin1String("gs (bbox raster)"), &settings, isMainThread, tempdir);
+    p.setArgv(QStringList() << settings.gsexec
+              << "-dNOPAUSE" << "-dSAFER" << "-dTextAlphaBits=4" << "-dGraphicsAlphaBits=4"
+              << "-r"+QString::number(dpi) << "-dEPSCrop" << "-dMaxBitmap=2147483647"
+              << "-sDEVICE=pngalpha" << "-sOutputFile="+QDir::toNativeSeparators(fnAreaPng)
+              << "-q" << "-dBATCH" << "-");
+    if (!p.run(areaepsdata, fnAreaPng, &pngdata)) {
+      klfDbg("gs failed to render bbox raster: "<<p.resultErrorString()) ;
+      return false;
+    }
+  }
+
+  QImage img;
+  if (!img.loadFromData(pngdata, "PNG") || img.isNull()) {
+    return false;
+  }
+
+  QRect inked = klf_inked_rect(img);
+  if (inked.isNull()) {
+    klfDbg("empty raster, can't determine bbox.") ;
+    return false;
+  }
+  if (inked.left() == 0 || inked.top() == 0 ||
+      inked.right() == img.width()-1 || inked.bottom() == img.height()-1) {
+    klfDbg("ink reaches the edge of the raster, margin was too small.") ;
+    return false;
+  }
+
+  // the page gs rendered has integer size (in points), see correct_eps_bbox()
+  double pagew = ceil(areacorrected.x2);
+  double pageh = ceil(areacorrected.y2);
+  double sx = pagew / img.width();
+  double sy = pageh / img.height();
+
+  // the raster covers the whole page
+  rasterbbox->x1 = area.x1;
+  rasterbbox->y1 = area.y1;
+  rasterbbox->x2 = area.x1 + pagew;
+  rasterbbox->y2 = area.y1 + pageh;
+
+  bbox->x1 = area.x1 + inked.left()*sx;
+  bbox->x2 = area.x1 + (inked.right()+1)*sx;
+  bbox->y2 = area.y1 + pageh - inked.top()*sy;
+  bbox->y1 = area.y1 + pageh - (inked.bottom()+1)*sy;
+
+  *raster = img;
+
+  klfDbg("bbox from raster: "<<bbox->x1<<","<<bbox->y1<<","<<bbox->x2<<","<<bbox->y2) ;
+  return true;
+}
+
+
+// Job for the persistent gs server: set up the given output device and run the input files.
+// The device is closed, and the output file written, at the end of the job.
+static QByteArray gs_server_device_job(const QString& device, const QString& outFile,
+                                       const QByteArray& deviceparams, const QStringList& inputFiles)
+{
+  QByteArray job = "mark ";
+  if (!outFile.isEmpty()) {
+    job += "/OutputFile " + KLFGsServer::psFileName(outFile) + " ";
+  }
+  job += deviceparams + " (" + device.toLatin1() + ") finddevice putdeviceprops setdevice\n";
+  foreach (const QString& fn, inputFiles) {
+    job += KLFGsServer::psFileName(fn) + " run\n";
+  }
+  return job;
+}
+
+// Runs a job in this thread's persistent gs server, if settings.useGsServer is set, and reads
+// the output file. Returns FALSE if the server can't be used or if anything went wrong, in
+// which case the caller falls back to running a separate gs process.
+static bool run_gs_server_job(const KLFBackend::klfSettings& settings, bool isMainThread,
+                              const QStringList& startupArgs, const QByteArray& psjob,
+                              const QString& outFile, QByteArray *outdata, QByteArray *printed)
+{
+  if (!settings.useGsServer || settings.gsexec.isEmpty()) {
+    return false;
+  }
+  if (settings.abortFlag != NULL && settings.abortFlag->load()) {
+    // the regular process will report the interruption
+    return false;
+  }
+
+  // The jobs change the output file with putdeviceprops, which -dSAFER only allows since
+  // 9.50 with --permit-file-all. With older versions every job would fail and be run again.
+  GsInfo info;
+  if (!getGsInfo(settings.gsexec, &info) ||
+      info.version_maj < 9 || (info.version_maj == 9 && info.version_min < 50)) {
+    return false;
+  }
+  // since 9.50, -dSAFER also restricts reading and writing files; our files are all in
+  // (subdirectories of) the temporary directory
+  QStringList args = startupArgs;
+  args << "--permit-file-all=" + QDir::fromNativeSeparators(settings.tempdir) + "/*";
+
+  KLFGsServer *server = KLFGsServer::threadServer(settings, args);
+  if (server == NULL) {
+    klfDbg("gs server is busy, using a separate process.") ;
+    return false;
+  }
+
+  QString errstr;
+  if (!server->runJob(psjob, printed, isMainThread, &errstr, settings.abortFlag)) {
+    klfDbg("gs server job failed, will use a separate process instead. Error: "<<errstr) ;
+    return false;
+  }
+
+  if (outFile.isEmpty()) {
+    return true;
+  }
+
+  QFile f(outFile);
+  if (!f.open(QIODevice::ReadOnly)) {
+    klfDbg("gs server didn't produce "<<outFile) ;
+    return false;
+  }
+  if (outdata == NULL) {
+    // leave the output on disk
+    return f.size() > 0;
+  }
+  *outdata = f.readAll();
+  return !outdata->isEmpty();
+}
+
+static bool write_temp_file(const QString& fn, const QByteArray& data)
+{
+  QFile f(fn);
+  if (!f.open(QIODevice::WriteOnly)) {
+    klfWarning("Can't write "<<fn) ;
+    return false;
+  }
+  return f.write(data) == data.size();
+}
+
+// write the file only once; *written remembers whether it is already there
+static bool ensure_temp_file(bool *written, const QString& fn, const QByteArray& data)
+{
+  if (!*written)
+    *written = write_temp_file(fn, data);
+  return *written;
+}
+
+static qint64 buffers_memory_size(const QList<const QByteArray*>& buffers, const QImage& image)
+{
+  // implicitly shared data is only counted once
+  QSet<const char*> seen;
+  qint64 size = image.sizeInBytes();
+  foreach (const QByteArray *b, buffers) {
+    if (b->isEmpty() || seen.contains(b->constData()))
+      continue;
+    seen.insert(b->constData());
+    size += b->size();
+  }
+  return size;
+}
+
+
 static bool parse_bbox_values(const QString& str, klfbbox *bbox)
 {
   // parse bbox values
@@ -1639,6 +2271,7 @@ KLF_EXPORT bool operator==(const KLFBackend::klfSettings& a, const KLFBackend::k
     a.bborderoffset == b.bborderoffset &&
     a.lborderoffset == b.lborderoffset &&
     a.calcEpsBoundingBox == b.calcEpsBoundingBox &&
+    a.bboxMethod == b.bboxMethod &&
     a.outlineFonts == b.outlineFonts &&
     a.wantRaw == b.wantRaw &&
     a.wantPDF == b.wantPDF &&
@@ -1863,10 +2496,11 @@ KLF_EXPORT bool KLFBackend::detectOptionSettings(klfSettings * settings, bool is
   bool ok = true;
   if (settings->gsexec.length()) {
     initGsInfo(settings, isMainThread);
-    if (!gsInfo.contains(settings->gsexec)) {
+    GsInfo info;
+    if (!getGsInfo(settings->gsexec, &info)) {
       klfWarning("Cannot get 'gs' devices information with "<<(settings->gsexec+" --version/--help"));
       ok = false;
-    } else if (gsInfo[settings->gsexec].availdevices.contains("svg")) {
+    } else if (info.availdevices.contains("svg")) {
       settings->wantSVG = true;
     }
   }
@@ -1917,7 +2551,7 @@ void initGsInfo(const KLFBackend::klfSettings *settings, bool isMainThread)
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
 
-  if (gsInfo.contains(settings->gsexec)) // info already cached
+  if (getGsInfo(settings->gsexec, NULL)) // info already cached
     return;
 
   if (settings->gsexec.isEmpty()) {
@@ -2014,6 +2648,9 @@ void initGsInfo(const KLFBackend::klfSettings *settings, bool isMainThread)
   i.help = gshelp;
   i.availdevices = availdevices;
 
+  // several threads may have queried gs concurrently; they all obtain the same info, so
+  // whoever stores it last doesn't matter.
+  QMutexLocker lock(&klf_gsinfo_mutex);
   gsInfo[settings->gsexec] = i;
 }
 
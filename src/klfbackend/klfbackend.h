@@ -29,6 +29,7 @@
 #include <QByteArray>
 #include <QImage>
 #include <QMutex>
+#include <QAtomicInt>
 #include <QMap>
 #include <QVariant>
 
@@ -203,6 +204,8 @@
  *
  * \author Philippe Faist &lt;philippe.faist@bluewin.ch&gt;
  */
+class KLFRenderCache;
+
 class KLF_EXPORT KLFBackend
 {
 public:
@@ -219,9 +222,10 @@ public:
   {
     /** A default constructor assigning default (empty) values to all fields */
     klfSettings() : tborderoffset(0), rborderoffset(0), bborderoffset(0), lborderoffset(0),
-		    calcEpsBoundingBox(true), outlineFonts(true),
+		    calcEpsBoundingBox(true), bboxMethod(BBoxGsDevice), outlineFonts(true),
 		    wantRaw(false), wantPDF(true), wantSVG(true), execenv(),
-		    templateGenerator(NULL) { }
+		    templateGenerator(NULL), renderCache(NULL), useGsServer(false),
+		    abortFlag(NULL) { }
 
     /** A temporary directory in which we have write access, e.g. <tt>/tmp/</tt> */
     QString tempdir;
@@ -263,6 +267,20 @@ public:
      * is ignored with a non-white or non-transparent background color. */
     bool calcEpsBoundingBox;
 
+    /** How the EPS bounding box is recalculated, see \ref bboxMethod */
+    enum BBoxMethod {
+      /** Run \c gs with its \c bbox device (precise, but costs one more \c gs run) */
+      BBoxGsDevice = 0,
+      /** Render the EPS once at the output resolution, and find the inked area in the
+       * image. The bounding box is then precise up to one output pixel, and the image is
+       * directly reused as PNG output. If this fails, or if the background color is not
+       * transparent, \c BBoxGsDevice is used. */
+      BBoxRaster
+    };
+    /** Which method to use to recalculate the EPS bounding box, if \ref calcEpsBoundingBox
+     * is set. */
+    BBoxMethod bboxMethod;
+
     /** Strip away fonts in favor of vectorially outlining them with gs.
      *
      * Use this option to produce output that doens't embed fonts, eg. for Adobe Illustrator.
@@ -298,6 +316,29 @@ public:
      *  corresponding interpreter (e.g. "/usr/bin/python")
      */
     QMap<QString,QString> userScriptInterpreters;
+
+    /** A cache of previously generated results (see \ref KLFRenderCache), or \c NULL to
+     * always run the full process chain. If set, getLatexFormula() first looks up the
+     * result in this cache, and stores successful results in it.
+     *
+     * This object is not owned by the settings object; it must stay valid as long as any
+     * settings object referring to it is used. */
+    KLFRenderCache *renderCache;
+
+    /** Run ghostscript jobs in a long-lived \c gs process instead of starting a new process
+     * for each step. Each thread calling getLatexFormula() gets its own \c gs server
+     * processes. If a job fails in the server, it is run again in a separate process as
+     * usual, so this setting never changes the output.
+     *
+     * This requires ghostscript 9.50 or later, and is ignored for older versions. */
+    bool useGsServer;
+
+    /** If not \c NULL, the programs run by getLatexFormula() are killed as soon as this flag
+     * becomes nonzero, and getLatexFormula() returns with an error. This may be set from any
+     * thread, and is used for example to interrupt a preview which has become obsolete.
+     *
+     * This object is not owned by the settings object. */
+    const QAtomicInt *abortFlag;
   };
 
   //! Specific input to KLFBackend::getLatexFormula()
@@ -451,6 +492,12 @@ public:
     double width_pt;
     /** \brief Width in points of the resulting equation */
     double height_pt;
+
+    /** \brief The largest total size, in bytes, of the data (image, file contents) held in memory
+     * at the same time while generating this output
+     *
+     * This is for information only. Data shared between several fields is counted once. */
+    qint64 peak_memory;
   };
 
   /** \brief The function that processes everything.
@@ -507,12 +554,13 @@ public:
    *   ...
    * \endcode
    *
-   * \note This function is safe for threads; it locks a mutex at the beginning and unlocks
-   *   it at the end; so if a call to this function is issued while a first call is already
-   *   being processed in another thread, the second waits for the first call to finish.
-   *   However, if you are not running this from the main thread, you should be sure to pass
-   *   FALSE to \c isMainThread, in order to prevent this function from allowing the
-   *   application to process events during process executions.
+   * \note This function is reentrant and safe for threads. Several calls may run at the
+   *   same time in different threads (each run uses its own temporary directory), which
+   *   allows to render several formulas in parallel. Only the access to the cached
+   *   ghostscript information and the execution of user scripts are serialized internally.
+   *   If you are not running this from the main thread, you should be sure to pass FALSE
+   *   to \c isMainThread, in order to prevent this function from allowing the application
+   *   to process events during process executions.
    */
   static klfOutput getLatexFormula(const klfInput& in, const klfSettings& settings,
 				   bool isMainThread = true);
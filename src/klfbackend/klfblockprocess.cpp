@@ -24,6 +24,7 @@
 #include <QProcess>
 #include <QCoreApplication>
 #include <QEventLoop>
+#include <QTimer>
 #include <QFile>
 #include <QThread>
 #include <QPair>
@@ -150,6 +151,8 @@ KLFBlockProcess::KLFBlockProcess(QObject *p)
   : QProcess(p)
 {
   mProcessAppEvents = true;
+  mAbortFlag = NULL;
+  mAborted = false;
   connect(this, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(ourProcExited()));
 }
 
@@ -167,6 +170,21 @@ void KLFBlockProcess::ourProcExited()
   _runstatus = 1; // exited
 }
 
+void KLFBlockProcess::checkAbort()
+{
+  if (_runstatus == 0 && abortRequested()) {
+    abortProcess();
+  }
+}
+
+void KLFBlockProcess::abortProcess()
+{
+  klfDbg("abort requested, killing process "<<program()) ;
+  mAborted = true;
+  kill();
+  waitForFinished(2000);
+}
+
 // virtual
 QString KLFBlockProcess::getInterpreterPath(const QString & ext)
 {
@@ -203,13 +221,12 @@ bool KLFBlockProcess::startProcess(QStringList cmd, QStringList env)
   return startProcess(cmd, QByteArray(), env);
 }
 
-bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStringList env)
+bool KLFBlockProcess::startProcessAsync(QStringList cmd, QStringList env)
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
-  klfDbg("Running: "<<cmd<<", stdindata/size="<<stdindata.size());
-
   _runstatus = 0;
+  mAborted = false;
 
   KLF_ASSERT_CONDITION(cmd.size(), "Empty command list given.", return false;) ;
 
@@ -227,6 +244,12 @@ bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStrin
     }
   }
 
+  if (abortRequested()) {
+    klfDbg("abort requested, not starting process.") ;
+    mAborted = true;
+    return false;
+  }
+
   QString program = cmd[0];
 
   klfDbg("Running cmd="<<cmd);
@@ -240,6 +263,18 @@ bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStrin
   args.erase(args.begin());
   klfDbg("Starting "<<program<<", "<<args) ;
   start(program, args);
+  return true;
+}
+
+bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStringList env)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  klfDbg("Running: "<<cmd<<", stdindata/size="<<stdindata.size());
+
+  if (!startProcessAsync(cmd, env)) {
+    return false;
+  }
   if ( ! waitForStarted() ) {
     klfDbg("Can't wait for started! Error="<<error()) ;
     return false;
@@ -252,15 +287,33 @@ bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStrin
 
   if (mProcessAppEvents) {
     klfDbg("letting current thread (="<<QThread::currentThread()<<") process events ...") ;
-    while (_runstatus == 0) {
-      QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents, 1000);
-      klfDbg("events processed, maybe more?") ;
+    // wait in a local event loop which is woken up by the finished() signal, rather than
+    // polling. Check the abort flag regularly if we have one.
+    QEventLoop loop;
+    connect(this, SIGNAL(finished(int, QProcess::ExitStatus)), &loop, SLOT(quit()));
+    QTimer abortTimer;
+    if (mAbortFlag != NULL) {
+      connect(&abortTimer, SIGNAL(timeout()), this, SLOT(checkAbort()));
+      abortTimer.start(50);
     }
-  } else {
-    if (!waitForFinished()) {
-      klfDbg("Can't wait for finished!");
+    if (_runstatus == 0) {
+      loop.exec(QEventLoop::ExcludeUserInputEvents);
+    }
+    if (mAborted) {
       return false;
     }
+  } else {
+    // if we may be aborted, wake up regularly to check the abort flag
+    while (!waitForFinished(mAbortFlag != NULL ? 50 : -1)) {
+      if (mAbortFlag == NULL || state() == QProcess::NotRunning) {
+        klfDbg("Can't wait for finished!");
+        return false;
+      }
+      if (abortRequested()) {
+        abortProcess();
+        return false;
+      }
+    }
   }
   klfDbg("Process should have finished now.");
 
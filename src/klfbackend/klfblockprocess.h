@@ -34,6 +34,7 @@
 #include <QProcess>
 #include <QString>
 #include <QByteArray>
+#include <QAtomicInt>
 
 
 //! A QProcess subclass for code-blocking process execution
@@ -67,6 +68,14 @@ public:
    * disable this behavior by passing FALSE here. */
   inline void setProcessAppEvents(bool processAppEvents) { mProcessAppEvents = processAppEvents; }
 
+  /** Kill the process and make \ref startProcess() return FALSE as soon as \c *abortFlag
+   * becomes nonzero. The flag may be set from any thread. Pass \c NULL (the default) to
+   * always let the process run to completion. */
+  inline void setAbortFlag(const QAtomicInt *abortFlag) { mAbortFlag = abortFlag; }
+
+  /** TRUE if the last \ref startProcess() was interrupted because the abort flag was set. */
+  inline bool processAborted() const { return mAborted; }
+
   /** Returns all standard error output as a QByteArray. This function is to standardize the
    * readStderr() and readAllStandardError() functions in QT 3 or QT 4 respectively */
   QByteArray getAllStderr() {
@@ -127,6 +136,15 @@ public slots:
    * anything to it. */
   bool startProcess(QStringList cmd, QStringList env = QStringList());
 
+  /** Starts cmd like startProcess(), but returns immediately without writing anything to the
+   * process' standard input nor waiting for it to finish. Use the usual QProcess signals and
+   * functions to interact with the process.
+   *
+   * \returns FALSE if the process could not be launched at all. Failures to start the
+   *   program itself are reported with QProcess' \c error() signal as usual.
+   */
+  bool startProcessAsync(QStringList cmd, QStringList env = QStringList());
+
   /** Same as getAllStderr(), except result is returned here as QString. */
   QString readStderrString() {
     return QString::fromLocal8Bit(getAllStderr());
@@ -137,6 +155,15 @@ public slots:
   }
 
 
+  /** Kills the process if the abort flag (see \ref setAbortFlag()) is set. This is done
+   * regularly while waiting in \ref startProcess(); after \ref startProcessAsync(), call
+   * this yourself if needed. */
+  void checkAbort();
+
+protected:
+  bool abortRequested() const { return mAbortFlag != NULL && mAbortFlag->load() != 0; }
+  void abortProcess();
+
 private slots:
   void ourProcExited();
   void ourProcGotOurStdinData();
@@ -144,6 +171,8 @@ private slots:
 private:
   int _runstatus;
   bool mProcessAppEvents;
+  const QAtomicInt *mAbortFlag;
+  bool mAborted;
 };
 
 
@@ -24,6 +24,8 @@
 #include <QString>
 #include <QFile>
 #include <QProcess>
+#include <QTimer>
+#include <QEventLoop>
 
 #include <klfdefs.h>
 
@@ -121,12 +123,20 @@ struct KLFFilterProcessPrivate {
 
   bool processAppEvents;
 
+  const QAtomicInt *abortFlag;
+
   // these fields are set after calling run()
   int exitStatus;
   int exitCode;
 
   int res;
   QString resErrorString;
+
+  /** Sets the fields above according to how the program ran, and collects the output data.
+   * Returns TRUE if everything went fine. */
+  bool collectResults(bool started, bool aborted, bool normalExit, int procExitCode,
+                      const QByteArray& stdoutdata, const QByteArray& stderrdata,
+                      const QMap<QString, QByteArray*>& outdatalist);
 };
 
 // ---------
@@ -159,6 +169,8 @@ void KLFFilterProcessPrivate::init(const QString& pTitle, const KLFBackend::klfS
 
   interpreters = QMap<QString,QString>();
 
+  abortFlag = NULL;
+
   if (rundir.size()) {
     programCwd = rundir;
   }
@@ -177,6 +189,8 @@ void KLFFilterProcessPrivate::init(const QString& pTitle, const KLFBackend::klfS
     klfDbg("set execution environment to : "<<execEnviron) ;
     
     interpreters = settings->userScriptInterpreters;
+
+    abortFlag = settings->abortFlag;
   }
 
   processAppEvents = true;
@@ -321,70 +335,82 @@ bool KLFFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByt
   proc.setWorkingDirectory(d->programCwd);
 
   proc.setProcessAppEvents(d->processAppEvents);
+  proc.setAbortFlag(d->abortFlag);
 
   klfDbg("about to exec "<<d->progTitle<<" ...") ;
   klfDbg("\t"<<qPrintable(d->argv.join(" "))) ;
   bool r = proc.startProcess(d->argv, indata, d->execEnviron);
   klfDbg(d->progTitle<<" returned.") ;
 
-  if (!r) {
-    klfDbg("couldn't launch " << d->progTitle) ;
-    d->res = KLFFP_NOSTART;
-    d->resErrorString = QObject::tr("Unable to start %1 program `%2'!", "KLFBackend").arg(d->progTitle, d->argv[0]);
+  return d->collectResults(r, proc.processAborted(), proc.processNormalExit(), proc.processExitStatus(),
+                           proc.getAllStdout(), proc.getAllStderr(), outdatalist);
+}
+
+bool KLFFilterProcessPrivate::collectResults(bool started, bool aborted, bool normalExit, int procExitCode,
+                                             const QByteArray& stdoutdata, const QByteArray& stderrdata,
+                                             const QMap<QString, QByteArray*>& outdatalist)
+{
+  if (!started && aborted) {
+    klfDbg(progTitle << " was aborted") ;
+    res = KLFFP_NOSTART;
+    resErrorString = QObject::tr("Execution of %1 was interrupted.", "KLFBackend").arg(progTitle);
+    return false;
+  }
+  if (!started) {
+    klfDbg("couldn't launch " << progTitle) ;
+    res = KLFFP_NOSTART;
+    resErrorString = QObject::tr("Unable to start %1 program `%2'!", "KLFBackend").arg(progTitle, argv.value(0));
     return false;
   }
-  if (!proc.processNormalExit()) {
-    klfDbg(d->progTitle<<" did not exit normally (crashed)") ;
-    d->exitStatus = proc.exitStatus();
-    d->exitCode = -1;
-    d->res = KLFFP_NOEXIT;
-    d->resErrorString = QObject::tr("Program %1 crashed!", "KLFBackend").arg(d->progTitle);
+  if (!normalExit) {
+    klfDbg(progTitle<<" did not exit normally (crashed)") ;
+    exitStatus = QProcess::CrashExit;
+    exitCode = -1;
+    res = KLFFP_NOEXIT;
+    resErrorString = QObject::tr("Program %1 crashed!", "KLFBackend").arg(progTitle);
     return false;
   }
-  if (proc.processExitStatus() != 0) {
-    d->exitStatus = 0;
-    d->exitCode = proc.processExitStatus();
-    klfDbg(d->progTitle<<" exited with code "<<d->exitCode) ;
-    d->res = KLFFP_NOSUCCESSEXIT;
-    d->resErrorString = progErrorMsg(d->progTitle, proc.processExitStatus(), proc.readStderrString(),
-				     proc.readStdoutString());
+  if (procExitCode != 0) {
+    exitStatus = 0;
+    exitCode = procExitCode;
+    klfDbg(progTitle<<" exited with code "<<exitCode) ;
+    res = KLFFP_NOSUCCESSEXIT;
+    resErrorString = progErrorMsg(progTitle, procExitCode, QString::fromLocal8Bit(stderrdata),
+                                  QString::fromLocal8Bit(stdoutdata));
     return false;
   }
 
-  if (d->collectStdout != NULL) {
-    *d->collectStdout = proc.getAllStdout();
+  if (collectStdout != NULL) {
+    *collectStdout = stdoutdata;
   }
-  if (d->collectStderr != NULL) {
-    *d->collectStderr = proc.getAllStderr();
+  if (collectStderr != NULL) {
+    *collectStderr = stderrdata;
   }
 
   for (QMap<QString,QByteArray*>::const_iterator it = outdatalist.begin(); it != outdatalist.end(); ++it) {
     QString outFileName = it.key();
     QByteArray * outdata = it.value();
       
-    KLF_ASSERT_NOT_NULL(outdata, "Given NULL outdata pointer for file "<<outFileName<<" !", return false; ) ;
-
     klfDbg("Will collect output in file "<<(outFileName.isEmpty()?QString("(stdout)"):outFileName)
 	   <<" to its corresponding QByteArray pointer="<<outdata) ;
 
     if (outFileName.isEmpty()) {
+      KLF_ASSERT_NOT_NULL(outdata, "Given NULL outdata pointer for standard output!", return false; ) ;
       // empty outFileName means to use standard output
       *outdata = QByteArray();
-      if (d->outputStdout) {
-	QByteArray stdoutdata = (d->collectStdout != NULL) ? *d->collectStdout : proc.getAllStdout();
+      if (outputStdout) {
 	*outdata += stdoutdata;
       }
-      if (d->outputStderr) {
-	QByteArray stderrdata = (d->collectStderr != NULL) ? *d->collectStderr : proc.getAllStderr();
+      if (outputStderr) {
 	*outdata += stderrdata;
       }
       if (outdata->isEmpty()) {
 	// no data
-	QString stderrstr = (!d->outputStderr) ? ("\n"+proc.readStderrString()) : QString();
-	klfDbg(d->progTitle<<" did not provide any data. Error message: "<<stderrstr);
-	d->res = KLFFP_NODATA;
-	d->resErrorString = QObject::tr("Program %1 did not provide any output data.", "KLFBackend")
-	  .arg(d->progTitle) + stderrstr;
+	QString stderrstr = (!outputStderr) ? ("\n"+QString::fromLocal8Bit(stderrdata)) : QString();
+	klfDbg(progTitle<<" did not provide any data. Error message: "<<stderrstr);
+	res = KLFFP_NODATA;
+	resErrorString = QObject::tr("Program %1 did not provide any output data.", "KLFBackend")
+	  .arg(progTitle) + stderrstr;
 	return false;
       }
       // read standard output to buffer, continue with other possible outputs
@@ -392,20 +418,26 @@ bool KLFFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByt
     }
 
     if (!QFile::exists(outFileName)) {
-      klfDbg("File "<<outFileName<<" did not appear after running "<<d->progTitle) ;
-      d->res = KLFFP_NODATA;
-      d->resErrorString = QObject::tr("Output file didn't appear after having called %1!", "KLFBackend")
-	.arg(d->progTitle);
+      klfDbg("File "<<outFileName<<" did not appear after running "<<progTitle) ;
+      res = KLFFP_NODATA;
+      resErrorString = QObject::tr("Output file didn't appear after having called %1!", "KLFBackend")
+	.arg(progTitle);
       return false;
     }
 
+    if (outdata == NULL) {
+      // the caller only needs the file to exist, e.g. to pass it on to another program
+      klfDbg("Leaving output "<<outFileName<<" on disk") ;
+      continue;
+    }
+
     // read output file into outdata
     QFile outfile(outFileName);
-    r = outfile.open(QIODevice::ReadOnly);
+    bool r = outfile.open(QIODevice::ReadOnly);
     if ( ! r ) {
-      klfDbg("File "<<outFileName<<" cannot be read (after running "<<d->progTitle<<")") ;
-      d->res = KLFFP_DATAREADFAIL;
-      d->resErrorString = QObject::tr("Can't read file '%1'!\n", "KLFBackend").arg(outFileName);
+      klfDbg("File "<<outFileName<<" cannot be read (after running "<<progTitle<<")") ;
+      res = KLFFP_DATAREADFAIL;
+      resErrorString = QObject::tr("Can't read file '%1'!\n", "KLFBackend").arg(outFileName);
       return false;
     }
       
@@ -413,13 +445,13 @@ bool KLFFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByt
     klfDbg("Read file "<<outFileName<<", got data, length="<<outdata->size());
   }
 
-  klfDbg(d->progTitle<<" was successfully run and output successfully retrieved.") ;
+  klfDbg(progTitle<<" was successfully run and output successfully retrieved.") ;
 
   // all OK
-  d->exitStatus = 0;
-  d->exitCode = 0;
-  d->res = KLFFP_NOERR;
-  d->resErrorString = QString();
+  exitStatus = 0;
+  exitCode = 0;
+  res = KLFFP_NOERR;
+  resErrorString = QString();
 
   return true;
 }
@@ -439,3 +471,258 @@ QByteArray KLFFilterProcess::collectedStderr() const
   }
   return *d->collectStderr;
 }
+
+
+
+// -----------------
+
+KLFFilterProcessJob * KLFFilterProcess::startAsync(const QByteArray& indata,
+                                                   const QMap<QString, QByteArray*> outdatalist,
+                                                   QObject * parent)
+{
+  KLFFilterProcessJob * job = new KLFFilterProcessJob(this, outdatalist, parent);
+  job->start(NULL);
+  job->writeInput(indata);
+  job->closeInput();
+  return job;
+}
+
+KLFFilterProcessJob * KLFFilterProcess::startAsync(QIODevice * input,
+                                                   const QMap<QString, QByteArray*> outdatalist,
+                                                   QObject * parent)
+{
+  KLFFilterProcessJob * job = new KLFFilterProcessJob(this, outdatalist, parent);
+  job->start(input);
+  return job;
+}
+
+
+// size of the chunks in which we feed an input device to the program
+#define KLF_FILTERPROCESS_INPUT_CHUNK_SIZE (64*1024)
+
+struct KLFFilterProcessJobPrivate
+{
+  KLF_PRIVATE_HEAD(KLFFilterProcessJob)
+  {
+    fproc = NULL;
+    proc = NULL;
+    input = NULL;
+    keepStdout = false;
+    launchFailed = false;
+    userAborted = false;
+    done = false;
+    successful = false;
+  }
+
+  KLFFilterProcess * fproc;
+  KLFFilterProcessBlockProcess * proc;
+
+  QMap<QString, QByteArray*> outdatalist;
+
+  // the device we're streaming the input from, if any
+  QIODevice * input;
+
+  // whether we need to keep the standard output to collect the results
+  bool keepStdout;
+  QByteArray stdoutdata;
+  QByteArray stderrdata;
+
+  bool launchFailed;
+  bool userAborted;
+  bool done;
+  bool successful;
+
+  void feedInput()
+  {
+    while (input != NULL && proc->bytesToWrite() < KLF_FILTERPROCESS_INPUT_CHUNK_SIZE) {
+      QByteArray chunk = input->read(KLF_FILTERPROCESS_INPUT_CHUNK_SIZE);
+      if (chunk.isEmpty()) {
+        // end of input (or read error)
+        proc->closeWriteChannel();
+        input = NULL;
+        break;
+      }
+      proc->write(chunk);
+    }
+  }
+};
+
+
+KLFFilterProcessJob::KLFFilterProcessJob(KLFFilterProcess * fproc,
+                                         const QMap<QString, QByteArray*>& outdatalist,
+                                         QObject * parent)
+  : QObject(parent)
+{
+  KLF_INIT_PRIVATE(KLFFilterProcessJob) ;
+  d->fproc = fproc;
+  d->outdatalist = outdatalist;
+}
+
+KLFFilterProcessJob::~KLFFilterProcessJob()
+{
+  // d->proc is our child and will be killed if it's still running
+  KLF_DELETE_PRIVATE ;
+}
+
+void KLFFilterProcessJob::start(QIODevice * input)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  KLFFilterProcessPrivate * fd = d->fproc->d;
+
+  fd->exitCode = 0;
+  fd->exitStatus = 0;
+
+  d->proc = new KLFFilterProcessBlockProcess(d->fproc);
+  d->proc->setParent(this);
+  d->proc->setWorkingDirectory(fd->programCwd);
+  d->proc->setAbortFlag(fd->abortFlag);
+
+  d->keepStdout = (fd->collectStdout != NULL || d->outdatalist.contains(QString()));
+
+  connect(d->proc, SIGNAL(readyReadStandardOutput()), this, SLOT(procStdoutReady()));
+  connect(d->proc, SIGNAL(readyReadStandardError()), this, SLOT(procStderrReady()));
+  connect(d->proc, SIGNAL(bytesWritten(qint64)), this, SLOT(procBytesWritten()));
+  connect(d->proc, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(procFinished()));
+  connect(d->proc, SIGNAL(error(QProcess::ProcessError)), this, SLOT(procError()));
+
+  if (fd->abortFlag != NULL) {
+    QTimer * abortTimer = new QTimer(this);
+    connect(abortTimer, SIGNAL(timeout()), this, SLOT(checkAbort()));
+    abortTimer->start(50);
+  }
+
+  klfDbg("starting "<<fd->progTitle<<" asynchronously: "<<qPrintable(fd->argv.join(" "))) ;
+
+  if (fd->argv.isEmpty() || !d->proc->startProcessAsync(fd->argv, fd->execEnviron)) {
+    klfDbg("couldn't launch "<<fd->progTitle) ;
+    d->launchFailed = true;
+    // report this once the caller had a chance to connect to our signals
+    QMetaObject::invokeMethod(this, "procFinished", Qt::QueuedConnection);
+    return;
+  }
+
+  d->input = input;
+  d->feedInput();
+}
+
+KLFFilterProcess * KLFFilterProcessJob::filterProcess() const
+{
+  return d->fproc;
+}
+
+bool KLFFilterProcessJob::isFinished() const
+{
+  return d->done;
+}
+
+bool KLFFilterProcessJob::success() const
+{
+  return d->successful;
+}
+
+bool KLFFilterProcessJob::waitForFinished(int msecs)
+{
+  if (!d->done) {
+    QEventLoop loop;
+    connect(this, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+    if (msecs >= 0) {
+      QTimer::singleShot(msecs, &loop, SLOT(quit()));
+    }
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+  }
+  return d->done && d->successful;
+}
+
+void KLFFilterProcessJob::writeInput(const QByteArray& data)
+{
+  if (d->launchFailed || d->done) {
+    return;
+  }
+  d->proc->write(data);
+}
+
+void KLFFilterProcessJob::closeInput()
+{
+  if (d->launchFailed || d->done) {
+    return;
+  }
+  d->input = NULL;
+  d->proc->closeWriteChannel();
+}
+
+void KLFFilterProcessJob::abort()
+{
+  if (d->launchFailed || d->done) {
+    return;
+  }
+  klfDbg("aborting "<<d->fproc->progTitle()) ;
+  d->userAborted = true;
+  d->proc->kill();
+}
+
+void KLFFilterProcessJob::procStdoutReady()
+{
+  QByteArray data = d->proc->readAllStandardOutput();
+  if (data.isEmpty()) {
+    return;
+  }
+  if (d->keepStdout) {
+    d->stdoutdata += data;
+  }
+  emit stdoutDataAvailable(data);
+}
+
+void KLFFilterProcessJob::procStderrReady()
+{
+  d->stderrdata += d->proc->readAllStandardError();
+}
+
+void KLFFilterProcessJob::procBytesWritten()
+{
+  d->feedInput();
+}
+
+void KLFFilterProcessJob::procError()
+{
+  // if the program crashed, finished() is emitted as well. But if it failed to start, it
+  // isn't, so finish now.
+  if (!d->done && d->proc->state() == QProcess::NotRunning && d->proc->error() == QProcess::FailedToStart) {
+    QMetaObject::invokeMethod(this, "procFinished", Qt::QueuedConnection);
+  }
+}
+
+void KLFFilterProcessJob::checkAbort()
+{
+  if (!d->done && !d->launchFailed) {
+    d->proc->checkAbort();
+  }
+}
+
+void KLFFilterProcessJob::procFinished()
+{
+  if (d->done) {
+    return;
+  }
+
+  KLFFilterProcessPrivate * fd = d->fproc->d;
+
+  bool aborted = d->userAborted || d->proc->processAborted();
+  bool started = !d->launchFailed && !aborted && d->proc->error() != QProcess::FailedToStart;
+
+  if (!d->launchFailed) {
+    // get any remaining output
+    procStdoutReady();
+    procStderrReady();
+  }
+
+  klfDbg(fd->progTitle<<" finished.") ;
+
+  d->done = true;
+  d->input = NULL;
+  d->successful = fd->collectResults(started, aborted,
+                                     d->launchFailed || d->proc->exitStatus() == QProcess::NormalExit,
+                                     d->launchFailed ? -1 : d->proc->exitCode(),
+                                     d->stdoutdata, d->stderrdata, d->outdatalist);
+  emit finished(d->successful);
+}
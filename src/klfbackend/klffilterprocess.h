@@ -30,6 +30,9 @@
 #include <klfblockprocess.h>
 #include <klfbackend.h>
 
+#include <QObject>
+#include <QIODevice>
+
 
 #define KLFFP_NOERR 0
 #define KLFFP_NOSTART 1
@@ -43,6 +46,7 @@
 
 struct KLFFilterProcessPrivate;
 class KLFFilterProcessBlockProcess;
+class KLFFilterProcessJob;
 
 class KLF_EXPORT KLFFilterProcess
 {
@@ -129,7 +133,9 @@ public:
    *
    * \param indata a QByteArray to write into the program's standard input
    * \param outdatalist a QMap with keys being files that are created by the program. These files are
-   *   read and their contents stored in the QByteArray's pointed by the corresponding pointer.
+   *   read and their contents stored in the QByteArray's pointed by the corresponding pointer. If the
+   *   pointer is \c NULL, the file is only checked to exist and is not read; this avoids loading
+   *   data in memory which is only going to be passed on to another program.
    * \param resError the klfOutput object is initialized to the corresponding error if an error occurred.
    *
    * An empty file name in the list means to collect the standard output.
@@ -141,9 +147,36 @@ public:
     return do_run(indata, outdatalist);
   }
 
+  /** \brief Start the program without waiting for it to finish
+   *
+   * Returns a job object which emits \ref KLFFilterProcessJob::finished() when the program
+   * has finished and the output has been collected, exactly as \ref run() would have done.
+   * The result is then available with resultStatus() and resultErrorString() as usual. No
+   * thread is blocked meanwhile, so a single thread can drive many programs at the same time,
+   * as long as it runs an event loop.
+   *
+   * \c indata is written to the program's standard input, which is then closed.
+   *
+   * This KLFFilterProcess object must stay valid until the job has finished. The job is
+   * owned by the caller (or \c parent).
+   */
+  KLFFilterProcessJob * startAsync(const QByteArray& indata, const QMap<QString, QByteArray*> outdatalist,
+                                   QObject * parent = NULL);
+
+  /** \brief Start the program without waiting for it to finish, streaming its input
+   *
+   * Same as above, but the standard input is read in chunks from \c input as the program
+   * consumes it, so that the data never needs to be loaded in memory at once. If \c input is
+   * \c NULL, then the caller feeds the input itself with \ref KLFFilterProcessJob::writeInput()
+   * and \ref KLFFilterProcessJob::closeInput().
+   */
+  KLFFilterProcessJob * startAsync(QIODevice * input, const QMap<QString, QByteArray*> outdatalist,
+                                   QObject * parent = NULL);
+
 protected:
 
   friend class KLFFilterProcessBlockProcess;
+  friend class KLFFilterProcessJob;
   virtual QMap<QString,QString> interpreters() const;
 
   /** \brief Actually run the process
@@ -175,6 +208,74 @@ private:
 
 
 
+struct KLFFilterProcessJobPrivate;
+
+//! A program started with \ref KLFFilterProcess::startAsync()
+/** This object lets you interact with the running program, and tells you when it has
+ * finished. It is driven by the event loop of the thread it was created in.
+ *
+ * To process the standard output while the program is running, connect to
+ * \ref stdoutDataAvailable() before returning to the event loop. If the standard output is
+ * not requested in the output list nor with \ref KLFFilterProcess::collectStdoutTo(), it is
+ * then not kept in memory.
+ *
+ * Jobs can be chained into pipelines by connecting \ref stdoutDataAvailable() of one job to
+ * \ref writeInput() of the next one, and \ref finished() to \ref closeInput().
+ */
+class KLF_EXPORT KLFFilterProcessJob : public QObject
+{
+  Q_OBJECT
+public:
+  virtual ~KLFFilterProcessJob();
+
+  KLFFilterProcess * filterProcess() const;
+
+  /** TRUE once the program has finished (or failed to start) and \ref finished() was emitted */
+  bool isFinished() const;
+  /** After the job has finished, whether it was successful, i.e. the return value \ref
+   * KLFFilterProcess::run() would have had. */
+  bool success() const;
+
+  /** Blocks until the job has finished, running a local event loop. Returns \ref success().
+   * A negative \c msecs means to wait indefinitely; returns FALSE on timeout. */
+  bool waitForFinished(int msecs = -1);
+
+signals:
+  /** Emitted whenever the program wrote some data on its standard output */
+  void stdoutDataAvailable(const QByteArray& data);
+  /** Emitted once the program has finished and its output was collected */
+  void finished(bool success);
+
+public slots:
+  /** Write more data to the program's standard input. Only meaningful if the job was
+   * started with a \c NULL input device. */
+  void writeInput(const QByteArray& data);
+  /** Close the program's standard input. */
+  void closeInput();
+  /** Kill the program. The job then finishes with an error. */
+  void abort();
+
+private slots:
+  void procStdoutReady();
+  void procStderrReady();
+  void procBytesWritten();
+  void procFinished();
+  void procError();
+  void checkAbort();
+
+private:
+  KLFFilterProcessJob(KLFFilterProcess * fproc, const QMap<QString, QByteArray*>& outdatalist,
+                      QObject * parent);
+  friend class KLFFilterProcess;
+
+  void start(QIODevice * input);
+
+  KLF_DECLARE_PRIVATE(KLFFilterProcessJob) ;
+};
+
+
+
+
 
 
 
@@ -0,0 +1,315 @@
+/***************************************************************************
+ *   file klfgsserver.cpp
+ *   This file is part of the KLatexFormula Project.
+ *   Copyright (C) 2020 by Philippe Faist
+ *   philippe.faist at bluewin.ch
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/* $Id$ */
+
+#include <QCoreApplication>
+#include <QProcess>
+#include <QHash>
+#include <QThreadStorage>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+#include <QDir>
+
+#include <klfdefs.h>
+#include <klfutil.h>
+
+#include "klfbackend.h"
+#include "klfgsserver_p.h"
+
+
+// restart the gs process after this many jobs, in case it leaks memory
+#define KLF_GSSERVER_MAX_JOBS 200
+// give up on a job (and kill gs) if it doesn't finish within this time
+#define KLF_GSSERVER_JOB_TIMEOUT_MS 60000
+
+
+struct KLFGsServerPrivate
+{
+  KLF_PRIVATE_HEAD(KLFGsServer)
+  {
+    proc = NULL;
+    busy = false;
+    jobcounter = 0;
+    jobsthisprocess = 0;
+  }
+
+  QString gsexec;
+  QString rundir;
+  QStringList startupArgs;
+  QStringList execenv;
+
+  QProcess *proc;
+  bool busy;
+  int jobcounter;
+  int jobsthisprocess;
+
+  bool ensureStarted(QString *errorString);
+};
+
+
+KLFGsServer::KLFGsServer(const KLFBackend::klfSettings& settings, const QStringList& startupArgs)
+{
+  KLF_INIT_PRIVATE(KLFGsServer) ;
+
+  d->gsexec = settings.gsexec;
+  d->rundir = settings.tempdir;
+  d->startupArgs = startupArgs;
+  // same environment as KLFFilterProcess would use
+  d->execenv = klfMergeEnvironment(QStringList(), settings.execenv,
+                                   QStringList()<<"PATH"<<"TEXINPUTS"<<"BIBINPUTS"<<"PYTHONPATH",
+                                   KlfEnvPathPrepend|KlfEnvMergeExpandVars);
+}
+
+KLFGsServer::~KLFGsServer()
+{
+  stop();
+  KLF_DELETE_PRIVATE ;
+}
+
+bool KLFGsServer::isRunning() const
+{
+  return d->proc != NULL && d->proc->state() == QProcess::Running;
+}
+
+bool KLFGsServer::isBusy() const
+{
+  return d->busy;
+}
+
+bool KLFGsServerPrivate::ensureStarted(QString *errorString)
+{
+  if (proc != NULL && proc->state() == QProcess::Running && jobsthisprocess < KLF_GSSERVER_MAX_JOBS) {
+    return true;
+  }
+  K->stop();
+
+  QStringList args;
+  args << "-q" << "-dNOPAUSE" << "-dSAFER" << "-dJOBSERVER" << "-sDEVICE=nullpage"
+       << startupArgs << "-";
+
+  klfDbg("starting gs server: "<<gsexec<<" "<<args) ;
+
+  proc = new QProcess;
+  proc->setProcessChannelMode(QProcess::MergedChannels);
+  if (rundir.size()) {
+    proc->setWorkingDirectory(rundir);
+  }
+  if (execenv.size()) {
+    proc->setEnvironment(execenv);
+  }
+  proc->start(gsexec, args);
+  if (!proc->waitForStarted()) {
+    if (errorString != NULL) {
+      *errorString = QObject::tr("Can't start ghostscript server `%1': %2", "KLFBackend")
+        .arg(gsexec, proc->errorString());
+    }
+    delete proc;
+    proc = NULL;
+    return false;
+  }
+  jobsthisprocess = 0;
+  return true;
+}
+
+void KLFGsServer::stop()
+{
+  if (d->proc == NULL) {
+    return;
+  }
+  if (d->proc->state() != QProcess::NotRunning) {
+    d->proc->closeWriteChannel();
+    if (!d->proc->waitForFinished(1000)) {
+      d->proc->kill();
+      d->proc->waitForFinished(1000);
+    }
+  }
+  delete d->proc;
+  d->proc = NULL;
+}
+
+bool KLFGsServer::runJob(const QByteArray& psjob, QByteArray *output, bool processAppEvents,
+                         QString *errorString, const QAtomicInt *abortFlag)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  KLF_ASSERT_CONDITION(!d->busy, "gs server is busy!", return false; ) ;
+
+  if (!d->ensureStarted(errorString)) {
+    return false;
+  }
+
+  d->busy = true;
+
+  int jobid = ++d->jobcounter;
+  ++d->jobsthisprocess;
+  QByteArray okmark = "%%KLFGS-OK " + QByteArray::number(jobid);
+  QByteArray endmark = "%%KLFGS-END " + QByteArray::number(jobid);
+
+  // The first job runs the user code, and prints the OK mark only if no error occurred.
+  // The end of a job (^D) restores the interpreter state and closes the job's output
+  // device. The second job tells us that the first one has finished.
+  QByteArray data;
+  data += psjob;
+  data += "\n(" + okmark + "\\n) print flush\n\004";
+  data += "(" + endmark + "\\n) print flush\n\004";
+  d->proc->write(data);
+
+  QByteArray out;
+  bool gotok = false;
+  bool gotend = false;
+  bool aborted = false;
+  QElapsedTimer timer;
+  timer.start();
+
+  // When processing events, wait in a local event loop which is woken up when gs writes
+  // something or exits, rather than polling. The timer wakes us up when the job times out,
+  // or regularly to check the abort flag if we have one.
+  QEventLoop loop;
+  QTimer wakeTimer;
+  if (processAppEvents) {
+    QObject::connect(d->proc, SIGNAL(readyRead()), &loop, SLOT(quit()));
+    QObject::connect(d->proc, SIGNAL(finished(int, QProcess::ExitStatus)), &loop, SLOT(quit()));
+    wakeTimer.setSingleShot(true);
+    QObject::connect(&wakeTimer, SIGNAL(timeout()), &loop, SLOT(quit()));
+  }
+
+  while (!gotend) {
+    while (d->proc->canReadLine()) {
+      QByteArray line = d->proc->readLine();
+      if (line.startsWith(endmark)) {
+        gotend = true;
+        break;
+      } else if (line.startsWith(okmark)) {
+        gotok = true;
+      } else {
+        out += line;
+      }
+    }
+    if (gotend) {
+      break;
+    }
+    if (d->proc->state() != QProcess::Running) {
+      klfDbg("gs server exited unexpectedly. output so far: "<<out) ;
+      break;
+    }
+    if (timer.elapsed() > KLF_GSSERVER_JOB_TIMEOUT_MS) {
+      klfWarning("gs server job timed out.") ;
+      break;
+    }
+    if (abortFlag != NULL && abortFlag->load()) {
+      klfDbg("gs server job interrupted.") ;
+      aborted = true;
+      // don't wait for the job to finish, stop() below would
+      d->proc->kill();
+      d->proc->waitForFinished(1000);
+      break;
+    }
+    int waitms = qMax(0, KLF_GSSERVER_JOB_TIMEOUT_MS - (int)timer.elapsed());
+    if (abortFlag != NULL) {
+      waitms = qMin(waitms, 50);
+    }
+    if (processAppEvents) {
+      wakeTimer.start(waitms);
+      loop.exec(QEventLoop::ExcludeUserInputEvents);
+      wakeTimer.stop();
+    } else {
+      d->proc->waitForReadyRead(waitms);
+    }
+  }
+
+  d->busy = false;
+
+  if (output != NULL) {
+    *output = out;
+  }
+
+  klfDbg("gs server job #"<<jobid<<" finished in "<<timer.elapsed()<<"ms; ok="<<gotok<<", end="<<gotend) ;
+
+  if (!gotend || !gotok) {
+    if (errorString != NULL) {
+      if (aborted) {
+        *errorString = QObject::tr("Ghostscript server job was interrupted", "KLFBackend");
+      } else {
+        *errorString = QObject::tr("Ghostscript server job failed: %1", "KLFBackend")
+          .arg(QString::fromLocal8Bit(out));
+      }
+    }
+    // don't trust the state of this process any longer
+    stop();
+    return false;
+  }
+
+  return true;
+}
+
+QByteArray KLFGsServer::psFileName(const QString& fileName)
+{
+  QByteArray fn = QDir::fromNativeSeparators(fileName).toLocal8Bit();
+  QByteArray escaped;
+  for (int i = 0; i < fn.size(); ++i) {
+    char c = fn[i];
+    if (c == '(' || c == ')' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return "(" + escaped + ")";
+}
+
+
+// -----------------
+
+struct KLFGsServerSet
+{
+  ~KLFGsServerSet()
+  {
+    qDeleteAll(servers);
+  }
+
+  QHash<QString,KLFGsServer*> servers;
+};
+
+static QThreadStorage<KLFGsServerSet*> klf_gs_servers;
+
+// static
+KLFGsServer * KLFGsServer::threadServer(const KLFBackend::klfSettings& settings,
+                                        const QStringList& startupArgs)
+{
+  if (!klf_gs_servers.hasLocalData()) {
+    klf_gs_servers.setLocalData(new KLFGsServerSet);
+  }
+  KLFGsServerSet *set = klf_gs_servers.localData();
+
+  QString key = QStringList(QStringList() << settings.gsexec << settings.tempdir << startupArgs
+                            << settings.execenv).join(QLatin1String("\n"));
+
+  KLFGsServer *server = set->servers.value(key, NULL);
+  if (server == NULL) {
+    server = new KLFGsServer(settings, startupArgs);
+    set->servers[key] = server;
+  }
+  if (server->isBusy()) {
+    return NULL;
+  }
+  return server;
+}
@@ -0,0 +1,104 @@
+/***************************************************************************
+ *   file klfgsserver_p.h
+ *   This file is part of the KLatexFormula Project.
+ *   Copyright (C) 2020 by Philippe Faist
+ *   philippe.faist at bluewin.ch
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/* $Id$ */
+
+#ifndef KLFGSSERVER_P_H
+#define KLFGSSERVER_P_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QAtomicInt>
+
+#include <klfdefs.h>
+#include <klfbackend.h>
+
+
+struct KLFGsServerPrivate;
+
+//! A long-lived ghostscript process which runs jobs fed over its standard input
+/** Starting \c gs is expensive (the interpreter is initialized and the fonts are loaded
+ * every time). This class keeps a single \c gs process running in job server mode
+ * (<tt>-dJOBSERVER</tt>), and runs PostScript jobs in it. Each job is encapsulated,
+ * meaning that the interpreter state (VM, graphics state and output device) is restored
+ * between jobs.
+ *
+ * A KLFGsServer instance, like the QProcess it uses, belongs to the thread which created
+ * it. Use \ref threadServer() to get an instance for the current thread.
+ *
+ * Any failure (gs refuses to start, a job reports an error, or a job times out) is
+ * reported to the caller, which is expected to fall back to running a separate \c gs
+ * process. A server which failed is restarted for the next job.
+ */
+class KLF_EXPORT KLFGsServer
+{
+public:
+  /** \c startupArgs are given to \c gs on its command line, in addition to the options
+   * needed for job server mode, and are in effect for all jobs (e.g. <tt>-dEPSCrop</tt>
+   * or <tt>-dNOCACHE</tt>). */
+  KLFGsServer(const KLFBackend::klfSettings& settings, const QStringList& startupArgs);
+  virtual ~KLFGsServer();
+
+  bool isRunning() const;
+  /** TRUE while a job is running. The server can't be used recursively (e.g. from an
+   * event processed while waiting for a job to finish) */
+  bool isBusy() const;
+
+  /** \brief Run a PostScript job
+   *
+   * Runs the PostScript code \c psjob in an encapsulated job. The job should set up its
+   * output device and run its input files; the output device is closed at the end of the
+   * job. Anything gs prints during the job is stored in \c output (if non-NULL).
+   *
+   * If \c processAppEvents is TRUE, application events are processed while waiting for
+   * the job to finish.
+   *
+   * If \c abortFlag is non-NULL and becomes non-zero while the job runs, the gs process is
+   * killed and this function returns FALSE right away.
+   *
+   * Returns TRUE if the job completed without PostScript errors.
+   */
+  bool runJob(const QByteArray& psjob, QByteArray *output, bool processAppEvents,
+              QString *errorString = NULL, const QAtomicInt *abortFlag = NULL);
+
+  /** Terminate the gs process. It is restarted automatically by the next runJob(). */
+  void stop();
+
+  /** Returns a PostScript string literal (including the parentheses) for the given file
+   * name */
+  static QByteArray psFileName(const QString& fileName);
+
+  /** \brief The server for the current thread with the given \c startupArgs
+   *
+   * The server is created if needed, and is deleted when the thread exits. Returns NULL
+   * if the server for these arguments is busy (the caller should then fall back to a
+   * separate process). */
+  static KLFGsServer * threadServer(const KLFBackend::klfSettings& settings,
+                                    const QStringList& startupArgs);
+
+private:
+  KLF_DECLARE_PRIVATE(KLFGsServer) ;
+};
+
+
+
+#endif
@@ -26,6 +26,7 @@
 #include <QMutex>
 #include <QWaitCondition>
 #include <QQueue>
+#include <QMutexLocker>
 
 #include <klfbackend.h>
 
@@ -94,47 +95,17 @@ KLFLatexPreviewThread::KLFLatexPreviewThread(QObject * parent)
   if (QMetaType::type("KLFBackend::klfSettings") == 0) {
     qRegisterMetaType<KLFBackend::klfSettings>("KLFBackend::klfSettings") ;
   }
-  if (QMetaType::type("KLFLatexPreviewThreadWorker::Task") == 0) {
-    qRegisterMetaType<KLFLatexPreviewThreadWorker::Task>("KLFLatexPreviewThreadWorker::Task") ;
-  }
   if (QMetaType::type("KLFLatexPreviewThread::TaskId") == 0) {
     qRegisterMetaType<KLFLatexPreviewThread::TaskId>("KLFLatexPreviewThread::TaskId") ;
   }
 
-
-  //
-  // create a worker that will do all the job for us
-  //
-
-  d->worker = new KLFLatexPreviewThreadWorker;
-  d->worker->moveToThread(this);
-
-  // create a direct-connection abort signal; this is fine because worker.abort() is thread-safe.
-  connect(d, SIGNAL(internalRequestAbort()), d->worker, SLOT(abort()), Qt::DirectConnection);
-  
-  // connect the signal that submits a new job.
-  connect(d, SIGNAL(internalRequestSubmitNewTask(KLFLatexPreviewThreadWorker::Task, bool,
-						 KLFLatexPreviewThread::TaskId)),
-	  d->worker, SLOT(threadSubmitTask(KLFLatexPreviewThreadWorker::Task, bool,
-                                           KLFLatexPreviewThread::TaskId)),
-	  Qt::QueuedConnection);
-  // signal to clear all pending jobs
-  connect(d, SIGNAL(internalRequestClearPendingTasks()), d->worker, SLOT(threadClearPendingTasks()),
-	  Qt::QueuedConnection);
-  // signal to cancel a specific task
-  connect(d, SIGNAL(internalRequestCancelTask(KLFLatexPreviewThread::TaskId)),
-	  d->worker, SLOT(threadCancelTask(KLFLatexPreviewThread::TaskId)),
-	  Qt::QueuedConnection);
+  // the workers are created in start()
 }
 
 KLFLatexPreviewThread::~KLFLatexPreviewThread()
 {
   stop();
 
-  if (d->worker) {
-    delete d->worker;
-  }
-
   KLF_DELETE_PRIVATE ;
 }
 
@@ -149,21 +120,75 @@ void KLFLatexPreviewThread::setPreviewSize(const QSize& previewSize)
 void KLFLatexPreviewThread::setLargePreviewSize(const QSize& largePreviewSize)
 { d->largePreviewSize = largePreviewSize; }
 
+int KLFLatexPreviewThread::workerCount() const
+{ return d->workerCount; }
+void KLFLatexPreviewThread::setWorkerCount(int count)
+{ d->workerCount = count; }
+
 
 void KLFLatexPreviewThread::start(Priority priority)
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
-  // fire up the thread
+  if (d->workers.size()) {
+    klfDbg("already started.") ;
+    return;
+  }
+
+  int n = d->effectiveWorkerCount();
+  klfDbg("starting "<<n<<" worker(s).") ;
+
+  d->scheduler.setNumWorkers(n);
+
+  //
+  // create the workers that will do all the job for us
+  //
+  for (int k = 0; k < n; ++k) {
+    KLFLatexPreviewThreadWorker * worker = new KLFLatexPreviewThreadWorker(&d->scheduler);
+    if (k == 0) {
+      worker->moveToThread(this);
+    } else {
+      QThread * th = new QThread;
+      d->extraThreads.append(th);
+      worker->moveToThread(th);
+    }
+    d->workers.append(worker);
+
+    // create a direct-connection abort signal; this is fine because worker.abort() is thread-safe.
+    connect(d, SIGNAL(internalRequestAbort()), worker, SLOT(abort()), Qt::DirectConnection);
+    // forward task completion notifications. This is queued in our thread after the calls to the
+    // handler's methods.
+    connect(worker, SIGNAL(threadFinishedJob(KLFLatexPreviewThread::TaskId)),
+            this, SIGNAL(previewTaskFinished(KLFLatexPreviewThread::TaskId)), Qt::QueuedConnection);
+  }
+
+  // fire up the threads
   QThread::start(priority);
+  foreach (QThread * th, d->extraThreads) {
+    th->start(priority);
+  }
+
+  // there might be tasks submitted before we started
+  d->wakeWorkers();
 }
 
 void KLFLatexPreviewThread::stop()
 {
-  // tell thread to stop, and wait for it
+  // tell threads to stop, and wait for them
   emit d->internalRequestAbort();
   quit();
   wait();
+  foreach (QThread * th, d->extraThreads) {
+    th->quit();
+    th->wait();
+    delete th;
+  }
+  d->extraThreads.clear();
+
+  foreach (KLFLatexPreviewThreadWorker * worker, d->workers) {
+    delete worker;
+  }
+  d->workers.clear();
 }
 
 
@@ -180,7 +205,8 @@ KLFLatexPreviewThread::TaskId
 						const KLFBackend::klfSettings& settings,
 						KLFLatexPreviewHandler * outputhandler,
 						const QSize& previewSize,
-						const QSize& largePreviewSize)
+						const QSize& largePreviewSize,
+						TaskPriority priority)
 {
   KLFLatexPreviewThreadWorker::Task t;
   t.input = input;
@@ -188,6 +214,7 @@ KLFLatexPreviewThread::TaskId
   t.handler = outputhandler;
   t.previewSize = previewSize;
   t.largePreviewSize = largePreviewSize;
+  t.priority = priority;
 
   return d->submitTask(t, false, -1);
 }
@@ -195,7 +222,8 @@ KLFLatexPreviewThread::TaskId
 KLFLatexPreviewThread::TaskId
 /* */  KLFLatexPreviewThread::submitPreviewTask(const KLFBackend::klfInput& input,
 						const KLFBackend::klfSettings& settings,
-						KLFLatexPreviewHandler * outputhandler)
+						KLFLatexPreviewHandler * outputhandler,
+						TaskPriority priority)
 {
   KLFLatexPreviewThreadWorker::Task t;
   t.input = input;
@@ -203,6 +231,7 @@ KLFLatexPreviewThread::TaskId
   t.handler = outputhandler;
   t.previewSize = d->previewSize;
   t.largePreviewSize = d->largePreviewSize;
+  t.priority = priority;
 
   return d->submitTask(t, false, -1);
 }
@@ -212,7 +241,8 @@ KLFLatexPreviewThread::TaskId
 							const KLFBackend::klfSettings& settings,
 							KLFLatexPreviewHandler * outputhandler,
 							const QSize& previewSize,
-							const QSize& largePreviewSize)
+							const QSize& largePreviewSize,
+							TaskPriority priority)
 {
   KLFLatexPreviewThreadWorker::Task t;
   t.input = input;
@@ -220,6 +250,7 @@ KLFLatexPreviewThread::TaskId
   t.handler = outputhandler;
   t.previewSize = previewSize;
   t.largePreviewSize = largePreviewSize;
+  t.priority = priority;
 
   return d->submitTask(t, true, -1);
 }
@@ -227,7 +258,8 @@ KLFLatexPreviewThread::TaskId
 KLFLatexPreviewThread::TaskId
 /* */  KLFLatexPreviewThread::clearAndSubmitPreviewTask(const KLFBackend::klfInput& input,
 							const KLFBackend::klfSettings& settings,
-							KLFLatexPreviewHandler * outputhandler)
+							KLFLatexPreviewHandler * outputhandler,
+							TaskPriority priority)
 {
   KLFLatexPreviewThreadWorker::Task t;
   t.input = input;
@@ -235,6 +267,7 @@ KLFLatexPreviewThread::TaskId
   t.handler = outputhandler;
   t.previewSize = d->previewSize;
   t.largePreviewSize = d->largePreviewSize;
+  t.priority = priority;
 
   return d->submitTask(t, true, -1);
 }
@@ -245,7 +278,8 @@ KLFLatexPreviewThread::TaskId
 						       const KLFBackend::klfSettings& settings,
 						       KLFLatexPreviewHandler * outputhandler,
 						       const QSize& previewSize,
-						       const QSize& largePreviewSize)
+						       const QSize& largePreviewSize,
+						       TaskPriority priority)
 {
   KLFLatexPreviewThreadWorker::Task t;
   t.input = input;
@@ -253,6 +287,7 @@ KLFLatexPreviewThread::TaskId
   t.handler = outputhandler;
   t.previewSize = previewSize;
   t.largePreviewSize = largePreviewSize;
+  t.priority = priority;
 
   return d->submitTask(t, false, replaceId);
 }
@@ -261,7 +296,8 @@ KLFLatexPreviewThread::TaskId
 /* */  KLFLatexPreviewThread::replaceSubmitPreviewTask(KLFLatexPreviewThread::TaskId replaceId,
 						       const KLFBackend::klfInput& input,
 						       const KLFBackend::klfSettings& settings,
-						       KLFLatexPreviewHandler * outputhandler)
+						       KLFLatexPreviewHandler * outputhandler,
+						       TaskPriority priority)
 {
   KLFLatexPreviewThreadWorker::Task t;
   t.input = input;
@@ -269,6 +305,7 @@ KLFLatexPreviewThread::TaskId
   t.handler = outputhandler;
   t.previewSize = d->previewSize;
   t.largePreviewSize = d->largePreviewSize;
+  t.priority = priority;
 
   return d->submitTask(t, false, replaceId);
 }
@@ -277,11 +314,15 @@ KLFLatexPreviewThread::TaskId
 
 void KLFLatexPreviewThread::cancelTask(TaskId task)
 {
-  emit d->internalRequestCancelTask(task);
+  if (!d->scheduler.cancel(task)) {
+    // this might not be an error, it could be that the task completed before we had
+    // a chance to cancel it
+    klfDbg("No such task ID: "<<task) ;
+  }
 }
 void KLFLatexPreviewThread::clearPendingTasks()
 {
-  emit d->internalRequestClearPendingTasks();
+  d->scheduler.clearPending();
 }
 
 
@@ -290,118 +331,166 @@ void KLFLatexPreviewThread::clearPendingTasks()
 // -----
 
 
-
-void KLFLatexPreviewThreadWorker::threadSubmitTask(Task task, bool clearOtherJobs, TaskId replaceTaskId)
+bool KLFLatexPreviewThreadScheduler::cancel_locked(TaskId taskid)
 {
-  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
-
-  if (clearOtherJobs) {
-    threadClearPendingTasks();
+  int k;
+  for (k = 0; k < pending.size(); ++k) {
+    if (pending.at(k).taskid == taskid) {
+      pending.removeAt(k);
+      return true;
+    }
   }
-  if (replaceTaskId) {
-    threadCancelTask(replaceTaskId);
+  QMap<TaskId,Running>::iterator it = running.find(taskid);
+  if (it != running.end()) {
+    // don't waste time finishing this task
+    klfDbg("interrupting running task id="<<taskid) ;
+    it.value().abortFlag->fetchAndStoreOrdered(1);
+    return true;
   }
-
-  // enqueue the new task
-  newTasks.enqueue(task);
-
-  klfDbg("enqueued task id="<<task.taskid) ;
-
-  // and notify ourself in the event loop that there are more jobs to process
-  QMetaObject::invokeMethod(this, "threadProcessJobs", Qt::QueuedConnection);
+  return false;
 }
 
-bool KLFLatexPreviewThreadWorker::threadCancelTask(TaskId taskid)
+bool KLFLatexPreviewThreadScheduler::handlerBusy(KLFLatexPreviewHandler * handler) const
 {
-  int k;
-  for (k = 0; k < newTasks.size(); ++k) {
-    if (newTasks.at(k).taskid == taskid) {
-      newTasks.removeAt(k);
+  for (QMap<TaskId,Running>::const_iterator it = running.begin(); it != running.end(); ++it) {
+    if (it.value().handler == handler) {
       return true;
     }
   }
-
-  // this might not be an error, it could be that the task completed before we had
-  // a chance to cancel it
-  klfDbg("No such task ID: "<<taskid) ;
   return false;
 }
 
-void KLFLatexPreviewThreadWorker::threadClearPendingTasks()
+bool KLFLatexPreviewThreadScheduler::takeNextTask(Task * task, QAtomicInt * abortFlag)
 {
-  newTasks.clear();
+  QMutexLocker lock(&mutex);
+
+  int maxBackground = qMax(1, numWorkers - 1);
+
+  int best = -1;
+  quint64 bestServed = 0;
+  for (int k = 0; k < pending.size(); ++k) {
+    const Task& t = pending.at(k);
+    if (t.priority <= KLFLatexPreviewThread::BackgroundTaskPriority &&
+        numRunningBackground >= maxBackground) {
+      continue;
+    }
+    if (handlerBusy(t.handler)) {
+      continue;
+    }
+    quint64 served = lastServed.value(t.handler, 0);
+    if (best < 0 || t.priority > pending.at(best).priority ||
+        (t.priority == pending.at(best).priority && served < bestServed)) {
+      best = k;
+      bestServed = served;
+    }
+  }
+  if (best < 0) {
+    return false;
+  }
+
+  *task = pending.takeAt(best);
+
+  Running r;
+  r.handler = task->handler;
+  r.priority = task->priority;
+  r.abortFlag = abortFlag;
+  abortFlag->fetchAndStoreOrdered(0);
+  running[task->taskid] = r;
+  if (r.priority <= KLFLatexPreviewThread::BackgroundTaskPriority) {
+    ++numRunningBackground;
+  }
+  lastServed[task->handler] = ++serveCounter;
+  return true;
 }
 
+bool KLFLatexPreviewThreadScheduler::finishTask(const Task& task, QAtomicInt * abortFlag,
+                                                KLFLatexPreviewThreadWorker * worker,
+                                                const KLFLatexPreviewThreadWorker::Result& result)
+{
+  QMutexLocker lock(&mutex);
+
+  running.remove(task.taskid);
+  if (task.priority <= KLFLatexPreviewThread::BackgroundTaskPriority) {
+    --numRunningBackground;
+  }
+  if (pending.isEmpty() && running.isEmpty()) {
+    // forget about handlers which might not exist any more
+    lastServed.clear();
+  }
+  if (abortFlag->fetchAndStoreOrdered(0) != 0) {
+    return false;
+  }
+  // still under our lock, so that cancel() can't slip in between
+  worker->postResult(task, result);
+  return true;
+}
+
+
+
+// -----
+
+
+
 void KLFLatexPreviewThreadWorker::threadProcessJobs()
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
 
   Task task;
-  KLFBackend::klfOutput ouroutput;
 
-  if (!newTasks.size()) {
+  if (_abort) {
     return;
   }
 
-  if (_abort) {
+  // fetch task info
+  if (!_scheduler->takeNextTask(&task, &_runningAbort)) {
     return;
   }
 
-  // fetch task info
-  task = newTasks.dequeue();
+  klfDbg("processing job ID="<<task.taskid<<", submitted "<<task.submitted.elapsed()<<" ms ago") ;
 
-  klfDbg("processing job ID="<<task.taskid) ;
+  emit threadStartedProcessingJob(task.taskid);
 
-  QImage img, prev, lprev;
+  Result result;
   if ( task.input.latex.trimmed().isEmpty() ) {
-    QMetaObject::invokeMethod(task.handler, "latexPreviewReset", Qt::QueuedConnection);
+    result.reset = true;
   } else {
     // and GO!
     klfDbg("worker: running KLFBackend::getLatexFormula()") ;
-    ouroutput = KLFBackend::getLatexFormula(task.input, task.settings, false);
-    img = ouroutput.result;
+    // allow this task to be interrupted if it is replaced by a newer one
+    task.settings.abortFlag = &_runningAbort;
+    result.output = KLFBackend::getLatexFormula(task.input, task.settings, false);
+    result.output.settings.abortFlag = NULL; // don't let the flag escape this thread
 
-    klfDbg("got result: status="<<ouroutput.status) ;
+    klfDbg("got result: status="<<result.output.status) ;
 
-    if (ouroutput.status != 0) {
-      // error...
-      QMetaObject::invokeMethod(task.handler, "latexPreviewError", Qt::QueuedConnection,
-				Q_ARG(QString, ouroutput.errorstr),
-				Q_ARG(int, ouroutput.status));
-    } else {
-      // this method must be called first (by API design)
-      QMetaObject::invokeMethod(task.handler, "latexOutputAvailable", Qt::QueuedConnection,
-				Q_ARG(KLFBackend::klfOutput, ouroutput));
+    // don't bother scaling an obsolete result; finishTask() below will discard it
+    if (result.output.status == 0 && !_runningAbort.load()) {
+      const QImage& img = result.output.result;
       if (task.previewSize.isValid()) {
-	prev = img;
-	if (prev.width() > task.previewSize.width() || prev.height() > task.previewSize.height()) {
-	  prev = img.scaled(task.previewSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+	result.preview = img;
+	if (img.width() > task.previewSize.width() || img.height() > task.previewSize.height()) {
+	  result.preview = img.scaled(task.previewSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
         }
       }
       if (task.largePreviewSize.isValid()) {
-	lprev = img;
-	if (lprev.width() > task.largePreviewSize.width() || lprev.height() > task.largePreviewSize.height()) {
-	  lprev = img.scaled(task.largePreviewSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+	result.largePreview = img;
+	if (img.width() > task.largePreviewSize.width() || img.height() > task.largePreviewSize.height()) {
+	  result.largePreview = img.scaled(task.largePreviewSize, Qt::KeepAspectRatio,
+					   Qt::SmoothTransformation);
         }
       }
-      
-      QMetaObject::invokeMethod(task.handler, "latexPreviewAvailable", Qt::QueuedConnection,
-				Q_ARG(QImage, prev),
-				Q_ARG(QImage, lprev),
-				Q_ARG(QImage, img));
-      if (task.previewSize.isValid()) {
-	QMetaObject::invokeMethod(task.handler, "latexPreviewImageAvailable", Qt::QueuedConnection,
-				  Q_ARG(QImage, prev));
-      }
-      if (task.largePreviewSize.isValid()) {
-	QMetaObject::invokeMethod(task.handler, "latexPreviewLargeImageAvailable", Qt::QueuedConnection,
-				  Q_ARG(QImage, lprev));
-      }
-      QMetaObject::invokeMethod(task.handler, "latexPreviewFullImageAvailable", Qt::QueuedConnection,
-				Q_ARG(QImage, img));
     }
   }
 
+  // only now may the next task of this handler start, so that its results are delivered after
+  // these ones. The results are posted only if the task wasn't cancelled in the meantime.
+  if (_scheduler->finishTask(task, &_runningAbort, this, result)) {
+    klfDbg("job ID="<<task.taskid<<" done, "<<task.submitted.elapsed()<<" ms after submission") ;
+  } else {
+    // the result is obsolete; the error, if any, is just that we killed the process
+    klfDbg("job ID="<<task.taskid<<" was cancelled, discarding result.") ;
+  }
+
   klfDbg("about to invoke delayed threadProcessJobs.") ;
 
   // continue processing jobs, but let the event loop have a chance to run a bit too.
@@ -410,6 +499,38 @@ void KLFLatexPreviewThreadWorker::threadProcessJobs()
   klfDbg("threadProcessJobs: end") ;
 }
 
+void KLFLatexPreviewThreadWorker::postResult(const Task& task, const Result& result)
+{
+  if (result.reset) {
+    QMetaObject::invokeMethod(task.handler, "latexPreviewReset", Qt::QueuedConnection);
+  } else if (result.output.status != 0) {
+    // error...
+    QMetaObject::invokeMethod(task.handler, "latexPreviewError", Qt::QueuedConnection,
+			      Q_ARG(QString, result.output.errorstr),
+			      Q_ARG(int, result.output.status));
+  } else {
+    // this method must be called first (by API design)
+    QMetaObject::invokeMethod(task.handler, "latexOutputAvailable", Qt::QueuedConnection,
+			      Q_ARG(KLFBackend::klfOutput, result.output));
+    QMetaObject::invokeMethod(task.handler, "latexPreviewAvailable", Qt::QueuedConnection,
+			      Q_ARG(QImage, result.preview),
+			      Q_ARG(QImage, result.largePreview),
+			      Q_ARG(QImage, result.output.result));
+    if (task.previewSize.isValid()) {
+      QMetaObject::invokeMethod(task.handler, "latexPreviewImageAvailable", Qt::QueuedConnection,
+				Q_ARG(QImage, result.preview));
+    }
+    if (task.largePreviewSize.isValid()) {
+      QMetaObject::invokeMethod(task.handler, "latexPreviewLargeImageAvailable", Qt::QueuedConnection,
+				Q_ARG(QImage, result.largePreview));
+    }
+    QMetaObject::invokeMethod(task.handler, "latexPreviewFullImageAvailable", Qt::QueuedConnection,
+			      Q_ARG(QImage, result.output.result));
+  }
+
+  emit threadFinishedJob(task.taskid);
+}
+
 
 
 
@@ -448,12 +569,50 @@ bool KLFContLatexPreview::enabled() const
 void KLFContLatexPreview::setEnabled(bool enabled)
 {
   d->enabled = enabled;
+  if (!enabled) {
+    d->debounceTimer->stop();
+    d->pendingSince.invalidate();
+  }
+}
+
+int KLFContLatexPreview::debounceDelay() const
+{
+  return d->debounceDelay;
+}
+
+void KLFContLatexPreview::setDebounceDelay(int delay)
+{
+  d->debounceDelay = delay;
+  if (d->debounceTimer->isActive() && delay <= 0) {
+    d->refreshPreview();
+  }
+}
+
+int KLFContLatexPreview::lastPreviewLatency() const
+{
+  return d->lastLatency;
+}
+
+int KLFContLatexPreview::averagePreviewLatency() const
+{
+  if (d->latencyCount == 0) {
+    return -1;
+  }
+  return (int)(d->latencySum / d->latencyCount);
 }
 
 
 void KLFContLatexPreview::setThread(KLFLatexPreviewThread * thread)
 {
+  if (d->thread != NULL) {
+    disconnect(d->thread, SIGNAL(previewTaskFinished(KLFLatexPreviewThread::TaskId)),
+               d, SLOT(taskFinished(KLFLatexPreviewThread::TaskId)));
+  }
   d->thread = thread;
+  if (d->thread != NULL) {
+    connect(d->thread, SIGNAL(previewTaskFinished(KLFLatexPreviewThread::TaskId)),
+            d, SLOT(taskFinished(KLFLatexPreviewThread::TaskId)));
+  }
 }
 
 bool KLFContLatexPreview::setInput(const KLFBackend::klfInput& input)
@@ -464,7 +623,7 @@ bool KLFContLatexPreview::setInput(const KLFBackend::klfInput& input)
     return false;
 
   d->input = input;
-  d->refreshPreview();
+  d->scheduleRefreshPreview();
   return true;
 }
 bool KLFContLatexPreview::setSettings(const KLFBackend::klfSettings& settings, bool disableExtraFormats)
@@ -480,7 +639,7 @@ bool KLFContLatexPreview::setSettings(const KLFBackend::klfSettings& settings, b
     return false;
 
   d->settings = s;
-  d->refreshPreview();
+  d->scheduleRefreshPreview();
   return true;
 }
 
@@ -489,7 +648,7 @@ bool KLFContLatexPreview::setPreviewSize(const QSize& previewSize)
   if (d->previewSize == previewSize)
     return false;
   d->previewSize = previewSize;
-  d->refreshPreview();
+  d->scheduleRefreshPreview();
   return true;
 }
 bool KLFContLatexPreview::setLargePreviewSize(const QSize& largePreviewSize)
@@ -497,7 +656,7 @@ bool KLFContLatexPreview::setLargePreviewSize(const QSize& largePreviewSize)
   if (d->largePreviewSize == largePreviewSize)
     return false;
   d->largePreviewSize = largePreviewSize;
-  d->refreshPreview();
+  d->scheduleRefreshPreview();
   return true;
 }
 
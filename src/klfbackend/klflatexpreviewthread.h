@@ -70,12 +70,20 @@ public slots:
 
 
 
+/** \brief Generates previews in the background
+ *
+ * Tasks are processed by \ref workerCount() worker threads. Tasks are handed out by
+ * priority (see \ref TaskPriority), and handlers take turns among tasks of the same priority.
+ * The tasks submitted with a given handler are always processed one at a time, in the order
+ * they were submitted.
+ */
 class KLF_EXPORT KLFLatexPreviewThread : public QThread
 {
   Q_OBJECT
 
   Q_PROPERTY(QSize previewSize READ previewSize WRITE setPreviewSize) ;
   Q_PROPERTY(QSize largePreviewSize READ largePreviewSize WRITE setLargePreviewSize) ;
+  Q_PROPERTY(int workerCount READ workerCount WRITE setWorkerCount) ;
 
 public:
   KLFLatexPreviewThread(QObject *parent = NULL);
@@ -83,6 +91,21 @@ public:
 
   typedef qint64 TaskId;
 
+  enum TaskPriority {
+    /** For tasks which nobody is waiting for, e.g. regenerating many previews. Unless there
+     * is a single worker, at least one worker is always kept free for other tasks. */
+    BackgroundTaskPriority = -1,
+    NormalTaskPriority = 0,
+    /** For previews of what the user is currently typing */
+    InteractiveTaskPriority = 1
+  };
+
+  /** The number of worker threads. The value 0 (the default) means as many as there are
+   * processor cores. */
+  int workerCount() const;
+  /** Set the number of worker threads. This is taken into account at the next \ref start(). */
+  void setWorkerCount(int count);
+
   QSize previewSize() const;
   QSize largePreviewSize() const;
   void getPreviewSizes(QSize *previewsize, QSize *largepreviewsize) const;
@@ -97,31 +120,42 @@ public:
   void start(Priority priority = InheritPriority);
   void stop();
 
+signals:
+  /** Emitted when the given task has been processed, after the corresponding handler
+   * methods have been called. Not emitted for tasks which were cancelled. */
+  void previewTaskFinished(KLFLatexPreviewThread::TaskId taskid);
+
 public slots:
 
   TaskId submitPreviewTask(const KLFBackend::klfInput& input,
 			   const KLFBackend::klfSettings& settings,
 			   KLFLatexPreviewHandler * outputhandler,
-			   const QSize& previewSize, const QSize& largePreviewSize);
+			   const QSize& previewSize, const QSize& largePreviewSize,
+			   TaskPriority priority = NormalTaskPriority);
   TaskId submitPreviewTask(const KLFBackend::klfInput& input,
 			   const KLFBackend::klfSettings& settings,
-			   KLFLatexPreviewHandler * outputhandler);
+			   KLFLatexPreviewHandler * outputhandler,
+			   TaskPriority priority = NormalTaskPriority);
   TaskId clearAndSubmitPreviewTask(const KLFBackend::klfInput& input,
 				   const KLFBackend::klfSettings& settings,
 				   KLFLatexPreviewHandler * outputhandler,
-				   const QSize& previewSize, const QSize& largePreviewSize);
+				   const QSize& previewSize, const QSize& largePreviewSize,
+				   TaskPriority priority = NormalTaskPriority);
   TaskId clearAndSubmitPreviewTask(const KLFBackend::klfInput& input,
 				   const KLFBackend::klfSettings& settings,
-				   KLFLatexPreviewHandler * outputhandler); 
+				   KLFLatexPreviewHandler * outputhandler,
+				   TaskPriority priority = NormalTaskPriority);
   TaskId replaceSubmitPreviewTask(TaskId replaceId,
 				  const KLFBackend::klfInput& input,
 				  const KLFBackend::klfSettings& settings,
 				  KLFLatexPreviewHandler * outputhandler,
-				  const QSize& previewSize, const QSize& largePreviewSize);
+				  const QSize& previewSize, const QSize& largePreviewSize,
+				  TaskPriority priority = NormalTaskPriority);
   TaskId replaceSubmitPreviewTask(TaskId replaceId,
 				  const KLFBackend::klfInput& input,
 				  const KLFBackend::klfSettings& settings,
-				  KLFLatexPreviewHandler * outputhandler); 
+				  KLFLatexPreviewHandler * outputhandler,
+				  TaskPriority priority = NormalTaskPriority);
 
 protected:
   virtual void run();
@@ -155,6 +189,7 @@ class KLF_EXPORT KLFContLatexPreview : public QObject
 
   Q_PROPERTY(QSize previewSize READ previewSize WRITE setPreviewSize) ;
   Q_PROPERTY(QSize largePreviewSize READ largePreviewSize WRITE setLargePreviewSize) ;
+  Q_PROPERTY(int debounceDelay READ debounceDelay WRITE setDebounceDelay) ;
 
 public:
   KLFContLatexPreview(KLFLatexPreviewThread * thread = NULL);
@@ -168,6 +203,18 @@ public:
   QSize previewSize() const;
   QSize largePreviewSize() const;
 
+  /** Time in milliseconds to wait after a change of input, settings or preview size before
+   * submitting the new preview task. Changes made during that time are coalesced into a single
+   * task. Zero (the default) submits each change immediately. */
+  int debounceDelay() const;
+
+  /** Time in milliseconds between the first change which was not yet shown and the moment the
+   * corresponding preview was delivered, for the last preview. -1 if no preview was generated
+   * yet. See also \ref previewLatency(). */
+  int lastPreviewLatency() const;
+  /** Average of \ref lastPreviewLatency() over all previews generated so far, or -1. */
+  int averagePreviewLatency() const;
+
   void setThread(KLFLatexPreviewThread * thread);
 
 signals:
@@ -199,10 +246,16 @@ signals:
   /** Is emitted whenever there currently is a LaTeX formula compiling */
   void compiling(bool isCompiling);
 
+  /** Emitted after a preview (or error) was delivered, with the time in milliseconds elapsed
+   * since the first change it reflects. See \ref lastPreviewLatency(). */
+  void previewLatency(int latency);
+
 public slots:
 
   void setEnabled(bool enabled);
 
+  void setDebounceDelay(int delay);
+
   /** \returns TRUE if the input was set, FALSE if current input is already equal to \c input.
    * The thread will then take care to generate the corresponding preview and emit the previewAvailable() etc.
    * signals. */
@@ -30,23 +30,31 @@
 
 #include <QObject>
 #include <QThread>
-#include <QQueue>
 #include <QAtomicInt>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QList>
+#include <QMap>
+#include <QHash>
+#include <QTimer>
+#include <QElapsedTimer>
 
 #include "klflatexpreviewthread.h"
 
 
 
+class KLFLatexPreviewThreadScheduler;
+
 class KLFLatexPreviewThreadWorker : public QObject
 {
   Q_OBJECT
 
 public:
-  KLFLatexPreviewThreadWorker()
-    : QObject(NULL)
+  KLFLatexPreviewThreadWorker(KLFLatexPreviewThreadScheduler * scheduler)
+    : QObject(NULL), _scheduler(scheduler)
   {
     _abort = 0;
-    newTasks = QQueue<Task>();
+    _runningAbort = 0;
   };
 
   typedef KLFLatexPreviewThread::TaskId TaskId;
@@ -62,28 +70,138 @@ public:
     KLFLatexPreviewHandler * handler;
 
     TaskId taskid;
+    KLFLatexPreviewThread::TaskPriority priority;
+
+    //! Started when the task was submitted
+    QElapsedTimer submitted;
+  };
+
+  struct Result {
+    Result() : reset(false) { }
+
+    //! TRUE if the input was empty, in which case the handler's preview is just reset
+    bool reset;
+    KLFBackend::klfOutput output;
+    QImage preview;
+    QImage largePreview;
   };
 
+  /** Queues the calls to the handler's methods for \c result, and emits threadFinishedJob().
+   * Called by the scheduler from within finishTask(), see there. */
+  void postResult(const Task& task, const Result& result);
+
 
 signals:
-  void threadStartedProcessingJob(TaskId taskid);
-  void threadFinishedJob(TaskId taskid);
+  void threadStartedProcessingJob(KLFLatexPreviewThread::TaskId taskid);
+  void threadFinishedJob(KLFLatexPreviewThread::TaskId taskid);
 
 public slots:
-  void threadSubmitTask(KLFLatexPreviewThreadWorker::Task task, bool clearOtherJobs = false,
-			KLFLatexPreviewThread::TaskId replaceJobId = -1);
+  /** Process the tasks of the scheduler, until there are no more tasks this worker may
+   * take. Invoked (queued) whenever new tasks are submitted. */
   void threadProcessJobs();
-  bool threadCancelTask(KLFLatexPreviewThread::TaskId task);
-  void threadClearPendingTasks();
 
   // this slot may be called by direct connection, it is thread-safe.
-  inline void abort() { _abort.fetchAndStoreOrdered(1); }
+  inline void abort() { _abort.fetchAndStoreOrdered(1); _runningAbort.fetchAndStoreOrdered(1); }
 
 private:
+  KLFLatexPreviewThreadScheduler * _scheduler;
+
   // the thread will stop if it notices this has become 1
   QAtomicInt _abort;
 
-  QQueue<Task> newTasks;
+  // abort flag for the task currently being processed (see klfSettings::abortFlag)
+  QAtomicInt _runningAbort;
+};
+
+
+
+/** \internal
+ *
+ * The queue of pending tasks, shared by all workers. All methods are thread-safe.
+ *
+ * The next task given to a worker is the oldest one with the highest priority. Among tasks of
+ * the same priority, handlers take turns, so that a handler which submitted many tasks doesn't
+ * starve the others. The tasks of a given handler are processed one at a time and in order,
+ * because the handler methods can't tell apart results of different tasks. Finally, unless
+ * there is a single worker, background tasks never occupy all the workers, so that an
+ * interactive task can always start immediately.
+ */
+class KLFLatexPreviewThreadScheduler
+{
+public:
+  typedef KLFLatexPreviewThread::TaskId TaskId;
+  typedef KLFLatexPreviewThreadWorker::Task Task;
+
+  KLFLatexPreviewThreadScheduler()
+    : numWorkers(1), numRunningBackground(0), serveCounter(0)
+  {
+  }
+
+  void setNumWorkers(int n)
+  {
+    QMutexLocker lock(&mutex);
+    numWorkers = n;
+  }
+
+  void submit(const Task& task, bool clearOtherTasks, TaskId replaceId)
+  {
+    QMutexLocker lock(&mutex);
+    if (clearOtherTasks) {
+      pending.clear();
+    }
+    if (replaceId >= 0) {
+      cancel_locked(replaceId);
+    }
+    pending.append(task);
+  }
+
+  /** Removes the task if it is pending, or interrupts it if it is being processed. Returns
+   * FALSE if no such task exists (any more). */
+  bool cancel(TaskId taskid)
+  {
+    QMutexLocker lock(&mutex);
+    return cancel_locked(taskid);
+  }
+
+  void clearPending()
+  {
+    QMutexLocker lock(&mutex);
+    pending.clear();
+  }
+
+  /** Called by a worker to get the next task to process. \c abortFlag is the flag the worker
+   * will pass on to getLatexFormula(); it is set if the task is cancelled. Returns FALSE if
+   * there is no task this worker may process now. */
+  bool takeNextTask(Task * task, QAtomicInt * abortFlag);
+
+  /** Called by a worker after processing a task. If the task is still live, calls
+   * <tt>worker->postResult(task, result)</tt> and returns TRUE. Returns FALSE if the task
+   * was cancelled, in which case its result is discarded. Both happen under the scheduler
+   * lock, so a task is either cancelled or gets its results delivered, never both. */
+  bool finishTask(const Task& task, QAtomicInt * abortFlag, KLFLatexPreviewThreadWorker * worker,
+                  const KLFLatexPreviewThreadWorker::Result& result);
+
+private:
+  QMutex mutex;
+
+  int numWorkers;
+
+  QList<Task> pending;
+
+  struct Running {
+    KLFLatexPreviewHandler * handler;
+    KLFLatexPreviewThread::TaskPriority priority;
+    QAtomicInt * abortFlag;
+  };
+  QMap<TaskId,Running> running;
+  int numRunningBackground;
+
+  // last time a task of this handler was given out, in units of serveCounter
+  QHash<KLFLatexPreviewHandler*,quint64> lastServed;
+  quint64 serveCounter;
+
+  bool cancel_locked(TaskId taskid);
+  bool handlerBusy(KLFLatexPreviewHandler * handler) const;
 };
 
 
@@ -94,7 +212,7 @@ struct KLFLatexPreviewThreadPrivate : public QObject
 public:
   KLF_PRIVATE_QOBJ_HEAD(KLFLatexPreviewThread, QObject)
   {
-    worker = NULL;
+    workerCount = 0;
 
     previewSize = QSize(280, 80);
     largePreviewSize = QSize(640, 480);
@@ -102,52 +220,65 @@ public:
     taskIdCounter = 1;
   }
 
-  KLFLatexPreviewThreadWorker * worker;
+  KLFLatexPreviewThreadScheduler scheduler;
+
+  /** The worker at index 0 lives in the KLFLatexPreviewThread itself; the others each live in
+   * the corresponding thread of \c extraThreads. */
+  QList<KLFLatexPreviewThreadWorker*> workers;
+  QList<QThread*> extraThreads;
+
+  int workerCount;
 
   QSize previewSize;
   QSize largePreviewSize;
 
 
+  QMutex taskIdMutex;
   KLFLatexPreviewThread::TaskId taskIdCounter;
 
+  int effectiveWorkerCount() const
+  {
+    if (workerCount > 0) {
+      return workerCount;
+    }
+    return qMax(1, QThread::idealThreadCount());
+  }
+
   KLFLatexPreviewThread::TaskId submitTask(KLFLatexPreviewThreadWorker::Task t, bool clear,
 					   KLFLatexPreviewThread::TaskId replaceId)
   {
-    //    if (replaceId >= 0) // if we're replacing a job, use the same ID
-    //      t.taskid = replaceId;
-    //    else
-    t.taskid = taskIdCounter++;
+    {
+      QMutexLocker lock(&taskIdMutex);
+      t.taskid = taskIdCounter++;
+    }
+    t.submitted.start();
+
+    // this also interrupts the task we're replacing if it is running
+    scheduler.submit(t, clear, replaceId);
 
-    emit internalRequestSubmitNewTask(t, clear, replaceId);
+    klfDbg("new task submitted, id="<<t.taskid<<", priority="<<(int)t.priority) ;
 
-    klfDbg("new task submitted, id="<<t.taskid) ;
+    wakeWorkers();
     return t.taskid;
   }
 
+  void wakeWorkers()
+  {
+    // busy workers will only see this after their current task, but they look for the next
+    // task at that point anyway.
+    foreach (KLFLatexPreviewThreadWorker * w, workers) {
+      QMetaObject::invokeMethod(w, "threadProcessJobs", Qt::QueuedConnection);
+    }
+  }
+
 
 signals:
   /** \internal
    *
-   * This signal is meant to be received by the inner worker, but others can access it too. It
+   * This signal is meant to be received by the inner workers, but others can access it too. It
    * is emitted _before_ the abort process has completed. */
   void internalRequestAbort();
 
-  /** \internal
-   *
-   * This signal is meant to be only received by the inner worker. */
-  void internalRequestSubmitNewTask(const KLFLatexPreviewThreadWorker::Task& task, bool clearOtherJobs,
-				    KLFLatexPreviewThread::TaskId replaceTaskId);
-
-  /** \internal
-   *
-   * This signal is meant to be only received by the inner worker. */
-  void internalRequestClearPendingTasks();
-
-  /** \internal
-   *
-   * This signal is meant to be only received by the inner worker. */
-  void internalRequestCancelTask(KLFLatexPreviewThread::TaskId id);
-
 
   friend class KLFLatexPreviewThread;
 
@@ -179,6 +310,15 @@ public:
     settings = KLFBackend::klfSettings();
     previewSize = QSize(280, 80);
     largePreviewSize = QSize(640, 480);
+
+    debounceDelay = 0;
+    debounceTimer = new QTimer(this);
+    debounceTimer->setSingleShot(true);
+    connect(debounceTimer, SIGNAL(timeout()), this, SLOT(debounceTimeout()));
+
+    lastLatency = -1;
+    latencySum = 0;
+    latencyCount = 0;
   }
   virtual ~KLFContLatexPreviewPrivate()
   {
@@ -196,6 +336,35 @@ public:
   QSize previewSize;
   QSize largePreviewSize;
 
+  int debounceDelay;
+  QTimer *debounceTimer;
+
+  // started at the first change which wasn't submitted yet
+  QElapsedTimer pendingSince;
+  // started at the first change which wasn't displayed yet, when curTask was submitted
+  QElapsedTimer curTaskSince;
+
+  int lastLatency;
+  qint64 latencySum;
+  int latencyCount;
+
+  /** Called whenever something changed. Submits a new task, after \ref debounceDelay if
+   * set: changes made in the meantime are coalesced into the same task. */
+  void scheduleRefreshPreview()
+  {
+    if (!enabled) {
+      return;
+    }
+    if (!pendingSince.isValid()) {
+      pendingSince.start();
+    }
+    if (debounceDelay > 0) {
+      debounceTimer->start(debounceDelay); // restarts the timer if already active
+      return;
+    }
+    refreshPreview();
+  }
+
   void refreshPreview()
   {
     KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
@@ -207,17 +376,45 @@ public:
 
     KLF_ASSERT_NOT_NULL(thread, "Thread is NULL! Can't refresh preview!", return; ) ;
 
+    debounceTimer->stop();
+
     curTask = thread->replaceSubmitPreviewTask(curTask, input, settings, this,
-					       previewSize, largePreviewSize);
+					       previewSize, largePreviewSize,
+					       KLFLatexPreviewThread::InteractiveTaskPriority);
     if (curTask == -1) {
       klfWarning("Failed to submit preview task to thread.") ;
     } else {
       emit K->compiling(true);
     }
+
+    // if we replaced a task whose result wasn't displayed, keep counting from its change
+    if (!curTaskSince.isValid()) {
+      curTaskSince = pendingSince;
+    }
+    pendingSince.invalidate();
   }
 
 public slots:
 
+  void debounceTimeout()
+  {
+    refreshPreview();
+  }
+
+  void taskFinished(KLFLatexPreviewThread::TaskId taskid)
+  {
+    if (taskid != curTask || !curTaskSince.isValid()) {
+      return;
+    }
+    // all queued handler calls for this task have been delivered by now
+    lastLatency = (int)curTaskSince.elapsed();
+    curTaskSince.invalidate();
+    latencySum += lastLatency;
+    ++latencyCount;
+    klfDbg("preview latency: "<<lastLatency<<" ms, average: "<<(latencySum/latencyCount)<<" ms") ;
+    emit K->previewLatency(lastLatency);
+  }
+
   void latexPreviewReset()
   {
     emit K->compiling(false);
@@ -0,0 +1,481 @@
+/***************************************************************************
+ *   file klfrendercache.cpp
+ *   This file is part of the KLatexFormula Project.
+ *   Copyright (C) 2020 by Philippe Faist
+ *   philippe.faist at bluewin.ch
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/* $Id$ */
+
+#include <QFile>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QDataStream>
+#include <QBuffer>
+#include <QCache>
+#include <QMap>
+#include <QMutex>
+#include <QCryptographicHash>
+
+#include <klfdefs.h>
+#include <klfutil.h>
+
+#include "klfbackend.h"
+#include "klfrendercache.h"
+
+
+// increase this whenever the key or file format changes
+#define KLF_RENDERCACHE_VERSION 3
+
+static const char * klf_rendercache_magic = "KLFRenderCache";
+static const char * klf_rendercache_suffix = ".klfrc";
+
+
+struct KLFRenderCacheEntry
+{
+  KLFRenderCacheEntry() : width_pt(0), height_pt(0) { }
+
+  QImage result;
+  QByteArray dvidata;
+  QByteArray pngdata_raw;
+  QByteArray pngdata;
+  QByteArray epsdata_raw;
+  QByteArray epsdata_bbox;
+  QByteArray epsdata;
+  QByteArray pdfdata;
+  QByteArray svgdata;
+  double width_pt;
+  double height_pt;
+
+  qint64 dataSize() const
+  {
+    return (qint64)dvidata.size() + pngdata_raw.size() + pngdata.size() + epsdata_raw.size()
+      + epsdata_bbox.size() + epsdata.size() + pdfdata.size() + svgdata.size()
+      + result.sizeInBytes();
+  }
+
+  void fromOutput(const KLFBackend::klfOutput& o)
+  {
+    result = o.result;
+    dvidata = o.dvidata;
+    pngdata_raw = o.pngdata_raw;
+    pngdata = o.pngdata;
+    epsdata_raw = o.epsdata_raw;
+    epsdata_bbox = o.epsdata_bbox;
+    epsdata = o.epsdata;
+    pdfdata = o.pdfdata;
+    svgdata = o.svgdata;
+    width_pt = o.width_pt;
+    height_pt = o.height_pt;
+  }
+  void toOutput(KLFBackend::klfOutput * o) const
+  {
+    o->status = KLFERR_NOERROR;
+    o->errorstr = QString();
+    o->result = result;
+    o->dvidata = dvidata;
+    o->pngdata_raw = pngdata_raw;
+    o->pngdata = pngdata;
+    o->epsdata_raw = epsdata_raw;
+    o->epsdata_bbox = epsdata_bbox;
+    o->epsdata = epsdata;
+    o->pdfdata = pdfdata;
+    o->svgdata = svgdata;
+    o->width_pt = width_pt;
+    o->height_pt = height_pt;
+  }
+
+  // the image itself is not saved, it is reloaded from the (final) PNG data, which
+  // also contains the meta-information text fields.
+  void save(QDataStream& stream) const
+  {
+    stream << dvidata << pngdata_raw << pngdata << epsdata_raw << epsdata_bbox << epsdata
+           << pdfdata << svgdata << width_pt << height_pt;
+  }
+  bool load(QDataStream& stream)
+  {
+    stream >> dvidata >> pngdata_raw >> pngdata >> epsdata_raw >> epsdata_bbox >> epsdata
+           >> pdfdata >> svgdata >> width_pt >> height_pt;
+    if (stream.status() != QDataStream::Ok) {
+      return false;
+    }
+    result = QImage();
+    if (!pngdata.isEmpty()) {
+      result.loadFromData(pngdata, "PNG");
+    }
+    return true;
+  }
+};
+
+struct KLFRenderCacheDiskEntry
+{
+  KLFRenderCacheDiskEntry(qint64 s = 0, const QDateTime& dt = QDateTime()) : size(s), lastAccess(dt) { }
+  qint64 size;
+  QDateTime lastAccess;
+};
+
+
+struct KLFRenderCachePrivate
+{
+  KLF_PRIVATE_HEAD(KLFRenderCache)
+  {
+    maxMemorySize = 0;
+    maxDiskSize = 0;
+    diskIndexRead = false;
+    diskTotalSize = 0;
+  }
+
+  QString cacheDir;
+  qint64 maxMemorySize;
+  qint64 maxDiskSize;
+
+  // QCache is LRU; costs are expressed in kilobytes so that they fit in an int
+  QCache<QByteArray,KLFRenderCacheEntry> memCache;
+  // intermediate results (memory only), same cost units
+  QCache<QByteArray,QByteArray> stageCache;
+
+  bool diskIndexRead;
+  QMap<QByteArray,KLFRenderCacheDiskEntry> diskIndex;
+  qint64 diskTotalSize;
+
+  QMutex mutex;
+
+  static int memCost(const KLFRenderCacheEntry * e)
+  {
+    return (int)(e->dataSize() / 1024) + 1;
+  }
+
+  bool useDisk() const
+  {
+    return !cacheDir.isEmpty() && maxDiskSize > 0;
+  }
+
+  QString entryFileName(const QByteArray& key) const
+  {
+    return cacheDir + "/" + QString::fromLatin1(key) + QLatin1String(klf_rendercache_suffix);
+  }
+
+  void readDiskIndex()
+  {
+    if (diskIndexRead || !useDisk()) {
+      return;
+    }
+    diskIndexRead = true;
+
+    diskIndex.clear();
+    diskTotalSize = 0;
+    QDir dir(cacheDir);
+    QFileInfoList files = dir.entryInfoList(QStringList() << QString("*%1").arg(klf_rendercache_suffix),
+                                            QDir::Files);
+    foreach (const QFileInfo& fi, files) {
+      QByteArray key = fi.completeBaseName().toLatin1();
+      diskIndex[key] = KLFRenderCacheDiskEntry(fi.size(), fi.lastModified());
+      diskTotalSize += fi.size();
+    }
+    klfDbg("read render cache index in "<<cacheDir<<": "<<diskIndex.size()<<" entries, "
+           <<diskTotalSize<<" bytes") ;
+  }
+
+  void removeDiskEntry(const QByteArray& key)
+  {
+    QMap<QByteArray,KLFRenderCacheDiskEntry>::iterator it = diskIndex.find(key);
+    if (it == diskIndex.end()) {
+      return;
+    }
+    diskTotalSize -= it->size;
+    diskIndex.erase(it);
+    QFile::remove(entryFileName(key));
+  }
+
+  void pruneDisk()
+  {
+    // remove least recently used entries until we're below the size limit
+    while (diskTotalSize > maxDiskSize && !diskIndex.isEmpty()) {
+      QMap<QByteArray,KLFRenderCacheDiskEntry>::const_iterator it, oldest = diskIndex.constBegin();
+      for (it = diskIndex.constBegin(); it != diskIndex.constEnd(); ++it) {
+        if (it->lastAccess < oldest->lastAccess) {
+          oldest = it;
+        }
+      }
+      QByteArray key = oldest.key(); // copy, the map entry is removed
+      klfDbg("pruning render cache entry "<<key) ;
+      removeDiskEntry(key);
+    }
+  }
+
+  void clearAll()
+  {
+    memCache.clear();
+    stageCache.clear();
+    if (cacheDir.isEmpty()) {
+      return;
+    }
+    QDir dir(cacheDir);
+    QStringList files = dir.entryList(QStringList() << QString("*%1").arg(klf_rendercache_suffix),
+                                      QDir::Files);
+    foreach (const QString& fn, files) {
+      dir.remove(fn);
+    }
+    diskIndex.clear();
+    diskTotalSize = 0;
+  }
+
+  KLFRenderCacheEntry * loadDiskEntry(const QByteArray& key)
+  {
+    QFile f(entryFileName(key));
+    if (!f.open(QIODevice::ReadOnly)) {
+      return NULL;
+    }
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_5_0);
+    QByteArray magic;
+    qint32 version;
+    stream >> magic >> version;
+    if (magic != klf_rendercache_magic || version != KLF_RENDERCACHE_VERSION) {
+      klfDbg("Invalid render cache file "<<f.fileName()) ;
+      return NULL;
+    }
+    KLFRenderCacheEntry * e = new KLFRenderCacheEntry;
+    if (!e->load(stream)) {
+      klfWarning("Failed to read render cache file "<<f.fileName()) ;
+      delete e;
+      return NULL;
+    }
+    return e;
+  }
+
+  /** Writes the file for entry \c key. This doesn't use any member which may change, and may
+   * be called without holding the mutex. The file is replaced atomically, so that other
+   * threads never see it half written. Returns the size of the file, or -1 on error. */
+  qint64 writeDiskEntry(const QByteArray& key, const KLFRenderCacheEntry * e) const
+  {
+    if (!klfEnsureDir(cacheDir)) {
+      klfWarning("Can't create render cache directory "<<cacheDir) ;
+      return -1;
+    }
+    QSaveFile f(entryFileName(key));
+    if (!f.open(QIODevice::WriteOnly)) {
+      klfWarning("Can't write render cache file "<<f.fileName()) ;
+      return -1;
+    }
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << QByteArray(klf_rendercache_magic) << (qint32)KLF_RENDERCACHE_VERSION;
+    e->save(stream);
+    qint64 size = f.size();
+    if (!f.commit()) {
+      klfWarning("Can't write render cache file "<<f.fileName()) ;
+      return -1;
+    }
+    return size;
+  }
+
+  //! Records the file written by writeDiskEntry() in the index
+  void addDiskEntry(const QByteArray& key, qint64 size)
+  {
+    if (diskIndex.contains(key)) { // we overwrote an existing entry
+      diskTotalSize -= diskIndex[key].size;
+    }
+    diskIndex[key] = KLFRenderCacheDiskEntry(size, QDateTime::currentDateTime());
+    diskTotalSize += size;
+  }
+};
+
+
+KLFRenderCache::KLFRenderCache(const QString& cacheDir, qint64 maxMemorySize, qint64 maxDiskSize)
+{
+  KLF_INIT_PRIVATE(KLFRenderCache) ;
+
+  d->cacheDir = cacheDir;
+  setMaxMemorySize(maxMemorySize);
+  setMaxDiskSize(maxDiskSize);
+}
+
+KLFRenderCache::~KLFRenderCache()
+{
+  KLF_DELETE_PRIVATE ;
+}
+
+KLF_DEFINE_PROPERTY_GET(KLFRenderCache, QString, cacheDir) ;
+KLF_DEFINE_PROPERTY_GET(KLFRenderCache, qint64, maxMemorySize) ;
+KLF_DEFINE_PROPERTY_GET(KLFRenderCache, qint64, maxDiskSize) ;
+
+void KLFRenderCache::setMaxMemorySize(qint64 size)
+{
+  QMutexLocker lock(&d->mutex);
+  d->maxMemorySize = size;
+  d->memCache.setMaxCost((int)qMin<qint64>(size / 1024, 0x7fffffff));
+  // intermediate results are small and only useful for the last few formulas
+  d->stageCache.setMaxCost((int)qMin<qint64>(size / 4 / 1024, 0x7fffffff));
+}
+
+void KLFRenderCache::setMaxDiskSize(qint64 size)
+{
+  QMutexLocker lock(&d->mutex);
+  d->maxDiskSize = size;
+  if (d->diskIndexRead) {
+    d->pruneDisk();
+  }
+}
+
+// static
+QByteArray KLFRenderCache::cacheKey(const KLFBackend::klfInput& in, const KLFBackend::klfSettings& settings,
+                                    const QString& toolsStamp)
+{
+  QByteArray data;
+  { QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    stream << (qint32)KLF_RENDERCACHE_VERSION << toolsStamp;
+    // input
+    stream << in.latex << in.mathmode << in.preamble << in.fontsize
+           << (quint32)in.fg_color << (quint32)in.bg_color << (qint32)in.dpi << in.vectorscale
+           << in.bypassTemplate << in.userScript << in.userScriptParam;
+    if (!in.userScript.isEmpty()) {
+      // the user script may have been modified
+      QFileInfo fi(in.userScript);
+      stream << fi.lastModified() << fi.size();
+    }
+    if (settings.templateGenerator != NULL) {
+      stream << settings.templateGenerator->generateTemplate(in, settings);
+    }
+    // output-relevant settings (not e.g. tempdir)
+    stream << settings.latexexec << settings.dvipsexec << settings.gsexec
+           << settings.tborderoffset << settings.rborderoffset << settings.bborderoffset
+           << settings.lborderoffset << settings.calcEpsBoundingBox << (int)settings.bboxMethod
+           << settings.outlineFonts
+           << settings.wantRaw << settings.wantPDF << settings.wantSVG << settings.execenv
+           << settings.userScriptInterpreters;
+  }
+  return QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex();
+}
+
+bool KLFRenderCache::lookup(const QByteArray& key, KLFBackend::klfOutput * output)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  if (key.isEmpty()) {
+    return false;
+  }
+
+  QMutexLocker lock(&d->mutex);
+
+  KLFRenderCacheEntry * e = d->memCache.object(key);
+  if (e != NULL) {
+    klfDbg("found "<<key<<" in memory cache") ;
+    e->toOutput(output);
+    return true;
+  }
+
+  if (!d->useDisk()) {
+    return false;
+  }
+
+  d->readDiskIndex();
+  QMap<QByteArray,KLFRenderCacheDiskEntry>::iterator it = d->diskIndex.find(key);
+  if (it == d->diskIndex.end()) {
+    return false;
+  }
+  e = d->loadDiskEntry(key);
+  if (e == NULL) {
+    // corrupt entry, get rid of it
+    d->removeDiskEntry(key);
+    return false;
+  }
+  klfDbg("found "<<key<<" in disk cache") ;
+  it->lastAccess = QDateTime::currentDateTime();
+  e->toOutput(output);
+  d->memCache.insert(key, e, KLFRenderCachePrivate::memCost(e));
+  return true;
+}
+
+void KLFRenderCache::insert(const QByteArray& key, const KLFBackend::klfOutput& output)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  if (key.isEmpty() || output.status != KLFERR_NOERROR) {
+    return;
+  }
+
+  KLFRenderCacheEntry * e = new KLFRenderCacheEntry;
+  e->fromOutput(output);
+
+  bool usedisk;
+  {
+    QMutexLocker lock(&d->mutex);
+    usedisk = d->useDisk();
+  }
+  // don't keep the other threads waiting while we write the file
+  qint64 disksize = -1;
+  if (usedisk) {
+    disksize = d->writeDiskEntry(key, e);
+  }
+
+  QMutexLocker lock(&d->mutex);
+
+  if (disksize >= 0) {
+    d->readDiskIndex();
+    d->addDiskEntry(key, disksize);
+    d->pruneDisk();
+  }
+
+  // QCache takes ownership (and deletes the entry right away if it is too big)
+  d->memCache.insert(key, e, KLFRenderCachePrivate::memCost(e));
+}
+
+// static
+QByteArray KLFRenderCache::stageKey(const QString& stage, const QList<QByteArray>& inputs)
+{
+  QByteArray data;
+  {
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << (qint32)KLF_RENDERCACHE_VERSION << stage << inputs;
+  }
+  return QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex();
+}
+
+bool KLFRenderCache::lookupStage(const QByteArray& key, QByteArray * data)
+{
+  if (key.isEmpty()) {
+    return false;
+  }
+  QMutexLocker lock(&d->mutex);
+  QByteArray * e = d->stageCache.object(key);
+  if (e == NULL) {
+    return false;
+  }
+  *data = *e;
+  return true;
+}
+
+void KLFRenderCache::insertStage(const QByteArray& key, const QByteArray& data)
+{
+  if (key.isEmpty()) {
+    return;
+  }
+  QMutexLocker lock(&d->mutex);
+  d->stageCache.insert(key, new QByteArray(data), data.size() / 1024 + 1);
+}
+
+void KLFRenderCache::clear()
+{
+  QMutexLocker lock(&d->mutex);
+  d->clearAll();
+}
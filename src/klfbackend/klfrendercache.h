@@ -0,0 +1,119 @@
+/***************************************************************************
+ *   file klfrendercache.h
+ *   This file is part of the KLatexFormula Project.
+ *   Copyright (C) 2020 by Philippe Faist
+ *   philippe.faist at bluewin.ch
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/* $Id$ */
+
+#ifndef KLFRENDERCACHE_H
+#define KLFRENDERCACHE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+
+#include <klfdefs.h>
+#include <klfbackend.h>
+
+
+struct KLFRenderCachePrivate;
+
+//! A cache of KLFBackend::getLatexFormula() results
+/** Stores successful \ref KLFBackend::klfOutput results, indexed by a hash of the
+ * \ref KLFBackend::klfInput and of those fields of \ref KLFBackend::klfSettings which
+ * influence the output (see \ref cacheKey()).
+ *
+ * Results are kept in an in-memory LRU cache, backed by an optional on-disk cache directory
+ * which persists across sessions. Both have a size limit; the least recently used entries
+ * are discarded first.
+ *
+ * Cached entries are only valid for a given set of tools (latex, dvips, gs): their paths and
+ * versions are part of the cache key (see \ref cacheKey()), so that settings objects using
+ * different tools may share the cache. Entries made with tools which are no longer used are
+ * eventually discarded as the least recently used ones.
+ *
+ * In addition, intermediate results of the process chain (DVI, EPS at its different stages)
+ * are kept in memory, so that when only some of the input changes (for example the DPI), only
+ * the steps which depend on it need to run again (see \ref lookupStage()).
+ *
+ * To use the cache, set \ref KLFBackend::klfSettings::renderCache to point to an instance
+ * of this class. An instance may be shared by several settings objects and may be used
+ * from several threads at the same time.
+ */
+class KLF_EXPORT KLFRenderCache
+{
+public:
+  /** Create a render cache. If \c cacheDir is empty, then only an in-memory cache is
+   * used. \c maxMemorySize and \c maxDiskSize are given in bytes. */
+  KLFRenderCache(const QString& cacheDir = QString(), qint64 maxMemorySize = 64*1024*1024,
+                 qint64 maxDiskSize = 256*1024*1024);
+  virtual ~KLFRenderCache();
+
+  QString cacheDir() const;
+  qint64 maxMemorySize() const;
+  qint64 maxDiskSize() const;
+
+  void setMaxMemorySize(qint64 size);
+  void setMaxDiskSize(qint64 size);
+
+  /** \brief A stable hash identifying the output of a getLatexFormula() call
+   *
+   * If a custom template generator is set, the LaTeX template it generates is included
+   * in the hash. \c toolsStamp identifies the versions of the tools used.
+   */
+  static QByteArray cacheKey(const KLFBackend::klfInput& input, const KLFBackend::klfSettings& settings,
+                             const QString& toolsStamp = QString());
+
+  /** \brief Look up a cached result
+   *
+   * Returns TRUE and sets the data fields of \c output (image, data blobs, size) if an
+   * entry is found. The \c input and \c settings fields of \c output are left untouched.
+   */
+  bool lookup(const QByteArray& key, KLFBackend::klfOutput * output);
+
+  /** \brief Store a result in the cache
+   *
+   * Only successful results (<tt>output.status == 0</tt>) are stored. */
+  void insert(const QByteArray& key, const KLFBackend::klfOutput& output);
+
+  /** \brief A hash identifying an intermediate result of the process chain
+   *
+   * \c stage is the name of the step (e.g. \c "dvi"), and \c inputs is all the data on
+   * which the output of this step depends.
+   */
+  static QByteArray stageKey(const QString& stage, const QList<QByteArray>& inputs);
+
+  /** \brief Look up an intermediate result
+   *
+   * Intermediate results are only kept in memory. Returns TRUE and sets \c data if an entry
+   * was found. */
+  bool lookupStage(const QByteArray& key, QByteArray * data);
+  /** \brief Store an intermediate result */
+  void insertStage(const QByteArray& key, const QByteArray& data);
+
+  /** Remove all entries from the cache (both in memory and on disk). */
+  void clear();
+
+private:
+  KLF_DECLARE_PRIVATE(KLFRenderCache) ;
+};
+
+
+
+#endif
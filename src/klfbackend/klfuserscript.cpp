@@ -25,6 +25,8 @@
 #include <QDir>
 #include <QDateTime>
 #include <QByteArray>
+#include <QMutex>
+#include <QAtomicInt>
 
 #include <klfdefs.h>
 #include <klfdebug.h>
@@ -87,7 +89,6 @@ struct KLFUserScriptInfo::Private : public KLFPropertizedObject
   Private()
     : KLFPropertizedObject("KLFUserScriptInfo")
   {
-    refcount = 0;
     scriptInfoError = KLFERR_NOERROR;
 
     registerBuiltInProperty(ExeScript, QLatin1String("ExeScript"));
@@ -112,9 +113,10 @@ struct KLFUserScriptInfo::Private : public KLFPropertizedObject
     }
   }
 
-  int refcount;
-  inline int ref() { return ++refcount; }
-  inline int deref() { return --refcount; }
+  // instances are shared between the threads which call KLFBackend::getLatexFormula()
+  QAtomicInt refcount;
+  inline int ref() { return refcount.fetchAndAddOrdered(1) + 1; }
+  inline int deref() { return refcount.fetchAndAddOrdered(-1) - 1; }
 
   QString uspath;
   QString normalizedfname;
@@ -267,6 +269,8 @@ struct KLFUserScriptInfo::Private : public KLFPropertizedObject
 
 
   static QMap<QString,KLFRefPtr<Private> > userScriptInfoCache;
+  //! Protects \c userScriptInfoCache
+  static QMutex userScriptInfoCacheMutex;
   
 private:
   /* no copy constructor */
@@ -276,6 +280,8 @@ private:
 
 // static
 QMap<QString,KLFRefPtr<KLFUserScriptInfo::Private> > KLFUserScriptInfo::Private::userScriptInfoCache;
+// static
+QMutex KLFUserScriptInfo::Private::userScriptInfoCacheMutex;
 
 static QString normalizedFn(const QString& userScriptFileName)
 {
@@ -288,7 +294,10 @@ KLFUserScriptInfo KLFUserScriptInfo::forceReloadScriptInfo(const QString& userSc
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
   QString normalizedfn = normalizedFn(userScriptFileName);
-  Private::userScriptInfoCache.remove(normalizedfn);
+  {
+    QMutexLocker cachelocker(&Private::userScriptInfoCacheMutex);
+    Private::userScriptInfoCache.remove(normalizedfn);
+  }
 
   KLFUserScriptInfo usinfo(userScriptFileName) ;
   if (usinfo.scriptInfoError() != KLFERR_NOERROR) {
@@ -301,6 +310,7 @@ KLFUserScriptInfo KLFUserScriptInfo::forceReloadScriptInfo(const QString& userSc
 void KLFUserScriptInfo::clearCacheAll()
 {
   // will decrease the refcounts if needed automatically (KLFRefPtr)
+  QMutexLocker cachelocker(&Private::userScriptInfoCacheMutex);
   Private::userScriptInfoCache.clear();
 }
 
@@ -310,6 +320,7 @@ bool KLFUserScriptInfo::hasScriptInfoInCache(const QString& userScriptFileName)
 {
   QString normalizedfn = normalizedFn(userScriptFileName);
   klfDbg("userScriptFileName = " << userScriptFileName << "; normalizedfn = " << normalizedfn) ;
+  QMutexLocker cachelocker(&Private::userScriptInfoCacheMutex);
   klfDbg("cache: " << Private::userScriptInfoCache) ;
   return Private::userScriptInfoCache.contains(normalizedfn);
 }
@@ -320,6 +331,9 @@ KLFUserScriptInfo::KLFUserScriptInfo(const QString& userScriptFileName)
 
   QFileInfo fi(userScriptFileName);
   QString normalizedfn = fi.canonicalFilePath();
+  // this may be called from several threads (see KLFBackend::getLatexFormula()). Keep the lock
+  // while reading the script info, so that it's only read once.
+  QMutexLocker cachelocker(&Private::userScriptInfoCacheMutex);
   if (Private::userScriptInfoCache.contains(normalizedfn)) {
     d = Private::userScriptInfoCache[normalizedfn];
   } else {
@@ -846,10 +860,14 @@ struct KLFUserScriptFilterProcessPrivate
 
   // log of user script output
   static QStringList log;
+  // user scripts may be run from several threads
+  static QMutex logMutex;
 };
 
 // static
 QStringList KLFUserScriptFilterProcessPrivate::log = QStringList();
+// static
+QMutex KLFUserScriptFilterProcessPrivate::logMutex;
 
 
 KLFUserScriptFilterProcess::KLFUserScriptFilterProcess(const QString& userScriptFileName,
@@ -914,6 +932,8 @@ bool KLFUserScriptFilterProcess::do_run(const QByteArray& indata, const QMap<QSt
     thislog += templ.arg("STDERR").arg(QString::fromLocal8Bit(bstderr).toHtmlEscaped());
   }
 
+  QMutexLocker loglocker(&KLFUserScriptFilterProcessPrivate::logMutex);
+
   // start discarding old logs after 255 entries
   if (KLFUserScriptFilterProcessPrivate::log.size() > 255) {
     KLFUserScriptFilterProcessPrivate::log.erase(KLFUserScriptFilterProcessPrivate::log.begin());
@@ -928,6 +948,7 @@ bool KLFUserScriptFilterProcess::do_run(const QByteArray& indata, const QMap<QSt
 QString KLFUserScriptFilterProcess::getUserScriptLogHtml(bool include_head)
 {
   QString loghtml;
+  QMutexLocker loglocker(&KLFUserScriptFilterProcessPrivate::logMutex);
   QStringList::const_iterator it = KLFUserScriptFilterProcessPrivate::log.cend();
   while (it != KLFUserScriptFilterProcessPrivate::log.cbegin()) {
     --it;
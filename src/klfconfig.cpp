@@ -338,6 +338,7 @@ void KLFConfig::loadDefaults()
   KLFCONFIGPROP_INIT(UI.enableToolTipPreview, false) ;
   KLFCONFIGPROP_INIT(UI.enableRealTimePreview, true) ;
   KLFCONFIGPROP_INIT(UI.realTimePreviewExceptBattery, true) ;
+  KLFCONFIGPROP_INIT(UI.realTimePreviewDebounceDelay, 150) ;
   KLFCONFIGPROP_INIT(UI.autosaveLibraryMin, 5) ;
   KLFCONFIGPROP_INIT(UI.showHintPopups, true) ;
   KLFCONFIGPROP_INIT(UI.clearLatexOnly, false) ;
@@ -398,11 +399,15 @@ void KLFConfig::loadDefaults()
   KLFCONFIGPROP_INIT(BackendSettings.rborderoffset, 0) ;
   KLFCONFIGPROP_INIT(BackendSettings.bborderoffset, 0) ;
   KLFCONFIGPROP_INIT(BackendSettings.calcEpsBoundingBox, true) ;
+  KLFCONFIGPROP_INIT(BackendSettings.calcEpsBoundingBoxMethod, (int)KLFBackend::klfSettings::BBoxGsDevice) ;
   KLFCONFIGPROP_INIT(BackendSettings.outlineFonts, true) ;
   KLFCONFIGPROP_INIT_DEFNOTDEF(BackendSettings.wantPDF, true) ;
   KLFCONFIGPROP_INIT_DEFNOTDEF(BackendSettings.wantSVG, true) ;
   KLFCONFIGPROP_INIT(BackendSettings.userScriptAddPath, QStringList() );
   KLFCONFIGPROP_INIT(BackendSettings.userScriptInterpreters, QVariantMap());
+  KLFCONFIGPROP_INIT(BackendSettings.renderCacheMaxSize, 128);
+  KLFCONFIGPROP_INIT(BackendSettings.useGsServer, false);
+  KLFCONFIGPROP_INIT(BackendSettings.previewWorkerCount, 0);
 
   KLFCONFIGPROP_INIT(LibraryBrowser.colorFound, QColor(128, 255, 128)) ;
   KLFCONFIGPROP_INIT(LibraryBrowser.colorNotFound, QColor(255, 128, 128)) ;
@@ -423,6 +428,9 @@ void KLFConfig::loadDefaults()
   KLFCONFIGPROP_INIT(LibraryBrowser.treePreviewSizePercent, 75) ;
   KLFCONFIGPROP_INIT(LibraryBrowser.listPreviewSizePercent, 75) ;
   KLFCONFIGPROP_INIT(LibraryBrowser.iconPreviewSizePercent, 100) ;
+  KLFCONFIGPROP_INIT(LibraryBrowser.dbTransactionBatchSize, 500) ;
+  KLFCONFIGPROP_INIT(LibraryBrowser.dbPreviewTable, false) ;
+  KLFCONFIGPROP_INIT(LibraryBrowser.dbUpgradeIndexes, false) ;
 
   // User Scripts
   UserScripts.userScriptConfig = QMap< QString, QMap<QString,QVariant> >() ;
@@ -595,6 +603,7 @@ int KLFConfig::readFromConfig_v2(const QString& fname)
   klf_config_read(s, "enabletooltippreview", &UI.enableToolTipPreview);
   klf_config_read(s, "enablerealtimepreview", &UI.enableRealTimePreview);
   klf_config_read(s, "realtimepreviewexceptbattery", &UI.realTimePreviewExceptBattery);
+  klf_config_read(s, "realtimepreviewdebouncedelay", &UI.realTimePreviewDebounceDelay);
   klf_config_read(s, "autosavelibrarymin", &UI.autosaveLibraryMin);
   klf_config_read(s, "showhintpopups", &UI.showHintPopups);
   klf_config_read(s, "clearlatexonly", &UI.clearLatexOnly);
@@ -651,12 +660,16 @@ int KLFConfig::readFromConfig_v2(const QString& fname)
   klf_config_read(s, "rborderoffset", &BackendSettings.rborderoffset);
   klf_config_read(s, "bborderoffset", &BackendSettings.bborderoffset);
   klf_config_read(s, "calcepsboundingbox", &BackendSettings.calcEpsBoundingBox);
+  klf_config_read(s, "calcepsboundingboxmethod", &BackendSettings.calcEpsBoundingBoxMethod);
   klf_config_read(s, "outlinefonts", &BackendSettings.outlineFonts);
   klf_config_read(s, "wantpdf", &BackendSettings.wantPDF);
   klf_config_read(s, "wantsvg", &BackendSettings.wantSVG);
   klf_config_read(s, "userscriptaddpath", &BackendSettings.userScriptAddPath);
   klf_config_read(s, "userscriptinterpreters", &BackendSettings.userScriptInterpreters,
                   "QString" /*listOrMapType*/);
+  klf_config_read(s, "rendercachemaxsize", &BackendSettings.renderCacheMaxSize);
+  klf_config_read(s, "usegsserver", &BackendSettings.useGsServer);
+  klf_config_read(s, "previewworkercount", &BackendSettings.previewWorkerCount);
   s.endGroup();
 
   s.beginGroup("LibraryBrowser");
@@ -671,6 +684,9 @@ int KLFConfig::readFromConfig_v2(const QString& fname)
   klf_config_read(s, "treepreviewsizepercent", &LibraryBrowser.treePreviewSizePercent);
   klf_config_read(s, "listpreviewsizepercent", &LibraryBrowser.listPreviewSizePercent);
   klf_config_read(s, "iconpreviewsizepercent", &LibraryBrowser.iconPreviewSizePercent);
+  klf_config_read(s, "dbtransactionbatchsize", &LibraryBrowser.dbTransactionBatchSize);
+  klf_config_read(s, "dbpreviewtable", &LibraryBrowser.dbPreviewTable);
+  klf_config_read(s, "dbupgradeindexes", &LibraryBrowser.dbUpgradeIndexes);
   s.endGroup();
 
   // Special treatment for UserScripts.userScriptConfig
@@ -767,6 +783,7 @@ int KLFConfig::writeToConfig()
   klf_config_write(s, "enabletooltippreview", &UI.enableToolTipPreview);
   klf_config_write(s, "enablerealtimepreview", &UI.enableRealTimePreview);
   klf_config_write(s, "realtimepreviewexceptbattery", &UI.realTimePreviewExceptBattery);
+  klf_config_write(s, "realtimepreviewdebouncedelay", &UI.realTimePreviewDebounceDelay);
   klf_config_write(s, "autosavelibrarymin", &UI.autosaveLibraryMin);
   klf_config_write(s, "showhintpopups", &UI.showHintPopups);
   klf_config_write(s, "clearlatexonly", &UI.clearLatexOnly);
@@ -814,11 +831,15 @@ int KLFConfig::writeToConfig()
   klf_config_write(s, "rborderoffset", &BackendSettings.rborderoffset);
   klf_config_write(s, "bborderoffset", &BackendSettings.bborderoffset); 
   klf_config_write(s, "calcepsboundingbox", &BackendSettings.calcEpsBoundingBox);
+  klf_config_write(s, "calcepsboundingboxmethod", &BackendSettings.calcEpsBoundingBoxMethod);
   klf_config_write(s, "outlinefonts", &BackendSettings.outlineFonts);
   klf_config_write(s, "wantpdf", &BackendSettings.wantPDF);
   klf_config_write(s, "wantsvg", &BackendSettings.wantSVG);
   klf_config_write(s, "userscriptaddpath", &BackendSettings.userScriptAddPath);
   klf_config_write(s, "userscriptinterpreters", &BackendSettings.userScriptInterpreters);
+  klf_config_write(s, "rendercachemaxsize", &BackendSettings.renderCacheMaxSize);
+  klf_config_write(s, "usegsserver", &BackendSettings.useGsServer);
+  klf_config_write(s, "previewworkercount", &BackendSettings.previewWorkerCount);
   s.endGroup();
 
   s.beginGroup("LibraryBrowser");
@@ -833,6 +854,9 @@ int KLFConfig::writeToConfig()
   klf_config_write(s, "treepreviewsizepercent", &LibraryBrowser.treePreviewSizePercent);
   klf_config_write(s, "listpreviewsizepercent", &LibraryBrowser.listPreviewSizePercent);
   klf_config_write(s, "iconpreviewsizepercent", &LibraryBrowser.iconPreviewSizePercent);
+  klf_config_write(s, "dbtransactionbatchsize", &LibraryBrowser.dbTransactionBatchSize);
+  klf_config_write(s, "dbpreviewtable", &LibraryBrowser.dbPreviewTable);
+  klf_config_write(s, "dbupgradeindexes", &LibraryBrowser.dbUpgradeIndexes);
   s.endGroup();
 
   // // Special treatment for Plugins.pluginConfig
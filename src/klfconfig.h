@@ -281,6 +281,7 @@ public:
     KLFConfigProp<bool> enableToolTipPreview;
     KLFConfigProp<bool> enableRealTimePreview;
     KLFConfigProp<bool> realTimePreviewExceptBattery;
+    KLFConfigProp<int> realTimePreviewDebounceDelay;
     KLFConfigProp<int> autosaveLibraryMin;
     KLFConfigProp<bool> showHintPopups;
     KLFConfigProp<bool> clearLatexOnly;
@@ -334,11 +335,20 @@ public:
     KLFConfigProp<double> rborderoffset;
     KLFConfigProp<double> bborderoffset;
     KLFConfigProp<bool> calcEpsBoundingBox;
+    /** See KLFBackend::klfSettings::bboxMethod */
+    KLFConfigProp<int> calcEpsBoundingBoxMethod;
     KLFConfigProp<bool> outlineFonts;
     KLFConfigProp<bool> wantPDF;
     KLFConfigProp<bool> wantSVG;
     KLFConfigProp<QStringList> userScriptAddPath;
     KLFConfigProp<QVariantMap> userScriptInterpreters;
+    /** Maximum size of the on-disk render cache in MB. 0 disables the render cache. */
+    KLFConfigProp<int> renderCacheMaxSize;
+    /** See KLFBackend::klfSettings::useGsServer */
+    KLFConfigProp<bool> useGsServer;
+    /** Number of threads generating previews, 0 for one per processor core. See
+     * KLFLatexPreviewThread::setWorkerCount() */
+    KLFConfigProp<int> previewWorkerCount;
 
   } BackendSettings;
 
@@ -358,6 +368,15 @@ public:
     KLFConfigProp<int> listPreviewSizePercent;
     KLFConfigProp<int> iconPreviewSizePercent;
 
+    /** Number of entries written to a library database per transaction */
+    KLFConfigProp<int> dbTransactionBatchSize;
+    /** Store the previews of new library sub-resources in a separate table. Older versions of
+     * KLatexFormula don't show the previews of such sub-resources. */
+    KLFConfigProp<bool> dbPreviewTable;
+    /** Add indexes, including a full-text index, to the libraries we write to. Versions of
+     * KLatexFormula (or of SQLite) without FTS5 support can't modify such libraries any more. */
+    KLFConfigProp<bool> dbUpgradeIndexes;
+
   } LibraryBrowser;
 
   // struct {
@@ -24,6 +24,8 @@
 
 #include <QVariant>
 #include <QVariantList>
+#include <QCache>
+#include <QDataStream>
 
 #include <klfdefs.h>
 
@@ -106,9 +108,30 @@ struct KLFExporterManagerPrivate
 {
   KLF_PRIVATE_HEAD( KLFExporterManager )
   {
+    // costs are in kilobytes
+    pDataCache.setMaxCost(16*1024);
   }
 
   QList<KLFExporter*> pExporters;
+
+  //! Exported data, indexed by dataCacheKey()
+  QCache<QByteArray,QByteArray> pDataCache;
+
+  /** The output is identified by its image, which all copies of a given klfOutput share.
+   * Returns an empty key if the output can't be identified (then nothing is cached). */
+  static QByteArray dataCacheKey(KLFExporter * exporter, const QString & format,
+                                 const KLFBackend::klfOutput & output, const QVariantMap & params)
+  {
+    if (output.result.isNull()) {
+      return QByteArray();
+    }
+    QByteArray key;
+    {
+      QDataStream stream(&key, QIODevice::WriteOnly);
+      stream << output.result.cacheKey() << exporter->exporterName() << format << params;
+    }
+    return key;
+  }
 };
 
 KLFExporterManager::KLFExporterManager()
@@ -144,6 +167,8 @@ void KLFExporterManager::registerExporter(KLFExporter *exporter)
 void KLFExporterManager::unregisterExporter(KLFExporter *exporter)
 {
   d->pExporters.removeAll(exporter);
+  // another exporter may be registered later under the same name
+  d->pDataCache.clear();
 }
 
 
@@ -206,7 +231,7 @@ QByteArray KLFExporterManager::getDataByExporterNameAndFormat(const QString & ex
   if ( ! exporter->supports(format, output) ) {
     return QByteArray();
   }
-  return exporter->getData(format, output, params);
+  return getExporterData(exporter, format, output, params);
 }
 
 QByteArray KLFExporterManager::getDataByExporterNamesAndFormats(const KLFExporterNameAndFormatList& exporterNamesAndFormats,
@@ -233,6 +258,46 @@ QByteArray KLFExporterManager::getDataByExporterNamesAndFormats(const KLFExporte
 
 
 
+QByteArray KLFExporterManager::getExporterData(KLFExporter * exporter, const QString & format,
+                                               const KLFBackend::klfOutput & output,
+                                               const QVariantMap & params)
+{
+  KLF_ASSERT_NOT_NULL( exporter, "NULL exporter!", return QByteArray() ) ;
+
+  QByteArray key = KLFExporterManagerPrivate::dataCacheKey(exporter, format, output, params);
+  if (!key.isEmpty()) {
+    QByteArray * cached = d->pDataCache.object(key);
+    if (cached != NULL) {
+      klfDbg("Reusing exported data from " << exporter->exporterName() << " : " << format) ;
+      return *cached;
+    }
+  }
+
+  QByteArray data = exporter->getData(format, output, params);
+
+  if (!key.isEmpty() && data.size() > 0) {
+    d->pDataCache.insert(key, new QByteArray(data), (data.size() + 1023) / 1024);
+  }
+  return data;
+}
+
+qint64 KLFExporterManager::maxDataCacheSize() const
+{
+  return (qint64)d->pDataCache.maxCost() * 1024;
+}
+
+void KLFExporterManager::setMaxDataCacheSize(qint64 size)
+{
+  d->pDataCache.setMaxCost((int)qBound<qint64>(0, size / 1024, 0x7fffffff));
+}
+
+void KLFExporterManager::clearDataCache()
+{
+  d->pDataCache.clear();
+}
+
+
+
 
 // =============================================================================
 // =============================================================================
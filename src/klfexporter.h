@@ -210,6 +210,30 @@ public:
                                               const QVariantMap & params,
                                               KLFExporterNameAndFormat * whichExporterNameAndFormat = NULL) ;
 
+  /** \brief Get data from the given exporter, reusing a previous result if possible
+   *
+   * Calls <code>exporter->getData(format, output, params)</code>, unless the same exporter
+   * was already asked for the same format and parameters for this \a output (or a copy of
+   * it), in which case the previously exported data is returned.
+   *
+   * Only successful (non-empty) results are cached, so that on failure \ref
+   * KLFExporter::errorString() still describes the error.  The cache is shared by all users
+   * of this manager and its size is bounded (see \ref setMaxDataCacheSize()); the least
+   * recently used results are discarded first.
+   */
+  QByteArray getExporterData(KLFExporter * exporter, const QString & format,
+                             const KLFBackend::klfOutput & output,
+                             const QVariantMap & params = QVariantMap()) ;
+
+  //! Maximum total size of the cached exported data, in bytes
+  qint64 maxDataCacheSize() const;
+  void setMaxDataCacheSize(qint64 size);
+
+  /** \brief Forget all cached exported data
+   *
+   * Call this when settings which exporters depend on have changed. */
+  void clearDataCache();
+
 private:
   KLF_DECLARE_PRIVATE( KLFExporterManager ) ;
 };
@@ -43,16 +43,21 @@
 #include <QDebug>
 #include <QPainter>
 #include <QStyleFactory>
+#include <QTemporaryDir>
+#include <QSaveFile>
+#include <QBuffer>
 
 #include <QDomDocument>
 #include <QDomElement>
 
 #include <klfbackend.h>
+#include <klffilterprocess.h>
 
 #include <ui_klflatexsymbols.h>
 
 #include <klfpixmapbutton.h>
 #include <klfrelativefont.h>
+#include <klfimageutil.h>
 
 #include "klfmain.h"
 #include "klfconfig.h"
@@ -269,11 +274,21 @@ KLFLatexSymbolsCache::~KLFLatexSymbolsCache()
   KLF_DELETE_PRIVATE ;
 }
 
+// The symbols cache file format starts with an index of all symbols: their KLFLatexSymbol
+// definition, the position and size of their (PNG) image data relative to the end of the index,
+// the device pixel ratio the image was generated for and its size. The image data follows. The
+// file is mapped into memory and each image is only decoded when it is needed.
+//
+// Files with the old header (such as the base cache shipped in the resources) contain the whole
+// QHash<KLFLatexSymbol,SymbolInfo>, which is fully decoded when read. They are saved in the new
+// format next time.
+
 int KLFLatexSymbolsCache::loadCacheStream(QDataStream& stream)
 {
   QString readHeader;
   QString readCompatKLFVersion;
-  bool r = klfDataStreamReadHeader(stream, QStringList()<<"KLATEXFORMULA_SYMBOLS_PIXMAP_CACHE",
+  bool r = klfDataStreamReadHeader(stream, QStringList()<<"KLATEXFORMULA_SYMBOLS_PIXMAP_CACHE"
+				   <<"KLATEXFORMULA_SYMBOLS_PIXMAP_CACHE_INDEXED",
 				   &readHeader, &readCompatKLFVersion);
   if (!r) {
     klfDbg("failed to read symbolscache data header. readHeader="<<readHeader
@@ -286,17 +301,85 @@ int KLFLatexSymbolsCache::loadCacheStream(QDataStream& stream)
 
   // stream is now ready to read
 
-  stream >> d->cache;
+  if (readHeader == QLatin1String("KLATEXFORMULA_SYMBOLS_PIXMAP_CACHE")) {
+    // old format, convert it when saving
+    stream >> d->cache;
+    d->setImageData(NULL, QByteArray(), NULL, 0);
+    d->flag_modified = true;
+    return 0;
+  }
+
+  // read the index
+  QHash<KLFLatexSymbol,SymbolInfo> cache;
+  quint32 n;
+  stream >> n;
+  quint32 k;
+  for (k = 0; k < n && stream.status() == QDataStream::Ok; ++k) {
+    KLFLatexSymbol sym;
+    SymbolInfo s;
+    double dpr;
+    stream >> sym >> s.dataoffset >> s.datasize >> dpr >> s.pixsize;
+    if (qAbs(dpr - d->device_pixel_ratio) > 0.01) {
+      klfDbg("skipping symbol "<<sym.symbol<<" generated for device pixel ratio "<<dpr) ;
+      continue;
+    }
+    cache[sym] = s;
+  }
+  if (stream.status() != QDataStream::Ok) {
+    klfWarning("Error reading symbols cache index") ;
+    return BadHeader;
+  }
+
+  // and get access to the image data, which follows the index
+  QIODevice *dev = stream.device();
+  qint64 start = dev->pos();
+  QFile *file = qobject_cast<QFile*>(dev);
+  uchar *mapped = NULL;
+  if (file != NULL && file->size() >= start)
+    mapped = file->map(start, file->size() - start);
+  if (mapped != NULL) {
+    klfDbg("mapped symbols cache file "<<file->fileName()) ;
+    d->setImageData(file, QByteArray(), mapped, file->size() - start);
+  } else {
+    QByteArray data = dev->readAll();
+    d->setImageData(NULL, data, reinterpret_cast<const uchar*>(data.constData()), data.size());
+  }
 
+  d->cache = cache;
   d->flag_modified = false;
   return 0;
 }
 
 int KLFLatexSymbolsCache::saveCacheStream(QDataStream& stream)
 {
-  klfDataStreamWriteHeader(stream, "KLATEXFORMULA_SYMBOLS_PIXMAP_CACHE");
+  klfDataStreamWriteHeader(stream, "KLATEXFORMULA_SYMBOLS_PIXMAP_CACHE_INDEXED");
   // stream is now ready to be written
-  stream << d->cache;
+
+  // images which haven't been decoded are written back as they are
+  QList<QByteArray> imgdatalist;
+  stream << (quint32)d->cache.size();
+  qint64 offset = 0;
+  for (QHash<KLFLatexSymbol,SymbolInfo>::const_iterator it = d->cache.begin();
+       it != d->cache.end(); ++it) {
+    const SymbolInfo& s = it.value();
+    QByteArray imgdata;
+    if (s.dataoffset >= 0) {
+      imgdata = QByteArray::fromRawData(reinterpret_cast<const char*>(d->imgdata) + s.dataoffset,
+					s.datasize);
+    } else if (!s.pix.isNull()) {
+      QBuffer buf(&imgdata);
+      buf.open(QIODevice::WriteOnly);
+      s.pix.save(&buf, "PNG");
+    }
+    stream << it.key() << offset << (qint32)imgdata.size() << (double)d->device_pixel_ratio
+	   << (s.dataoffset >= 0 ? s.pixsize : s.pix.size());
+    offset += imgdata.size();
+    imgdatalist << imgdata;
+  }
+  foreach (const QByteArray& imgdata, imgdatalist) {
+    stream.writeRawData(imgdata.constData(), imgdata.size());
+  }
+
   d->flag_modified = false;
   return 0;
 }
@@ -311,16 +394,29 @@ QPixmap KLFLatexSymbolsCache::getSymbolPixmap(const KLFLatexSymbol& sym)
   klfDbg("sym.symbol="<<sym.symbol) ;
   klfDbg("full symbol: "<<sym) ;
 
-  if (d->cache.contains(sym)) {
-    klfDbg("Found symbol in cache! pixmap is null="<<d->cache[sym].pix.isNull()
+  QHash<KLFLatexSymbol,SymbolInfo>::iterator it = d->cache.find(sym);
+  if (it != d->cache.end()) {
+    d->decodePixmap(&it.value());
+    klfDbg("Found symbol in cache! pixmap is null="<<it.value().pix.isNull()
 	   <<"; sym.preamble="<<sym.preamble.join(";"));
-    return QPixmap(d->cache[sym].pix);
+    return QPixmap(it.value().pix);
   }
 
   // if we weren't able to load it from cache, show failed icon
   return QPixmap(":/pics/badsym.png");
 }
 
+QSize KLFLatexSymbolsCache::symbolPixmapSize(const KLFLatexSymbol& sym)
+{
+  QHash<KLFLatexSymbol,SymbolInfo>::const_iterator it = d->cache.find(sym);
+  if (it != d->cache.end()) {
+    if (it.value().dataoffset >= 0)
+      return it.value().pixsize;
+    return it.value().pix.size();
+  }
+  return getSymbolPixmap(sym).size();
+}
+
 void KLFLatexSymbolsCache::setSymbolPixmap(const KLFLatexSymbol & sym, const QPixmap & pix)
 {
   klfDbg("sym.symbol="<<sym.symbol) ;
@@ -343,8 +439,11 @@ void KLFLatexSymbolsCache::setSymbolPixmap(const KLFLatexSymbol & sym, const QPi
     }
   }
 
-  d->cache[sym].pix = pix;
-  d->cache[sym].confirmed = true;
+  SymbolInfo& s = d->cache[sym];
+  s.pix = pix;
+  s.confirmed = true;
+  s.dataoffset = -1;
+  s.pixsize = pix.size();
 
   d->flag_modified = true;
 }
@@ -422,7 +521,9 @@ QPixmap KLFLatexSymbolsCache::findSymbolPixmap(const QString& symbolCode)
     return QPixmap();
   }
   // return the pixmap from cache
-  return d->cache[sym].pix;
+  SymbolInfo& s = d->cache[sym];
+  d->decodePixmap(&s);
+  return s.pix;
 }
 
 void KLFLatexSymbolsCache::debugDump()
@@ -433,11 +534,12 @@ void KLFLatexSymbolsCache::debugDump()
   int k;
   for (it = d->cache.begin(), k = 0; it != d->cache.end(); ++it, ++k) {
     const KLFLatexSymbol& s = it.key();
-    const QPixmap& p = it.value().pix;
-    qDebug("  #%4d  %s (%s)  prembl/sz=%d  txtmd=%s  hid=%s  pix/sz=(%d,%d) confirmed=%s", k,
+    QSize sz = (it.value().dataoffset >= 0) ? it.value().pixsize : it.value().pix.size();
+    qDebug("  #%4d  %s (%s)  prembl/sz=%d  txtmd=%s  hid=%s  pix/sz=(%d,%d) decoded=%s confirmed=%s", k,
 	   qPrintable(s.symbolWithArgs()), qPrintable(s.previewlatex),
 	   s.preamble.size(), s.textmode?"yes":"no", s.hidden?"yes":"no",
-	   p.width(), p.height(), it.value().confirmed?"yes":"no"
+	   sz.width(), sz.height(), (it.value().dataoffset < 0)?"yes":"no",
+	   it.value().confirmed?"yes":"no"
 	   );
   }
 #endif
@@ -450,21 +552,27 @@ void KLFLatexSymbolsCache::debugDump()
 // private
 int KLFLatexSymbolsCache::loadCacheFrom(const QString& fname, int version)
 {
-  QFile f(fname);
-  if ( ! f.open(QIODevice::ReadOnly) ) {
+  // the cache keeps the file open if it maps it into memory
+  QFile *f = new QFile(fname);
+  if ( ! f->open(QIODevice::ReadOnly) ) {
     klfDbg("Failed to open "<<fname) ;
+    delete f;
     return -1;
   }
-  QDataStream ds(&f);
+  QDataStream ds(f);
   if (version >= 0) {
     ds.setVersion(version);
   }
   int r = loadCacheStream(ds);
+  if (d->cachefile != f)
+    delete f;
   return r;
 }
 
 void KLFLatexSymbolsCache::loadKlfCache()
 {
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
   // load the klf cache
 
   QStringList cachefiles;
@@ -501,7 +609,13 @@ void KLFLatexSymbolsCache::saveCache(const QString & fname)
 
   if (cacheNeedsSave()) {
     // QString s = klfconfig.homeConfigDir + relcachefile();
-    QFile f(fname);
+    // the file we are about to replace may be the one which is mapped into memory; on some
+    // systems it can't be replaced then, so keep a copy of the image data instead
+    if (d->cachefile != NULL) {
+      QByteArray data(reinterpret_cast<const char*>(d->imgdata), d->imgdatasize);
+      d->setImageData(NULL, data, reinterpret_cast<const uchar*>(data.constData()), data.size());
+    }
+    QSaveFile f(fname);
     if ( ! f.open(QIODevice::WriteOnly) ) {
       klfWarning("Can't save cache to file " << fname);
       return;
@@ -509,6 +623,10 @@ void KLFLatexSymbolsCache::saveCache(const QString & fname)
     QDataStream ds(&f);
     ds.setVersion(QDataStream::Qt_4_4);
     saveCacheStream(ds);
+    if ( ! f.commit() ) {
+      klfWarning("Can't save cache to file " << fname);
+      return;
+    }
     klfDbg("Saved cache to file "<<fname);
   }
 }
@@ -516,6 +634,276 @@ void KLFLatexSymbolsCache::saveCache(const QString & fname)
 
 
 
+// -----------------------------------------------------------
+
+
+// The previews are rendered at this magnification, and then scaled down
+static const double klf_sympreview_mag = 8.0;
+
+// In a batch, each symbol is centered on its own page of this size, in postscript points. A
+// symbol which doesn't fit on its page is rendered on its own.
+static const int klf_sympreview_page_width = 216;
+static const int klf_sympreview_page_height = 108;
+
+// the name of the PNG file gs writes for the given page, see "-sOutputFile=" below
+static QString klf_sympreview_page_fname(const QString& tempfname, int page)
+{
+  return tempfname + QString("-%1.png").arg(page, 5, 10, QChar('0'));
+}
+
+
+bool KLFLatexSymbolPreviewsGenerator::interrupted()
+{
+  if ( QThread::currentThread()->isInterruptionRequested() ) {
+    klfDbg("thread was interrupted, returning") ;
+    QThread::currentThread()->quit();
+    return true;
+  }
+  return false;
+}
+
+void KLFLatexSymbolPreviewsGenerator::symbolDone(const KLFLatexSymbol & sym, const QPixmap & pixmap)
+{
+  emit previewGenerated(sym, pixmap);
+  ++pNumDone;
+  emit progress(pNumDone * 100 / qMax(1, pNumTotal)) ;
+}
+
+void KLFLatexSymbolPreviewsGenerator::generatePreviewList(const QList<KLFLatexSymbol> & list)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  emit started();
+
+  pNumDone = 0;
+  pNumTotal = list.size();
+
+  // group the symbols by preamble, keeping the order in which the preambles first appear
+  QStringList preambles;
+  QHash<QString, QList<KLFLatexSymbol> > groups;
+  foreach (const KLFLatexSymbol & sym, list) {
+    if (sym.hidden) {
+      // special treatment for hidden symbols
+      // insert a QPixmap() into cache and return it
+      klfDbg("symbol is hidden. Assigning NULL pixmap.") ;
+      symbolDone(sym, QPixmap());
+      continue;
+    }
+    QString preamble = sym.preamble.join("\n");
+    if (!groups.contains(preamble))
+      preambles << preamble;
+    groups[preamble].append(sym);
+  }
+
+  foreach (const QString & preamble, preambles) {
+    if (interrupted())
+      return;
+
+    const QList<KLFLatexSymbol> & group = groups[preamble];
+    QList<KLFLatexSymbol> remaining;
+    if (group.size() > 1) {
+      generateBatch(group, &remaining);
+    } else {
+      remaining = group;
+    }
+
+    // render those symbols for which the batch failed one by one
+    foreach (const KLFLatexSymbol & sym, remaining) {
+      if (interrupted())
+        return;
+      generateSingle(sym);
+    }
+  }
+
+  if (interrupted())
+    return;
+
+  emit finished();
+}
+
+void KLFLatexSymbolPreviewsGenerator::generateBatch(const QList<KLFLatexSymbol> & group,
+                                                    QList<KLFLatexSymbol> * remaining)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  const KLFBackend::klfSettings & settings = pBackendSettings;
+  const int dpi = (int)(klf_sympreview_mag * 150 * pDevicePixelRatio);
+
+  klfDbg("rendering "<<group.size()<<" symbols in one batch, preamble="<<group[0].preamble) ;
+
+  if (settings.latexexec.isEmpty() || settings.dvipsexec.isEmpty() || settings.gsexec.isEmpty()) {
+    *remaining << group;
+    return;
+  }
+
+  QTemporaryDir tempdir(settings.tempdir + "/klfsymbols-XXXXXX");
+  if (!tempdir.isValid()) {
+    klfWarning("Can't create temporary directory in " << settings.tempdir) ;
+    *remaining << group;
+    return;
+  }
+  QString tempfname = tempdir.path() + "/klfsymbols";
+  QString fnTex = tempfname + ".tex";
+  QString fnDvi = tempfname + ".dvi";
+  QString fnPs = tempfname + ".ps";
+
+  // generate the LaTeX document, with one symbol per page, each one centered on a page of
+  // fixed size
+  {
+    QFile file(fnTex);
+    if ( ! file.open(QIODevice::WriteOnly) ) {
+      klfWarning("Can't open file for writing: " << fnTex) ;
+      *remaining << group;
+      return;
+    }
+    QTextStream stream(&file);
+    stream << "\\documentclass{article}\n"
+      "\\usepackage[dvips]{color}\n"
+	   << group[0].preamble.join("\n") << "\n"
+	   << QString("\\setlength{\\paperwidth}{%1bp}\\setlength{\\paperheight}{%2bp}\n"
+		      "\\setlength{\\textwidth}{%1bp}\\setlength{\\textheight}{%2bp}\n")
+      .arg(klf_sympreview_page_width).arg(klf_sympreview_page_height)
+	   << "\\setlength{\\hoffset}{-1in}\\setlength{\\voffset}{-1in}\n"
+      "\\setlength{\\oddsidemargin}{0pt}\\setlength{\\evensidemargin}{0pt}\n"
+      "\\setlength{\\topmargin}{0pt}\\setlength{\\headheight}{0pt}\\setlength{\\headsep}{0pt}\n"
+      "\\setlength{\\footskip}{0pt}\\setlength{\\parindent}{0pt}\n"
+      "\\begin{document}\n"
+      "\\pagestyle{empty}\n"
+	   << QString("\\special{papersize=%1bp,%2bp}%\n")
+      .arg(klf_sympreview_page_width).arg(klf_sympreview_page_height);
+    foreach (const KLFLatexSymbol & sym, group) {
+      // same as KLFBackend::DefaultTemplateGenerator
+      QString latexin = sym.textmode ? QString("...") : QString("\\[ ... \\]");
+      latexin.replace("...", sym.latexCodeForPreview() + "%\n");
+      stream << "\\vbox to\\textheight{\\vfil\\parbox{\\textwidth}{\\centering " << latexin
+	     << "}\\vfil}\\newpage\n";
+    }
+    stream << "\\end{document}\n";
+  }
+
+  // latex, dvips and gs each run once for the whole batch
+  {
+    KLFFilterProcess p(QLatin1String("LaTeX"), &settings, tempdir.path(), true);
+    p.setProcessAppEvents(false);
+    // stop at the first error: a symbol which doesn't compile would otherwise shift the pages
+    // of all the following symbols
+    p.setArgv(QStringList() << settings.latexexec << "-interaction=nonstopmode" << "-halt-on-error"
+	      << QDir::toNativeSeparators(fnTex));
+    if (!p.run(QByteArray(), fnDvi, NULL)) {
+      klfDbg("latex failed, rendering symbols one by one: " << p.resultErrorString()) ;
+      *remaining << group;
+      return;
+    }
+  }
+  {
+    KLFFilterProcess p(QLatin1String("dvips"), &settings, tempdir.path(), true);
+    p.setProcessAppEvents(false);
+    p.setArgv(QStringList() << settings.dvipsexec << QDir::toNativeSeparators(fnDvi)
+	      << "-o" << QDir::toNativeSeparators(fnPs));
+    if (!p.run(fnPs, NULL)) {
+      klfWarning("dvips failed: " << p.resultErrorString()) ;
+      *remaining << group;
+      return;
+    }
+  }
+  {
+    KLFFilterProcess p(QLatin1String("gs (PNG)"), &settings, tempdir.path(), true);
+    p.setProcessAppEvents(false);
+    p.setArgv(QStringList() << settings.gsexec
+	      << "-dNOPAUSE" << "-dSAFER" << "-dTextAlphaBits=4" << "-dGraphicsAlphaBits=4"
+	      << "-r"+QString::number(dpi)
+	      << "-dDEVICEWIDTHPOINTS="+QString::number(klf_sympreview_page_width)
+	      << "-dDEVICEHEIGHTPOINTS="+QString::number(klf_sympreview_page_height)
+	      << "-dFIXEDMEDIA" << "-sDEVICE=pngalpha"
+	      << "-sOutputFile="+QDir::toNativeSeparators(tempfname + "-%05d.png") << "-q" << "-dBATCH"
+	      << QDir::toNativeSeparators(fnPs));
+    if (!p.run(klf_sympreview_page_fname(tempfname, 1), NULL)) {
+      klfWarning("gs failed: " << p.resultErrorString()) ;
+      *remaining << group;
+      return;
+    }
+  }
+
+  // each symbol must have given exactly one page, otherwise we can't tell which page belongs
+  // to which symbol
+  if ( ! QFile::exists(klf_sympreview_page_fname(tempfname, group.size())) ||
+       QFile::exists(klf_sympreview_page_fname(tempfname, group.size()+1)) ) {
+    klfWarning("Batch of " << group.size() << " symbols didn't give as many pages, "
+	       "rendering them one by one") ;
+    *remaining << group;
+    return;
+  }
+
+  // now split the pages back into the individual symbols
+  const double pxperpt = dpi / 72.0;
+  for (int i = 0; i < group.size(); ++i) {
+    if ( QThread::currentThread()->isInterruptionRequested() )
+      return; // generatePreviewList() will notice
+
+    const KLFLatexSymbol & sym = group[i];
+
+    QImage page(klf_sympreview_page_fname(tempfname, i+1), "PNG");
+    QRect rect;
+    if (!page.isNull())
+      rect = klfImageOpaqueRect(page);
+    if (rect.isNull() || rect.left() == 0 || rect.top() == 0 ||
+	rect.right() == page.width()-1 || rect.bottom() == page.height()-1) {
+      // missing page, nothing drawn or possibly clipped by the page boundary
+      klfDbg("can't get symbol "<<sym.symbol<<" from batch, will render it on its own") ;
+      remaining->append(sym);
+      continue;
+    }
+    // parts of the image outside the page are transparent
+    rect.adjust(-qRound(sym.bbexpand.l * pxperpt), -qRound(sym.bbexpand.t * pxperpt),
+		qRound(sym.bbexpand.r * pxperpt), qRound(sym.bbexpand.b * pxperpt));
+    QImage img = page.copy(rect);
+
+    QImage scaled = img.scaled((int)(img.width() / klf_sympreview_mag),
+			       (int)(img.height() / klf_sympreview_mag),
+			       Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    klfDbg("got pixmap for symbol "<<sym.symbol<<" from batch.") ;
+
+    symbolDone(sym, QPixmap::fromImage(scaled));
+  }
+}
+
+void KLFLatexSymbolPreviewsGenerator::generateSingle(const KLFLatexSymbol & sym)
+{
+  klfDbg("generating preview for symbol "<<sym.symbol) ;
+
+  KLFBackend::klfInput in;
+  in.latex = sym.latexCodeForPreview();
+  in.mathmode = sym.textmode ? "..." : "\\[ ... \\]";
+  in.preamble = sym.preamble.join("\n")+"\n";
+  in.fg_color = qRgb(0,0,0);
+  in.bg_color = qRgba(255,255,255,0); // transparent Bg
+  in.dpi = (int)(klf_sympreview_mag * 150 * pDevicePixelRatio);
+
+  pBackendSettings.epstopdfexec = ""; // don't waste time making PDF, we don't need it
+  pBackendSettings.tborderoffset = sym.bbexpand.t;
+  pBackendSettings.rborderoffset = sym.bbexpand.r;
+  pBackendSettings.bborderoffset = sym.bbexpand.b;
+  pBackendSettings.lborderoffset = sym.bbexpand.l;
+
+  KLFBackend::klfOutput out = KLFBackend::getLatexFormula(in, pBackendSettings);
+
+  if (out.status != 0) {
+    klfWarning("Can't generate preview for symbol " << sym.symbol << " : status " << out.status << "!"
+	       << "\n\tError: " << out.errorstr) ;
+    ++pNumDone;
+    return;
+  }
+  klfDbg("successfully got pixmap for symbol "<<sym.symbol<<".") ;
+
+  QImage scaled = out.result.scaled((int)(out.result.width() / klf_sympreview_mag),
+				    (int)(out.result.height() / klf_sympreview_mag),
+				    Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+  symbolDone(sym, QPixmap::fromImage(scaled));
+}
+
+
+
+
 // -----------------------------------------------------------
 
 
@@ -541,6 +929,9 @@ KLFLatexSymbolsView::KLFLatexSymbolsView(const QString& category, QWidget *paren
   mLayout = 0;
   mSpacerItem = 0;
 
+  mCache = NULL;
+  mPixmapsPending = false;
+
   setWidget(mFrame);
 }
 
@@ -571,8 +962,9 @@ void KLFLatexSymbolsView::buildDisplay(KLFLatexSymbolsCache * cache)
   mLayout = new QGridLayout(mFrame);
   int i, k;
   for (i = 0; i < _symbols.size(); ++i) {
-    QPixmap p = cache->getSymbolPixmap(_symbols[i]);
-    KLFPixmapButton *btn = new KLFPixmapButton(p, mFrame);
+    // the pixmap itself is only set in loadPixmaps()
+    QSize pixsize = cache->symbolPixmapSize(_symbols[i]);
+    KLFPixmapButton *btn = new KLFPixmapButton(QPixmap(), mFrame);
 #ifdef KLF_WS_MAC
     btn->setStyle(buttonstyle);
 //    btn->setPalette(pal);
@@ -581,7 +973,7 @@ void KLFLatexSymbolsView::buildDisplay(KLFLatexSymbolsCache * cache)
     btn->setProperty("symbol", QVariant::fromValue<int>(i));
     btn->setProperty("gridpos", QPoint(-1,-1));
     btn->setProperty("gridcolspan", -1);
-    btn->setProperty("myWidth", p.width() + 4);
+    btn->setProperty("myWidth", pixsize.width() + 4);
     QString symcode = _symbols[i].symbol;
     if (_symbols[i].symbol_option) {
       symcode += "[]";
@@ -616,10 +1008,40 @@ void KLFLatexSymbolsView::buildDisplay(KLFLatexSymbolsCache * cache)
     connect(btn, SIGNAL(clicked()), this, SLOT(slotSymbolActivated()));
     mSymbols.append(btn);
   }
+  mCache = cache;
+  mPixmapsPending = true;
+  if (isVisible())
+    loadPixmaps();
   mSpacerItem = new QSpacerItem(1, 1, QSizePolicy::Fixed, QSizePolicy::Expanding);
   recalcLayout();
 }
 
+void KLFLatexSymbolsView::loadPixmaps()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  mPixmapsPending = false;
+  int i;
+  for (i = 0; i < mSymbols.size(); ++i) {
+    KLFPixmapButton *btn = qobject_cast<KLFPixmapButton*>(mSymbols[i]);
+    if (btn == NULL)
+      continue;
+    int symIndex = btn->property("symbol").toInt();
+    if (symIndex < 0 || symIndex >= _symbols.size())
+      continue;
+    btn->setPixmap(mCache->getSymbolPixmap(_symbols[symIndex]));
+    btn->updateGeometry();
+  }
+}
+
+void KLFLatexSymbolsView::showEvent(QShowEvent *event)
+{
+  // decode the pixmaps of this category only once it is shown
+  if (mPixmapsPending)
+    loadPixmaps();
+  QScrollArea::showEvent(event);
+}
+
 void KLFLatexSymbolsView::recalcLayout()
 {
   int row = 0, col = 0, colspan;
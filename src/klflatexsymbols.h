@@ -120,6 +120,8 @@ public:
 
   QPixmap findSymbolPixmap(const QString& symbolCode);
   QPixmap getSymbolPixmap(const KLFLatexSymbol& sym);
+  /** The size of the pixmap getSymbolPixmap() returns, without having to decode it. */
+  QSize symbolPixmapSize(const KLFLatexSymbol& sym);
 
   bool cacheNeedsSave() const;
 
@@ -176,12 +178,19 @@ protected:
   QString _category;
   QList<KLFLatexSymbol> _symbols;
 
+  virtual void showEvent(QShowEvent *event);
+
 private:
   QWidget *mFrame;
   QGridLayout *mLayout;
   QSpacerItem *mSpacerItem;
   QList<QWidget*> mSymbols;
 
+  /** The symbol pixmaps are only decoded when the view is first shown */
+  KLFLatexSymbolsCache *mCache;
+  bool mPixmapsPending;
+  void loadPixmaps();
+
   friend class KLFLatexSymbolsSearchable;
 
   bool symbolMatches(int symbol, const QString& qs);
@@ -34,6 +34,7 @@
 #include <QThread>
 #include <QToolTip>
 #include <QScrollBar>
+#include <QFile>
 
 #include <klfsearchbar.h>
 
@@ -45,11 +46,19 @@
 
 struct SymbolInfo
 {
-  SymbolInfo() : pix(), confirmed(false) { }
+  SymbolInfo() : pix(), confirmed(false), dataoffset(-1), datasize(0), pixsize() { }
   
   QPixmap pix;
   //! Whether this symbol was specified in the config (true) or was only in cache previously (false)
   bool confirmed;
+
+  /** For a symbol read from an indexed cache file whose image wasn't decoded yet, the position
+   * of the (PNG) image data relative to the start of the image data in the file. -1 if \c pix
+   * holds the image. */
+  qint64 dataoffset;
+  qint32 datasize;
+  //! The size of the image, known before it is decoded
+  QSize pixsize;
 };
 
 struct KLFLatexSymbolsCachePrivate
@@ -58,6 +67,13 @@ struct KLFLatexSymbolsCachePrivate
   {
     flag_modified = false;
     device_pixel_ratio = 1.0;
+    cachefile = NULL;
+    imgdata = NULL;
+    imgdatasize = 0;
+  }
+  ~KLFLatexSymbolsCachePrivate()
+  {
+    delete cachefile;
   }
 
   QHash<KLFLatexSymbol,SymbolInfo> cache;
@@ -66,6 +82,40 @@ struct KLFLatexSymbolsCachePrivate
 
   qreal device_pixel_ratio;
 
+  /** The image data of the indexed cache file the symbols were read from. It points into the
+   * file mapped into memory, or into \c cachefiledata if the file couldn't be mapped. */
+  const uchar *imgdata;
+  qint64 imgdatasize;
+  QFile *cachefile;
+  QByteArray cachefiledata;
+
+  void setImageData(QFile *file, const QByteArray& data, const uchar *p, qint64 size)
+  {
+    if (file != cachefile) {
+      delete cachefile;
+      cachefile = file;
+    }
+    cachefiledata = data;
+    imgdata = p;
+    imgdatasize = size;
+  }
+
+  //! Decodes the image of \c s if it wasn't done yet
+  void decodePixmap(SymbolInfo *s)
+  {
+    if (s->dataoffset < 0)
+      return;
+    s->pix = QPixmap();
+    if (s->datasize > 0) {
+      if (s->dataoffset + s->datasize <= imgdatasize) {
+        s->pix.loadFromData(imgdata + s->dataoffset, s->datasize, "PNG");
+      } else {
+        klfWarning("Invalid image data position in symbols cache: "<<s->dataoffset) ;
+      }
+    }
+    s->dataoffset = -1;
+  }
+
   QString klf_cache_file_name() const
   {
     QString variant;
@@ -82,17 +132,15 @@ struct KLFLatexSymbolsCachePrivate
   }
 };
 
-// WARNING: Does NOT write s.confirmed (!)
-inline QDataStream& operator<<(QDataStream& stream, const SymbolInfo& s)
-{
-  return stream << s.pix;
-}
-
+// Reads a symbol of the old (non-indexed) cache format.
 // WARNING: Does NOT read s.confirmed (!), sets to false.
 inline QDataStream& operator>>(QDataStream& stream, SymbolInfo& s)
 {
   s.confirmed = false;
-  return stream >> s.pix;
+  s.dataoffset = -1;
+  stream >> s.pix;
+  s.pixsize = s.pix.size();
+  return stream;
 }
 
 
@@ -322,7 +370,7 @@ class KLFLatexSymbolPreviewsGenerator : public QObject
   Q_OBJECT
 public:
   KLFLatexSymbolPreviewsGenerator(QObject * parent = NULL)
-    : QObject(parent), pBackendSettings(), pDevicePixelRatio(1.0)
+    : QObject(parent), pBackendSettings(), pDevicePixelRatio(1.0), pNumDone(0), pNumTotal(0)
   {
   }
 
@@ -340,6 +388,19 @@ private:
   KLFBackend::klfSettings pBackendSettings;
   qreal pDevicePixelRatio;
 
+  int pNumDone;
+  int pNumTotal;
+
+  bool interrupted();
+  void symbolDone(const KLFLatexSymbol & sym, const QPixmap & pixmap);
+
+  /** Renders all symbols of \c group (which share the same preamble) in a single multi-page
+   * LaTeX document. Symbols which could not be rendered this way are appended to \c
+   * remaining. */
+  void generateBatch(const QList<KLFLatexSymbol> & group, QList<KLFLatexSymbol> * remaining);
+  /** Renders a single symbol with KLFBackend::getLatexFormula(). */
+  void generateSingle(const KLFLatexSymbol & sym);
+
 signals:
   void progress(int percent) ;
 
@@ -349,71 +410,7 @@ signals:
   void finished();
 
 public slots:
-  void generatePreviewList(const QList<KLFLatexSymbol> & list)
-  {
-    KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-
-    emit started();
-
-    for (int i = 0; i < list.size(); ++i) {
-
-      klfDbg("generating preview for symbol #"<<i<<": "<<list[i].symbol) ;
-
-      if ( QThread::currentThread()->isInterruptionRequested() ) {
-        klfDbg("thread was interrupted, returning") ; 
-        QThread::currentThread()->quit();
-        return;
-      }
-
-      emit progress(i * 100 / list.size()) ;
-
-      const KLFLatexSymbol & sym = list[i];
-
-      if (sym.hidden) {
-        // special treatment for hidden symbols
-        // insert a QPixmap() into cache and return it
-        klfDbg("symbol is hidden. Assigning NULL pixmap.") ;
-        emit previewGenerated(sym, QPixmap());
-        continue;
-      }
-
-      const double mag = 8.0;
-      
-      KLFBackend::klfInput in;
-      in.latex = sym.latexCodeForPreview();
-      in.mathmode = sym.textmode ? "..." : "\\[ ... \\]";
-      in.preamble = sym.preamble.join("\n")+"\n";
-      in.fg_color = qRgb(0,0,0);
-      in.bg_color = qRgba(255,255,255,0); // transparent Bg
-      in.dpi = (int)(mag * 150 * pDevicePixelRatio);
-      
-      pBackendSettings.epstopdfexec = ""; // don't waste time making PDF, we don't need it
-      pBackendSettings.tborderoffset = sym.bbexpand.t;
-      pBackendSettings.rborderoffset = sym.bbexpand.r;
-      pBackendSettings.bborderoffset = sym.bbexpand.b;
-      pBackendSettings.lborderoffset = sym.bbexpand.l;
-      
-      KLFBackend::klfOutput out = KLFBackend::getLatexFormula(in, pBackendSettings);
-
-      if (out.status != 0) {
-        klfWarning("Can't generate preview for symbol " << sym.symbol << " : status " << out.status << "!"
-                   << "\n\tError: " << out.errorstr) ;
-        continue;
-      }
-      klfDbg("successfully got pixmap for symbol "<<sym.symbol<<".") ;
-
-      QImage scaled = out.result.scaled((int)(out.result.width() / mag),
-                                        (int)(out.result.height() / mag),
-                                        Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-      QPixmap pix = QPixmap::fromImage(scaled);
-      klfDbg("Ran getLatexFormula() to get the pixmap, adding to list.") ;
-
-      emit previewGenerated(sym, pix);
-
-    }
-
-    emit finished();
-  }
+  void generatePreviewList(const QList<KLFLatexSymbol> & list);
 };
 
 
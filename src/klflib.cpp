@@ -424,10 +424,16 @@ KLFLibResourceEngine::KLFLibResourceEngine(const QUrl& url, uint featureflags,
 					   QObject *parent)
   : QObject(parent), KLFPropertizedObject("KLFLibResourceEngine"), pUrl(url),
     pFeatureFlags(featureflags), pReadOnly(false), pDefaultSubResource(QString()),
-    pProgressBlocked(false), pThisOperationProgressBlockedOnly(false)
+    pProgressBlocked(false), pThisOperationProgressBlockedOnly(false), pLastQueryId(0)
 {
   initRegisteredProperties();
 
+  // needed to report query results across threads, see startQuery()
+  if (QMetaType::type("QList<KLFLibResourceEngine::KLFLibEntryWithId>") == 0) {
+    qRegisterMetaType< QList<KLFLibResourceEngine::KLFLibEntryWithId> >
+      /* */ ("QList<KLFLibResourceEngine::KLFLibEntryWithId>");
+  }
+
   //  klfDbg( "KLFLibResourceEngine::KLFLibResourceEngine("<<url<<","<<pFeatureFlags<<","
   //	  <<parent<<")" ) ;
 
@@ -679,6 +685,33 @@ bool KLFLibResourceEngine::thisOperationProgressBlocked() const
 }
 
 
+int KLFLibResourceEngine::startQuery(const QString& subResource, const Query& query)
+{
+  int queryId = newQueryId();
+  pPendingQueries[queryId] = QPair<QString,Query>(subResource, query);
+  QMetaObject::invokeMethod(this, "runPendingQuery", Qt::QueuedConnection, Q_ARG(int, queryId));
+  return queryId;
+}
+
+void KLFLibResourceEngine::cancelQuery(int queryId)
+{
+  pPendingQueries.remove(queryId);
+}
+
+void KLFLibResourceEngine::runPendingQuery(int queryId)
+{
+  if (!pPendingQueries.contains(queryId))
+    return; // cancelled
+  QPair<QString,Query> pq = pPendingQueries.take(queryId);
+
+  QueryResult result(QueryResult::FillEntryWithIdList);
+  int count = query(pq.first, pq.second, &result);
+  if (count > 0)
+    emit queryResultsAvailable(queryId, result.entryWithIdList);
+  emit queryFinished(queryId, count);
+}
+
+
 KLFLibResourceEngine::entryId KLFLibResourceEngine::insertEntry(const QString& subResource,
 								const KLFLibEntry& entry)
 {
@@ -992,12 +1025,29 @@ int KLFLibResourceSimpleEngine::queryImpl(KLFLibResourceEngine *resource, const
   KLFLibEntrySorter sorter(query.orderPropId, query.orderDirection);
   QueryResultListSorter lsorter(&sorter, result);
 
+  // the entry after which results start, see Query::afterId
+  KLFLibEntry afterentry;
+  if (query.afterId != -1 && sorter.isValid())
+    afterentry.setEntryProperty(afterentry.propertyNameForId(query.orderPropId), query.afterOrderValue);
+  const bool afterdesc = (sorter.isValid() && query.orderDirection == Qt::DescendingOrder);
+
   // we first need to order _all_ the entries (yes, since the order of allEntries()
   // is undefined ... and limit/skip refer to _ordered_ entry list...)
   int k;
   for (k = 0; k < allEList.size(); ++k) {
     // test match condition
     const KLFLibEntryWithId& ewid = allEList[k];
+    if (query.afterId != -1) {
+      bool isafter;
+      if (sorter.isValid() && sorter(afterentry, ewid.entry))
+	isafter = true;
+      else if (sorter.isValid() && sorter(ewid.entry, afterentry))
+	isafter = false;
+      else // same ordering value (or no ordering)
+	isafter = afterdesc ? (ewid.id < query.afterId) : (ewid.id > query.afterId);
+      if (!isafter)
+	continue;
+    }
     if (testEntryMatchConditionImpl(query.matchCondition, ewid.entry)) {
       lsorter.insertIntoOrderedResult(ewid);
     }
@@ -929,6 +929,14 @@ public:
    * \c wantedEntryProperties set. The other properties are undefined (some implementations may decide
    * to ignore this optimization). An empty list (which is the default) indicates that all entry
    * properties have to be set.
+   *
+   * \c afterId and \c afterOrderValue allow to fetch results page by page without having the
+   * engine go through all the previous pages again (as \c skip would). If \c afterId is not \c -1,
+   * only the entries which come after the entry with ID \c afterId are returned, where that entry
+   * has the value \c afterOrderValue for the property \c orderPropId. Entries with equal values of
+   * \c orderPropId are ordered by ID (in the direction given by \c orderDirection). Typically, one
+   * sets these to the ID and to the ordering property value of the last entry of the previous
+   * page. \c skip is applied after this condition. Default: \c -1 (no condition).
    */
   struct Query
   {
@@ -939,7 +947,9 @@ public:
 	limit(-1),
 	orderPropId(-1),
 	orderDirection(Qt::AscendingOrder),
-	wantedEntryProperties(QList<int>())
+	wantedEntryProperties(QList<int>()),
+	afterId(-1),
+	afterOrderValue()
     {
     }
 
@@ -949,6 +959,8 @@ public:
     int orderPropId;
     Qt::SortOrder orderDirection;
     QList<int> wantedEntryProperties;
+    KLFLib::entryId afterId;
+    QVariant afterOrderValue;
   };
 
   /** \brief A structure that will hold the result of a query() query.
@@ -1035,6 +1047,27 @@ public:
    */
   virtual int query(const QString& subResource, const Query& query, QueryResult *result) = 0;
 
+  //! Start an asynchronous query
+  /** Same as \ref query(), except that this function returns immediately. The results are
+   * reported, possibly in several batches, by the \ref queryResultsAvailable() signal, and the
+   * end of the query is notified by \ref queryFinished().
+   *
+   * \returns an ID for this query, which is passed to the above signals and which may be given
+   *   to \ref cancelQuery().
+   *
+   * The default implementation runs \ref query() when control returns to the event loop, and
+   * reports all results in one batch. Subclasses may reimplement this function to run the
+   * query in another thread (see for example KLFLibDBEngine).
+   */
+  virtual int startQuery(const QString& subResource, const Query& query);
+
+  //! Cancel an asynchronous query
+  /** Cancels a query started with \ref startQuery(). Once this function returns, no more
+   * signals are emitted for the query \c queryId (not even \ref queryFinished()). Cancelling a
+   * query which has already finished has no effect.
+   */
+  virtual void cancelQuery(int queryId);
+
 
   /** \brief List all distinct values that a property takes in all entries
    *
@@ -1124,6 +1157,16 @@ signals:
   void dataChanged(const QString& subResource, int modificationType,
 		   const QList<KLFLib::entryId>& entryIdList);
 
+  //! Emitted when results of a query started with \ref startQuery() are available
+  /** The entries are in the requested order, and each batch follows the previous one. Only the
+   * \c wantedEntryProperties of the query are guaranteed to be set in the entries. */
+  void queryResultsAvailable(int queryId, const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries);
+
+  //! Emitted when a query started with \ref startQuery() has finished
+  /** \c count is the total number of entries reported for this query, or \c -1 if an error
+   * occurred. */
+  void queryFinished(int queryId, int count);
+
   //! Emitted when the default sub-resource changes.
   void defaultSubResourceChanged(const QString& newDefaultSubResource);
   
@@ -1541,9 +1584,19 @@ protected:
 
   bool thisOperationProgressBlocked() const;
 
+  //! A new ID for an asynchronous query, see \ref startQuery()
+  int newQueryId() { return ++pLastQueryId; }
+
+private slots:
+  void runPendingQuery(int queryId);
+
 private:
   void initRegisteredProperties();
 
+  int pLastQueryId;
+  /** queries started with the default implementation of startQuery() which have not yet run */
+  QMap<int, QPair<QString,Query> > pPendingQueries;
+
   QUrl pUrl;
   uint pFeatureFlags;
   bool pReadOnly;
@@ -45,6 +45,7 @@
 #include "klflibbrowser.h"
 #include <ui_klflibbrowser.h>
 #include "klfliblegacyengine.h"
+#include "klflibdbengine.h"
 
 
 KLFLibBrowser::KLFLibBrowser(QWidget *parent)
@@ -75,6 +76,10 @@ KLFLibBrowser::KLFLibBrowser(QWidget *parent)
   klfconfig.LibraryBrowser.colorFound.connectQObjectProperty(u->searchBar, "colorFound");
   klfconfig.LibraryBrowser.colorNotFound.connectQObjectProperty(u->searchBar, "colorNotFound");
 
+  KLFLibDBEngine::setDefaultBatchSize(klfconfig.LibraryBrowser.dbTransactionBatchSize);
+  KLFLibDBEngine::setDefaultUsePreviewTable(klfconfig.LibraryBrowser.dbPreviewTable);
+  KLFLibDBEngine::setDefaultUpgradeIndexes(klfconfig.LibraryBrowser.dbUpgradeIndexes);
+
   pResourceMenu = new QMenu(u->tabResources);
   // connect actions
   connect(u->aRename, SIGNAL(triggered()), this, SLOT(slotResourceRename()));
@@ -35,6 +35,8 @@
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QSqlError>
+#include <QSqlDriver>
+#include <QThreadPool>
 
 #include <klfguiutil.h>
 #include "klflib.h"
@@ -281,6 +283,7 @@ KLFLibDBEngine::KLFLibDBEngine(const QSqlDatabase& db, bool autodisconnect,
 			 |FeatureSubResourceProps, parent)
 {
   pAutoDisconnectDB = autodisconnect;
+  pBatchSize = pDefaultBatchSize;
 
   // load some read-only properties in memory (these are NOT stored in the DB)
   KLFPropertizedObject::doSetProperty(PropAccessShared, accessshared);
@@ -291,8 +294,9 @@ KLFLibDBEngine::KLFLibDBEngine(const QSqlDatabase& db, bool autodisconnect,
   readDbMetaInfo();
   QStringList subres = subResourceList();
   int k;
-  for (k = 0; k < subres.size(); ++k)
+  for (k = 0; k < subres.size(); ++k) {
     readAvailColumns(subres[k]);
+  }
 
   KLFLibDBEnginePropertyChangeNotifier *dbNotifier = dbPropertyNotifierInstance(db.connectionName());
   connect(dbNotifier, SIGNAL(resourcePropertyChanged(int)),
@@ -305,6 +309,12 @@ KLFLibDBEngine::KLFLibDBEngine(const QSqlDatabase& db, bool autodisconnect,
 
 KLFLibDBEngine::~KLFLibDBEngine()
 {
+  // running queries use their own connection, they just need to stop
+  foreach (QPointer<KLFLibDBQueryJob> job, pQueryJobs) {
+    if (job != NULL)
+      job->cancel();
+  }
+
   pDBConnectionName = pDB.connectionName();
   KLFLibDBEnginePropertyChangeNotifier *dbNotifier = dbPropertyNotifierInstance(pDBConnectionName);
   if (dbNotifier->deRef() && pAutoDisconnectDB) {
@@ -334,6 +344,32 @@ QString KLFLibDBEngine::quotedDataTableName(const QString& subResource)
   dtname.replace('"', "\"\"");
   return '"' + dtname + '"';
 }
+// static
+QString KLFLibDBEngine::previewTableName(const QString& subResource)
+{
+  // must not start with "t_", see subResourceList()
+  return "prev_"+subResource.toLower();
+}
+// static
+QString KLFLibDBEngine::quotedPreviewTableName(const QString& subResource)
+{
+  QString name = previewTableName(subResource);
+  name.replace('"', "\"\"");
+  return '"' + name + '"';
+}
+// static
+QString KLFLibDBEngine::ftsTableName(const QString& subResource)
+{
+  // must not start with "t_", see subResourceList()
+  return "fts_"+subResource.toLower();
+}
+// static
+QString KLFLibDBEngine::quotedFtsTableName(const QString& subResource)
+{
+  QString name = ftsTableName(subResource);
+  name.replace('"', "\"\"");
+  return '"' + name + '"';
+}
 
 
 uint KLFLibDBEngine::compareUrlTo(const QUrl& other, uint interestFlags) const
@@ -466,6 +502,37 @@ void KLFLibDBEngine::readResourceProperty(int propId)
   }
 }
 
+static bool exec_sql_list(QSqlDatabase db, const QStringList& sql)
+{
+  int k;
+  for (k = 0; k < sql.size(); ++k) {
+    QSqlQuery query(db);
+    query.prepare(sql[k]);
+    bool r = query.exec();
+    if ( !r || query.lastError().isValid() ) {
+      klfDbg("SQL Error: "<<query.lastError().text()<<"; SQL="<<sql[k]) ;
+      return false;
+    }
+  }
+  return true;
+}
+
+// whether this SQLite library was built with FTS5 and has the trigram tokenizer (>= 3.34).
+// All connections use the same SQLite library, so only find out once.
+static bool sqlite_has_fts5_trigram(QSqlDatabase db)
+{
+  static int available = -1;
+  if (available < 0) {
+    bool ok = exec_sql_list(db, QStringList()
+			    << "CREATE VIRTUAL TABLE temp.klf_fts_probe USING fts5(x, tokenize='trigram')"
+			    << "DROP TABLE temp.klf_fts_probe");
+    klfDbg("FTS5 with trigram tokenizer available: "<<ok) ;
+    available = ok ? 1 : 0;
+  }
+  return available == 1;
+}
+
+
 void KLFLibDBEngine::readDbMetaInfo()
 {
   QSqlQuery q = QSqlQuery(pDB);
@@ -492,6 +559,10 @@ void KLFLibDBEngine::readAvailColumns(const QString& subResource)
     columns << rec.fieldName(k);
 
   pDBAvailColumns[subResource] = columns;
+  // without FTS5, matches are looked up with LIKE in the data table
+  pDBHasFtsIndex[subResource] = pDB.tables().contains(ftsTableName(subResource), Qt::CaseInsensitive)
+    && sqlite_has_fts5_trigram(pDB);
+  pDBHasPreviewTable[subResource] = pDB.tables().contains(previewTableName(subResource), Qt::CaseInsensitive);
 }
 
 
@@ -511,14 +582,28 @@ QStringList KLFLibDBEngine::columnNameList(const QString& subResource, const QLi
       cols << "Preview";
   }
   if (entryPropList.size() == 0) {
-    cols << "*";
+    if (pDBHasPreviewTable.value(subResource, false)) {
+      cols << pDBAvailColumns[subResource];
+      cols.removeAll("id");
+    } else {
+      cols << "*";
+    }
+  }
+  // previews are read from the preview table if there is one. We leave the Preview column of
+  // the data table NULL, so a preview there was written by a version which doesn't know about
+  // preview tables, more recently than ours.
+  if (pDBHasPreviewTable.value(subResource, false)) {
+    int i = cols.indexOf("Preview");
+    if (i >= 0)
+      cols[i] = QString("ifnull(%2.Preview, (SELECT Preview FROM %1 WHERE %1.id = %2.id)) AS Preview")
+	.arg(quotedPreviewTableName(subResource), quotedDataTableName(subResource));
   }
   if (wantIdFirst && (!cols.size() || cols[0] != "id") )
     cols.prepend("id");
 
   return cols;
 }
-// private
+// private, static
 QStringList KLFLibDBEngine::detectEntryColumns(const QSqlQuery& q)
 {
   const QSqlRecord rec = q.record();
@@ -536,7 +621,7 @@ QStringList KLFLibDBEngine::detectEntryColumns(const QSqlQuery& q)
   }
   return cols;
 }
-// private
+// private, static
 KLFLibEntry KLFLibDBEngine::readEntry(const QSqlQuery& q, const QStringList& cols)
 {
   // and actually read the result and return it
@@ -662,42 +747,86 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
 }
 
 
-static QString escape_sql_data_string(QString s)
-{
-  s.replace("'", "''");
-  return "'" + s + "'";
-}
-
 // note: does not enclose expression in parens
-static QString make_like_condition(QString field, QString val, bool wildbefore, bool wildafter, bool casesensitive)
+static QString make_like_condition(const QString& field, QString val, bool wildbefore, bool wildafter,
+				   bool casesensitive, QVariantList *placeholders)
 {
   if (casesensitive) { // use GLOB for case sensitive match
-    QString globval = val;
+    // escape special GLOB chars by enclosing them in a character class
+    QString globval;
+    int k;
+    for (k = 0; k < val.size(); ++k) {
+      if (val[k] == '*' || val[k] == '?' || val[k] == '[')
+	globval += QString("[") + val[k] + "]";
+      else
+	globval += val[k];
+    }
     if (wildbefore)
       globval.prepend("*");
     if (wildafter)
       globval.append("*");
-    // we cannot escape special chars in GLOB -> use glob in conjunction with like
-    return field+" GLOB "+escape_sql_data_string(globval)+"  AND  "
-      + make_like_condition(field, val, wildbefore, wildafter, false);
+    placeholders->append(globval);
+    return field+" GLOB ? ";
   } else {
     // use LIKE for case-insensitive match
+    val.replace("\\", "\\\\");
     val.replace("%", "\\%");
     val.replace("_", "\\_");
-    val.replace("\\", "\\\\");
-    val = escape_sql_data_string(val);
     if (wildbefore)
       val.prepend("%");
     if (wildafter)
       val.append("%");
-    return field+" LIKE '"+val+"' ESCAPE '\\' ";
+    placeholders->append(val);
+    return field+" LIKE ? ESCAPE '\\' ";
   }
 }
 
+//! Restricts the rows considered for a match condition using the indexes
+/** Returns a condition (possibly empty) which is implied by the given match condition on
+ * \c field, but which SQLite can evaluate using an index instead of scanning the whole
+ * table. The full condition must still be tested afterwards. \c ftstable is the full-text
+ * index table of this data table, or an empty string if there is none.
+ *
+ * Note: the returned expression includes a trailing " AND " if it is not empty.
+ */
+static QString make_index_condition(const QString& field, const QString& val, uint matchtype,
+				    const QString& ftstable, QVariantList *placeholders)
+{
+  // the trigram tokenizer matches substrings of at least three characters, case-insensitively
+  if (!ftstable.isEmpty() && val.size() >= 3 &&
+      (field == QLatin1String("Latex") || field == QLatin1String("Tags") || field == QLatin1String("Category")) &&
+      (matchtype == Qt::MatchContains || matchtype == Qt::MatchStartsWith || matchtype == Qt::MatchEndsWith)) {
+    QString phrase = val;
+    phrase.replace("\"", "\"\"");
+    placeholders->append(field + " : \"" + phrase + "\"");
+    return "id IN (SELECT rowid FROM "+ftstable+" WHERE "+ftstable+" MATCH ?) AND ";
+  }
+  // prefix search on the (COLLATE NOCASE) Category index: look up the range of values
+  // starting with val
+  if (field == QLatin1String("Category") && matchtype == Qt::MatchStartsWith && !val.isEmpty()) {
+    QString lo = val;
+    int k;
+    for (k = 0; k < lo.size(); ++k) {
+      // NOCASE only folds ASCII characters
+      if (lo[k] >= QLatin1Char('A') && lo[k] <= QLatin1Char('Z'))
+	lo[k] = QChar(lo[k].unicode() + ('a' - 'A'));
+    }
+    ushort last = lo[lo.size()-1].unicode();
+    if (last == 0xFFFF)
+      return QString();
+    QString hi = lo;
+    hi[hi.size()-1] = QChar((ushort)(last + 1));
+    placeholders->append(lo);
+    placeholders->append(hi);
+    return field+" >= ? COLLATE NOCASE AND "+field+" < ? COLLATE NOCASE AND ";
+  }
+  return QString();
+}
 
 
-static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantList *placeholders,
-				  bool *haspostsqlcondition, KLFLib::EntryMatchCondition *postsqlcondition)
+static QString make_sql_condition(const KLFLib::EntryMatchCondition m, const QString& ftstable,
+				  QVariantList *placeholders, bool *haspostsqlcondition,
+				  KLFLib::EntryMatchCondition *postsqlcondition)
 {
   /** \bug ........... LARGELY UNTESTED ..........................
    */
@@ -713,6 +842,9 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
     QString field = dummyentry.propertyNameForId(pm.propertyId());
     condition += "(";
     uint f = pm.matchFlags();
+    // both index conditions are case-insensitive, so they also hold for case-sensitive matches
+    condition += make_index_condition(field, pm.matchValueString(), f & 0xFF, ftstable, placeholders);
+    condition += "(";
     switch ( f & 0xFF ) { // the match type
     case Qt::MatchExactly:
       condition += field+" = ?";
@@ -726,16 +858,20 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
 	condition += " OR "+field+" IS NULL";
       break;
     case Qt::MatchContains:
-      condition += make_like_condition(field, pm.matchValueString(), true, true, (f & Qt::CaseSensitive));
+      condition += make_like_condition(field, pm.matchValueString(), true, true, (f & Qt::CaseSensitive),
+				       placeholders);
       break;
     case Qt::MatchStartsWith:
-      condition += make_like_condition(field, pm.matchValueString(), true, false, (f & Qt::CaseSensitive));
+      condition += make_like_condition(field, pm.matchValueString(), false, true, (f & Qt::CaseSensitive),
+				       placeholders);
       break;
     case Qt::MatchEndsWith:
-      condition += make_like_condition(field, pm.matchValueString(), false, true, (f & Qt::CaseSensitive));
+      condition += make_like_condition(field, pm.matchValueString(), true, false, (f & Qt::CaseSensitive),
+				       placeholders);
       break;
     case Qt::MatchRegExp:
-      // sqlite does not support regexp natively
+      // sqlite does not support regexp natively: the rows are filtered after the SQL query (see
+      // KLFLibDBEngine::query()). Here, don't restrict anything.
       *haspostsqlcondition = true;
       *postsqlcondition = m;
       condition += "1";
@@ -752,7 +888,7 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
       qWarning()<<KLF_FUNC_NAME<<": unknown property match type flags: "<<f ;
       return "0";
     }
-    condition += ")";
+    condition += "))";
     return condition;
   }
   if (m.type() == KLFLib::EntryMatchCondition::NegateMatchType) {
@@ -761,12 +897,18 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
       return "0";
     }
     KLFLib::EntryMatchCondition postm = KLFLib::EntryMatchCondition::mkMatchAll(); // has to be initialized to sth..
-    QString c = "(NOT " + make_sql_condition(m.conditionList()[0], placeholders,
-					     haspostsqlcondition, &postm) ;
+    // don't restrict to indexed rows under a NOT
+    QVariantList innerplaceholders;
+    QString c = make_sql_condition(m.conditionList()[0], QString(), &innerplaceholders,
+				   haspostsqlcondition, &postm) ;
     if (*haspostsqlcondition) {
       *postsqlcondition = KLFLib::EntryMatchCondition::mkNegateMatch(postm);
+      // the inner SQL condition is then weaker than the real one, so its negation would be
+      // too strong. Don't restrict anything, the whole condition is tested after the query.
+      return "1";
     }
-    return c;
+    *placeholders << innerplaceholders;
+    return "(NOT " + c + ")";
   }
   if (m.type() == KLFLib::EntryMatchCondition::OrMatchType ||
       m.type() == KLFLib::EntryMatchCondition::AndMatchType) {
@@ -777,7 +919,7 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
     if (clist.isEmpty())
       return "1";
     int k;
-    QString str;
+    QString str = "(";
     QList<KLFLib::EntryMatchCondition> postconditionlist;
     for (k = 0; k < clist.size(); ++k) {
       if (k > 0)
@@ -785,18 +927,19 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
 
       KLFLib::EntryMatchCondition thispostm = KLFLib::EntryMatchCondition::mkMatchAll(); // init to sth...
       bool thishaspostsql;
-      QString c = make_sql_condition(m.conditionList()[0], placeholders,
+      QString c = make_sql_condition(clist[k], ftstable, placeholders,
 				     &thishaspostsql, &thispostm) ;
       if (thishaspostsql) {
 	postconditionlist.append(thispostm);
       }
       str += c;
     } // for
+    str += ")";
     if (postconditionlist.size()) {
       *haspostsqlcondition = true;
       *postsqlcondition = (m.type() == KLFLib::EntryMatchCondition::OrMatchType)
 	?  KLFLib::EntryMatchCondition::mkOrMatch(postconditionlist)
-	:  KLFLib::EntryMatchCondition::mkOrMatch(postconditionlist) ;
+	:  KLFLib::EntryMatchCondition::mkAndMatch(postconditionlist) ;
     }
     return str;
   }
@@ -804,98 +947,215 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
   return "0";
 }
 
+static void collect_condition_properties(const KLFLib::EntryMatchCondition& m, QList<int> *props)
+{
+  if (m.type() == KLFLib::EntryMatchCondition::PropertyMatchType) {
+    int propId = m.propertyMatch().propertyId();
+    if (!props->contains(propId))
+      props->append(propId);
+    return;
+  }
+  foreach (const KLFLib::EntryMatchCondition& c, m.conditionList())
+    collect_condition_properties(c, props);
+}
+
 int KLFLibDBEngine::query(const QString& subResource, const Query& query, QueryResult *result)
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME);
   klfDbg( "\t: subResource="<<subResource<<"; query="<<query ) ;
 
+  KLFLibDBQuerySql s;
+  if (!prepareQuerySql(subResource, query, &s))
+    return -1;
+
+  return execQuerySql(pDB, s, result, this, NULL);
+}
+
+// private
+bool KLFLibDBEngine::prepareQuerySql(const QString& subResource, const Query& query, KLFLibDBQuerySql *s)
+{
   KLF_ASSERT_CONDITION( validDatabase() , "Database connection not valid!" ,
-			return -1 ) ;
+			return false ) ;
 
-  QStringList cols = columnNameList(subResource, query.wantedEntryProperties, true);
+  QVariantList placeholders;
+  bool haspostsqlcondition = false;
+  KLFLib::EntryMatchCondition postsqlcondition = KLFLib::EntryMatchCondition::mkMatchAll();
+  // use the full-text index, if we have one, to narrow down text searches
+  QString ftstable;
+  if (pDBHasFtsIndex.value(subResource, false))
+    ftstable = quotedFtsTableName(subResource);
+  QString wherecond = make_sql_condition(query.matchCondition, ftstable, &placeholders,
+					 &haspostsqlcondition, &postsqlcondition);
+
+  // If part of the condition can't be expressed in SQL (e.g. regular expressions), the SQL
+  // condition is only a necessary condition. The full condition is then tested on each row as
+  // it is read, using only the columns it refers to.
+  QList<int> condprops;
+  QList<int> wantedprops = query.wantedEntryProperties;
+  if (haspostsqlcondition) {
+    collect_condition_properties(query.matchCondition, &condprops);
+    if (!wantedprops.isEmpty()) {
+      foreach (int propId, condprops) {
+	if (!wantedprops.contains(propId))
+	  wantedprops << propId;
+      }
+    }
+  }
+
+  QStringList cols = columnNameList(subResource, wantedprops, true);
 
   QString sql;
   // prepare SQL string.
   sql = QString("SELECT %1 FROM %2 ").arg(cols.join(","), quotedDataTableName(subResource));
-  QVariantList placeholders;
-  bool haspostsqlcondition = false;
-  KLFLib::EntryMatchCondition postsqlcondition = KLFLib::EntryMatchCondition::mkMatchAll();
-  QString wherecond = make_sql_condition(query.matchCondition, &placeholders, &haspostsqlcondition,
-					 &postsqlcondition);
   sql += " WHERE "+wherecond;
 
-  /** \bug. ................ postsqlcondition is NOT implemented ............. */
-  if (haspostsqlcondition) {
-    // fallback on very rudimentary search
-    klfDbg("You are using a feature that is not natively implemented in KLFLibDBEngine: falling back to "
-	   "rudimentary and slow implementation!");
-    return KLFLibResourceSimpleEngine::queryImpl(this, subResource, query, result);
+  // ties are ordered by id, so that an entry's position is well defined for keyset pagination
+  QString orderfield;
+  QString orderdir = "ASC";
+  if (query.orderPropId != -1) {
+    orderfield = KLFLibEntry().propertyNameForId(query.orderPropId);
+    orderdir = (query.orderDirection==Qt::AscendingOrder) ? "ASC" : "DESC";
   }
 
-  if (query.orderPropId != -1) {
-    sql += " ORDER BY "+KLFLibEntry().propertyNameForId(query.orderPropId)+" ";
-    sql += (query.orderDirection==Qt::AscendingOrder)?"ASC ":"DESC ";
+  if (query.afterId != -1) {
+    // only entries after (afterOrderValue, afterId) in the order. Careful with NULLs, which
+    // SQLite sorts first.
+    const char * idcmp = (orderdir == "ASC") ? "id > ?" : "id < ?";
+    if (orderfield.isEmpty()) {
+      sql += QString(" AND %1").arg(idcmp);
+      placeholders << query.afterId;
+    } else {
+      QVariant afterval = dbMakeEntryPropertyValue(query.afterOrderValue, query.orderPropId);
+      const char * valcmp = (orderdir == "ASC") ? ">" : "<";
+      if (afterval.isNull()) {
+	if (orderdir == "ASC")
+	  sql += QString(" AND (%1 IS NOT NULL OR %2)").arg(orderfield, idcmp);
+	else
+	  sql += QString(" AND (%1 IS NULL AND %2)").arg(orderfield, idcmp);
+	placeholders << query.afterId;
+      } else {
+	sql += QString(" AND (%1 %2 ? OR (%1 = ? AND %3)").arg(orderfield, valcmp, idcmp);
+	if (orderdir == "DESC")
+	  sql += QString(" OR %1 IS NULL").arg(orderfield);
+	sql += ")";
+	placeholders << afterval << afterval << query.afterId;
+      }
+    }
   }
 
-  if (query.limit != -1) {
+  sql += " ORDER BY ";
+  if (!orderfield.isEmpty())
+    sql += orderfield+" "+orderdir+", ";
+  sql += "id "+orderdir+" ";
+
+  if (query.limit != -1 && !haspostsqlcondition) {
     sql += " LIMIT "+QString::number(query.skip+query.limit);
   }
 
   klfDbg("Built query: SQL="<<sql<<"; placeholders="<<placeholders) ;
 
-  QSqlQuery q = QSqlQuery(pDB);
-  q.prepare(sql);
+  s->query = query;
+  s->sql = sql;
+  s->placeholders = placeholders;
+  s->hasPostSqlCondition = haspostsqlcondition;
+  s->condProps = condprops;
+  return true;
+}
+
+// private, static
+int KLFLibDBEngine::execQuerySql(QSqlDatabase db, const KLFLibDBQuerySql& s, QueryResult *result,
+				 KLFLibDBEngine *progressengine, KLFLibDBQueryJob *job)
+{
+  const Query& query = s.query;
+  const bool haspostsqlcondition = s.hasPostSqlCondition;
+  const QList<int>& condprops = s.condProps;
+
+  QSqlQuery q = QSqlQuery(db);
+  q.prepare(s.sql);
   q.setForwardOnly(true);
   int k;
-  for (k = 0; k < placeholders.size(); ++k)
-    q.bindValue(k, placeholders[k]);
+  for (k = 0; k < s.placeholders.size(); ++k)
+    q.bindValue(k, s.placeholders[k]);
 
   // and exec the query
   bool r = q.exec();
   if ( !r || q.lastError().isValid() ) {
     qWarning()<<KLF_FUNC_NAME<<"SQL Error: "<<qPrintable(q.lastError().text())
-	      <<"\nSql was="<<sql<<"; bound values="<<q.boundValues();
+	      <<"\nSql was="<<s.sql<<"; bound values="<<q.boundValues();
     return -1;
   }
 
   // retrieve the entries
 
-  cols = detectEntryColumns(q);
+  QStringList cols = detectEntryColumns(q);
+
+  // the columns needed to test the post-SQL condition
+  QList<int> condcolumns;
+  if (haspostsqlcondition) {
+    KLFLibEntry dummy;
+    for (k = 0; k < cols.size(); ++k) {
+      if (condprops.contains(dummy.propertyIdForName(cols[k])))
+	condcolumns << k;
+    }
+  }
 
   int N = q.size();
   if (N == -1)
     N = 100;
   else
     N -= query.skip;
-  KLFProgressReporter progr(0, N, this);
-  if (!thisOperationProgressBlocked())
-    emit operationStartReportingProgress(&progr, tr("Querying items from library database ..."));
+  KLFProgressReporter progr(0, N, progressengine);
+  if (progressengine != NULL && !progressengine->thisOperationProgressBlocked())
+    emit progressengine->operationStartReportingProgress(&progr,
+							 tr("Querying items from library database ..."));
 
-  // skip the first 'query.skip' entries
+  // skip the first 'query.skip' entries. With a post-SQL condition, we can only count the
+  // matching entries as they come.
   int skipped = 0;
   bool ok = true;
-  while (skipped < query.skip && (ok = q.next()))
+  while (!haspostsqlcondition && skipped < query.skip && (ok = q.next()))
     ++skipped;
   klfDbg("skipped "<<skipped<<" entries.") ;
 
   // warning: Qt crashes on two consequent failing q.next() calls, if forward-only mode is enabled.
 
   int count = 0;
-  while (ok && q.next()) {
+  while (ok && (query.limit == -1 || count < query.limit) && q.next()) {
+    if (job != NULL && job->isCancelled()) {
+      klfDbg("query cancelled.") ;
+      break;
+    }
     if (count % 10 == 0 && count < N) {
       // emit every 10 items, without exceeding what maximum we gave
       progr.doReportProgress(count);
     }
 
+    if (haspostsqlcondition) {
+      // only decode the values the condition needs
+      KLFLibEntry testentry;
+      foreach (int c, condcolumns) {
+	testentry.setEntryProperty(cols[c], dbReadEntryPropertyValue(q.value(c),
+								     testentry.propertyIdForName(cols[c])));
+      }
+      if (!KLFLibResourceSimpleEngine::testEntryMatchConditionImpl(query.matchCondition, testentry))
+	continue;
+      if (skipped < query.skip) {
+	++skipped;
+	continue;
+      }
+    }
+
     KLFLibEntryWithId e;
     e.id = q.value(0).toInt(); // column 0 is 'id', see \ref columnNameList()
     e.entry = readEntry(q, cols);
 
-    if (result->fillFlags & QueryResult::FillEntryIdList)
+    if (job != NULL)
+      job->addResult(e);
+    if (result != NULL && (result->fillFlags & QueryResult::FillEntryIdList))
       result->entryIdList << e.id;
-    if (result->fillFlags & QueryResult::FillRawEntryList)
+    if (result != NULL && (result->fillFlags & QueryResult::FillRawEntryList))
       result->rawEntryList << e.entry;
-    if (result->fillFlags & QueryResult::FillEntryWithIdList)
+    if (result != NULL && (result->fillFlags & QueryResult::FillEntryWithIdList))
       result->entryWithIdList << e;
     ++count;
   }
@@ -904,6 +1164,103 @@ int KLFLibDBEngine::query(const QString& subResource, const Query& query, QueryR
   klfDbg("got "<<count<<" entries.") ;
   return count;
 }
+
+int KLFLibDBEngine::startQuery(const QString& subResource, const Query& query)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME);
+
+  // the worker opens its own connection to the database file, which is only possible for
+  // SQLite databases stored in a file
+  if (pDB.driverName() != QLatin1String("QSQLITE") || pDB.databaseName().isEmpty() ||
+      pDB.databaseName() == QLatin1String(":memory:"))
+    return KLFLibResourceEngine::startQuery(subResource, query);
+
+  KLFLibDBQuerySql s;
+  if (!prepareQuerySql(subResource, query, &s))
+    return KLFLibResourceEngine::startQuery(subResource, query); // will report the error
+
+  // register any unknown column as entry property now, rather than in the worker thread (see
+  // detectEntryColumns())
+  KLFLibEntry dummy;
+  foreach (QString col, pDBAvailColumns[subResource]) {
+    if (col != "id" && dummy.propertyIdForName(col) < 0)
+      dummy.setEntryProperty(col, QVariant());
+  }
+
+  int queryId = newQueryId();
+  KLFLibDBQueryJob *job = new KLFLibDBQueryJob(queryId, pDB, s);
+  connect(job, SIGNAL(resultsAvailable(int, const QList<KLFLibResourceEngine::KLFLibEntryWithId>&)),
+	  this, SLOT(queryJobResultsAvailable(int, const QList<KLFLibResourceEngine::KLFLibEntryWithId>&)));
+  connect(job, SIGNAL(finished(int, int)), this, SLOT(queryJobFinished(int, int)));
+  pQueryJobs[queryId] = job;
+  QThreadPool::globalInstance()->start(job);
+  klfDbg("started query "<<queryId<<": "<<s.sql) ;
+  return queryId;
+}
+
+void KLFLibDBEngine::cancelQuery(int queryId)
+{
+  if (!pQueryJobs.contains(queryId)) {
+    KLFLibResourceEngine::cancelQuery(queryId);
+    return;
+  }
+  QPointer<KLFLibDBQueryJob> job = pQueryJobs.take(queryId);
+  if (job != NULL)
+    job->cancel();
+}
+
+void KLFLibDBEngine::queryJobResultsAvailable(int queryId,
+					      const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries)
+{
+  // results of cancelled queries may still be in the event queue
+  if (pQueryJobs.contains(queryId))
+    emit queryResultsAvailable(queryId, entries);
+}
+
+void KLFLibDBEngine::queryJobFinished(int queryId, int count)
+{
+  if (pQueryJobs.remove(queryId))
+    emit queryFinished(queryId, count);
+}
+
+
+static QAtomicInt klf_db_query_connection_counter;
+
+void KLFLibDBQueryJob::run()
+{
+  int count = -1;
+  if (!isCancelled()) {
+    QString connName = QString("klflibdbquery_%1").arg(klf_db_query_connection_counter.fetchAndAddOrdered(1));
+    {
+      QSqlDatabase db = QSqlDatabase::addDatabase(pDriverName, connName);
+      db.setDatabaseName(pDatabaseName);
+      // we only read, and we'd rather wait than fail while the GUI thread writes
+      db.setConnectOptions("QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=5000");
+      if (db.open()) {
+	count = KLFLibDBEngine::execQuerySql(db, pQuerySql, NULL, NULL, this);
+	db.close();
+      } else {
+	qWarning()<<KLF_FUNC_NAME<<": Can't open database "<<pDatabaseName<<": "<<db.lastError().text();
+      }
+    }
+    QSqlDatabase::removeDatabase(connName);
+  }
+  if (!pBatch.isEmpty()) {
+    emit resultsAvailable(pQueryId, pBatch);
+    pBatch.clear();
+  }
+  emit finished(pQueryId, count);
+  deleteLater();
+}
+
+void KLFLibDBQueryJob::addResult(const KLFLibResourceEngine::KLFLibEntryWithId& e)
+{
+  pBatch << e;
+  if (pBatch.size() >= ResultBatchSize) {
+    emit resultsAvailable(pQueryId, pBatch);
+    pBatch.clear();
+  }
+}
 QList<QVariant> KLFLibDBEngine::queryValues(const QString& subResource, int entryPropId)
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME);
@@ -959,7 +1316,8 @@ KLFLibEntry KLFLibDBEngine::entry(const QString& subResource, entryId id)
 			return KLFLibEntry() ) ;
 
   QSqlQuery q = QSqlQuery(pDB);
-  q.prepare(QString("SELECT * FROM %1 WHERE id = ?").arg(quotedDataTableName(subResource)));
+  q.prepare(QString("SELECT %1 FROM %2 WHERE id = ?")
+	    .arg(columnNameList(subResource, QList<int>(), false).join(","), quotedDataTableName(subResource)));
   q.addBindValue(id);
   bool r = q.exec();
 
@@ -1178,6 +1536,7 @@ QVariant KLFLibDBEngine::dbMakeEntryPropertyValue(const QVariant& entryval, int
   // otherwise, return a generic encapsulation
   return convertVariantToDBData(entryval);
 }
+// static
 QVariant KLFLibDBEngine::dbReadEntryPropertyValue(const QVariant& dbdata, int propertyId)
 {
   if (propertyId == KLFLibEntry::Latex)
@@ -1256,7 +1615,8 @@ QVariant KLFLibDBEngine::encaps(const char *ts, const QByteArray& data) const
   edata.append(data);
   return QVariant::fromValue<QByteArray>(edata);
 }
-QVariant KLFLibDBEngine::convertVariantFromDBData(const QVariant& dbdata) const
+// static
+QVariant KLFLibDBEngine::convertVariantFromDBData(const QVariant& dbdata)
 {
   if ( !dbdata.isValid() )
     return QVariant();
@@ -1274,11 +1634,13 @@ QVariant KLFLibDBEngine::convertVariantFromDBData(const QVariant& dbdata) const
   qWarning()<<"Unexpected DB data variant found: "<<dbdata;
   return QVariant();
 }
-QVariant KLFLibDBEngine::decaps(const QString& sdata) const
+// static
+QVariant KLFLibDBEngine::decaps(const QString& sdata)
 {
   return decaps(sdata.toUtf8());
 }
-QVariant KLFLibDBEngine::decaps(const QByteArray& data) const
+// static
+QVariant KLFLibDBEngine::decaps(const QByteArray& data)
 {
   //  klfDbg( "decaps(): "<<data ) ;
   int k;
@@ -1325,16 +1687,62 @@ QVariant KLFLibDBEngine::decaps(const QByteArray& data) const
   return value;
 }
 
+// static
+int KLFLibDBEngine::pDefaultBatchSize = 500;
+
+// static
+void KLFLibDBEngine::setDefaultBatchSize(int n)
+{
+  pDefaultBatchSize = qMax(1, n);
+}
+
+void KLFLibDBEngine::setBatchSize(int n)
+{
+  pBatchSize = qMax(1, n);
+}
+
+bool KLFLibDBEngine::beginTransaction()
+{
+  if (!pDB.driver()->hasFeature(QSqlDriver::Transactions))
+    return false;
+  if (!pDB.transaction()) {
+    // eg. a transaction is already in progress
+    klfDbg("Can't start transaction: "<<pDB.lastError().text()) ;
+    return false;
+  }
+  return true;
+}
+
+bool KLFLibDBEngine::endTransaction(bool intransaction, bool ok)
+{
+  if (!intransaction)
+    return ok;
+
+  if (ok) {
+    if (pDB.commit())
+      return true;
+    qWarning()<<KLF_FUNC_NAME<<": Can't commit transaction: "<<pDB.lastError().text();
+  }
+  if (!pDB.rollback()) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't roll back transaction: "<<pDB.lastError().text();
+  }
+  return false;
+}
+
 bool KLFLibDBEngine::ensureDataTableColumnsExist(const QString& subResource, const QStringList& columnList)
 {
   QSqlRecord rec = pDB.record(dataTableName(subResource));
   int k;
   bool failed = false;
-  for (k = 0; k < columnList.size(); ++k) {
+  bool intransaction = false;
+  for (k = 0; k < columnList.size() && !failed; ++k) {
     if (columnList[k] == "*") // in case a superfluous '*' remained in a 'cols' stringlist... in eg. entries()
       continue;
     if (rec.contains(columnList[k]))
       continue;
+    // add all missing columns in one go
+    if (!intransaction)
+      intransaction = beginTransaction();
     QSqlQuery sql = QSqlQuery(pDB);
     sql.prepare("ALTER TABLE "+quotedDataTableName(subResource)+" ADD COLUMN "+columnList[k]+" BLOB");
     bool r = sql.exec();
@@ -1344,6 +1752,7 @@ bool KLFLibDBEngine::ensureDataTableColumnsExist(const QString& subResource, con
       failed = true;
     }
   }
+  endTransaction(intransaction, !failed);
 
   readAvailColumns(subResource);
 
@@ -1356,6 +1765,16 @@ bool KLFLibDBEngine::ensureDataTableColumnsExist(const QString& subResource)
   QStringList propNameList = dummy.registeredPropertyNameList();
   return ensureDataTableColumnsExist(subResource, propNameList);
 }
+void KLFLibDBEngine::ensureDataTableIndexesExist(const QString& subResource)
+{
+  // libraries created by older versions don't have indexes yet. Only add them if the user
+  // asked for it, and only when we're writing to the library anyway.
+  if (!pDefaultUpgradeIndexes || pDBIndexesChecked.value(subResource, false))
+    return;
+  pDBIndexesChecked[subResource] = true;
+  createDataTableIndexes(pDB, subResource);
+  readAvailColumns(subResource);
+}
 
 
 // --
@@ -1377,6 +1796,27 @@ bool KLFLibDBEngine::deleteSubResource(const QString& subResource)
 	      <<q.lastError().text() << "\n\tSQL="<<q.lastQuery() ;
     return false;
   }
+  // the indexes and triggers went with the table, but not the full-text index
+  if (pDBHasFtsIndex.value(subResource, false)) {
+    QSqlQuery qfts = QSqlQuery(pDB);
+    qfts.prepare(QString("DROP TABLE %1").arg(quotedFtsTableName(subResource)));
+    if (!qfts.exec() || qfts.lastError().isValid()) {
+      qWarning()<<KLF_FUNC_NAME<<"("<<subResource<<"): Can't drop full-text index: "
+		<<qfts.lastError().text();
+    }
+  }
+  if (pDBHasPreviewTable.value(subResource, false)) {
+    QSqlQuery qprev = QSqlQuery(pDB);
+    qprev.prepare(QString("DROP TABLE %1").arg(quotedPreviewTableName(subResource)));
+    if (!qprev.exec() || qprev.lastError().isValid()) {
+      qWarning()<<KLF_FUNC_NAME<<"("<<subResource<<"): Can't drop preview table: "
+		<<qprev.lastError().text();
+    }
+  }
+  pDBAvailColumns.remove(subResource);
+  pDBHasFtsIndex.remove(subResource);
+  pDBHasPreviewTable.remove(subResource);
+  pDBIndexesChecked.remove(subResource);
 
   // all ok
   emit subResourceDeleted(subResource);
@@ -1411,6 +1851,7 @@ bool KLFLibDBEngine::createSubResource(const QString& subResource, const QString
   bool r = createFreshDataTable(pDB, subResource);
   if (!r)
     return false;
+  readAvailColumns(subResource);
   QString title = subResourceTitle;
   if (title.isEmpty())
     title = subResource;
@@ -1461,6 +1902,7 @@ QList<KLFLibResourceEngine::entryId> KLFLibDBEngine::insertEntries(const QString
   QList<entryId> insertedIds;
 
   ensureDataTableColumnsExist(subres);
+  ensureDataTableIndexesExist(subres);
 
   KLFProgressReporter progr(0, entrylist.size(), this);
   if (!thisOperationProgressBlocked())
@@ -1470,36 +1912,72 @@ QList<KLFLibResourceEngine::entryId> KLFLibDBEngine::insertEntries(const QString
   q.prepare("INSERT INTO " + quotedDataTableName(subres) + " (" + props.join(",") + ") "
 	    " VALUES (" + questionmarks.join(",") + ")");
   klfDbg( "INSERT query: "<<q.lastQuery() ) ;
-  // now loop all entries, and exec the query with appropriate bound values
-  for (j = 0; j < entrylist.size(); ++j) {
-    if (j % 10 == 0) // emit every 10 items
-      progr.doReportProgress(j);
-    //    klfDbg( "New entry to insert." ) ;
-    for (k = 0; k < propids.size(); ++k) {
-      QVariant data = dbMakeEntryPropertyValue(entrylist[j].property(propids[k]), propids[k]);
-      // and add a corresponding bind value for sql query
-      klfDbg( "Binding value "<<k<<": "<<data ) ;
-      q.bindValue(k, data);
-    }
-    // and exec the query with these bound values
-    bool r = q.exec();
-    if ( ! r || q.lastError().isValid() ) {
-      qWarning()<<"INSERT failed! SQL Error: "<<q.lastError().text()<<"\n\tSQL="<<q.lastQuery();
-      insertedIds << -1;
-    } else {
+  // previews go to the preview table, if any
+  const bool usepreviewtable = pDBHasPreviewTable.value(subres, false);
+  QSqlQuery qprev = QSqlQuery(pDB);
+  if (usepreviewtable)
+    prepareWritePreviewQuery(&qprev, subres);
+  // now loop all entries, and exec the query with appropriate bound values. Do this in
+  // batches of pBatchSize entries, each in its own transaction.
+  bool failed = false;
+  int batchstart;
+  for (batchstart = 0; batchstart < entrylist.size() && !failed; batchstart += pBatchSize) {
+    int batchend = qMin(batchstart + pBatchSize, entrylist.size());
+    bool intransaction = beginTransaction();
+    QList<entryId> batchIds;
+    for (j = batchstart; j < batchend; ++j) {
+      if (j % 10 == 0) // emit every 10 items
+	progr.doReportProgress(j);
+      //    klfDbg( "New entry to insert." ) ;
+      for (k = 0; k < propids.size(); ++k) {
+	QVariant data;
+	if (usepreviewtable && propids[k] == KLFLibEntry::Preview)
+	  data = QVariant(QVariant::ByteArray);
+	else
+	  data = dbMakeEntryPropertyValue(entrylist[j].property(propids[k]), propids[k]);
+	// and add a corresponding bind value for sql query
+	klfDbg( "Binding value "<<k<<": "<<data ) ;
+	q.bindValue(k, data);
+      }
+      // and exec the query with these bound values
+      bool r = q.exec();
+      if ( ! r || q.lastError().isValid() ) {
+	qWarning()<<"INSERT failed! SQL Error: "<<q.lastError().text()<<"\n\tSQL="<<q.lastQuery();
+	failed = true;
+	break;
+      }
       QVariant v_id = q.lastInsertId();
+      if (usepreviewtable && v_id.isValid() &&
+	  !writePreview(&qprev, v_id.toInt(), previewRowValues(entrylist[j].preview()))) {
+	failed = true;
+	// without a transaction, nothing will roll back this row: remove it ourselves, or
+	// report it as inserted if we can't
+	if (!intransaction && !deleteDataRow(subres, v_id.toInt()))
+	  batchIds << v_id.toInt();
+	break;
+      }
       if ( ! v_id.isValid() )
-	insertedIds << -2;
+	batchIds << -2;
       else
-	insertedIds << v_id.toInt();
+	batchIds << v_id.toInt();
+    }
+    if (!endTransaction(intransaction, !failed)) {
+      failed = true;
+      if (intransaction) // the whole batch was rolled back
+	batchIds.clear();
     }
+    insertedIds << batchIds;
+    if (!batchIds.isEmpty())
+      emit dataChanged(subres, InsertData, batchIds);
   }
+  // entries which were not inserted
+  while (insertedIds.size() < entrylist.size())
+    insertedIds << -1;
 
   // make sure the last signal is emitted as specified by KLFLibResourceEngine doc (needed
   // for example to close progress dialog!)
   progr.doReportProgress(entrylist.size());
 
-  emit dataChanged(subres, InsertData, insertedIds);
   return insertedIds;
 }
 
@@ -1529,6 +2007,7 @@ bool KLFLibDBEngine::changeEntries(const QString& subResource, const QList<entry
 	  <<properties<<" vals="<<values ) ;
 
   ensureDataTableColumnsExist(subResource);
+  ensureDataTableIndexesExist(subResource);
 
   KLFLibEntry e; // dummy 
   QStringList updatepairs;
@@ -1540,8 +2019,20 @@ bool KLFLibDBEngine::changeEntries(const QString& subResource, const QList<entry
   QSqlQuery q = QSqlQuery(pDB);
   q.prepare(QString("UPDATE %1 SET %2 WHERE id = ?")
 	    .arg(quotedDataTableName(subResource), updatepairs.join(",")));
+  // previews go to the preview table, if any
+  QSqlQuery qprev = QSqlQuery(pDB);
+  QVariantList previewvalues;
+  const int previewIndex = properties.indexOf(KLFLibEntry::Preview);
+  const bool usepreviewtable = pDBHasPreviewTable.value(subResource, false) && previewIndex >= 0;
+  if (usepreviewtable) {
+    prepareWritePreviewQuery(&qprev, subResource);
+    previewvalues = previewRowValues(values[previewIndex].value<QImage>());
+  }
   for (k = 0; k < properties.size(); ++k) {
-    q.bindValue(k, dbMakeEntryPropertyValue(values[k], properties[k]));
+    if (usepreviewtable && k == previewIndex)
+      q.bindValue(k, QVariant(QVariant::ByteArray));
+    else
+      q.bindValue(k, dbMakeEntryPropertyValue(values[k], properties[k]));
   }
   const int idBindValueNum = k;
 
@@ -1550,23 +2041,41 @@ bool KLFLibDBEngine::changeEntries(const QString& subResource, const QList<entry
     emit operationStartReportingProgress(&progr, tr("Changing entries in database ..."));
 
   bool failed = false;
-  for (k = 0; k < idlist.size(); ++k) {
-    if (k % 10 == 0)
-      progr.doReportProgress(k);
-
-    q.bindValue(idBindValueNum, idlist[k]);
-    bool r = q.exec();
-    if ( !r || q.lastError().isValid() ) {
-      qWarning() << "SQL UPDATE Error: "<<q.lastError().text()<<"\nWith SQL="<<q.lastQuery()
-		 <<";\n and bound values="<<q.boundValues();
+  int batchstart;
+  for (batchstart = 0; batchstart < idlist.size() && !failed; batchstart += pBatchSize) {
+    QList<entryId> batchIds = idlist.mid(batchstart, pBatchSize);
+    bool intransaction = beginTransaction();
+    int nchanged = 0; // number of entries of this batch whose UPDATE went through
+    for (k = 0; k < batchIds.size(); ++k) {
+      if ((batchstart+k) % 10 == 0)
+	progr.doReportProgress(batchstart+k);
+
+      q.bindValue(idBindValueNum, batchIds[k]);
+      bool r = q.exec();
+      if ( !r || q.lastError().isValid() ) {
+	qWarning() << "SQL UPDATE Error: "<<q.lastError().text()<<"\nWith SQL="<<q.lastQuery()
+		   <<";\n and bound values="<<q.boundValues();
+	failed = true;
+	break;
+      }
+      ++nchanged;
+      if (usepreviewtable && !writePreview(&qprev, batchIds[k], previewvalues)) {
+	failed = true;
+	break;
+      }
+    }
+    if (!endTransaction(intransaction, !failed)) {
       failed = true;
+      // if the batch was rolled back, nothing changed; otherwise the entries up to the
+      // failing one were changed (including it, if only its preview could not be written)
+      batchIds = intransaction ? QList<entryId>() : batchIds.mid(0, nchanged);
     }
+    if (!batchIds.isEmpty())
+      emit dataChanged(subResource, ChangeData, batchIds);
   }
 
   progr.doReportProgress(idlist.size());
 
-  emit dataChanged(subResource, ChangeData, idlist);
-
   return !failed;
 }
 
@@ -1598,23 +2107,33 @@ bool KLFLibDBEngine::deleteEntries(const QString& subResource, const QList<entry
   if (!thisOperationProgressBlocked())
     emit operationStartReportingProgress(&progr, tr("Removing entries from database ..."));
 
-  for (k = 0; k < idlist.size(); ++k) {
-    if (k % 10 == 0)
-      progr.doReportProgress(k);
-
-    q.bindValue(0, idlist[k]);
-    bool r = q.exec();
-    if ( !r || q.lastError().isValid() ) {
-      qWarning()<<KLF_FUNC_NAME<<": Sql error: "<<q.lastError().text();
+  int batchstart;
+  for (batchstart = 0; batchstart < idlist.size() && !failed; batchstart += pBatchSize) {
+    QList<entryId> batchIds = idlist.mid(batchstart, pBatchSize);
+    bool intransaction = beginTransaction();
+    for (k = 0; k < batchIds.size(); ++k) {
+      if ((batchstart+k) % 10 == 0)
+	progr.doReportProgress(batchstart+k);
+
+      q.bindValue(0, batchIds[k]);
+      bool r = q.exec();
+      if ( !r || q.lastError().isValid() ) {
+	qWarning()<<KLF_FUNC_NAME<<": Sql error: "<<q.lastError().text();
+	failed = true;
+	break;
+      }
+    }
+    if (!endTransaction(intransaction, !failed)) {
       failed = true;
-      continue;
+      // see changeEntries()
+      batchIds = intransaction ? QList<entryId>() : batchIds.mid(0, k);
     }
+    if (!batchIds.isEmpty())
+      emit dataChanged(subResource, DeleteData, batchIds);
   }
 
   progr.doReportProgress(idlist.size());
 
-  emit dataChanged(subResource, DeleteData, idlist);
-
   return !failed;
 }
 
@@ -1692,9 +2211,160 @@ bool KLFLibDBEngine::createFreshDataTable(QSqlDatabase db, const QString& subres
     return false;
   }
 
+  // the library works without the indexes, so don't fail if they can't be created
+  createDataTableIndexes(db, subres);
+
+  if (pDefaultUsePreviewTable && !createPreviewTable(db, subres))
+    return false;
+
+  return true;
+}
+
+// static
+bool KLFLibDBEngine::createDataTableIndexes(QSqlDatabase db, const QString& subres)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  QString dtname = dataTableName(subres);
+  QString qdtname = quotedDataTableName(subres);
+  QString idxprefix = "\"i_" + subres.toLower().replace('"', "\"\"");
+
+  bool ok = exec_sql_list(db, QStringList()
+			  << "CREATE INDEX IF NOT EXISTS "+idxprefix+"_category\" ON "+qdtname
+			  +" (Category COLLATE NOCASE)"
+			  << "CREATE INDEX IF NOT EXISTS "+idxprefix+"_datetime\" ON "+qdtname+" (DateTime)");
+  if (!ok) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't create indexes for sub-resource "<<subres;
+    return false;
+  }
+
+  if (!pDefaultUpgradeIndexes || db.tables().contains(ftsTableName(subres), Qt::CaseInsensitive))
+    return true; // full-text index not wanted, or already there
+
+  if (!sqlite_has_fts5_trigram(db))
+    return true; // no full-text index, queries will scan the table
+
+  // an external content FTS5 table, kept in sync with the data table by triggers
+  QString qftsname = quotedFtsTableName(subres);
+  QString ftsname = ftsTableName(subres).replace('"', "\"\"");
+  QString contentname = dtname;
+  contentname.replace("'", "''");
+  QString cols = "Latex, Tags, Category";
+  QString newcols = "new.Latex, new.Tags, new.Category";
+  QString oldcols = "old.Latex, old.Tags, old.Category";
+  QStringList sql;
+  sql << "CREATE VIRTUAL TABLE "+qftsname+" USING fts5("+cols+", content='"+contentname+"',"
+    " content_rowid='id', tokenize='trigram')";
+  sql << "CREATE TRIGGER \""+ftsname+"_ai\" AFTER INSERT ON "+qdtname+" BEGIN "
+    "INSERT INTO "+qftsname+" (rowid, "+cols+") VALUES (new.id, "+newcols+"); END";
+  sql << "CREATE TRIGGER \""+ftsname+"_ad\" AFTER DELETE ON "+qdtname+" BEGIN "
+    "INSERT INTO "+qftsname+" ("+qftsname+", rowid, "+cols+") VALUES ('delete', old.id, "+oldcols+"); END";
+  sql << "CREATE TRIGGER \""+ftsname+"_au\" AFTER UPDATE ON "+qdtname+" BEGIN "
+    "INSERT INTO "+qftsname+" ("+qftsname+", rowid, "+cols+") VALUES ('delete', old.id, "+oldcols+"); "
+    "INSERT INTO "+qftsname+" (rowid, "+cols+") VALUES (new.id, "+newcols+"); END";
+  // index the existing entries
+  sql << "INSERT INTO "+qftsname+" ("+qftsname+") VALUES ('rebuild')";
+
+  bool intransaction = db.transaction();
+  ok = exec_sql_list(db, sql);
+  if (intransaction) {
+    if (ok)
+      ok = db.commit();
+    if (!ok)
+      db.rollback();
+  }
+  if (!ok) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't create full-text index for sub-resource "<<subres;
+    return false;
+  }
+  return true;
+}
+
+// static
+bool KLFLibDBEngine::createPreviewTable(QSqlDatabase db, const QString& subres)
+{
+  QString qprevname = quotedPreviewTableName(subres);
+  QString trigname = previewTableName(subres).replace('"', "\"\"") + "_ad";
+  bool ok = exec_sql_list(db, QStringList()
+			  << "CREATE TABLE "+qprevname+" (id INTEGER PRIMARY KEY, Preview BLOB)"
+			  << "CREATE TRIGGER \""+trigname+"\" AFTER DELETE ON "+quotedDataTableName(subres)
+			  +" BEGIN DELETE FROM "+qprevname+" WHERE id = old.id; END");
+  if (!ok) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't create preview table for sub-resource "<<subres;
+    return false;
+  }
+  return true;
+}
+
+QVariantList KLFLibDBEngine::previewRowValues(const QImage& preview)
+{
+  QVariantList values;
+  if (preview.isNull())
+    values << QVariant(QVariant::ByteArray);
+  else
+    values << dbMakeEntryPropertyValue(QVariant::fromValue<QImage>(preview), KLFLibEntry::Preview);
+  return values;
+}
+
+bool KLFLibDBEngine::prepareWritePreviewQuery(QSqlQuery *q, const QString& subres)
+{
+  bool ok = q->prepare(QString("INSERT OR REPLACE INTO %1 (id, Preview) VALUES (?, ?)")
+		       .arg(quotedPreviewTableName(subres)));
+  if (!ok)
+    qWarning()<<KLF_FUNC_NAME<<": SQL Error: "<<q->lastError().text();
+  return ok;
+}
+
+bool KLFLibDBEngine::writePreview(QSqlQuery *q, entryId id, const QVariantList& values)
+{
+  q->bindValue(0, id);
+  int k;
+  for (k = 0; k < values.size(); ++k)
+    q->bindValue(k+1, values[k]);
+  bool r = q->exec();
+  if ( !r || q->lastError().isValid() ) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't write preview: "<<q->lastError().text();
+    return false;
+  }
+  return true;
+}
+
+bool KLFLibDBEngine::deleteDataRow(const QString& subresource, entryId id)
+{
+  QSqlQuery q = QSqlQuery(pDB);
+  q.prepare(QString("DELETE FROM %1 WHERE id = ?").arg(quotedDataTableName(subresource)));
+  q.addBindValue(id);
+  bool r = q.exec();
+  if ( !r || q.lastError().isValid() ) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't remove entry "<<id<<": "<<q.lastError().text();
+    return false;
+  }
   return true;
 }
 
+// static
+bool KLFLibDBEngine::pDefaultUsePreviewTable = false;
+
+// static
+bool KLFLibDBEngine::pDefaultUpgradeIndexes = false;
+
+// static
+void KLFLibDBEngine::setDefaultUpgradeIndexes(bool upgrade)
+{
+  pDefaultUpgradeIndexes = upgrade;
+}
+
+// static
+void KLFLibDBEngine::setDefaultUsePreviewTable(bool use)
+{
+  pDefaultUsePreviewTable = use;
+}
+
+bool KLFLibDBEngine::hasPreviewTable(const QString& subResource) const
+{
+  return pDBHasPreviewTable.value(subResource, false);
+}
+
 
 /*
  QStringList KLFLibDBEngine::getDataTableNames(const QUrl& url)
@@ -26,6 +26,8 @@
 
 #include <QSqlDatabase>
 #include <QSqlQuery>
+#include <QImage>
+#include <QPointer>
 
 #include <klfdefs.h>
 #include <klflib.h>
@@ -54,6 +56,8 @@ protected:
 
 
 class KLFLibDBEnginePropertyChangeNotifier;
+class KLFLibDBQueryJob;
+struct KLFLibDBQuerySql;
 
 /** Library Resource engine implementation for an (abstract) database (using Qt
  * SQL interfaces)
@@ -109,6 +113,50 @@ public:
   virtual bool canModifyProp(int propid) const;
   virtual bool canRegisterProperty(const QString& propName) const;
 
+  /** The number of entries which are inserted, changed or deleted within a single database
+   * transaction by \ref insertEntries(), \ref changeEntries() and \ref deleteEntries().
+   *
+   * Each batch is committed separately and is followed by a \ref dataChanged() signal for
+   * the entries of that batch. If an entry fails within a batch, the whole batch is rolled
+   * back and the remaining entries are not processed. */
+  int batchSize() const { return pBatchSize; }
+  /** See \ref batchSize(). Values smaller than 1 are treated as 1. */
+  void setBatchSize(int n);
+
+  /** Whether the previews of new sub-resources are stored in a separate table. Existing
+   * sub-resources are left as they are. This is off by default.
+   *
+   * Keeping the (large) preview images out of the data table makes queries on the other
+   * columns much faster. Note that versions of KLatexFormula which don't know about preview
+   * tables won't display the previews of such sub-resources. The previews these versions write
+   * there go to the data table, where they are still found. */
+  static bool defaultUsePreviewTable() { return pDefaultUsePreviewTable; }
+  /** See \ref defaultUsePreviewTable() */
+  static void setDefaultUsePreviewTable(bool use);
+
+  /** Whether the indexes of \ref createDataTableIndexes() are added to the sub-resources we
+   * write to, including a full-text index when the SQLite library supports it. Existing
+   * sub-resources get them the first time they are modified, never when merely opened. New
+   * sub-resources always get the plain indexes, and also the full-text index if this is set.
+   *
+   * This is off by default: changing the schema of a library someone else may use is not
+   * something to do behind the user's back, and the full-text index is maintained by triggers
+   * which versions of KLatexFormula or of SQLite without FTS5 can't run, so that they can no
+   * longer modify such a library. Existing full-text indexes are used regardless of this
+   * setting. */
+  static bool defaultUpgradeIndexes() { return pDefaultUpgradeIndexes; }
+  /** See \ref defaultUpgradeIndexes() */
+  static void setDefaultUpgradeIndexes(bool upgrade);
+
+  /** TRUE if the previews of \c subResource are stored in a separate table, see
+   * \ref defaultUsePreviewTable() */
+  bool hasPreviewTable(const QString& subResource) const;
+
+  /** The batch size new instances start with */
+  static int defaultBatchSize() { return pDefaultBatchSize; }
+  /** See \ref defaultBatchSize(). Does not affect existing instances. */
+  static void setDefaultBatchSize(int n);
+
   /** True if one has supplied a valid database in the constructor or with a
    * \ref setDatabase() call. */
   virtual bool validDatabase() const;
@@ -122,6 +170,10 @@ public:
 					   const QList<int>& wantedEntryProperties = QList<int>());
 
   virtual int query(const QString& subResource, const Query& query, QueryResult *result);
+  /** Runs the query in a worker thread, using a separate (read-only) connection to the
+   * database. The results are reported in batches as they are read. */
+  virtual int startQuery(const QString& subResource, const Query& query);
+  virtual void cancelQuery(int queryId);
   virtual QList<QVariant> queryValues(const QString& subResource, int entryPropId);
 
   virtual KLFLibEntry entry(const QString& subRes, entryId id);
@@ -158,6 +210,10 @@ protected:
   virtual bool saveResourceProperty(int propId, const QVariant& value);
 
 private slots:
+  void queryJobResultsAvailable(int queryId,
+				const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries);
+  void queryJobFinished(int queryId, int count);
+
   /** Called by our instance of KLFLibDBEnginePropertyChangeNotifier that tells us when
    * other class instances using the same connection change the properties. */
   void resourcePropertyUpdate(int propId);
@@ -183,37 +239,96 @@ private:
 
   /** Key is sub-resource name (not raw table name) */
   QMap<QString,QStringList> pDBAvailColumns;
+
+  /** Key is sub-resource name; TRUE if a full-text index table exists for it and this SQLite
+   * library can use it, see \ref createDataTableIndexes() */
+  QMap<QString,bool> pDBHasFtsIndex;
+  /** Key is sub-resource name; TRUE if its previews are in a separate table */
+  QMap<QString,bool> pDBHasPreviewTable;
+  /** Key is sub-resource name; TRUE once \ref ensureDataTableIndexesExist() has run for it */
+  QMap<QString,bool> pDBIndexesChecked;
+
+  static bool pDefaultUsePreviewTable;
+  static bool pDefaultUpgradeIndexes;
+
+  /** Creates the (empty) preview table for \c subresource */
+  static bool createPreviewTable(QSqlDatabase db, const QString& subresource);
+  /** The values of the columns of the preview table (except id) for \c preview */
+  QVariantList previewRowValues(const QImage& preview);
+  bool prepareWritePreviewQuery(QSqlQuery *q, const QString& subresource);
+  bool writePreview(QSqlQuery *q, entryId id, const QVariantList& values);
+  /** Removes the row \c id of the data table of \c subresource, without emitting any signal.
+   * Used to undo a partial insert when no transaction is available. */
+  bool deleteDataRow(const QString& subresource, entryId id);
+
+  int pBatchSize;
+  static int pDefaultBatchSize;
+
+  /** Starts a transaction. Returns FALSE if none could be started (e.g. because one is
+   * already in progress), in which case statements are executed without one. */
+  bool beginTransaction();
+  /** Commits the transaction started by \ref beginTransaction() if \c ok is TRUE, otherwise
+   * rolls it back. Returns TRUE if the changes were committed. */
+  bool endTransaction(bool intransaction, bool ok);
   
   QStringList columnNameList(const QString& subResource, const QList<int>& entryPropList,
 			     bool wantIdFirst = true);
-  QStringList detectEntryColumns(const QSqlQuery& q);
-  KLFLibEntry readEntry(const QSqlQuery& q, const QStringList& columns);
+  // the functions reading entries are static, as they are also used by query jobs in worker
+  // threads, see execQuerySql()
+  static QStringList detectEntryColumns(const QSqlQuery& q);
+  static KLFLibEntry readEntry(const QSqlQuery& q, const QStringList& columns);
 
   QVariant dbMakeEntryPropertyValue(const QVariant& entryValue, int entryPropertyId);
-  QVariant dbReadEntryPropertyValue(const QVariant& dbdata, int entryPropertyId);
+  static QVariant dbReadEntryPropertyValue(const QVariant& dbdata, int entryPropertyId);
 
   QVariant convertVariantToDBData(const QVariant& value) const;
-  QVariant convertVariantFromDBData(const QVariant& dbdata) const;
+  static QVariant convertVariantFromDBData(const QVariant& dbdata);
   QVariant encaps(const char *ts, const QString& data) const;
   QVariant encaps(const char *ts, const QByteArray& data) const;
-  QVariant decaps(const QString& string) const;
-  QVariant decaps(const QByteArray& data) const;
+  static QVariant decaps(const QString& string);
+  static QVariant decaps(const QByteArray& data);
+
+  /** Builds the SQL statement for \c query. Must be called in the thread of this object. */
+  bool prepareQuerySql(const QString& subResource, const Query& query, KLFLibDBQuerySql *s);
+  /** Runs a query prepared with \ref prepareQuerySql() on \c db, and stores the results in
+   * \c result and/or reports them to \c job (either may be NULL). Progress is reported by
+   * \c progressengine if it is not NULL. */
+  static int execQuerySql(QSqlDatabase db, const KLFLibDBQuerySql& s, QueryResult *result,
+			  KLFLibDBEngine *progressengine, KLFLibDBQueryJob *job);
+
+  /** The queries started with startQuery() which are still running */
+  QMap<int, QPointer<KLFLibDBQueryJob> > pQueryJobs;
+
+  friend class KLFLibDBQueryJob;
 
   bool ensureDataTableColumnsExist(const QString& subResource, const QStringList& columnList);
   /** Inserts columns into datatable that don't exist for each extra registered property,
    * in sub-resource subResource. */
   bool ensureDataTableColumnsExist(const QString& subResource);
+  /** Adds the missing indexes of \c subResource (see \ref createDataTableIndexes()) if
+   * \ref defaultUpgradeIndexes() is set. Called before modifying the data of a sub-resource;
+   * only does anything the first time. */
+  void ensureDataTableIndexesExist(const QString& subResource);
 
   /** Initializes a fresh database, without any sub-resource. */
   static bool initFreshDatabase(QSqlDatabase db);
   /** Creates and initializes a fresh data table. It should not yet exist. \c subresource should
    * NOT contain the leading \c "t_" prefix. */
   static bool createFreshDataTable(QSqlDatabase db, const QString& subresource);
+  /** Creates the indexes on the Category and DateTime columns of the data table of
+   * \c subresource if they don't exist yet. If \ref defaultUpgradeIndexes() is set and the
+   * SQLite library supports it, also creates an FTS5 full-text index over the Latex, Tags and
+   * Category columns, which triggers keep in sync with the data table. */
+  static bool createDataTableIndexes(QSqlDatabase db, const QString& subresource);
 
   bool tableExists(const QString& subResource) const;
 
   static QString dataTableName(const QString& subResource);
   static QString quotedDataTableName(const QString& subResource);
+  static QString previewTableName(const QString& subResource);
+  static QString quotedPreviewTableName(const QString& subResource);
+  static QString ftsTableName(const QString& subResource);
+  static QString quotedFtsTableName(const QString& subResource);
 
   static QMap<QString,KLFLibDBEnginePropertyChangeNotifier*> pDBPropertyNotifiers;
   static KLFLibDBEnginePropertyChangeNotifier *dbPropertyNotifierInstance(const QString& dbname);
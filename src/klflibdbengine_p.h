@@ -31,6 +31,11 @@
 #define KLFLIBDBENGINE_P_H
 
 #include <QObject>
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QSqlDatabase>
+
+#include <klflib.h>
 
 
 /** \internal */
@@ -68,5 +73,64 @@ private:
 
 
 
+/** \internal
+ * A query prepared by KLFLibDBEngine::prepareQuerySql() */
+struct KLFLibDBQuerySql
+{
+  KLFLibDBQuerySql() : hasPostSqlCondition(false) { }
+
+  KLFLibResourceEngine::Query query;
+  QString sql;
+  QVariantList placeholders;
+  /** TRUE if (part of) the match condition must be tested on each row read, see
+   * KLFLibDBEngine::query() */
+  bool hasPostSqlCondition;
+  /** The properties needed to test the match condition */
+  QList<int> condProps;
+};
+
+
+/** \internal
+ * Runs a query in a worker thread with its own database connection, see
+ * KLFLibDBEngine::startQuery() */
+class KLFLibDBQueryJob : public QObject, public QRunnable
+{
+  Q_OBJECT
+public:
+  /** Number of entries reported at once by resultsAvailable() */
+  enum { ResultBatchSize = 100 };
+
+  KLFLibDBQueryJob(int queryId, const QSqlDatabase& db, const KLFLibDBQuerySql& s)
+    : QObject(NULL), pQueryId(queryId), pDriverName(db.driverName()),
+      pDatabaseName(db.databaseName()), pQuerySql(s), pCancelled(0)
+  {
+    // we're a QObject living in the GUI thread, see run()
+    setAutoDelete(false);
+  }
+
+  void run();
+
+  /** May be called from any thread */
+  void cancel() { pCancelled.storeRelease(1); }
+  bool isCancelled() const { return pCancelled.loadAcquire() != 0; }
+
+  /** Called by KLFLibDBEngine::execQuerySql() for each entry read */
+  void addResult(const KLFLibResourceEngine::KLFLibEntryWithId& e);
+
+signals:
+  void resultsAvailable(int queryId, const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries);
+  void finished(int queryId, int count);
+
+private:
+  int pQueryId;
+  QString pDriverName;
+  QString pDatabaseName;
+  KLFLibDBQuerySql pQuerySql;
+  QAtomicInt pCancelled;
+
+  QList<KLFLibResourceEngine::KLFLibEntryWithId> pBatch;
+};
+
+
 
 #endif
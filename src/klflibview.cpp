@@ -57,6 +57,7 @@
 #include <ui_klflibnewsubresdlg.h>
 
 #include <klfguiutil.h>
+#include <klfimageutil.h>
 #include "klfconfig.h"
 #include "klflibview.h"
 
@@ -64,110 +65,6 @@
 
 
 
-// ---------------------------------------------------
-
-/** \internal */
-static QImage transparentify_image(const QImage& img, qreal factor)
-{
-  // set the image opacity to factor (by multiplying each alpha value by factor)
-  QImage img2 = img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
-  int k, j;
-  for (k = 0; k < img.height(); ++k) {
-    for (j = 0; j < img.width(); ++j) {
-      QRgb c = img2.pixel(j, k);
-      img2.setPixel(j, k, qRgba(qRed(c),qGreen(c),qBlue(c),(int)(factor*qAlpha(c))));
-    }
-  }
-  return img2;
-}
-
-
-/** \internal */
-static QImage autocrop_image(const QImage& img, int alpha_threshold = 0)
-{
-  // crop transparent borders
-  int x, y;
-  int min_x = -1, max_x = -1, min_y = -1, max_y = -1;
-  // so first find borders
-  for (x = 0; x < img.width(); ++x) {
-    for (y = 0; y < img.height(); ++y) {
-      if (qAlpha(img.pixel(x,y)) - alpha_threshold > 0) {
-	// opaque pixel: include it.
-	if (min_x == -1 || min_x > x) min_x = x;
-	if (max_x == -1 || max_x < x) max_x = x;
-	if (min_y == -1 || min_y > y) min_y = y;
-	if (max_y == -1 || max_y < y) max_y = y;
-      }
-    }
-  }
-  return img.copy(QRect(QPoint(min_x, min_y), QPoint(max_x, max_y)));
-}
-
-/** \internal */
-static float color_distinguishable_distance(QRgb a, QRgb b, bool aPremultiplied = false) {
-  static const float C_r = 11.f,   C_g = 16.f,   C_b = 5.f;
-  static const float C_avg = (C_r + C_g + C_b) / 3.f;
-
-  // (?) really-> NO?  ON SECOND THOUGHT, REMOVE THIS FACTOR
-  //  // * drkfactor reduces distances for dark colors, accounting for the fact that the eye
-  //  //   distinguishes less dark colors than light colors
-  //  // * 0 <= qGray(...) <= 255
-  //  // * drkfactor <= 1 -> reducing factor
-  //  float drkfactor = 1 - (qGray(b)/1000.f);
-  static const float drkfactor = 1;
-
-  float alpha = qAlpha(a)/255.f;
-  QRgb m;
-  if (aPremultiplied)
-    m = qRgb((int)(qRed(a)+(1-alpha)*qRed(b)),
-	     (int)(qGreen(a)+(1-alpha)*qGreen(b)),
-	     (int)(qBlue(a)+(1-alpha)*qBlue(b)));
-  else
-    m = qRgb((int)(alpha*qRed(a)+(1-alpha)*qRed(b)),
-	     (int)(alpha*qGreen(a)+(1-alpha)*qGreen(b)),
-	     (int)(alpha*qBlue(a)+(1-alpha)*qBlue(b)));
-
-  float dst = qMax( qMax(C_r*abs(qRed(m) - qRed(b)), C_g*abs(qGreen(m) - qGreen(b))),
-		    C_b*abs(qBlue(m) - qBlue(b)) ) * drkfactor / C_avg;
-  // klfDbg("a="<<klfFmt("%#010x", a).data()<<" qRed(a)="<<qRed(a)<<" b="<<klfFmt("%#010x", b).data()
-  //	 <<" m="<<klfFmt("%#010x", m)<<"drkfactor="<<drkfactor<<" a/alpha="<<alpha<<" => distance="<<dst) ;
-  return dst;
-}
-
-
-/** \internal */
-static bool image_is_distinguishable(const QImage& imgsrc, QColor background, float threshold)
-{
-  int fmt = imgsrc.format();
-  bool apremultiplied;
-  QImage img;
-  switch (fmt) {
-  case QImage::Format_ARGB32: img = imgsrc; apremultiplied = false; break;
-  case QImage::Format_ARGB32_Premultiplied: img = imgsrc; apremultiplied = true; break;
-  default:
-   img = imgsrc.convertToFormat(QImage::Format_ARGB32);
-   apremultiplied = false;
-   break;
-  }
-  QRgb bg = background.rgb();
-  // crop transparent borders
-  int x, y;
-  for (x = 0; x < img.width(); ++x) {
-    for (y = 0; y < img.height(); ++y) {
-      //      klfDbg("src/format="<<imgsrc.format()<<"; thisformat="<<img.format()
-      //	     <<" Testing pixel at ("<<x<<","<<y<<") pixel="<<klfFmt("%#010x", img.pixel(x,y))) ;
-      float dist = color_distinguishable_distance(img.pixel(x,y), bg, apremultiplied);
-      if (dist > threshold) {
-	// ok we have one pixel at least we can distinguish.
-	return true;
-      }
-    }
-  }
-  return false;
-}
-
-
-
 // -------------------------------------------------------
 
 KLFAbstractLibView::KLFAbstractLibView(QWidget *parent)
@@ -427,7 +324,6 @@ void KLFLibModelCache::rebuildCache()
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
   klfDbg(klfFmtCC("flavorFlags=%#010x", pModel->pFlavorFlags));
-  int k;
 
   // report progress
 #ifndef KLF_WS_MAC
@@ -437,6 +333,9 @@ void KLFLibModelCache::rebuildCache()
   progressReporter.doReportProgress(0);
 #endif
 
+  // results of queries for the old tree are no longer of any use
+  cancelPendingQueries();
+
   klfDbgT("saving persistent indexes ...");
   QModelIndexList persistentIndexes = pModel->persistentIndexList();
   QList<KLFLibModel::PersistentId> persistentIndexIds = pModel->persistentIdList(persistentIndexes);
@@ -447,6 +346,8 @@ void KLFLibModelCache::rebuildCache()
   // clear cache first
   pEntryCache.clear();
   pCategoryLabelCache.clear();
+  pEntryIdIndex.clear();
+  pCategoryPathIndex.clear();
   // root category label MUST ALWAYS (in every display flavor) occupy index 0 in category label cache
   pCategoryLabelCache.append(CategoryLabelNode());
   CategoryLabelNode& root = pCategoryLabelCache[0];
@@ -454,47 +355,33 @@ void KLFLibModelCache::rebuildCache()
   root.categoryLabel = "/";
   root.allChildrenFetched = false;
 
-  QList<int> wantedProps = minimalistEntryPropIds();
-  KLFLibResourceEngine::Query q;
-  q.orderPropId = pLastSortPropId;
-  q.orderDirection = pLastSortOrder;
-  if (pModel->pFlavorFlags & KLFLibModel::CategoryTree) {
-    // fetch only elements in root category
-    KLFLib::PropertyMatch pmatch(KLFLibEntry::Category, KLFLib::StringMatch(QString("")));
-    q.matchCondition = KLFLib::EntryMatchCondition::mkPropertyMatch(pmatch);
-  }
-  q.wantedEntryProperties = minimalistEntryPropIds();
-  q.limit = pModel->pFetchBatchCount; // limit number of results
+  // fetch the first batch of root entries right away, so that the persistent indexes can be
+  // restored below. The remaining entries are queried in the background.
+  KLFLibResourceEngine::Query q = fetchMoreQuery(NodeId::rootNode(), pModel->pFetchBatchCount);
   KLFLibResourceEngine::QueryResult qr(KLFLibResourceEngine::QueryResult::FillEntryWithIdList);
-  // query the resource
   klfDbgT("about to query resource...");
   int count = pModel->pResource->query(pModel->pResource->defaultSubResource(), q, &qr);
   klfDbgT("resource returned "<<count<<" entries.");
   if (count < 0) {
     qWarning()<<KLF_FUNC_NAME<<": query() returned an error.";
     // don't return, continue with empty list
-  }
-  if (count < pModel->pFetchBatchCount) {
+  } else if (q.limit == -1 || count < q.limit) {
     // we have fetched all children
     klfDbg("all children have been fetched.") ;
-    root.allChildrenFetched = true;
+    getCategoryLabelNodeRef(NodeId::rootNode()).allChildrenFetched = true;
   }
-  const QList<KLFLibResourceEngine::KLFLibEntryWithId>& everything = qr.entryWithIdList;
-  QList<KLFLibResourceEngine::KLFLibEntryWithId>::const_iterator it;
-
-  k = 0; // used for progress reporting
-  for (it = everything.begin(); it != everything.end(); ++it) {
-    const KLFLibResourceEngine::KLFLibEntryWithId& ewid = *it;
-    klfDbgT( "Adding entry id="<<ewid.id<<"; entry="<<ewid.entry ) ;
+  const QList<KLFLibResourceEngine::KLFLibEntryWithId>& firstbatch = qr.entryWithIdList;
+  setFetchedAfter(NodeId::rootNode(), firstbatch);
+  int k;
+  for (k = 0; k < firstbatch.size(); ++k) {
     EntryNode e;
-    e.entryid = ewid.id;
+    e.entryid = firstbatch[k].id;
     e.minimalist = true;
-    e.entry = ewid.entry;
+    e.entry = firstbatch[k].entry;
     treeInsertEntry(e, true); // rebuildingCache=TRUE
-
 #ifndef KLF_WS_MAC
     if (k % 10 == 0)
-      progressReporter.doReportProgress((++k) * 100 / everything.size());
+      progressReporter.doReportProgress((k+1) * 100 / firstbatch.size());
 #endif
   }
 
@@ -525,7 +412,6 @@ void KLFLibModelCache::rebuildCache()
     // prefetch root items if they contain little number of children
     // or if there are little number of root items
     int numRootItems = pModel->rowCount(QModelIndex());
-    int k;
     for (k = 0; k < pModel->rowCount(QModelIndex()); ++k) {
       QModelIndex i = pModel->index(k, 0, QModelIndex());
       if (pModel->rowCount(i) < 6 || numRootItems < 6) {
@@ -546,6 +432,9 @@ void KLFLibModelCache::rebuildCache()
   pModel->changePersistentIndexList(persistentIndexes, newPersistentIndexes);
   klfDbg("... done restoring persistent indexes.");
 
+  // the remaining entries are queried in the background, and inserted as they come
+  fetchMoreAsync(NodeId::rootNode());
+
   klfDbgT( " end of func" ) ;
 }
 
@@ -786,7 +675,103 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
     return;
   }
 
+  // a background fetch of the same children would now give duplicates
+  cancelPendingQueries(n);
+
   // fetch more items, using query().
+  KLFLibResourceEngine::Query q = fetchMoreQuery(n, fetchBatchCount);
+  KLFLibResourceEngine::QueryResult qr(KLFLibResourceEngine::QueryResult::FillEntryWithIdList);
+  // _query()_ the resource
+  int count = pModel->pResource->query(pModel->pResource->defaultSubResource(), q, &qr);
+  if (count < 0) {
+    qWarning()<<KLF_FUNC_NAME<<": error fetching more results: count is "<<count;
+    pIsFetchingMore = false;
+    return;
+  }
+
+  // if we fetched all the remaining entries, then set allChildrenFetched to TRUE
+  appendFetchedEntries(n, qr.entryWithIdList, count < q.limit);
+
+  pIsFetchingMore = false;
+}
+
+void KLFLibModelCache::fetchMoreAsync(NodeId n, int fetchBatchCount)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME);
+
+  if (fetchBatchCount < 0) // set default value
+    fetchBatchCount = pModel->pFetchBatchCount;
+
+  if (!n.valid())
+    n = NodeId::rootNode();
+
+  if (n.kind != CategoryLabelKind) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't fetch more children of a non-category-label node.";
+    return;
+  }
+  if (getCategoryLabelNodeRef(n).allChildrenFetched)
+    return;
+
+  QMap<int,PendingQuery>::const_iterator it;
+  for (it = pPendingQueries.begin(); it != pPendingQueries.end(); ++it) {
+    if ((*it).parentId == n) {
+      klfDbg("already fetching children of "<<n) ;
+      return;
+    }
+  }
+
+  KLFLibResourceEngine::Query q = fetchMoreQuery(n, fetchBatchCount);
+  int queryId = pModel->pResource->startQuery(pModel->pResource->defaultSubResource(), q);
+  pPendingQueries[queryId] = PendingQuery(n, q.limit);
+}
+
+void KLFLibModelCache::cancelPendingQueries(NodeId parentId)
+{
+  QMap<int,PendingQuery>::iterator it = pPendingQueries.begin();
+  while (it != pPendingQueries.end()) {
+    if (!parentId.valid() || (*it).parentId == parentId) {
+      klfDbg("cancelling query "<<it.key()) ;
+      pModel->pResource->cancelQuery(it.key());
+      it = pPendingQueries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void KLFLibModelCache::queryResultsAvailable(int queryId,
+					     const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries)
+{
+  if (!pPendingQueries.contains(queryId))
+    return; // not ours
+
+  // don't let the views fetch more while we insert the rows
+  bool wasfetchingmore = pIsFetchingMore;
+  pIsFetchingMore = true;
+  appendFetchedEntries(pPendingQueries[queryId].parentId, entries, false);
+  pIsFetchingMore = wasfetchingmore;
+}
+
+void KLFLibModelCache::queryFinished(int queryId, int count)
+{
+  if (!pPendingQueries.contains(queryId))
+    return; // not ours
+
+  PendingQuery pq = pPendingQueries.take(queryId);
+  if (count < 0) {
+    qWarning()<<KLF_FUNC_NAME<<": error fetching more results: count is "<<count;
+    return;
+  }
+  // if we fetched all the remaining entries, then set allChildrenFetched to TRUE
+  if (pq.limit == -1 || count < pq.limit)
+    getCategoryLabelNodeRef(pq.parentId).allChildrenFetched = true;
+}
+
+// private
+KLFLibResourceEngine::Query KLFLibModelCache::fetchMoreQuery(NodeId n, int fetchBatchCount)
+{
+  const CategoryLabelNode& noderef = getCategoryLabelNodeRef(n);
+
   KLFLibResourceEngine::Query q;
   if (pModel->pFlavorFlags & KLFLibModel::CategoryTree) {
     QString c = KLFLibEntry::normalizeCategoryPath(noderef.fullCategoryPath);
@@ -795,51 +780,88 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
   }
   q.orderPropId = pLastSortPropId;
   q.orderDirection = pLastSortOrder;
-  q.limit = pModel->pFetchBatchCount;
-  q.skip = noderef.children.size();
+  q.limit = fetchBatchCount;
   q.wantedEntryProperties = minimalistEntryPropIds();
-  KLFLibResourceEngine::QueryResult qr(KLFLibResourceEngine::QueryResult::FillEntryWithIdList);
-  // _query()_ the resource
-  int count = pModel->pResource->query(pModel->pResource->defaultSubResource(), q, &qr);
-  if (count < 0) {
-    qWarning()<<KLF_FUNC_NAME<<": error fetching more results: count is "<<count;
-    pIsFetchingMore = false;
-    return;
+  // we need the sort property of the results to continue after them, see setFetchedAfter()
+  if (pLastSortPropId >= 0 && !q.wantedEntryProperties.contains(pLastSortPropId))
+    q.wantedEntryProperties << pLastSortPropId;
+  // continue after the last entry the resource gave us, rather than having it go through all
+  // the entries we already have again. (Not after our last child, which may have been inserted
+  // by treeInsertEntry(): the entries between would be skipped.)
+  if (noderef.fetchedAfterId != -1) {
+    q.afterId = noderef.fetchedAfterId;
+    q.afterOrderValue = noderef.fetchedAfterOrderValue;
   }
+  return q;
+}
+
+// private
+void KLFLibModelCache::setFetchedAfter(NodeId n, const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries)
+{
+  if (entries.isEmpty())
+    return;
+  CategoryLabelNode& noderef = getCategoryLabelNodeRef(n);
+  noderef.fetchedAfterId = entries.last().id;
+  noderef.fetchedAfterOrderValue = QVariant();
+  if (pLastSortPropId >= 0)
+    noderef.fetchedAfterOrderValue = entries.last().entry.property(pLastSortPropId);
+}
 
+// private
+void KLFLibModelCache::appendFetchedEntries(NodeId n,
+					    const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries,
+					    bool allChildrenFetched)
+{
   /** \todo ....... the items are _appended_. this supposes that the items that may have already
    * been listed as children nodes are the beginning, and that what we fetched is what
    * follows. This order must be enforced when updating data, for eg. an entry category
    * change. (in updateData()).
    */
 
+  // the next query continues after these, including any we skip below
+  setFetchedAfter(n, entries);
+
+  // entries which were inserted with treeInsertEntry() since we fetched the previous ones
+  // may be listed again, skip them
+  QList<KLFLibResourceEngine::KLFLibEntryWithId> newentries;
+  int k;
+  for (k = 0; k < entries.size(); ++k) {
+    if (!findEntryId(entries[k].id).valid())
+      newentries << entries[k];
+  }
+
+  if (newentries.isEmpty()) {
+    if (allChildrenFetched)
+      getCategoryLabelNodeRef(n).allChildrenFetched = true;
+    return;
+  }
+
   // append all results into category-label-noderef 'noderef'
 
-  // notify any views
-  pModel->startLayoutChange(false);
-  pModel->beginInsertRows(createIndexFromId(n, -1, 0), noderef.children.size(),
-			  noderef.children.size() + qr.entryWithIdList.size()-1);
+  // notify any views. The rows are appended, so the existing (persistent) indexes don't move.
+  QModelIndex parentindex = createIndexFromId(n, -1, 0);
+  CategoryLabelNode& noderef = getCategoryLabelNodeRef(n);
+  pModel->beginInsertRows(parentindex, noderef.children.size(),
+			  noderef.children.size() + newentries.size()-1);
 
-  // if we fetched all the remaining entries, then set allChildrenFetched to TRUE
-  if (count < q.limit) {
+  if (allChildrenFetched)
     noderef.allChildrenFetched = true;
-  }
 
-  int k;
-  for (k = 0; k < qr.entryWithIdList.size(); ++k) {
-    const KLFLibResourceEngine::KLFLibEntryWithId& ewid = qr.entryWithIdList[k];
+  for (k = 0; k < newentries.size(); ++k) {
+    const KLFLibResourceEngine::KLFLibEntryWithId& ewid = newentries[k];
     EntryNode e;
     e.entryid = ewid.id;
     e.minimalist = true;
     e.entry = ewid.entry;
     e.parent = n;
-    pEntryCache.append(e);
     NodeId entryindex;
     entryindex.kind = EntryKind;
-    entryindex.index = pEntryCache.size()-1;
+    entryindex.index = pEntryCache.insertNewNode(e);
+    pEntryIdIndex.insert(e.entryid, entryindex.index);
 
     klfDbg("appending "<<e<<" in category node.") ;
 
+    // noderef is still valid: pEntryCache and pCategoryLabelCache are separate lists
     noderef.children.append(entryindex);
   }
 
@@ -847,12 +869,8 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
   fullDump();
 
   pModel->endInsertRows();
-  klfDbg("signal emitted. restore persistent indexes...") ;
-  pModel->endLayoutChange(false);
-
-  klfDbg("views notified, persistent indexes restored.") ;
 
-  pIsFetchingMore = false;
+  klfDbg("views notified.") ;
 }
 
 
@@ -868,14 +886,19 @@ void KLFLibModelCache::updateData(const QList<KLFLib::entryId>& entryIdList, int
     return;
   }
 
-  if (entryIdList.size() > 10 &&
-      (entryIdList.size() > pEntryCache.size()/3 || entryIdList.size() > 100)) {
-    // too big a modification, just rebuild the cache
+  if (entryIdList.size() > 100 && entryIdList.size() > pEntryCache.size()/3) {
+    // too big a modification, just rebuild the cache. Smaller modifications are applied to
+    // the tree one entry at a time, each one only notifying the views of the rows it inserts
+    // or removes.
     klfDbg("Performing full refresh.") ;
     rebuildCache();
     return;
   }
 
+  // background fetches might return the entries we're about to insert, and the nodes they
+  // append to may change. The views will ask for more again.
+  cancelPendingQueries();
+
 #ifndef KLF_WS_MAC
   // progress reporting [here, not above, because rebuildCache() has its own progress reporting]
   KLFProgressReporter progressReporter(0, entryIdList.size(), NULL);
@@ -921,7 +944,8 @@ void KLFLibModelCache::updateData(const QList<KLFLib::entryId>& entryIdList, int
 	klfDbg("entry change: old="<<oldentry<<"; new="<<newentry) ;
 	// the modified entry may have a different category, move it if needed
 	if (newentry.category() != oldentry.category() && (pModel->pFlavorFlags & KLFLibModel::CategoryTree)) {
-	  pModel->startLayoutChange(false);
+	  // treeTakeEntry() and treeInsertEntry() notify the views of the rows they remove and
+	  // insert, no need for a layout change
 	  EntryNode entrynode = treeTakeEntry(n, true); // remove it from its position in tree
 	  // klfDbg( "\tremoved entry. dump:\n"
 	  //         <<"\t Entry Cache="<<pEntryCache<<"\n\t CategoryLabelCache = "<<pCategoryLabelCache ) ;
@@ -931,8 +955,7 @@ void KLFLibModelCache::updateData(const QList<KLFLib::entryId>& entryIdList, int
 	  entrynode.entry = newentry;
 	  // and insert it at the (new) correct position (automatically positioned!)
 	  treeInsertEntry(entrynode);
-	  pModel->endLayoutChange(false);
-	  QModelIndex idx = createIndexFromId(n, -1, 0);
+	  QModelIndex idx = createIndexFromId(findEntryId(entryIdList[k]), -1, 0);
 	  emit pModel->dataChanged(idx, idx);
 	} else {
 	  // just some data change
@@ -1011,6 +1034,12 @@ void KLFLibModelCache::treeInsertEntry(const EntryNode& entrynode, bool rebuildi
 
   NodeId parentid = NodeId(CategoryLabelKind, catindex);
 
+  // the entry may already have been fetched along with its neighbours
+  if (findEntryId(entrynode.entryid).valid()) {
+    klfDbg("entry "<<entrynode.entryid<<" is already in the tree") ;
+    return;
+  }
+
   // now actually create the entry cache node
   int index = pEntryCache.insertNewNode(entrynode);
   NodeId n = NodeId(EntryKind, index);
@@ -1042,8 +1071,10 @@ void KLFLibModelCache::treeInsertEntry(const EntryNode& entrynode, bool rebuildi
     } while (retry);
     // by fetching more, we may possibly have actually fetched the entry that we were instructed to insert
     // in the first place. Check.
-    if (insertPos < childlistref.size() && childlistref[insertPos] == n)
+    if (findEntryId(entrynode.entryid).valid()) {
+      pEntryCache.unlinkNode(n);
       return; // job already done.
+    }
   }
 
   CategoryLabelNode &catLabelNodeRef = getCategoryLabelNodeRef(parentid);
@@ -1058,6 +1089,7 @@ void KLFLibModelCache::treeInsertEntry(const EntryNode& entrynode, bool rebuildi
 	 qPrintable(catLabelNodeRef.fullCategoryPath));
 
   pEntryCache[n.index].parent = parentid; // set the parent, thus validating the node
+  pEntryIdIndex.insert(entrynode.entryid, n.index);
 
   childlistref.insert(insertPos, n); // insert into list of children
 
@@ -1110,9 +1142,11 @@ KLFLibModelCache::EntryNode KLFLibModelCache::treeTakeEntry(const NodeId& nodeid
     // remove 'n'
     if (n.kind == EntryKind) {
       klfDbg("unlinking entry node "<<n);
+      pEntryIdIndex.remove(pEntryCache[n.index].entryid);
       pEntryCache.unlinkNode(n);
     } else if (n.kind == CategoryLabelKind) {
       klfDbg("unlinking category label node "<<n);
+      pCategoryPathIndex.remove(pCategoryLabelCache[n.index].fullCategoryPath);
       pCategoryLabelCache.unlinkNode(n);
     } else {
       qWarning()<<KLF_FUNC_NAME<<": unlinking elements: unknown node kind in id="<<n<<"!";
@@ -1140,14 +1174,10 @@ KLFLibModelCache::IndexType
 
   QString catelpath = catelements.join("/");
 
-  int i;
-  for (i = 0; i < pCategoryLabelCache.size(); ++i) {
-    if (pCategoryLabelCache.isAllocated(i) &&
-	pCategoryLabelCache[i].parent.valid() &&
-	pCategoryLabelCache[i].fullCategoryPath == catelpath) {
-      // found the valid category label
-      return i;
-    }
+  QHash<QString, IndexType>::const_iterator it = pCategoryPathIndex.constFind(catelpath);
+  if (it != pCategoryPathIndex.constEnd()) {
+    // found the valid category label
+    return *it;
   }
   if (catelements.isEmpty())
     return 0; // index of root category label
@@ -1198,6 +1228,7 @@ KLFLibModelCache::IndexType
 
   childlistref.insert(insertPos, NodeId(CategoryLabelKind, this_index));
   pCategoryLabelCache[this_index].parent = NodeId(CategoryLabelKind, parent_index);
+  pCategoryPathIndex.insert(catelpath, this_index);
 
   if (notifyQtApi)
     pModel->endInsertRows();
@@ -1425,22 +1456,13 @@ QModelIndexList KLFLibModelCache::findEntryIdList(const QList<KLFLib::entryId>&
 {
   klfDbg( ": eidlist="<<eidlist ) ;
   int k;
-  int count = 0;
   QModelIndexList indexlist;
-  // pre-fill index list
-  for (k = 0; k < eidlist.size(); ++k)
-    indexlist << QModelIndex();
-
-  // walk entry list
-  for (k = 0; k < pEntryCache.size(); ++k) {
-    if (!pEntryCache[k].entryIsValid())
-      continue;
-    int i = eidlist.indexOf(pEntryCache[k].entryid);
-    if (i >= 0) {
-      indexlist[i] = createIndexFromId(NodeId(EntryKind, k), -1, 0);
-      if (++count == eidlist.size())
-	break; // found 'em all
-    }
+  for (k = 0; k < eidlist.size(); ++k) {
+    NodeId n = findEntryId(eidlist[k]);
+    if (n.valid())
+      indexlist << createIndexFromId(n, -1, 0);
+    else
+      indexlist << QModelIndex();
   }
   return indexlist;
 }
@@ -1448,10 +1470,9 @@ QModelIndexList KLFLibModelCache::findEntryIdList(const QList<KLFLib::entryId>&
 KLFLibModelCache::NodeId KLFLibModelCache::findEntryId(KLFLib::entryId eId)
 {
   klfDbg("eId="<<eId) ;
-  int k;
-  for (k = 0; k < pEntryCache.size(); ++k)
-    if (pEntryCache[k].entryid == eId && pEntryCache[k].entryIsValid())
-      return NodeId(EntryKind, k);
+  QHash<KLFLib::entryId, IndexType>::const_iterator it = pEntryIdIndex.constFind(eId);
+  if (it != pEntryIdIndex.constEnd() && pEntryCache[*it].entryIsValid())
+    return NodeId(EntryKind, *it);
 
   klfDbg("...not found.") ;
   return NodeId();
@@ -1540,7 +1561,7 @@ void KLFLibModelCache::dumpNodeTree(NodeId node, int indent)
 
 
 KLFLibModel::KLFLibModel(KLFLibResourceEngine *engine, uint flavorFlags, QObject *parent)
-  : QAbstractItemModel(parent), pFlavorFlags(flavorFlags)
+  : QAbstractItemModel(parent), pResource(NULL), pFlavorFlags(flavorFlags)
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
 
@@ -1579,7 +1600,18 @@ void KLFLibModel::setResource(KLFLibResourceEngine *resource)
 
   KLF_DEBUG_ASSIGN_SAME_REF_INSTANCE(pCache) ;
 
+  if (pResource != NULL) {
+    pCache->cancelPendingQueries();
+    disconnect(pResource, SIGNAL(queryResultsAvailable(int, const QList<KLFLibResourceEngine::KLFLibEntryWithId>&)),
+	       this, SLOT(slotQueryResultsAvailable(int, const QList<KLFLibResourceEngine::KLFLibEntryWithId>&)));
+    disconnect(pResource, SIGNAL(queryFinished(int, int)), this, SLOT(slotQueryFinished(int, int)));
+  }
+
   pResource = resource;
+  // the results of the queries we start ourselves (see KLFLibModelCache::fetchMoreAsync())
+  connect(pResource, SIGNAL(queryResultsAvailable(int, const QList<KLFLibResourceEngine::KLFLibEntryWithId>&)),
+	  this, SLOT(slotQueryResultsAvailable(int, const QList<KLFLibResourceEngine::KLFLibEntryWithId>&)));
+  connect(pResource, SIGNAL(queryFinished(int, int)), this, SLOT(slotQueryFinished(int, int)));
   updateCacheSetupModel();
 }
 
@@ -1905,11 +1937,28 @@ bool KLFLibModel::canFetchMore(const QModelIndex& parent) const
   return pCache->canFetchMore(pCache->getNodeForIndex(parent));
 }
 void KLFLibModel::fetchMore(const QModelIndex& parent)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  // the views don't need the rows right away, don't block them
+  pCache->fetchMoreAsync(pCache->getNodeForIndex(parent), pFetchBatchCount);
+}
+void KLFLibModel::fetchMoreNow(const QModelIndex& parent)
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
   pCache->fetchMore(pCache->getNodeForIndex(parent), pFetchBatchCount);
 }
 
+void KLFLibModel::slotQueryResultsAvailable(int queryId,
+					    const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries)
+{
+  pCache->queryResultsAvailable(queryId, entries);
+}
+
+void KLFLibModel::slotQueryFinished(int queryId, int count)
+{
+  pCache->queryFinished(queryId, count);
+}
+
 
 Qt::DropActions KLFLibModel::supportedDropActions() const
 {
@@ -2147,7 +2196,7 @@ QImage KLFLibModel::dragImage(const QModelIndexList& indexes)
     QPointF lastimgbr;
     for (k = 0; k < N; ++k) {
       // and add this image
-      QImage i = transparentify_image(previewlist[k], 0.7);
+      QImage i = klfImageScaleAlpha(previewlist[k], 0.7);
       p.drawImage(P, i);
       // p.drawRect(QRectF(P, s1));
       lastimgbr = P+sizeToPointF(i.size());
@@ -2163,7 +2212,11 @@ QImage KLFLibModel::dragImage(const QModelIndexList& indexes)
     }
   }
 
-  return autocrop_image(image);
+  // crop transparent borders
+  QRect opaquerect = klfImageOpaqueRect(image);
+  if (opaquerect.isNull())
+    return image;
+  return image.copy(opaquerect);
 }
 
 
@@ -2507,6 +2560,7 @@ KLFLibViewDelegate::KLFLibViewDelegate(QObject *parent)
     pPreviewSize(klfconfig.UI.labelOutputFixedSize)
 {
   pAutoBackgroundItems = true;
+  pPreviewPixmapCache.setMaxCost(32*1024); // 32 MB
 }
 KLFLibViewDelegate::~KLFLibViewDelegate()
 {
@@ -2626,58 +2680,28 @@ void KLFLibViewDelegate::paintEntry(PaintPrivate *p, const QModelIndex& index) c
       // ### space pixels (for retina displays for example).
       qreal dpr = p->p->device()->devicePixelRatioF();
       QImage img = index.data(KLFLibModel::entryItemRole(KLFLibEntry::Preview)).value<QImage>();
-      // now these are actual device pixels...
-      QImage img2 = img.scaled(p->innerRectImage.size()*dpr, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-      if (p->isselected) {
-	img2 = transparentify_image(img2, 0.85);
+      QSize devsize = p->innerRectImage.size()*dpr;
+      int glowr = 0;
+      if (klfconfig.UI.glowEffect)
+	glowr = klfconfig.UI.glowEffectRadius;
+      QColor glowcolor = klfconfig.UI.glowEffectColor;
+      // scaling, choosing a background and drawing the glow are expensive, so the resulting
+      // pixmap is cached. The image's cache key changes when the preview changes.
+      QString key = QString("%1/%2/%3x%4@%5/%6/%7/%8/%9")
+	.arg(index.data(KLFLibModel::EntryIdItemRole).toInt()).arg(img.cacheKey())
+	.arg(devsize.width()).arg(devsize.height()).arg(dpr).arg((int)p->isselected)
+	.arg(pAutoBackgroundItems ? p->background.color().name(QColor::HexArgb) : QString())
+	.arg(glowr).arg(glowcolor.name(QColor::HexArgb));
+      QPixmap *pix = pPreviewPixmapCache.object(key);
+      if (pix == NULL) {
+	pix = new QPixmap(makePreviewPixmap(p, img, devsize, dpr, glowr, glowcolor));
+	pPreviewPixmapCache.insert(key, pix, qMax(1, pix->width()*pix->height()*4/1024));
       }
+      // the pixmap has a margin of glowr around the image
+      QSize imgsize = pix->size()/dpr - QSize(2*glowr, 2*glowr);
       QPoint pos = p->innerRectImage.topLeft()
-	+ QPoint(0, (p->innerRectImage.height()-img2.height()/dpr) / 2);
-      if (pAutoBackgroundItems) {
-	// draw image on different background if it can't be "distinguished" from default background
-	// (eg. a transparent white formula)
-	klfDbg( " BG Brush is "<<p->background ) ;
-	QColor bgcolor = p->background.color();
-	QList<QColor> bglista, bglistb, bglist;
-	// 	bglist << bgcolor
-	// 	       << QColor(255,255,255)
-	// 	       << QColor(220,220,220)
-	// 	       << QColor(180,190,190)
-	// 	       << QColor(200,200,200)
-	// 	       << QColor(150,150,150)
-	// 	       << QColor(100,100,100)
-	// 	       << QColor(50,50,50)
-	// 	       << QColor(0,0,0);
-	bglist << bgcolor; // first try: default color (!)
-	bglista = bglistb = bglist;
-	int count;
-	for (count = 0; count < 5; ++count) // suggest N (ever) darker colors
-	  bglista << bglista.last().darker(105+count*2);
-	for (count = 0; count < 5; ++count) // and N (ever) lighter colors
-	  bglistb << bglistb.last().lighter(105+count*2);
-	// build the full list, and always provide white, and black to be sure
-	bglist << bglista.mid(1) << bglistb.mid(1) << QColor(255,255,255) << QColor(0,0,0);
-	klfDbg( "alt. bg list is "<<bglist );
-	int k;
-	for (k = 0; k < bglist.size(); ++k) {
-	  //	  klfDbg( "calling image_is_distinguishable on entry with latex="
-	  //		  <<index.data(KLFLibModel::entryItemRole(KLFLibEntry::Latex)).toString() );
-	  bool distinguishable = image_is_distinguishable(img2, bglist[k], 20); // 30
-	  if ( distinguishable )
-	    break; // got distinguishable color
-	}
-	// if the background color is not the default one, fill the background with that color
-	if (k > 0 && k < bglist.size())
-	  p->p->fillRect(QRect(pos, img2.size()/dpr), QBrush(bglist[k]));
-      }
-      // and draw the equation
-      p->p->save();
-      p->p->translate(pos);
-      if (klfconfig.UI.glowEffect) {
-	klfDrawGlowedImage(p->p, img2, klfconfig.UI.glowEffectColor, klfconfig.UI.glowEffectRadius, false);
-      }
-      p->p->drawImage(QRect(QPoint(0,0), img2.size()/dpr), img2);
-      p->p->restore();
+	+ QPoint(0, (p->innerRectImage.height()-imgsize.height()) / 2);
+      p->p->drawPixmap(pos - QPoint(glowr, glowr), *pix);
       break;
     }
   case KLFLibEntry::Category:
@@ -2704,6 +2728,64 @@ void KLFLibViewDelegate::paintEntry(PaintPrivate *p, const QModelIndex& index) c
   }
 }
 
+QPixmap KLFLibViewDelegate::makePreviewPixmap(PaintPrivate *p, const QImage& img, const QSize& devsize,
+					     qreal dpr, int glowr, const QColor& glowcolor) const
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  // ### PhF: we must be careful to make a difference between device pixels and user
+  // ### space pixels (for retina displays for example).
+  // now these are actual device pixels...
+  QImage img2 = img.scaled(devsize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+  if (p->isselected) {
+    img2 = klfImageScaleAlpha(img2, 0.85);
+  }
+  QColor fillcolor;
+  if (pAutoBackgroundItems) {
+    // draw image on different background if it can't be "distinguished" from default background
+    // (eg. a transparent white formula)
+    klfDbg( " BG Brush is "<<p->background ) ;
+    QColor bgcolor = p->background.color();
+    QList<QColor> bglista, bglistb, bglist;
+    bglist << bgcolor; // first try: default color (!)
+    bglista = bglistb = bglist;
+    int count;
+    for (count = 0; count < 5; ++count) // suggest N (ever) darker colors
+      bglista << bglista.last().darker(105+count*2);
+    for (count = 0; count < 5; ++count) // and N (ever) lighter colors
+      bglistb << bglistb.last().lighter(105+count*2);
+    // build the full list, and always provide white, and black to be sure
+    bglist << bglista.mid(1) << bglistb.mid(1) << QColor(255,255,255) << QColor(0,0,0);
+    klfDbg( "alt. bg list is "<<bglist );
+    int k;
+    for (k = 0; k < bglist.size(); ++k) {
+      bool distinguishable = klfImageIsDistinguishable(img2, bglist[k], 20); // 30
+      if ( distinguishable )
+	break; // got distinguishable color
+    }
+    // if the background color is not the default one, fill the background with that color
+    if (k > 0 && k < bglist.size())
+      fillcolor = bglist[k];
+  }
+
+  // leave room for the glow around the image
+  QPixmap pix(img2.size() + QSize(2*glowr, 2*glowr)*dpr);
+  pix.setDevicePixelRatio(dpr);
+  pix.fill(Qt::transparent);
+  QPainter pp(&pix);
+  pp.translate(glowr, glowr);
+  QRect imgrect(QPoint(0,0), img2.size()/dpr);
+  if (fillcolor.isValid())
+    pp.fillRect(imgrect, QBrush(fillcolor));
+  // and draw the equation
+  if (glowr > 0) {
+    klfDrawGlowedImage(&pp, img2, glowcolor, glowr, false);
+  }
+  pp.drawImage(imgrect, img2);
+  pp.end();
+  return pix;
+}
+
 void KLFLibViewDelegate::paintCategoryLabel(PaintPrivate *p, const QModelIndex& index) const
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
@@ -3642,7 +3724,7 @@ bool KLFLibDefaultView::func_selectAll(const QModelIndex& parent, uint selectAll
   // this function requires to fetch all items in parent!
 
   while (pModel->canFetchMore(parent)) {
-    pModel->fetchMore(parent);
+    pModel->fetchMoreNow(parent);
     pleaseWait->process();
     if (pleaseWait->wasUserDiscarded())
       return false;
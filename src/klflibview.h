@@ -37,6 +37,8 @@
 #include <QTextCharFormat>
 #include <QStandardItemModel>
 #include <QListView>
+#include <QCache>
+#include <QPixmap>
 
 #include <klfdefs.h>
 #include <klflib.h>
@@ -528,7 +530,11 @@ public:
   virtual int columnCount(const QModelIndex &parent = QModelIndex()) const;
 
   virtual bool canFetchMore(const QModelIndex& parent) const;
+  /** Starts fetching more children of \c parent in the background. The rows are inserted
+   * once the resource has reported them. */
   virtual void fetchMore(const QModelIndex& parent);
+  /** Same as \ref fetchMore(), but returns only once the new rows have been inserted. */
+  virtual void fetchMoreNow(const QModelIndex& parent);
 
   virtual Qt::DropActions supportedDropActions() const;
 
@@ -599,6 +605,11 @@ public slots:
   /** how many items to fetch at a time when fetching preview and style (non-minimalist) */
   virtual void setFetchBatchCount(int count) { pFetchBatchCount = count; }
 
+private slots:
+  void slotQueryResultsAvailable(int queryId,
+				 const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries);
+  void slotQueryFinished(int queryId, int count);
+
 private:
 
   friend class KLFLibModelCache;
@@ -705,6 +716,10 @@ protected:
   };
 
   virtual void paintEntry(PaintPrivate *p, const QModelIndex& index) const;
+  /** The preview \c img as drawn by paintEntry(): scaled to \c devsize device pixels, with a
+   * background if needed and with a glow of radius \c glowr (if not zero) */
+  QPixmap makePreviewPixmap(PaintPrivate *p, const QImage& img, const QSize& devsize, qreal dpr,
+			    int glowr, const QColor& glowcolor) const;
   virtual void paintCategoryLabel(PaintPrivate *p, const QModelIndex& index) const;
 
   enum { PTF_HighlightSearch        = 0x0001,
@@ -734,6 +749,10 @@ private:
   bool pAutoBackgroundItems;
   QColor pAutoBackgroundColor;
 
+  /** The previews as painted by paintEntry() (scaled, with their background and glow), so that
+   * they don't have to be computed again at each repaint. The cost is in kilobytes. */
+  mutable QCache<QString,QPixmap> pPreviewPixmapCache;
+
   //  QMap<QPersistentModelIndex, bool> pExpandedIndexes;
 
   struct ColorRegion {
@@ -34,6 +34,7 @@
 
 #include <QApplication>
 #include <QStringList>
+#include <QHash>
 #include <QAbstractItemView>
 #include <QTreeView>
 #include <QListView>
@@ -149,44 +150,56 @@ public:
     KLFLibEntry entry;
   };
   struct CategoryLabelNode : public Node {
-    CategoryLabelNode() : Node(CategoryLabelKind), categoryLabel(), fullCategoryPath()  { }
+    CategoryLabelNode() : Node(CategoryLabelKind), categoryLabel(), fullCategoryPath(),
+			  fetchedAfterId(-1), fetchedAfterOrderValue()  { }
     CategoryLabelNode(const CategoryLabelNode& copy)
-      : Node(copy), categoryLabel(copy.categoryLabel), fullCategoryPath(copy.fullCategoryPath) { }
+      : Node(copy), categoryLabel(copy.categoryLabel), fullCategoryPath(copy.fullCategoryPath),
+	fetchedAfterId(copy.fetchedAfterId), fetchedAfterOrderValue(copy.fetchedAfterOrderValue) { }
     //! The last element in \ref fullCategoryPath eg. "General Relativity"
     QString categoryLabel;
     //! The full category path of this category eg. "Physics/General Relativity"
     QString fullCategoryPath;
+    /** \brief The last entry the resource returned when fetching the children of this node, see
+     * KLFLibResourceEngine::Query::afterId
+     *
+     * This is not necessarily the last child: entries inserted with treeInsertEntry() may come
+     * after it. -1 if no entry was fetched yet. */
+    KLFLib::entryId fetchedAfterId;
+    //! The value of the sort property of the entry \ref fetchedAfterId
+    QVariant fetchedAfterOrderValue;
   };
 
   template<class N>
   class NodeCache : public QList<N> {
   public:
-    NodeCache() : QList<N>(), pContainsNonAllocated(false) { }
+    NodeCache() : QList<N>(), pFreeIndexes() { }
 
     inline bool isAllocated(IndexType i) { return QList<N>::at(i).allocated; }
 
+    void clear() {
+      QList<N>::clear();
+      pFreeIndexes.clear();
+    }
+
     IndexType insertNewNode(const N& n) {
-      IndexType insertPos = QList<N>::size();
-      if (pContainsNonAllocated) {
-	// walk the cache, and find an invalid node
-	for (insertPos = 0; insertPos < QList<N>::size() && QList<N>::at(insertPos).allocated; ++insertPos)
-	  ;
-      }
-      if (insertPos == QList<N>::size()) {
-	pContainsNonAllocated = false;
-	this->append(n);
+      if (!pFreeIndexes.isEmpty()) {
+	// reuse the space of an unlinked node
+	IndexType insertPos = pFreeIndexes.takeLast();
+	QList<N>::operator[](insertPos) = n;
 	return insertPos;
       }
-      QList<N>::operator[](insertPos) = n;
-      return insertPos;
+      this->append(n);
+      return QList<N>::size()-1;
     }
 
     /** \warning: you must check manually before calling this function that \c nid is right kind! */
     inline void unlinkNode(const NodeId& nid) { unlinkNode(nid.index); }
     void unlinkNode(IndexType index) {
       N& node = QList<N>::operator[](index);
+      if (!node.allocated)
+	return; // already unlinked
       node.allocated = false; // render invalid
-      pContainsNonAllocated = true;
+      pFreeIndexes.append(index);
     }
 
     /** \warning: you must check manually before calling this function that \c nid is right kind! */
@@ -201,7 +214,8 @@ public:
       return node;
     }
   private:
-    bool pContainsNonAllocated;
+    //! Indexes of the unlinked nodes, whose space can be reused by insertNewNode()
+    QList<IndexType> pFreeIndexes;
   };
 
   typedef NodeCache<EntryNode> EntryCache;
@@ -258,7 +272,20 @@ public:
   void ensureNotMinimalist(NodeId nodeId, int count = -1);
 
   bool canFetchMore(NodeId parentId);
+  /** Fetches more children of \c parentId, and returns once they are in the tree. */
   void fetchMore(NodeId parentId, int batchCount = -1);
+  /** Starts fetching more children of \c parentId in the background (see
+   * KLFLibResourceEngine::startQuery()), and returns immediately. The children are inserted as
+   * the resource reports them. Does nothing if such a fetch is already under way. */
+  void fetchMoreAsync(NodeId parentId, int batchCount = -1);
+  /** Cancels the background fetches started by fetchMoreAsync() for \c parentId, or all of them
+   * if \c parentId is not valid. */
+  void cancelPendingQueries(NodeId parentId = NodeId());
+
+  /** Called by the model for the results of our queries */
+  void queryResultsAvailable(int queryId, const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries);
+  /** Called by the model when one of our queries has finished */
+  void queryFinished(int queryId, int count);
 
   void updateData(const QList<KLFLib::entryId>& entryIdList, int modifyType);
 
@@ -367,6 +394,12 @@ private:
   EntryCache pEntryCache;
   CategoryLabelCache pCategoryLabelCache;
 
+  /** The index in \c pEntryCache of the node of each entry in the tree, see findEntryId() */
+  QHash<KLFLib::entryId, IndexType> pEntryIdIndex;
+  /** The index in \c pCategoryLabelCache of each category label node in the tree (except the
+   * root node), by full category path. See cacheFindCategoryLabel(). */
+  QHash<QString, IndexType> pCategoryPathIndex;
+
   QStringList pCatListCache;
 
   /** remember this category in the category list cache (that is useful only to
@@ -390,6 +423,23 @@ private:
 
   bool pIsFetchingMore;
 
+  /** The query which fetches the children of \c parentId following the ones we already have */
+  KLFLibResourceEngine::Query fetchMoreQuery(NodeId parentId, int batchCount);
+  /** Remembers the last of \c entries, which the resource returned for the children of
+   * \c parentId, as the point where the next fetchMoreQuery() continues */
+  void setFetchedAfter(NodeId parentId, const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries);
+  /** Appends \c entries to the children of \c parentId, notifying the views. */
+  void appendFetchedEntries(NodeId parentId, const QList<KLFLibResourceEngine::KLFLibEntryWithId>& entries,
+			    bool allChildrenFetched);
+
+  struct PendingQuery {
+    PendingQuery(NodeId n = NodeId(), int l = -1) : parentId(n), limit(l) { }
+    NodeId parentId;
+    int limit;
+  };
+  /** Background fetches started by fetchMoreAsync(), by query ID */
+  QMap<int,PendingQuery> pPendingQueries;
+
   int pLastSortPropId;
   Qt::SortOrder pLastSortOrder;
 
@@ -320,6 +320,7 @@ KLFMainWin::KLFMainWin()
   d->pContLatexPreview = new KLFContLatexPreview(d->pLatexPreviewThread);
   //  klfconfig.UI.labelOutputFixedSize.connectQObjectProperty(pLatexPreviewThread, "previewSize");
   klfconfig.UI.previewTooltipMaxSize.connectQObjectProperty(d->pContLatexPreview, "largePreviewSize");
+  klfconfig.UI.realTimePreviewDebounceDelay.connectQObjectProperty(d->pContLatexPreview, "debounceDelay");
   d->pContLatexPreview->setInput(d->collectInput(false));
   d->pContLatexPreview->setSettings(currentSettings());
 
@@ -369,6 +370,15 @@ KLFMainWin::KLFMainWin()
   connect(d->pContLatexPreview, SIGNAL(previewAvailable(const QImage&, const QImage&, const QImage&)),
 	  d, SLOT(showRealTimePreview(const QImage&, const QImage&)));
   connect(d->pContLatexPreview, SIGNAL(previewReset()), d, SLOT(showRealTimeReset()));
+  connect(d->pContLatexPreview, SIGNAL(outputAvailable(const KLFBackend::klfOutput&)),
+	  d, SLOT(showRealTimeOutput(const KLFBackend::klfOutput&)));
+
+  // 'Evaluate' also runs in the preview thread
+  d->pEvaluateHandler = new KLFMainWinEvaluateHandler(d);
+  connect(d->pLatexPreviewThread, SIGNAL(previewTaskFinished(KLFLatexPreviewThread::TaskId)),
+	  this, SLOT(slotEvaluateTaskFinished(KLFLatexPreviewThread::TaskId)));
+  d->pEvaluateWaitOverlay = new KLFWaitAnimationOverlay(u->lblOutput);
+  d->pEvaluateWaitOverlay->setWaitMovie(":/pics/wait_anim.mng");
 
 
   // MIME EXPORT PROFILES
@@ -625,6 +635,9 @@ KLFMainWin::~KLFMainWin()
     delete d->pContLatexPreview;
   if (d->pLatexPreviewThread)
     delete d->pLatexPreviewThread;
+  // after the preview thread, which might still be using the cache
+  if (d->pRenderCache)
+    delete d->pRenderCache;
 
 
 // Do not delete these -- segfault??
@@ -733,8 +746,8 @@ void KLFMainWin::startupFinished()
   /// \todo autoupdate: Add a UI item to enable/disable auto-check for updates, check now, etc.
 
   //if (klfconfig.UI.enableRealTimePreview) {
-  d->pLatexPreviewThread->start();
-  d->pLatexPreviewThread->setPriority(QThread::LowestPriority);
+  d->pLatexPreviewThread->setWorkerCount(klfconfig.BackendSettings.previewWorkerCount);
+  d->pLatexPreviewThread->start(QThread::LowestPriority);
 
   d->pContLatexPreview->setEnabled( klfconfig.UI.enableRealTimePreview );
   //}
@@ -794,9 +807,12 @@ void KLFMainWin::loadSettings()
   d->settings.bborderoffset = klfconfig.BackendSettings.bborderoffset;
 
   d->settings.calcEpsBoundingBox = klfconfig.BackendSettings.calcEpsBoundingBox;
+  d->settings.bboxMethod =
+    (KLFBackend::klfSettings::BBoxMethod)klfconfig.BackendSettings.calcEpsBoundingBoxMethod();
   d->settings.outlineFonts = klfconfig.BackendSettings.outlineFonts;
   d->settings.wantPDF = klfconfig.BackendSettings.wantPDF;
   d->settings.wantSVG = klfconfig.BackendSettings.wantSVG;
+  d->settings.useGsServer = klfconfig.BackendSettings.useGsServer;
 
   klfDbg("klfconfig.BackendSettings.userScriptInterpreters="
          << klfconfig.BackendSettings.userScriptInterpreters()) ;
@@ -805,6 +821,16 @@ void KLFMainWin::loadSettings()
     d->settings.userScriptInterpreters[it.key()] = it.value().toString();
   }
 
+  if (klfconfig.BackendSettings.renderCacheMaxSize() > 0) {
+    if (d->pRenderCache == NULL) {
+      d->pRenderCache = new KLFRenderCache(klfconfig.homeConfigDir + "/rendercache");
+    }
+    d->pRenderCache->setMaxDiskSize((qint64)klfconfig.BackendSettings.renderCacheMaxSize() * 1024 * 1024);
+    d->settings.renderCache = d->pRenderCache;
+  } else {
+    d->settings.renderCache = NULL;
+  }
+
   d->settings_altered = false;
 }
 
@@ -826,6 +852,7 @@ void KLFMainWin::saveSettings()
     klfconfig.BackendSettings.rborderoffset = d->settings.rborderoffset;
     klfconfig.BackendSettings.bborderoffset = d->settings.bborderoffset;
     klfconfig.BackendSettings.calcEpsBoundingBox = d->settings.calcEpsBoundingBox;
+    klfconfig.BackendSettings.calcEpsBoundingBoxMethod = (int)d->settings.bboxMethod;
     klfconfig.BackendSettings.outlineFonts = d->settings.outlineFonts;
     klfconfig.BackendSettings.wantPDF = d->settings.wantPDF;
     klfconfig.BackendSettings.wantSVG = d->settings.wantSVG;
@@ -2555,6 +2582,10 @@ bool KLFMainWin::eventFilter(QObject *obj, QEvent *e)
 	d->slotPopupClose();
 	return true;
       }
+      if (d->pEvaluateTask >= 0 && ke->key() == Qt::Key_Escape) {
+	slotCancelEvaluate();
+	return true;
+      }
       if (ke->key() == Qt::Key_F9) {
 	slotExpand(true);
 	u->tabsOptions->setCurrentWidget(u->tabLatexImage);
@@ -2816,6 +2847,9 @@ void KLFMainWin::applySettings(const KLFBackend::klfSettings& s)
   d->settings = s;
   d->settings_altered = false;
 
+  // exporters may depend on settings which were just changed
+  d->pExporterManager->clearDataCache();
+
   d->updatePreviewThreadSettings();
 }
 
@@ -2847,10 +2881,15 @@ void KLFMainWinPrivate::updatePreviewThreadInput()
     }
   }
 
-  bool inputchanged = pContLatexPreview->setInput(collectInput(false));
+  KLFBackend::klfInput input = collectInput(false);
+  bool inputchanged = pContLatexPreview->setInput(input);
   if (inputchanged) {
     emit K->userInputChanged();
   }
+  if (pEvaluateTask >= 0 && !(input == pEvaluateInput)) {
+    // the formula being evaluated is no longer the one the user is editing
+    K->slotCancelEvaluate();
+  }
   if (evaloutput_uptodate && !inputchanged) {
     // if we are in 'evaluated' mode, with a displayed result, then don't allow a window resize
     // to invalidate evaluated contents
@@ -2923,6 +2962,12 @@ void KLFMainWinPrivate::showRealTimeReset()
   slotSetSaveControlsEnabled(false);
 }
 
+void KLFMainWinPrivate::showRealTimeOutput(const KLFBackend::klfOutput& output)
+{
+  // remember it for slotEvaluate()
+  lastPreviewOutput = output;
+}
+
 void KLFMainWinPrivate::showRealTimePreview(const QImage& preview, const QImage& largePreview)
 {
   klfDbg("preview.size=" << preview.size()<< "  largepreview.size=" << largePreview.size());
@@ -3002,22 +3047,147 @@ KLFBackend::klfInput KLFMainWinPrivate::collectInput(bool final)
 
 void KLFMainWin::slotEvaluate()
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  if (d->pEvaluateTask >= 0) {
+    // the button reads "Cancel" while we're evaluating
+    slotCancelEvaluate();
+    return;
+  }
+  evaluate(false);
+}
 
-  // KLFBackend input
-  KLFBackend::klfInput input;
+void KLFMainWin::slotCancelEvaluate()
+{
+  if (d->pEvaluateTask < 0)
+    return;
+
+  klfDbg("cancelling evaluation task "<<d->pEvaluateTask) ;
+  d->pLatexPreviewThread->cancelTask(d->pEvaluateTask);
+  d->pEvaluateTask = -1;
+  setEvaluating(false);
+  if (d->pEvaluateAddsFormats) {
+    // keep what we have, without the additional formats
+    d->pEvaluateAddsFormats = false;
+    d->slotSetSaveControlsEnabled(true);
+  }
+}
 
-  u->btnEvaluate->setEnabled(false); // don't allow user to click us while we're not done, and
-  //				     additionally this gives visual feedback to the user
+void KLFMainWin::evaluate(bool synchronous)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
 
-  input = d->collectInput(true);
+  // KLFBackend input
+  KLFBackend::klfInput input = d->collectInput(true);
 
   // this accounts for both user script configuration and overriding of bbox margins
   KLFBackend::klfSettings settings = currentSettings();
 
-  // ****  and GO !
-  d->output = KLFBackend::getLatexFormula(input, settings);
-  // ****
+  // The real-time preview may have rendered this very formula already. It is generated with the
+  // same settings, except for the additional formats (see KLFContLatexPreview::setSettings()).
+  KLFBackend::klfSettings previewsettings = settings;
+  previewsettings.wantRaw = false;
+  previewsettings.wantPDF = false;
+  previewsettings.wantSVG = false;
+  const KLFBackend::klfOutput& prevout = d->lastPreviewOutput;
+  if (prevout.status == 0 && !prevout.result.isNull() &&
+      prevout.input == input && prevout.settings == previewsettings) {
+    if (!settings.wantRaw && !settings.wantPDF && !settings.wantSVG) {
+      klfDbg("using the output of the real-time preview") ;
+      evaluateDone(prevout, synchronous);
+      return;
+    }
+    if (!synchronous) {
+      // Only the additional formats are missing. Show the preview as the result right away,
+      // and generate them in the background: the preview left the DVI and EPS data in the
+      // render cache (if it is enabled), so getLatexFormula() only runs the remaining steps.
+      klfDbg("real-time preview is up to date, only generating additional formats") ;
+      startEvaluateTask(input, settings);
+      if (d->pEvaluateTask >= 0) {
+	d->pEvaluateAddsFormats = true;
+	evaluateDone(prevout, false);
+	d->slotSetSaveControlsEnabled(false); // until we have all the formats
+      }
+      return;
+    }
+  }
+
+  if (synchronous || input.latex.trimmed().isEmpty()) {
+    // (an empty input fails right away)
+    evaluateDone(KLFBackend::getLatexFormula(input, settings), synchronous);
+    return;
+  }
+
+  startEvaluateTask(input, settings);
+}
+
+void KLFMainWin::startEvaluateTask(const KLFBackend::klfInput& input, const KLFBackend::klfSettings& settings)
+{
+  // before submitting the task: starting the wait animation processes pending events
+  setEvaluating(true);
+
+  d->pEvaluateInput = input;
+  d->pEvaluateSettings = settings;
+  d->pEvaluateTask =
+    d->pLatexPreviewThread->replaceSubmitPreviewTask(d->pEvaluateTask, input, settings,
+						     d->pEvaluateHandler, QSize(), QSize(),
+						     KLFLatexPreviewThread::InteractiveTaskPriority);
+  if (d->pEvaluateTask < 0) {
+    klfWarning("Failed to submit evaluation task, running it here.") ;
+    setEvaluating(false);
+    evaluateDone(KLFBackend::getLatexFormula(input, settings), true);
+  }
+}
+
+void KLFMainWin::setEvaluating(bool evaluating)
+{
+  if (evaluating) {
+    if (d->pEvaluateButtonText.isEmpty())
+      d->pEvaluateButtonText = u->btnEvaluate->text();
+    u->btnEvaluate->setText(tr("Cancel", "[[evaluate button while evaluating]]"));
+    d->pEvaluateWaitOverlay->startWait();
+  } else {
+    d->pEvaluateWaitOverlay->stopWait();
+    if (!d->pEvaluateButtonText.isEmpty())
+      u->btnEvaluate->setText(d->pEvaluateButtonText);
+    d->pEvaluateButtonText = QString();
+  }
+}
+
+void KLFMainWin::slotEvaluateTaskFinished(KLFLatexPreviewThread::TaskId taskid)
+{
+  if (taskid != d->pEvaluateTask)
+    return; // a real-time preview, or a cancelled evaluation
+
+  d->pEvaluateTask = -1;
+  setEvaluating(false);
+
+  KLFBackend::klfOutput output = d->pEvaluateHandler->output;
+  if (output.status != 0) {
+    // errors are reported without the rest of the output
+    output.input = d->pEvaluateInput;
+    output.settings = d->pEvaluateSettings;
+  }
+
+  if (d->pEvaluateAddsFormats) {
+    d->pEvaluateAddsFormats = false;
+    if (output.status == 0) {
+      // the formula is already displayed and in history
+      d->output = output;
+      d->slotSetSaveControlsEnabled(true);
+      emit evaluateFinished(d->output);
+      return;
+    }
+  }
+
+  evaluateDone(output, false);
+}
+
+void KLFMainWin::evaluateDone(const KLFBackend::klfOutput& evaloutput, bool synchronous)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  d->output = evaloutput;
+  d->output.settings.abortFlag = NULL;
+  KLFBackend::klfInput input = d->output.input;
 
   // for 9.08 <= gs <= 9.14
   if (d->output.status == KLFERR_GSPOSTPROC_NOOUTLINEFONTS) {
@@ -3035,7 +3205,12 @@ void KLFMainWin::slotEvaluate()
     mbox.exec();
 
     // re-run without font outlines
+    KLFBackend::klfSettings settings = d->output.settings;
     settings.outlineFonts = false;
+    if (!synchronous) {
+      startEvaluateTask(input, settings);
+      return;
+    }
     d->output = KLFBackend::getLatexFormula(input, settings);
   }
 
@@ -3090,7 +3265,8 @@ void KLFMainWin::slotEvaluate()
       }
     }
 
-    emit evaluateFinished(d->output);
+    if (!d->pEvaluateAddsFormats) // otherwise, emitted once we have all the formats
+      emit evaluateFinished(d->output);
 
     u->lblOutput->display(scimg, tooltipimg, true);
 
@@ -3183,7 +3359,6 @@ void KLFMainWin::slotEvaluate()
     }
   }
 
-  u->btnEvaluate->setEnabled(true); // re-enable our button
   u->btnEvaluate->setFocus();
 }
 
@@ -3400,7 +3575,10 @@ void KLFMainWin::slotEvaluateAndSave(const QString& output, const QString& forma
     return;
   }
 
-  slotEvaluate();
+  // we need the result right away (and the preview thread may not be running in
+  // command-line mode)
+  slotCancelEvaluate();
+  evaluate(true);
 
   if ( ! output.isEmpty() ) {
     if ( d->output.result.isNull() ) {
@@ -3863,7 +4041,7 @@ void KLFMainWin::slotSave(const QString& suggestfname)
 
     klfDbg( "Saving using exporter `" << exporter->exporterName() << "' with format `" << formatname << "'" ) ;
 
-    QByteArray data = exporter->getData(formatname, d->output);
+    QByteArray data = d->pExporterManager->getExporterData(exporter, formatname, d->output);
     if (data.isEmpty()) {
       QMessageBox::critical(this, tr("Error saving file"),
                             tr("Error exporting the data: %1").arg(exporter->errorString()));
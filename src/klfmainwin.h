@@ -41,6 +41,7 @@
 #include <QShortcut>
 
 #include <klfbackend.h>
+#include <klflatexpreviewthread.h>
 
 #include <klfguiutil.h>
 
@@ -274,7 +275,10 @@ signals:
 
 public slots:
 
+  /** Runs LaTeX on the current input, in the background. While this is running, calling this
+   * function again cancels it (see \ref slotCancelEvaluate()). */
   void slotEvaluate();
+  void slotCancelEvaluate();
   void slotClear() { slotClearLatex(); }
   void slotClearLatex();
   void slotClearAll();
@@ -404,8 +408,17 @@ private:
 
   Ui::KLFMainWin *u;
 
+  /** Evaluates the current input, in the preview thread unless \c synchronous is TRUE. */
+  void evaluate(bool synchronous);
+  void startEvaluateTask(const KLFBackend::klfInput& input, const KLFBackend::klfSettings& settings);
+  void setEvaluating(bool evaluating);
+  /** Displays the result of an evaluation, and adds it to history. */
+  void evaluateDone(const KLFBackend::klfOutput& output, bool synchronous);
+
 private slots:
 
+  void slotEvaluateTaskFinished(KLFLatexPreviewThread::TaskId taskid);
+
   void slotCycleParenModifiers(bool forward = true);
   void slotCycleParenModifiersBack() { slotCycleParenModifiers(false); }
   void slotCycleParenTypes(bool forward = true);
@@ -44,6 +44,7 @@
 #include <klfutil.h>
 #include <klfdatautil.h>
 #include <klflatexpreviewthread.h>
+#include <klfrendercache.h>
 #include "klflibview.h"
 #include "klfmain.h"
 #include "klfsettings.h"
@@ -844,6 +845,39 @@ public:
 
 
 
+// --------------------------------------------------------------------------
+
+
+/** \internal
+ *
+ * Receives the result of the evaluations which KLFMainWin::slotEvaluate() runs in the preview
+ * thread. The result is only read when the thread reports the task as finished (see
+ * KLFLatexPreviewThread::previewTaskFinished()), which tells apart the results of a cancelled
+ * task from those of the following one.
+ */
+class KLFMainWinEvaluateHandler : public KLFLatexPreviewHandler
+{
+  Q_OBJECT
+public:
+  KLFMainWinEvaluateHandler(QObject *parent) : KLFLatexPreviewHandler(parent) { }
+
+  //! The result of the last task processed
+  KLFBackend::klfOutput output;
+
+public slots:
+  virtual void latexOutputAvailable(const KLFBackend::klfOutput& o)
+  {
+    output = o;
+  }
+  virtual void latexPreviewError(const QString& errorString, int errorCode)
+  {
+    output = KLFBackend::klfOutput();
+    output.status = errorCode;
+    output.errorstr = errorString;
+  }
+};
+
+
 // --------------------------------------------------------------------------
 
 
@@ -878,6 +912,13 @@ public:
     pLatexPreviewThread = NULL;
     pContLatexPreview = NULL;
 
+    pEvaluateHandler = NULL;
+    pEvaluateTask = -1;
+    pEvaluateAddsFormats = false;
+    pEvaluateWaitOverlay = NULL;
+
+    pRenderCache = NULL;
+
     pUserScriptSettings = NULL;
 
     pExporterManager = NULL;
@@ -943,6 +984,9 @@ public:
   KLFBackend::klfSettings settings; // settings we pass to KLFBackend
   bool settings_altered;
 
+  /** Cache of rendered formulas, shared by all our settings objects (see settings.renderCache) */
+  KLFRenderCache *pRenderCache;
+
   KLFBackend::klfOutput output; // output from KLFBackend
 
   /** If TRUE, then the output contained in _output is up-to-date, meaning that we favor displaying
@@ -951,6 +995,20 @@ public:
   /** The Thread that will create real-time previews of formulas. */
   KLFLatexPreviewThread *pLatexPreviewThread;
   KLFContLatexPreview *pContLatexPreview;
+  /** The last successful output of the real-time preview. If it was generated from the same
+   * input and settings, slotEvaluate() uses it instead of running LaTeX again. */
+  KLFBackend::klfOutput lastPreviewOutput;
+
+  /** The evaluation started by slotEvaluate() and running in \ref pLatexPreviewThread, or -1 */
+  KLFLatexPreviewThread::TaskId pEvaluateTask;
+  /** TRUE if \ref output is the (already displayed) real-time preview output, and the running
+   * evaluation only completes it with the additional formats */
+  bool pEvaluateAddsFormats;
+  KLFMainWinEvaluateHandler *pEvaluateHandler;
+  KLFBackend::klfInput pEvaluateInput;
+  KLFBackend::klfSettings pEvaluateSettings;
+  KLFWaitAnimationOverlay *pEvaluateWaitOverlay;
+  QString pEvaluateButtonText;
 
   QLabel *mExportMsgLabel;
   void showExportMsgLabel(const QString& msg, int timeout = 3000);
@@ -1058,6 +1116,7 @@ public slots: // .. but in private API
   void slotPresetDPISender();
 
   void showRealTimeReset();
+  void showRealTimeOutput(const KLFBackend::klfOutput& output);
   void showRealTimePreview(const QImage& preview, const QImage& largePreview);
   void showRealTimeError(const QString& errorstr, int errcode);
 
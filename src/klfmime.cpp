@@ -580,8 +580,9 @@ struct KLFMimeDataPrivate
       return QByteArray();
     }
   
-    // get the data
-    return exporter->getData(exportType.exporterFormat, output, params);
+    // get the data (the same data may already have been exported for another format request,
+    // another KLFMimeData instance or for saving)
+    return exporterManager->getExporterData(exporter, exportType.exporterFormat, output, params);
   }
 
   QStringList collectedFormatsAsProxyMimes() const;
@@ -27,11 +27,15 @@
 #include <QDesktopWidget>
 #include <QIcon>
 #include <QPushButton>
+#include <QCache>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QDebug>
 
 #include "klfutil.h"
 #include "klfrelativefont.h"
 #include "klfguiutil.h"
+#include "klfimageutil.h"
 
 
 // ----------------------------------------------
@@ -458,50 +462,62 @@ QRect KLFWaitAnimationOverlay::calcAnimationLabelGeometry()
 // -----------------------
 
 
+/** \internal
+ * The glow images computed last, in device pixels. The cost is in kilobytes. */
+static QCache<QString,QImage> klf_glow_cache(8*1024);
+static QMutex klf_glow_cache_mutex;
+
+/** \internal
+ * Returns the glow of \c fg, with a margin of a few pixels on each side (half the difference
+ * of the sizes of the two images). */
+static QImage klf_glow_image(const QImage& fg, const QColor& glowcol, int r, qreal dpr)
+{
+  QString key = QString("%1/%2/%3/%4").arg(fg.cacheKey()).arg(glowcol.rgba()).arg(r).arg(dpr);
+  {
+    QMutexLocker mutexlocker(&klf_glow_cache_mutex);
+    QImage *cached = klf_glow_cache.object(key);
+    if (cached != NULL)
+      return *cached;
+  }
+
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  // The glow used to be drawn as one copy of the image, tinted with the glow color and of
+  // opacity ga, at each offset (in steps of one user pixel) within a disk of radius r2
+  // device pixels; those are about pi*r*r copies. We use the square with the same area
+  // (of side sqrt(pi)*r2), and spread the opacity of the copies over its n*n device pixels.
+  const qreal pi = 3.14159265358979;
+  int r2 = (int)(r*dpr);
+  int h = qMax(1, qRound(r2 * std::sqrt(pi) / 2));
+  int n = 2*h+1;
+  qreal ga = qAlpha(glowcol.rgba()) / qreal(255);
+  ga /= r*r; // heuristic scaling of alpha
+  qreal strength = ga * (pi*r*r) / (n*n); // the sum of the opacities of the copies is the same
+
+  QImage glow = klfImageHalo(fg, glowcol, h, strength);
+
+  QMutexLocker mutexlocker(&klf_glow_cache_mutex);
+  klf_glow_cache.insert(key, new QImage(glow), (int)qBound<qint64>(1, glow.sizeInBytes() / 1024, 0x7fffffff));
+  return glow;
+}
+
 KLF_EXPORT void klfDrawGlowedImage(QPainter *p, const QImage& foreground, const QColor& glowcol,
 				   int r, bool also_draw_image)
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
-  QImage fg = foreground;
-  if (fg.format() != QImage::Format_ARGB32_Premultiplied &&
-      fg.format() != QImage::Format_ARGB32)
-    fg = fg.convertToFormat(QImage::Format_ARGB32);
-
-  QRgb glow_color = glowcol.rgba();
-
   qreal dpr = p->device()->devicePixelRatioF();
-  QSize userspace_size = fg.size() / dpr;
+  QSize userspace_size = foreground.size() / dpr;
 
-  int r2 = r*dpr;
-
-  QImage glow(fg.size(), QImage::Format_ARGB32_Premultiplied);
-  int x, y;
-  qreal ga = qAlpha(glow_color) / qreal(255);
-  ga /= r*r; // heuristic scaling of alpha
-  for (x = 0; x < fg.width(); ++x) {
-    for (y = 0; y < fg.height(); ++y) {
-      qreal ai = qAlpha(fg.pixel(x,y)) * ga;
-      qreal a = ai / 255;
-      // glow format is argb32_premultiplied
-      glow.setPixel(x,y, qRgba(qRed(glow_color)*a, qGreen(glow_color)*a, qBlue(glow_color)*a, ai));
-    }
-  }
-  // now draw that glowed image a few times moving around the interest point to do a glow effect
-  //  p->save();
-  //  p->setOpacity(std::log(-numoverlaps));
-  //  p->setCompositionMode(QPainter::CompositionMode_Plus);
-  int dx, dy;
-  for (dx = -r2; dx <= r2; dx += dpr) {
-    for (dy = -r2; dy <= r2; dy += dpr) {
-      if (dx*dx+dy*dy > r2*r2) // don't go beyond r2 device pixels from (0,0)
-	continue;
-      p->drawImage(QRectF(QPointF(dx/dpr,dy/dpr), userspace_size), glow);
-    }
+  if (r > 0 && qAlpha(glowcol.rgba()) > 0) {
+    QImage glow = klf_glow_image(foreground, glowcol, r, dpr);
+    // the glow extends beyond the image by a margin m on each side
+    qreal m = (glow.width() - foreground.width()) / (2*dpr);
+    p->drawImage(QRectF(QPointF(-m, -m), QSizeF(glow.size()) / dpr), glow);
   }
-  //  p->restore();
+
   if (also_draw_image) {
-    p->drawImage(QRect(QPoint(0,0), userspace_size), fg);
+    p->drawImage(QRect(QPoint(0,0), userspace_size), foreground);
   }
 }
 
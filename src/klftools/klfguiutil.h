@@ -544,11 +544,14 @@ public:
 
 /** \brief Draws the given image with a glow effect.
  *
- * Draws a glow effect for image \c foreground by extracting the alpha channel, and
- * creating fills an image of color \c glow_color with the same alpha channel. The
- * image is then drawn at all points (x,y) around (0,0) such that
- * <tt>|(x,y)-(0,0)| &lt; r</tt>, effectively overlapping the glow image with itself
- * creating a blur effect.
+ * Draws a glow effect for image \c foreground, of color \c glow_color, which looks like
+ * an image of color \c glow_color with the same alpha channel drawn at all points (x,y)
+ * around (0,0) such that <tt>|(x,y)-(0,0)| &lt; r</tt>, overlapping with itself to create
+ * a blur effect.
+ *
+ * The glow is computed once with a separable blur (see \ref klfImageHalo()) and drawn in
+ * one go. The last few computed glows are cached, so repainting the same image (same
+ * QImage::cacheKey()) with the same parameters is cheap.
  *
  * The resulting graphics are painted using the painter \c painter, at the reference
  * position <tt>(0,0)</tt>. If you want your image drawn at another position, use
@@ -0,0 +1,249 @@
+/***************************************************************************
+ *   file klfimageutil.cpp
+ *   This file is part of the KLatexFormula Project.
+ *   Copyright (C) 2020 by Philippe Faist
+ *   philippe.faist at bluewin.ch
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/* $Id$ */
+
+#include <stdlib.h> // abs()
+#include <cmath>
+
+#include <QVector>
+
+#include "klfdefs.h"
+#include "klfimageutil.h"
+
+
+/** \internal
+ * Returns \c img in a 32-bit format we can read directly (with the alpha value in the top
+ * byte of each pixel), converting it if needed. */
+static QImage argb32_image(const QImage& img, bool *premultiplied)
+{
+  switch (img.format()) {
+  case QImage::Format_ARGB32:
+  case QImage::Format_RGB32: // alpha is always 0xff
+    *premultiplied = false;
+    return img;
+  case QImage::Format_ARGB32_Premultiplied:
+    *premultiplied = true;
+    return img;
+  default:
+    *premultiplied = false;
+    return img.convertToFormat(QImage::Format_ARGB32);
+  }
+}
+
+
+KLF_EXPORT QImage klfImageScaleAlpha(const QImage& img, qreal factor)
+{
+  // in premultiplied format, all components are scaled by the same factor
+  QImage img2 = img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+  // factor in 1/256ths. Two 8-bit components are multiplied at once, each one in a 16-bit
+  // half of a 32-bit word.
+  const quint32 f = qBound(0, qRound(factor*256), 256);
+  const int w = img2.width();
+  int x, y;
+  for (y = 0; y < img2.height(); ++y) {
+    quint32 *line = reinterpret_cast<quint32*>(img2.scanLine(y));
+    for (x = 0; x < w; ++x) {
+      const quint32 p = line[x];
+      line[x] = ((((p & 0x00ff00ff) * f) >> 8) & 0x00ff00ff)
+	| ((((p >> 8) & 0x00ff00ff) * f) & 0xff00ff00);
+    }
+  }
+  return img2;
+}
+
+
+/** \internal */
+static inline bool row_has_opaque_pixel(const QRgb *line, int w, int alphaThreshold)
+{
+  int x;
+  for (x = 0; x < w; ++x) {
+    if (qAlpha(line[x]) > alphaThreshold)
+      return true;
+  }
+  return false;
+}
+
+KLF_EXPORT QRect klfImageOpaqueRect(const QImage& imgsrc, int alphaThreshold)
+{
+  bool premultiplied; // the alpha value is the same either way
+  const QImage img = argb32_image(imgsrc, &premultiplied);
+  const int w = img.width();
+  const int h = img.height();
+
+#define KLF_LINE(y) reinterpret_cast<const QRgb*>(img.constScanLine(y))
+
+  // first and last rows with an opaque pixel
+  int top = 0;
+  while (top < h && !row_has_opaque_pixel(KLF_LINE(top), w, alphaThreshold))
+    ++top;
+  if (top == h)
+    return QRect();
+  int bottom = h-1;
+  while (bottom > top && !row_has_opaque_pixel(KLF_LINE(bottom), w, alphaThreshold))
+    --bottom;
+
+  // then, on each row in between, only look at the pixels outside of the columns found so far
+  int left = w, right = -1;
+  int x, y;
+  for (y = top; y <= bottom; ++y) {
+    const QRgb *line = KLF_LINE(y);
+    for (x = 0; x < left; ++x) {
+      if (qAlpha(line[x]) > alphaThreshold) {
+	left = x;
+	break;
+      }
+    }
+    for (x = w-1; x > right; --x) {
+      if (qAlpha(line[x]) > alphaThreshold) {
+	right = x;
+	break;
+      }
+    }
+  }
+
+#undef KLF_LINE
+
+  return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+
+/** \internal
+ * Distance between the background \c b and the pixel \c a drawn over it. */
+static inline float color_distinguishable_distance(QRgb a, int br, int bg, int bb, bool aPremultiplied)
+{
+  static const float C_r = 11.f,   C_g = 16.f,   C_b = 5.f;
+  static const float C_avg = (C_r + C_g + C_b) / 3.f;
+
+  float alpha = qAlpha(a)/255.f;
+  int mr, mg, mb;
+  if (aPremultiplied) {
+    mr = (int)(qRed(a)+(1-alpha)*br);
+    mg = (int)(qGreen(a)+(1-alpha)*bg);
+    mb = (int)(qBlue(a)+(1-alpha)*bb);
+  } else {
+    mr = (int)(alpha*qRed(a)+(1-alpha)*br);
+    mg = (int)(alpha*qGreen(a)+(1-alpha)*bg);
+    mb = (int)(alpha*qBlue(a)+(1-alpha)*bb);
+  }
+  // same as qRgb() would do
+  mr &= 0xff; mg &= 0xff; mb &= 0xff;
+
+  return qMax( qMax(C_r*abs(mr - br), C_g*abs(mg - bg)), C_b*abs(mb - bb) ) / C_avg;
+}
+
+KLF_EXPORT bool klfImageIsDistinguishable(const QImage& imgsrc, const QColor& background, float threshold)
+{
+  bool premultiplied;
+  const QImage img = argb32_image(imgsrc, &premultiplied);
+  const QRgb bgrgb = background.rgb();
+  const int br = qRed(bgrgb), bg = qGreen(bgrgb), bb = qBlue(bgrgb);
+  const int w = img.width();
+
+  int x, y;
+  for (y = 0; y < img.height(); ++y) {
+    const QRgb *line = reinterpret_cast<const QRgb*>(img.constScanLine(y));
+    // formulas typically have large areas of the same color
+    QRgb last = line[0] ^ 0x1;
+    for (x = 0; x < w; ++x) {
+      const QRgb p = line[x];
+      if (p == last)
+	continue; // we already know it can't be distinguished
+      last = p;
+      if (!premultiplied && qAlpha(p) == 0)
+	continue; // that's the background color
+      if (color_distinguishable_distance(p, br, bg, bb, premultiplied) > threshold) {
+	// ok we have one pixel at least we can distinguish.
+	return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+KLF_EXPORT QImage klfImageHalo(const QImage& imgsrc, const QColor& color, int radius, qreal strength)
+{
+  bool premultiplied; // the alpha value is the same either way
+  const QImage img = argb32_image(imgsrc, &premultiplied);
+  if (img.isNull() || radius < 0)
+    return QImage();
+
+  const int w = img.width(), h = img.height();
+  const int n = 2*radius+1; // side of the square
+  const int W = w + 2*radius, H = h + 2*radius;
+  int x, y;
+
+  // pixel (X,Y) of the result is centered on pixel (X-radius,Y-radius) of img, so its square
+  // covers the columns X-n+1..X and the rows Y-n+1..Y of img.
+
+  // horizontal pass: hsum[y*W+X] is the sum of the alpha values of row y of img over the
+  // columns X-n+1..X
+  QVector<int> hsum(W*h);
+  for (y = 0; y < h; ++y) {
+    const QRgb *line = reinterpret_cast<const QRgb*>(img.constScanLine(y));
+    int *hline = hsum.data() + y*W;
+    int s = 0;
+    for (x = 0; x < W; ++x) {
+      if (x < w)
+	s += qAlpha(line[x]);
+      if (x-n >= 0)
+	s -= qAlpha(line[x-n]);
+      hline[x] = s;
+    }
+  }
+
+  // the result only depends on the sum, through its alpha value
+  QRgb table[256];
+  const QRgb c = color.rgb();
+  int a;
+  for (a = 0; a < 256; ++a)
+    table[a] = qRgba(qRed(c)*a/255, qGreen(c)*a/255, qBlue(c)*a/255, a);
+  const double k = strength / 255.0;
+
+  // vertical pass, keeping the running sum of each column
+  QImage result(W, H, QImage::Format_ARGB32_Premultiplied);
+  QVector<int> colsum(W, 0);
+  int *cs = colsum.data();
+  for (y = 0; y < H; ++y) {
+    if (y < h) {
+      const int *hline = hsum.constData() + y*W;
+      for (x = 0; x < W; ++x)
+	cs[x] += hline[x];
+    }
+    if (y-n >= 0) {
+      const int *hline = hsum.constData() + (y-n)*W;
+      for (x = 0; x < W; ++x)
+	cs[x] -= hline[x];
+    }
+    QRgb *out = reinterpret_cast<QRgb*>(result.scanLine(y));
+    for (x = 0; x < W; ++x) {
+      if (cs[x] == 0) {
+	out[x] = 0;
+	continue;
+      }
+      int alpha = (int)(255 * (1 - std::exp(-k*cs[x])));
+      out[x] = table[qBound(0, alpha, 255)];
+    }
+  }
+  return result;
+}
@@ -0,0 +1,82 @@
+/***************************************************************************
+ *   file klfimageutil.h
+ *   This file is part of the KLatexFormula Project.
+ *   Copyright (C) 2020 by Philippe Faist
+ *   philippe.faist at bluewin.ch
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/* $Id$ */
+
+#ifndef KLFIMAGEUTIL_H
+#define KLFIMAGEUTIL_H
+
+#include <QImage>
+#include <QColor>
+#include <QRect>
+
+#include <klfdefs.h>
+
+
+/** \file
+ * Per-pixel operations on images.
+ *
+ * These functions work on whole scan lines of 32-bit ARGB images rather than calling
+ * QImage::pixel() and QImage::setPixel() for each pixel. Images in other formats are
+ * converted first.
+ */
+
+
+/** \brief Multiply the opacity of an image by a factor
+ *
+ * Returns a copy of \c img in format \c QImage::Format_ARGB32_Premultiplied, in which all the
+ * components of each pixel are multiplied by \c factor (which should be between 0 and 1).
+ */
+KLF_EXPORT QImage klfImageScaleAlpha(const QImage& img, qreal factor);
+
+/** \brief The smallest rectangle containing all (sufficiently) opaque pixels
+ *
+ * Returns the bounding rectangle of all the pixels of \c img with an alpha value greater than
+ * \c alphaThreshold, or a null QRect if there is no such pixel.
+ */
+KLF_EXPORT QRect klfImageOpaqueRect(const QImage& img, int alphaThreshold = 0);
+
+/** \brief Whether an image can be seen on a given background
+ *
+ * Returns TRUE if at least one pixel of \c img, drawn over the (opaque) color \c background,
+ * gives a color whose distance to \c background is larger than \c threshold. The distance is
+ * the largest difference of the red, green and blue components, weighted by how well the eye
+ * perceives them.
+ */
+KLF_EXPORT bool klfImageIsDistinguishable(const QImage& img, const QColor& background, float threshold);
+
+/** \brief A blurred halo around the opaque parts of an image
+ *
+ * Returns an image larger than \c img by \c radius pixels on each side, in format
+ * \c QImage::Format_ARGB32_Premultiplied, of color \c color (whose alpha value is ignored).
+ * Its opacity at each point is <tt>1 - exp(-strength*S)</tt>, where \c S is the sum of the
+ * opacities (between 0 and 1) of the pixels of \c img in the square of side
+ * <tt>2*radius+1</tt> centered on this point. This is what drawing many copies of the image,
+ * each of opacity \c strength, shifted by all the offsets within the square gives.
+ *
+ * The blur is separable and computed with running sums, so its cost doesn't depend on
+ * \c radius.
+ */
+KLF_EXPORT QImage klfImageHalo(const QImage& img, const QColor& color, int radius, qreal strength);
+
+
+
+#endif
@@ -204,7 +204,7 @@ KLFLatexEdit::KLFLatexEdit(QWidget *parent)
   d->mSyntaxHighlighter = new KLFLatexSyntaxHighlighter(this, this);
 
   connect(this, SIGNAL(cursorPositionChanged()),
-	  d->mSyntaxHighlighter, SLOT(refreshAll()));
+	  d->mSyntaxHighlighter, SLOT(refreshChanged()));
 
   setContextMenuPolicy(Qt::DefaultContextMenu);
 
@@ -386,6 +386,8 @@ void KLFLatexEditPrivate::slotInsertFromActionSender()
 KLFLatexSyntaxHighlighter::KLFLatexSyntaxHighlighter(QTextEdit *textedit, QObject *parent)
   : QSyntaxHighlighter(parent) , _textedit(textedit)
 {
+  KLF_INIT_PRIVATE(KLFLatexSyntaxHighlighter) ;
+
   setDocument(textedit->document());
 
   // some reasonable defaults for our config...
@@ -406,6 +408,7 @@ KLFLatexSyntaxHighlighter::KLFLatexSyntaxHighlighter(QTextEdit *textedit, QObjec
 
 KLFLatexSyntaxHighlighter::~KLFLatexSyntaxHighlighter()
 {
+  KLF_DELETE_PRIVATE ;
 }
 
 
@@ -417,10 +420,12 @@ void KLFLatexSyntaxHighlighter::setHighlightEnabled(bool on)
 void KLFLatexSyntaxHighlighter::setHighlightParensOnly(bool on)
 {
   pConf.highlightParensOnly = on;
+  d->parsedRevision = -1; // the rules change
 }
 void KLFLatexSyntaxHighlighter::setHighlightLonelyParens(bool on)
 {
   pConf.highlightLonelyParens = on;
+  d->parsedRevision = -1; // the rules change
 }
 void KLFLatexSyntaxHighlighter::setFmtKeyword(const QTextFormat& f)
 {
@@ -482,80 +487,210 @@ void KLFLatexSyntaxHighlighter::refreshAll()
   rehighlight();
 }
 
-void KLFLatexSyntaxHighlighter::parseEverything()
+void KLFLatexSyntaxHighlighter::refreshChanged()
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
-  QString text;
+  if ( ! pConf.enabled )
+    return;
+
+  setCaretPos(_textedit->textCursor().position());
+  parseEverything();
+
+  QTextBlock block;
+  for (block = document()->firstBlock(); block.isValid(); block = block.next()) {
+    int n = block.blockNumber();
+    if (n >= d->appliedRules.size() || d->appliedRules[n] != d->blockRules.value(n)) {
+      klfDbg("block #"<<n<<" needs to be highlighted again") ;
+      rehighlightBlock(block);
+    }
+  }
+}
+
+
+bool KLFLatexSyntaxHighlighterPrivate::matchParen(const QString& text, int i, bool opening,
+						  KLFLatexToken *token) const
+{
+  const KLFStringTrie& parens = opening ? openParens : closeParens;
+  const KLFStringTrie& modifiers = opening ? openModifiers : closeModifiers;
+
+  // same as the regexp "^(?:(modifier)\\s*)?(paren)"
+  int len;
+  if (modifiers.matchLongest(text, i, &len) >= 0) {
+    int j = i + len;
+    while (j < text.length() && text[j].isSpace())
+      ++j;
+    int plen;
+    if (parens.matchLongest(text, j, &plen) >= 0) {
+      token->beginpos = i;
+      token->endpos = j + plen;
+      token->modifier = text.mid(i, len);
+      token->parenstr = text.mid(j, plen);
+      return true;
+    }
+  }
+  if (parens.matchLongest(text, i, &len) >= 0) {
+    token->beginpos = i;
+    token->endpos = i + len;
+    token->modifier = QString();
+    token->parenstr = text.mid(i, len);
+    return true;
+  }
+  return false;
+}
+
+const KLFLatexBlockTokens * KLFLatexSyntaxHighlighterPrivate::blockTokens(QTextBlock block)
+{
+  QString text = block.text();
+
+  KLFLatexBlockTokens *bt = static_cast<KLFLatexBlockTokens*>(block.userData());
+  if (bt != NULL && bt->text == text) {
+    return bt; // didn't change
+  }
+  if (bt == NULL) {
+    bt = new KLFLatexBlockTokens;
+    block.setUserData(bt); // the block takes ownership
+  }
+  bt->text = text;
+  bt->tokens.clear();
+
+  klfDbg("tokenizing block #"<<block.blockNumber()) ;
+
+  while (text.length() < block.length()) {
+    text += "\n";
+  }
+
+  // needed to avoid double-parsing of eg. "\\left(" when parsing "\\left(" and then "("
+  int lastparenparsingendpos = 0;
   int i = 0;
-  int blockpos;
-  QList<uint> blocklens; // the length of each block
+  int k;
+  while ( i < text.length() ) {
+    if (text[i] == '%') {
+      k = 0;
+      while (i+k < text.length() && text[i+k] != '\n')
+	++k;
+      bt->tokens.append(KLFLatexToken(KLFLatexToken::Comment, i, i+k));
+      i += k + 1;
+      continue;
+    }
+    KLFLatexToken paren;
+    if ( i >= lastparenparsingendpos && matchParen(text, i, true, &paren) ) {
+      paren.type = KLFLatexToken::OpenParen;
+      bt->tokens.append(paren);
+      lastparenparsingendpos = paren.endpos;
+    } else if ( i >= lastparenparsingendpos && matchParen(text, i, false, &paren) ) {
+      paren.type = KLFLatexToken::CloseParen;
+      bt->tokens.append(paren);
+      lastparenparsingendpos = paren.endpos;
+    }
+
+    if (text[i] == '\\') { // a keyword ("\symbol")
+      ++i;
+      k = 0;
+      if (i >= text.length())
+	continue;
+      while (i+k < text.length() && ( (text[i+k] >= 'a' && text[i+k] <= 'z') ||
+				      (text[i+k] >= 'A' && text[i+k] <= 'Z') ))
+	++k;
+      if (k == 0 && i+1 < text.length())
+	k = 1;
+
+      KLFLatexToken kw(KLFLatexToken::Keyword, i-1, i+k);
+      kw.keyword = text.mid(i-1,k+1); // from i-1, length k+1
+      bt->tokens.append(kw);
+      i += k;
+      continue;
+    }
+
+    if (!text[i].isPrint() && text[i] != '\n' && text[i] != '\t' && text[i] != '\r') {
+      bt->tokens.append(KLFLatexToken(KLFLatexToken::NonPrintable, i, i+1));
+    }
+
+    ++i;
+  }
+
+  return bt;
+}
+
+void KLFLatexSyntaxHighlighterPrivate::setBlockRules(const QList<FormatRule>& rules)
+{
+  QTextDocument *doc = K->document();
+
+  blockRules.clear();
+  blockRules.resize(doc->blockCount());
+
+  int k;
+  for (k = 0; k < rules.size(); ++k) {
+    const FormatRule& rule = rules[k];
+    QTextBlock block = (rule.pos <= 0) ? doc->firstBlock() : doc->findBlock(rule.pos);
+    for ( ; block.isValid() && block.position() < rule.end(); block = block.next()) {
+      int textlen = block.length() - 1; // without the paragraph separator
+      int start = rule.pos - block.position();
+      int len = rule.len;
+      if (start < 0) { // the rule starts before current paragraph
+	len += start; // "+" because start is negative
+	start = 0;
+      }
+      if (start > textlen)
+	continue;
+      if (len > textlen - start)
+	len = textlen - start;
+      if (len <= 0)
+	continue; // empty rule...
+      int n = block.blockNumber();
+      if (n >= 0 && n < blockRules.size())
+	blockRules[n].append(FormatRule(start, len, rule.format, rule.onlyIfFocus));
+    }
+  }
+}
+
+void KLFLatexSyntaxHighlighter::parseEverything()
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
   QStack<ParenItem> parens; // the parens that we'll meet
   QList<LonelyParenItem> lonelyparens; // extra lonely parens that we can't close within the text
 
-  QTextBlock block = document()->firstBlock();
-
   /** \bug "DON'T TRY TO MATCH PAREN TYPES" IS NOT FUNCTIONAL. REMOVE THAT OPTION OR IMPLEMENT IT. */
 
-  QString sopenrx =
-    "^(?:("+QStringList(klfListMap(ParsedBlock::parenSpecs.openParenModifiers(), &QRegExp::escape)).join("|")+")\\s*)?"
-    "(" + QStringList(klfListMap(ParsedBlock::parenSpecs.openParenList(), &QRegExp::escape)).join("|")+")";
-  QString scloserx =
-    "^(?:("+QStringList(klfListMap(ParsedBlock::parenSpecs.closeParenModifiers(), &QRegExp::escape)).join("|")+")\\s*)?"
-    "(" + QStringList(klfListMap(ParsedBlock::parenSpecs.closeParenList(), &QRegExp::escape)).join("|")+")";
-  klfDbg("open-paren-rx string: "<<sopenrx<<"; close-paren-rx string: "<<scloserx);
-  QRegExp rx_open(sopenrx);
-  QRegExp rx_close(scloserx);
+  // Only the blocks which changed are tokenized again. The parens are matched over the whole
+  // document, as adding a paren may change how another one far away is to be highlighted.
 
-  // needed to avoid double-parsing of eg. "\\left(" when parsing "\\left(" and then "("
-  int lastparenparsingendpos = 0;
-  
   _rulestoapply.clear();
   pParsedBlocks.clear();
   int k;
-  while (block.isValid()) {
-    text = block.text();
-    i = 0;
-    blockpos = block.position();
-    blocklens.append(block.length());
-
-    while (text.length() < block.length()) {
-      text += "\n";
-    }
-
-    i = 0;
-    while ( i < text.length() ) {
-      if (text[i] == '%') {
-	k = 0;
-	while (i+k < text.length() && text[i+k] != '\n')
-	  ++k;
-	_rulestoapply.append(FormatRule(blockpos+i, k, FComment));
-	pParsedBlocks.append(ParsedBlock(ParsedBlock::Comment, blockpos+i, k));
-	i += k + 1;
+  QTextBlock block;
+  for (block = document()->firstBlock(); block.isValid(); block = block.next()) {
+    int blockpos = block.position();
+    const KLFLatexBlockTokens *bt = d->blockTokens(block);
+
+    foreach (const KLFLatexToken& t, bt->tokens) {
+      if (t.type == KLFLatexToken::Comment) {
+	_rulestoapply.append(FormatRule(blockpos+t.beginpos, t.endpos-t.beginpos, FComment));
+	pParsedBlocks.append(ParsedBlock(ParsedBlock::Comment, blockpos+t.beginpos, t.endpos-t.beginpos));
 	continue;
       }
-      if ( blockpos+i >= lastparenparsingendpos && rx_open.indexIn(text.mid(i)) != -1) {
+      if (t.type == KLFLatexToken::OpenParen) {
 	ParenItem p;
 	p.isopening = true;
-	p.parenstr = rx_open.cap(2);
-	p.modifier = rx_open.cap(1);
-	p.beginpos = blockpos+i;
-	p.endpos = blockpos+i+rx_open.matchedLength();
-	p.pos = blockpos+i+p.modifier.length();
+	p.parenstr = t.parenstr;
+	p.modifier = t.modifier;
+	p.beginpos = blockpos+t.beginpos;
+	p.endpos = blockpos+t.endpos;
+	p.pos = blockpos+t.beginpos+p.modifier.length();
 	p.highlight = (_caretpos == p.caretHoverPos());
 	parens.push(p);
-	lastparenparsingendpos = p.endpos;
+	continue;
       }
-      else if ( blockpos+i >= lastparenparsingendpos && rx_close.indexIn(text.mid(i)) != -1) {
+      if (t.type == KLFLatexToken::CloseParen) {
 	ParenItem cp;
 	cp.isopening = false;
-	cp.parenstr = rx_close.cap(2);
-	cp.modifier = rx_close.cap(1);
-	cp.beginpos = blockpos+i;
-	cp.pos = blockpos+i+cp.modifier.length();
-	cp.endpos = blockpos+i+rx_close.matchedLength();
+	cp.parenstr = t.parenstr;
+	cp.modifier = t.modifier;
+	cp.beginpos = blockpos+t.beginpos;
+	cp.pos = blockpos+t.beginpos+cp.modifier.length();
+	cp.endpos = blockpos+t.endpos;
 	cp.highlight = (_caretpos == cp.caretHoverPos());
-	lastparenparsingendpos = cp.endpos;
 	
 	ParenItem p;
 	if (!parens.empty()) {
@@ -619,48 +754,34 @@ void KLFLatexSyntaxHighlighter::parseEverything()
 	pblk2.parenotherpos = p.beginpos;
 	pParsedBlocks.append(pblk1);
 	pParsedBlocks.append(pblk2);
+	continue;
       }
 
-      if (text[i] == '\\') { // a keyword ("\symbol")
-	++i;
-	k = 0;
-	if (i >= text.length())
-	  continue;
-	while (i+k < text.length() && ( (text[i+k] >= 'a' && text[i+k] <= 'z') ||
-					(text[i+k] >= 'A' && text[i+k] <= 'Z') ))
-	  ++k;
-	if (k == 0 && i+1 < text.length())
-	  k = 1;
-
-	QString symbol = text.mid(i-1,k+1); // from i-1, length k+1
-
-	_rulestoapply.append(FormatRule(blockpos+i-1, k+1, FKeyWord));
-	ParsedBlock pblk(ParsedBlock::Keyword, blockpos+i-1, k+1);
+      if (t.type == KLFLatexToken::Keyword) { // a keyword ("\symbol")
+	QString symbol = t.keyword;
+	_rulestoapply.append(FormatRule(blockpos+t.beginpos, t.endpos-t.beginpos, FKeyWord));
+	ParsedBlock pblk(ParsedBlock::Keyword, blockpos+t.beginpos, t.endpos-t.beginpos);
 	pblk.keyword = symbol;
 	pParsedBlocks.append(pblk);
 
 	if (symbol.size() > 1) { // no empty backslash
-	  klfDbg("symbol="<<symbol<<" i="<<i<<" k="<<k<<" caretpos="<<_caretpos<<" blockpos="<<blockpos);
-	  if ( (_caretpos < blockpos+i ||_caretpos >= blockpos+i+k+1) &&
+	  klfDbg("symbol="<<symbol<<" pos="<<blockpos+t.beginpos<<" caretpos="<<_caretpos) ;
+	  if ( (_caretpos < blockpos+t.beginpos+1 || _caretpos >= blockpos+t.endpos+1) &&
 	       !pTypedSymbols.contains(symbol)) { // not typing symbol
 	    klfDbg("newSymbolTyped() about to be emitted for : "<<symbol);
 	    emit newSymbolTyped(symbol);
 	    pTypedSymbols.append(symbol);
 	  }
 	}
-	i += k;
 	continue;
       }
 
-      if (!text[i].isPrint() && text[i] != '\n' && text[i] != '\t' && text[i] != '\r') {
+      if (t.type == KLFLatexToken::NonPrintable) {
 	/** \bug ..... TODO: DEBUG & IMPLEMENT !!!  HIGHLIGHT NONPRINTABLE CHARS IN RED. ........ */
+	int i = t.beginpos;
 	_rulestoapply.append(FormatRule(blockpos+i-1, blockpos+i+1, FParenMismatch));
       }
-
-      ++i;
     }
-
-    block = block.next();
   }
 
   QTextBlock lastblock = document()->lastBlock();
@@ -718,6 +839,9 @@ void KLFLatexSyntaxHighlighter::parseEverything()
       _rulestoapply.append(FormatRule(p.pos, p.poslength(), FLonelyParen));
   }
 
+  d->setBlockRules(_rulestoapply);
+  d->parsedRevision = document()->revision();
+  d->parsedCaretPos = _caretpos;
 }
 
 QTextCharFormat KLFLatexSyntaxHighlighter::charfmtForFormat(Format f)
@@ -763,36 +887,24 @@ void KLFLatexSyntaxHighlighter::highlightBlock(const QString& text)
 
   //  printf("\t -- block/position=%d\n", block.position());
 
-  if (block.position() == 0) {
-    setCaretPos(_textedit->textCursor().position());
+  // parse again only if the text or the caret position changed since the last time
+  int caretpos = _textedit->textCursor().position();
+  if (d->parsedRevision != document()->revision() || d->parsedCaretPos != caretpos) {
+    setCaretPos(caretpos);
     parseEverything();
   }
 
   QList<FormatRule> blockfmtrules;
 
   blockfmtrules.append(FormatRule(0, text.length(), FNormal));
+  // the rules which apply to this block, already relative to it
+  int n = block.blockNumber();
+  blockfmtrules << d->blockRules.value(n);
+  if (n >= d->appliedRules.size())
+    d->appliedRules.resize(n+1);
+  d->appliedRules[n] = d->blockRules.value(n);
 
   int k, j;
-  for (k = 0; k < _rulestoapply.size(); ++k) {
-    int start = _rulestoapply[k].pos - block.position();
-    int len = _rulestoapply[k].len;
-
-    if (start < 0) { // the rule starts before current paragraph
-      len += start; // "+" because start is negative
-      start = 0;
-    }
-    if (start > text.length())
-      continue;
-    if (len > text.length() - start)
-      len = text.length() - start;
-
-    if (len <= 0)
-      continue; // empty rule...
-    
-    // apply rule
-    klfDbg("Applying rule start="<<start<<", len="<<len<<", ...") ;
-    blockfmtrules.append(FormatRule(start, len, _rulestoapply[k].format, _rulestoapply[k].onlyIfFocus));
-  }
 
   bool hasfocus = _textedit->hasFocus();
 
@@ -184,6 +184,8 @@ private:
 // ----------------------------------------------
 
 
+struct KLFLatexSyntaxHighlighterPrivate;
+
 class KLF_EXPORT KLFLatexSyntaxHighlighter : public QSyntaxHighlighter
 {
   Q_OBJECT
@@ -257,6 +259,9 @@ public slots:
   void setCaretPos(int position);
 
   void refreshAll();
+  /** Re-highlights only those blocks whose formatting changed since they were last highlighted,
+   * e.g. the ones with the parens next to the caret when it moves. */
+  void refreshChanged();
 
   /** This clears for example the list of already typed symbols. */
   void resetEditing();
@@ -292,6 +297,12 @@ private:
     int end() const { return pos + len; }
     Format format;
     bool onlyIfFocus;
+
+    bool operator==(const FormatRule& other) const
+    {
+      return pos == other.pos && len == other.len && format == other.format
+	&& onlyIfFocus == other.onlyIfFocus;
+    }
   };
 
   QList<FormatRule> _rulestoapply;
@@ -317,6 +328,8 @@ private:
     QTextCharFormat fmtLonelyParen;
   };
   Conf pConf;
+
+  KLF_DECLARE_PRIVATE(KLFLatexSyntaxHighlighter) ;
 };
 
 
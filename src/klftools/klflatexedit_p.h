@@ -21,6 +21,10 @@
  ***************************************************************************/
 /* $Id$ */
 
+#include <QHash>
+#include <QVector>
+#include <QTextObject>
+
 #include "klflatexedit.h"
 
 
@@ -119,11 +123,140 @@ struct LonelyParenItem : public ParenItem
 };
 
 
+/** \internal
+ * Finds which of a fixed set of strings starts at a given position of a text, by walking down a
+ * tree of their characters. */
+struct KLFStringTrie
+{
+  KLFStringTrie() { nodes.append(Node()); }
+
+  struct Node {
+    Node() : children(), value(-1) { }
+    QHash<QChar,int> children; //!< indexes in \c nodes
+    int value; //!< the index of the string which ends here, or -1
+  };
+  QVector<Node> nodes;
+
+  void insert(const QString& s, int value)
+  {
+    int n = 0;
+    int k;
+    for (k = 0; k < s.length(); ++k) {
+      int next = nodes[n].children.value(s[k], -1);
+      if (next < 0) {
+	next = nodes.size();
+	nodes[n].children[s[k]] = next;
+	nodes.append(Node());
+      }
+      n = next;
+    }
+    nodes[n].value = value;
+  }
+
+  /** Returns the value of the longest string which starts at \c pos in \c text, and sets
+   * \c len to its length. Returns -1 if there is none. */
+  int matchLongest(const QString& text, int pos, int *len) const
+  {
+    int n = 0;
+    int value = -1;
+    int k;
+    for (k = pos; k < text.length(); ++k) {
+      n = nodes[n].children.value(text[k], -1);
+      if (n < 0)
+	break;
+      if (nodes[n].value >= 0) {
+	value = nodes[n].value;
+	*len = k + 1 - pos;
+      }
+    }
+    return value;
+  }
+};
+
+
+/** \internal
+ * A comment, keyword, paren or non-printable character found in a block of text. Positions are
+ * relative to the beginning of the block. */
+struct KLFLatexToken
+{
+  enum Type { Comment, Keyword, OpenParen, CloseParen, NonPrintable };
+
+  KLFLatexToken(Type t = Comment, int b = -1, int e = -1)
+    : type(t), beginpos(b), endpos(e), keyword(), parenstr(), modifier() { }
+
+  Type type;
+  int beginpos;
+  int endpos;
+  QString keyword;
+  QString parenstr;
+  QString modifier;
+};
+
+/** \internal
+ * The tokens of a block of text, stored as the block's user data so that only the blocks
+ * which changed are read again. No state carries over from one block to the next: comments end
+ * with the line, and a paren modifier must be on the same line as its paren. */
+struct KLFLatexBlockTokens : public QTextBlockUserData
+{
+  QString text; //!< the text which was tokenized
+  QList<KLFLatexToken> tokens;
+};
+
+
+
+
+
+
+
 
 
+// -----------------------------
+
 
+struct KLFLatexSyntaxHighlighterPrivate
+{
+  KLF_PRIVATE_HEAD(KLFLatexSyntaxHighlighter)
+  {
+    parsedRevision = -1;
+    parsedCaretPos = -1;
 
+    KLFLatexParenSpecs& specs = KLFLatexSyntaxHighlighter::ParsedBlock::parenSpecs;
+    int k;
+    QStringList l;
+    l = specs.openParenList();
+    for (k = 0; k < l.size(); ++k)
+      openParens.insert(l[k], k);
+    l = specs.closeParenList();
+    for (k = 0; k < l.size(); ++k)
+      closeParens.insert(l[k], k);
+    l = specs.openParenModifiers();
+    for (k = 0; k < l.size(); ++k)
+      openModifiers.insert(l[k], k);
+    l = specs.closeParenModifiers();
+    for (k = 0; k < l.size(); ++k)
+      closeModifiers.insert(l[k], k);
+  }
 
+  typedef KLFLatexSyntaxHighlighter::FormatRule FormatRule;
+
+  KLFStringTrie openParens;
+  KLFStringTrie closeParens;
+  KLFStringTrie openModifiers;
+  KLFStringTrie closeModifiers;
+
+  //! The document revision and caret position for which the rules below were computed
+  int parsedRevision;
+  int parsedCaretPos;
+
+  //! The format rules of each block (by block number), relative to the beginning of the block
+  QVector<QList<FormatRule> > blockRules;
+  //! The rules each block was last highlighted with, see refreshChanged()
+  QVector<QList<FormatRule> > appliedRules;
+
+  bool matchParen(const QString& text, int i, bool opening, KLFLatexToken *token) const;
+  const KLFLatexBlockTokens * blockTokens(QTextBlock block);
+  void setBlockRules(const QList<FormatRule>& rules);
+};
 
 
 // -----------------------------
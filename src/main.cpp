@@ -45,6 +45,13 @@
 #include <QMetaType>
 #include <QClipboard>
 #include <QFontDatabase>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
 
 #include <klfbackend.h>
 
@@ -92,6 +99,7 @@
 #define EXIT_ERR_FILEINPUT 100
 #define EXIT_ERR_FILESAVE 101
 #define EXIT_ERR_OPT 102
+#define EXIT_ERR_BATCH 103
 
 
 // COMMAND-LINE-OPTION SPECIFIC DEFINITIONS
@@ -134,6 +142,10 @@ char *opt_epstopdf;
 int opt_wantpdf = -1;
 int opt_wantsvg = -1;
 
+char *opt_batch = NULL;
+int opt_batch_jobs = -1;
+char *opt_batch_report = NULL;
+
 bool opt_help_requested = false;
 FILE * opt_help_fp = stderr;
 bool opt_version_requested = false;
@@ -196,6 +208,9 @@ enum {
   OPT_DVIPS,
   OPT_GS,
   OPT_EPSTOPDF,
+  OPT_BATCH,
+  OPT_BATCH_JOBS,
+  OPT_BATCH_REPORT,
 
   OPT_DBUS_EXPORT_MAINWIN,
   OPT_SKIP_PLUGINS,
@@ -248,6 +263,10 @@ static struct option klfcmdl_optlist[] = {
   { "gs", 1, NULL, OPT_GS },
   { "epstopdf", 1, NULL, OPT_EPSTOPDF },
   // -----
+  { "batch", 1, NULL, OPT_BATCH },
+  { "batch-jobs", 1, NULL, OPT_BATCH_JOBS },
+  { "batch-report", 1, NULL, OPT_BATCH_REPORT },
+  // -----
   { "help", 2, NULL, OPT_HELP },
   { "version", 2, NULL, OPT_VERSION },
   // -----
@@ -401,6 +420,311 @@ void main_save(KLFBackend::klfOutput klfoutput, const QString& f_output, QString
   KLFBackend::saveOutputToFile(klfoutput, f_output, format);
 }
 
+
+// BATCH MODE
+
+/** One formula to render in batch mode (see \ref main_run_batch()) */
+struct KLFBatchItem
+{
+  KLFBatchItem() : lineno(-1), status(-1), elapsedms(0), peakmemory(0) { }
+
+  /** Where this item was defined in the manifest (line number, or .tex file name) */
+  int lineno;
+  QString source;
+
+  KLFBackend::klfInput input;
+  QString output;
+  QString format;
+
+  /** Result: 0 on success, backend status or EXIT_ERR_* code otherwise */
+  int status;
+  QString errorstr;
+  qint64 elapsedms;
+  /** See \ref KLFBackend::klfOutput::peak_memory */
+  qint64 peakmemory;
+};
+
+static bool main_batch_parse_color(const QString& s, unsigned long * rgb, bool allowtransparent)
+{
+  if (allowtransparent && s.trimmed() == QLatin1String("-")) {
+    *rgb = qRgba(255, 255, 255, 0);
+    return true;
+  }
+  QColor c;
+  c.setNamedColor(s.trimmed());
+  if (!c.isValid())
+    return false;
+  *rgb = allowtransparent ? c.rgba() : c.rgb();
+  return true;
+}
+
+/** Read the batch manifest \c fname and append the items it defines to \c items.
+ *
+ * \c fname is either a directory, in which case each <tt>*.tex</tt> file it contains is
+ * rendered to a file with the same base name, or a file (or \c "-" for standard input) in
+ * JSON lines format, with one JSON object per line. Empty lines and lines starting with
+ * \c '#' are ignored. Recognized keys are \c "latex" or \c "input" (a file to read the latex
+ * code from), \c "output" (required, and not \c "-"), \c "format", \c "mathmode", \c "preamble",
+ * \c "userscript", \c "fgcolor", \c "bgcolor" and \c "dpi". Keys which are not given take
+ * their value from \c defaultinput. Relative file names are relative to the manifest
+ * location.
+ *
+ * Returns FALSE if the manifest cannot be read. Invalid individual items are reported
+ * with a nonzero status and are not rendered.
+ */
+static bool main_batch_read_manifest(const QString& fname, const KLFBackend::klfInput& defaultinput,
+                                     const QString& defaultformat, QList<KLFBatchItem> *items)
+{
+  QFileInfo fi(fname);
+  QString outputdir = (opt_output != NULL) ? QString::fromLocal8Bit(opt_output) : QString();
+
+  if (fname != QLatin1String("-") && fi.isDir()) {
+    QDir dir(fname);
+    QString ext = defaultformat.isEmpty() ? QString::fromLatin1("png") : defaultformat.toLower();
+    QStringList texfiles = dir.entryList(QStringList() << QLatin1String("*.tex"), QDir::Files, QDir::Name);
+    foreach (const QString& texfile, texfiles) {
+      KLFBatchItem item;
+      item.source = texfile;
+      item.input = defaultinput;
+      item.format = defaultformat;
+      QFile f(dir.absoluteFilePath(texfile));
+      if (!f.open(QIODevice::ReadOnly)) {
+        item.status = EXIT_ERR_FILEINPUT;
+        item.errorstr = QObject::tr("Can't read input file `%1'.").arg(f.fileName());
+      } else {
+        item.input.latex = QString::fromLocal8Bit(f.readAll());
+      }
+      QString outname = QFileInfo(texfile).completeBaseName() + "." + ext;
+      item.output = outputdir.isEmpty() ? dir.absoluteFilePath(outname) : QDir(outputdir).absoluteFilePath(outname);
+      items->append(item);
+    }
+    return true;
+  }
+
+  QFile f;
+  QDir basedir;
+  if (fname == QLatin1String("-")) {
+    if (!f.open(stdin, QIODevice::ReadOnly))
+      return false;
+    basedir = QDir::current();
+  } else {
+    f.setFileName(fname);
+    if (!f.open(QIODevice::ReadOnly))
+      return false;
+    basedir = fi.absoluteDir();
+  }
+
+  int lineno = 0;
+  while (!f.atEnd()) {
+    QByteArray line = f.readLine().trimmed();
+    ++lineno;
+    if (line.isEmpty() || line.startsWith('#'))
+      continue;
+
+    KLFBatchItem item;
+    item.lineno = lineno;
+    item.source = QString::fromLatin1("%1:%2").arg(fname).arg(lineno);
+    item.input = defaultinput;
+    item.format = defaultformat;
+
+    QJsonParseError jerr;
+    QJsonDocument doc = QJsonDocument::fromJson(line, &jerr);
+    if (jerr.error != QJsonParseError::NoError || !doc.isObject()) {
+      item.status = EXIT_ERR_FILEINPUT;
+      item.errorstr = QObject::tr("Invalid manifest entry: %1").arg(jerr.errorString());
+      items->append(item);
+      continue;
+    }
+    QJsonObject obj = doc.object();
+
+    if (obj.contains("latex")) {
+      item.input.latex = obj.value("latex").toString();
+    } else if (obj.contains("input")) {
+      QFile fin(basedir.absoluteFilePath(obj.value("input").toString()));
+      if (!fin.open(QIODevice::ReadOnly)) {
+        item.status = EXIT_ERR_FILEINPUT;
+        item.errorstr = QObject::tr("Can't read input file `%1'.").arg(fin.fileName());
+        items->append(item);
+        continue;
+      }
+      item.input.latex = QString::fromLocal8Bit(fin.readAll());
+    } else {
+      item.status = EXIT_ERR_FILEINPUT;
+      item.errorstr = QObject::tr("Manifest entry has neither \"latex\" nor \"input\" key.");
+      items->append(item);
+      continue;
+    }
+    if (!obj.contains("output")) {
+      item.status = EXIT_ERR_FILESAVE;
+      item.errorstr = QObject::tr("Manifest entry has no \"output\" key.");
+      items->append(item);
+      continue;
+    }
+    item.output = obj.value("output").toString();
+    if (item.output == QLatin1String("-")) {
+      // the items are rendered in parallel, and the report may go to stdout too
+      item.status = EXIT_ERR_FILESAVE;
+      item.errorstr = QObject::tr("Batch items can't be written to standard output.");
+      items->append(item);
+      continue;
+    }
+    item.output = basedir.absoluteFilePath(item.output);
+
+    if (obj.contains("format"))
+      item.format = obj.value("format").toString().trimmed().toUpper();
+    if (obj.contains("mathmode"))
+      item.input.mathmode = obj.value("mathmode").toString();
+    if (obj.contains("preamble"))
+      item.input.preamble = obj.value("preamble").toString();
+    if (obj.contains("userscript"))
+      item.input.userScript = obj.value("userscript").toString();
+    if (obj.contains("dpi"))
+      item.input.dpi = obj.value("dpi").toInt(item.input.dpi);
+    if (obj.contains("fgcolor") &&
+        !main_batch_parse_color(obj.value("fgcolor").toString(), &item.input.fg_color, false)) {
+      item.status = EXIT_ERR_OPT;
+      item.errorstr = QObject::tr("Invalid color: `%1'").arg(obj.value("fgcolor").toString());
+    }
+    if (obj.contains("bgcolor") &&
+        !main_batch_parse_color(obj.value("bgcolor").toString(), &item.input.bg_color, true)) {
+      item.status = EXIT_ERR_OPT;
+      item.errorstr = QObject::tr("Invalid color: `%1'").arg(obj.value("bgcolor").toString());
+    }
+
+    items->append(item);
+  }
+  return true;
+}
+
+static QMutex main_batch_msg_mutex;
+
+/** Renders and saves one batch item; run in a QThreadPool worker thread. */
+class KLFBatchRenderTask : public QRunnable
+{
+public:
+  KLFBatchRenderTask(KLFBatchItem *item, const KLFBackend::klfSettings& settings)
+    : pItem(item), pSettings(settings)
+  {
+    setAutoDelete(true);
+  }
+
+  void run()
+  {
+    QElapsedTimer timer;
+    timer.start();
+
+    // we're not the main thread: don't let the backend process application events
+    KLFBackend::klfOutput klfoutput = KLFBackend::getLatexFormula(pItem->input, pSettings, false);
+    pItem->peakmemory = klfoutput.peak_memory;
+    if (klfoutput.status != 0) {
+      pItem->status = klfoutput.status;
+      pItem->errorstr = klfoutput.errorstr;
+    } else {
+      QString errstr;
+      if (!KLFBackend::saveOutputToFile(klfoutput, pItem->output, pItem->format, &errstr)) {
+        pItem->status = EXIT_ERR_FILESAVE;
+        pItem->errorstr = errstr;
+      } else {
+        pItem->status = 0;
+      }
+    }
+    pItem->elapsedms = timer.elapsed();
+
+    if (pItem->status != 0 && !opt_quiet) {
+      QMutexLocker lock(&main_batch_msg_mutex);
+      fprintf(stderr, "%s: %s\n", qPrintable(pItem->source), pItem->errorstr.toLocal8Bit().constData());
+    }
+  }
+
+private:
+  KLFBatchItem *pItem;
+  KLFBackend::klfSettings pSettings;
+};
+
+/** Renders all the formulas listed in the manifest given by --batch.
+ *
+ * The settings are detected once for the whole batch, and the items are rendered in
+ * parallel by a pool of --batch-jobs worker threads (by default, one per CPU core). A
+ * status report with one JSON object per item is written to the file given by
+ * --batch-report, or to standard output.
+ *
+ * Returns 0 if all items were rendered successfully, or an EXIT_ERR_* code.
+ */
+int main_run_batch(const KLFBackend::klfInput& defaultinput, const KLFBackend::klfSettings& settings)
+{
+  QString manifest = QString::fromLocal8Bit(opt_batch);
+  QString defaultformat = QString::fromLocal8Bit(opt_format).trimmed().toUpper();
+
+  QList<KLFBatchItem> items;
+  if (!main_batch_read_manifest(manifest, defaultinput, defaultformat, &items)) {
+    qCritical("%s", qPrintable(QObject::tr("Can't read batch manifest `%1'.").arg(manifest)));
+    return EXIT_ERR_FILEINPUT;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+
+  // getLatexFormula() is reentrant; query the gs version information once here, so that
+  // the workers don't all probe gs at the same time when they start.
+  KLFBackend::klfSettings probesettings = settings;
+  KLFBackend::detectOptionSettings(&probesettings);
+
+  QThreadPool pool;
+  pool.setMaxThreadCount(opt_batch_jobs > 0 ? opt_batch_jobs : QThread::idealThreadCount());
+  int k;
+  for (k = 0; k < items.size(); ++k) {
+    if (items[k].status != -1)
+      continue; // invalid manifest entry
+    pool.start(new KLFBatchRenderTask(&items[k], settings));
+  }
+  pool.waitForDone();
+
+  // write the report
+  QFile freport;
+  bool reportok;
+  if (opt_batch_report == NULL || !strcmp(opt_batch_report, "-")) {
+    reportok = freport.open(stdout, QIODevice::WriteOnly);
+  } else {
+    freport.setFileName(QString::fromLocal8Bit(opt_batch_report));
+    reportok = freport.open(QIODevice::WriteOnly);
+  }
+  if (!reportok) {
+    qCritical("%s", qPrintable(QObject::tr("Can't write batch report to `%1'.")
+                               .arg(QString::fromLocal8Bit(opt_batch_report))));
+  }
+
+  int nfailed = 0;
+  for (k = 0; k < items.size(); ++k) {
+    const KLFBatchItem& item = items[k];
+    if (item.status != 0)
+      ++nfailed;
+    if (!reportok)
+      continue;
+    QJsonObject obj;
+    obj.insert("source", item.source);
+    obj.insert("output", item.output);
+    obj.insert("status", item.status);
+    if (item.status != 0)
+      obj.insert("error", item.errorstr);
+    obj.insert("ms", (double)item.elapsedms);
+    obj.insert("peak_memory", (double)item.peakmemory);
+    freport.write(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+    freport.write("\n");
+  }
+  freport.close();
+
+  if (!opt_quiet) {
+    fprintf(stderr, "%s\n",
+            qPrintable(QObject::tr("Rendered %1 of %2 formula(s) in %3 s using %4 worker(s).")
+                       .arg(items.size()-nfailed).arg(items.size())
+                       .arg(timer.elapsed()/1000.0, 0, 'f', 1).arg(pool.maxThreadCount())));
+  }
+
+  if (!reportok)
+    return EXIT_ERR_FILESAVE;
+  return (nfailed > 0) ? EXIT_ERR_BATCH : 0;
+}
+
 #ifdef KLF_DEBUG
 void dumpDir(const QDir& d, int indent = 0)
 {
@@ -1122,6 +1446,7 @@ int main(int argc, char **argv)
     settings.gsexec = klfconfig.BackendSettings.execGs;
     settings.epstopdfexec = klfconfig.BackendSettings.execEpstopdf; // obsolete
     settings.tempdir = klfconfig.BackendSettings.tempDir;
+    settings.useGsServer = klfconfig.BackendSettings.useGsServer;
     // executables: overriden by options
     if (opt_tempdir != NULL)
       settings.tempdir = QString::fromLocal8Bit(opt_tempdir);
@@ -1134,7 +1459,14 @@ int main(int argc, char **argv)
     if (opt_epstopdf != NULL)
       settings.epstopdfexec = QString::fromLocal8Bit(opt_epstopdf);
 
-    
+    if (opt_batch != NULL) {
+      int retcode = main_run_batch(input, settings);
+
+      delete klf_the_config; // before deleting the QApplication
+      klf_the_config = NULL;
+
+      main_exit( retcode );
+    }
 
     // Now, run it!
     klfoutput = KLFBackend::getLatexFormula(input, settings);
@@ -1451,6 +1783,16 @@ void main_parse_options(int argc, char *argv[])
     case OPT_EPSTOPDF:
       opt_epstopdf = arg;
       break;
+    case OPT_BATCH:
+      if (opt_interactive == -1) opt_interactive = 0;
+      opt_batch = arg;
+      break;
+    case OPT_BATCH_JOBS:
+      opt_batch_jobs = atoi(arg);
+      break;
+    case OPT_BATCH_REPORT:
+      opt_batch_report = arg;
+      break;
     case OPT_HELP:
       opt_help_fp = main_msg_get_fp_arg(arg);
       opt_help_requested = true;
@@ -1499,6 +1841,13 @@ void main_parse_options(int argc, char *argv[])
     qWarning("%s", qPrintable(QObject::tr("--noeval may not be used when --output is present.")));
     opt_noeval = false;
   }
+  if (opt_batch && opt_interactive) {
+    qWarning("%s", qPrintable(QObject::tr("--batch may not be used in interactive mode. Ignoring option.")));
+    opt_batch = NULL;
+  }
+  if (opt_batch && (opt_input || opt_latexinput)) {
+    qWarning("%s", qPrintable(QObject::tr("--input and --latexinput are ignored in --batch mode.")));
+  }
   if (opt_interactive && opt_format && !opt_output) {
     qWarning("%s", qPrintable(QObject::tr("Ignoring --format without --output.")));
     opt_format = NULL;